@@ -23,6 +23,7 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
 import numpy as np
 import warnings
 import csv
@@ -31,15 +32,18 @@ import sys
 import os
 
 from obspy import Stream, Trace, read as obsread
-from multiprocessing import Pool, cpu_count
+from multiprocessing import cpu_count
 from copy import deepcopy
+from future.utils import native_str
 from obspy.core.event import Event, Pick, WaveformStreamID, Origin
 from obspy.core.event import EventDescription, CreationInfo, Comment
 from obspy.core.trace import Stats
 
+from eqcorrscan.core import EQcorrscanDeprecationWarning
 from eqcorrscan.core.match_filter import Detection, normxcorr2
 from eqcorrscan.utils import findpeaks
 from eqcorrscan.core.template_gen import _template_gen
+from eqcorrscan.utils.libnames import _load_cdll
 
 
 class BrightnessError(Exception):
@@ -284,6 +288,9 @@ def _node_loop(stations, lags, stream, clip_level,
     """
     Internal function to allow for brightness to be paralleled.
 
+    No longer used by :func:`brightness`, which stacks every node in memory
+    with :func:`_stack_nodes`; kept as the reference for one node.
+
     :type stations: list
     :param stations: List of stations to use.
     :type lags: numpy.ndarray
@@ -414,6 +421,86 @@ def _cum_net_resp(node_lis, instance=0):
     return cum_net_resp, indices
 
 
+def _stack_nodes(stations, lags, stream, clip_level, cores=1):
+    """
+    Compute the cumulative network response for all nodes in memory.
+
+    Equivalent to running :func:`_node_loop` for every node and taking the
+    maximum across nodes as :func:`_cum_net_resp`, but the energy of each
+    channel is computed once and the delay-and-stack and maximum are done in
+    one compiled call, in parallel over blocks of nodes, without storing the
+    response of every node.
+
+    :type stations: list
+    :param stations: List of stations to use.
+    :type lags: numpy.ndarray
+    :param lags:
+        Array of lags in seconds where lags[i][j] is the lag of stations[i]
+        for node j.
+    :type stream: obspy.core.stream.Stream
+    :param stream: Data stream to find the brightness for.
+    :type clip_level: float
+    :param clip_level: Upper limit for energy as a multiplier to the mean \
+        energy.
+    :type cores: int
+    :param cores: Number of threads to use.
+
+    :returns: cumulative network response
+    :rtype: numpy.ndarray
+    :returns: node indices for each sample of the cumulative network response.
+    :rtype: numpy.ndarray
+    """
+    c_long = np.dtype(ctypes.c_long)
+    lags = np.asarray(lags, dtype=np.float64).reshape(len(stations), -1)
+    rows = []
+    for tr in stream:
+        j = [k for k in range(len(stations))
+             if stations[k] == tr.stats.station]
+        # Check that there is only one matching station
+        if len(j) > 1:
+            warnings.warn('Too many stations')
+        if len(j) == 0:
+            warnings.warn('No station match')
+            continue
+        rows.append((tr, j[0]))
+    if len(rows) == 0:
+        raise BrightnessError('No stations in stream match the lag table')
+    npts = len(rows[0][0].data)
+    if any(len(tr.data) != npts for tr, _ in rows):
+        raise BrightnessError('Data must all be the same length')
+    energy = np.empty((len(rows), npts))
+    shifts = np.empty((lags.shape[1], len(rows)), dtype=np.intc)
+    for row, (tr, j) in enumerate(rows):
+        energy[row] = np.nan_to_num(
+            np.square(tr.data.astype(np.float64)))
+        shifts[:, row] = np.round(lags[j] * tr.stats.sampling_rate)
+    if (shifts < 0).any():
+        raise BrightnessError('Lags must not be negative')
+    cum_net_resp = np.empty(npts)
+    peak_nodes = np.empty(npts, dtype=c_long)
+
+    utilslib = _load_cdll('libutils')
+    utilslib.brightness_stack.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long, ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long, ctypes.c_double,
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=c_long,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int]
+    utilslib.brightness_stack.restype = ctypes.c_int
+    ret = utilslib.brightness_stack(
+        energy, npts, len(rows), shifts, shifts.shape[0], clip_level,
+        cum_net_resp, peak_nodes, cores)
+    if ret != 0:
+        raise MemoryError('Could not allocate memory for brightness stacks')
+    return cum_net_resp, peak_nodes
+
+
 def _find_detections(cum_net_resp, nodes, threshold, thresh_type,
                      samp_rate, realstations, length):
     """
@@ -602,7 +689,7 @@ def brightness(stations, nodes, lags, stream, threshold, thresh_type,
         spikes) from the energy stack.
     :type instance: int
     :param instance:
-        Optional, used for tracking when using a distributed computing system.
+        Deprecated and ignored: no temporary files are written.
     :type pre_pick: float
     :param pre_pick: Seconds before the detection time to include in template
     :type plotvar: bool
@@ -619,12 +706,17 @@ def brightness(stations, nodes, lags, stream, threshold, thresh_type,
     :param debug: Debug level from 0-5, higher is more output.
     :type mem_issue: bool
     :param mem_issue:
-        Set to True to write temporary variables to disk rather than store in
-        memory, slow.
+        Deprecated and ignored: the network response is stacked in memory
+        without keeping the response of every node, so no temporary files are
+        written.
 
     :return: list of templates as :class:`obspy.core.stream.Stream` objects
     :rtype: list
     """
+    if mem_issue or instance != 0:
+        warnings.warn(
+            "mem_issue and instance are deprecated and ignored, no temporary "
+            "files are written", EQcorrscanDeprecationWarning)
     if plotsave:
         import matplotlib
         matplotlib.use('Agg')
@@ -648,93 +740,15 @@ def brightness(stations, nodes, lags, stream, threshold, thresh_type,
             # Make sure that the data aren't clipped it they are high gain
             # scale the data
         tr.data = tr.data.astype(np.int16)
-    # The internal _node_loop converts energy to int16 too to conserve memory,
-    # to do this it forces the maximum of a single energy trace to be 500 and
-    # normalises to this level - this only works for fewer than 65 channels of
-    # data
-    if len(stream_copy) > 130:
-        raise BrightnessError(
-            'Too many streams, either re-code and cope with either more memory'
-            ' usage, or less precision, or reduce data volume')
-    # Loop through each node in the input
-    # Linear run
+    # Delay-and-stack every node in memory in double precision, keeping only
+    # the brightest node at each sample
     print('Computing the energy stacks')
-    # Parallel run
-    num_cores = cores
-    if num_cores > len(nodes):
-        num_cores = len(nodes)
-    if num_cores > cpu_count():
-        num_cores = cpu_count()
-    if mem_issue and not os.path.isdir('tmp' + str(instance)):
-        os.makedirs('tmp' + str(instance))
-    pool = Pool(processes=num_cores)
-    results = [pool.apply_async(_node_loop, (stations,),
-                                {'lags': lags[:, i], 'stream': stream, 'i': i,
-                                 'clip_level': clip_level,
-                                 'mem_issue': mem_issue, 'instance': instance})
-               for i in range(len(nodes))]
-    pool.close()
-    if not mem_issue:
-        print('Computing the cumulative network response from memory')
-        try:
-            energy = [p.get() for p in results]
-        except KeyboardInterrupt as e:  # pragma: no cover
-            pool.terminate()
-            raise e
-        pool.join()
-        energy.sort(key=lambda tup: tup[0])
-        energy = [node[1] for node in energy]
-        energy = np.concatenate(energy, axis=0)
-        print(energy.shape)
-    else:
-        pool.join()
-        del results
-    # Now compute the cumulative network response and then detect possible
-    # events
-    if not mem_issue:
-        print(energy.shape)
-        indices = np.argmax(energy, axis=0)  # Indices of maximum energy
-        print(indices.shape)
-        cum_net_resp = np.array([np.nan] * len(indices))
-        cum_net_resp[0] = energy[indices[0]][0]
-        peak_nodes = [nodes[indices[0]]]
-        for i in range(1, len(indices)):
-            cum_net_resp[i] = energy[indices[i]][i]
-            peak_nodes.append(nodes[indices[i]])
-        del energy, indices
-    else:
-        print('Reading the temp files and computing network response')
-        node_splits = int(len(nodes) // num_cores)
-        print(node_splits)
-        indices = []
-        for i in range(num_cores):
-            indices.append(list(np.arange(node_splits * i,
-                                          node_splits * (i + 1))))
-        indices[-1] += list(np.arange(node_splits * (i + 1), len(nodes)))
-        # results = [_cum_net_resp(node_lis=indices[i], instance=instance)
-        #            for i in range(num_cores)]
-        pool = Pool(processes=num_cores)
-        results = [pool.apply_async(_cum_net_resp, args=(indices[i], instance))
-                   for i in range(num_cores)]
-        pool.close()
-        try:
-            results = [p.get() for p in results]
-        except KeyboardInterrupt as e:  # pragma: no cover
-            pool.terminate()
-            raise e
-        pool.join()
-        responses = [result[0] for result in results]
-        print(np.shape(responses))
-        node_indices = [result[1] for result in results]
-        cum_net_resp = np.array(responses)
-        indices = np.argmax(cum_net_resp, axis=0)
-        print(indices.shape)
-        print(cum_net_resp.shape)
-        cum_net_resp = np.array([cum_net_resp[indices[i]][i]
-                                 for i in range(len(indices))])
-        peak_nodes = [nodes[node_indices[indices[i]][i]]
-                      for i in range(len(indices))]
-        del indices, node_indices
+    num_cores = min(cores, len(nodes), cpu_count())
+    cum_net_resp, indices = _stack_nodes(
+        stations=stations, lags=lags, stream=stream, clip_level=clip_level,
+        cores=num_cores)
+    peak_nodes = [nodes[index] for index in indices]
+    del indices
     if plotvar:
         cum_net_trace = Stream(Trace(
             data=cum_net_resp, header=Stats(
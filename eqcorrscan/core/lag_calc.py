@@ -13,12 +13,14 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
 import numpy as np
 import scipy
 import warnings
 
-from multiprocessing import Pool, cpu_count
+from multiprocessing import cpu_count
 from collections import Counter
+from future.utils import native_str
 
 from obspy import Stream
 from obspy.core.event import Catalog
@@ -27,6 +29,21 @@ from obspy.core.event import ResourceIdentifier, Comment
 
 from eqcorrscan.utils.plotting import plot_repicked, detection_multiplot
 from eqcorrscan.utils.debug_log import debug_print
+from eqcorrscan.utils.libnames import _load_cdll
+
+# Status of each correlation from the C routine lag_calc_correlate, as in
+# lag_calc.c: the low bits are exclusive outcomes, the high bits warnings
+# from the interpolation.
+LAG_OK = 0
+LAG_NO_DATA = 1
+LAG_TOO_SHORT = 2
+LAG_NAN = 3
+LAG_OUTCOME = 7
+LAG_NOT_SMOOTH = 8
+LAG_FEW_SAMPLES = 16
+LAG_OPENS_UP = 32
+LAG_LARGE_RESIDUAL = 64
+LAG_AT_EDGE = 128
 
 
 class LagCalcError(Exception):
@@ -98,10 +115,105 @@ def _xcorr_interp(ccc, dt):
     return shift, coeff
 
 
+def _compute_lags(detection_streams, template, interpolate, cores=1):
+    """
+    Correlate a template with the data for many detections, and find peaks.
+
+    All channels of all detections are correlated in one call to the C
+    routine, which also refines the peaks as :func:`_xcorr_interp` if
+    `interpolate` is set.
+
+    :type detection_streams: list
+    :param detection_streams:
+        List of :class:`obspy.core.stream.Stream` of data for each
+        detection.
+    :type template: obspy.core.stream.Stream
+    :param template: Template to correlate with the data.
+    :type interpolate: bool
+    :param interpolate:
+        Interpolate the correlation function to achieve sub-sample precision.
+    :type cores: int
+    :param cores: Number of threads to correlate with.
+
+    :returns:
+        Arrays of shape (detections, template channels) of the time of the
+        peak correlation in seconds from the start of the data, the peak
+        correlation, and the status of each correlation (see `LAG_OK` etc.).
+    :rtype: tuple
+    """
+    n_detections, n_chans = len(detection_streams), len(template)
+    c_long = np.dtype(ctypes.c_long)
+    template_lens = np.array([tr.stats.npts for tr in template], dtype=c_long)
+    templates = np.zeros((n_chans, max(template_lens.max(), 1)),
+                         dtype=np.float32)
+    for row, tr in zip(templates, template):
+        row[0:tr.stats.npts] = tr.data
+    image_data = []
+    deltas = np.zeros(n_detections * n_chans)
+    for detection in detection_streams:
+        for tr in template:
+            image = detection.select(
+                station=tr.stats.station, channel=tr.stats.channel)
+            if len(image) == 0 or sum(image[0].data) == 0:
+                image_data.append(None)
+                continue
+            deltas[len(image_data)] = image[0].stats.delta
+            image_data.append(image[0].data)
+    image_lens = np.array([0 if data is None else len(data)
+                           for data in image_data], dtype=c_long)
+    images = np.zeros((len(image_data), max(image_lens.max(), 1)),
+                      dtype=np.float32)
+    for row, data in zip(images, image_data):
+        if data is not None:
+            row[0:len(data)] = data
+    shifts = np.zeros(len(image_data))
+    ccs = np.zeros(len(image_data))
+    status = np.zeros(len(image_data), dtype=np.intc)
+
+    utilslib = _load_cdll('libutils')
+    float_arr = np.ctypeslib.ndpointer(
+        dtype=np.float32, flags=native_str('C_CONTIGUOUS'))
+    long_arr = np.ctypeslib.ndpointer(
+        dtype=c_long, flags=native_str('C_CONTIGUOUS'))
+    double_arr = np.ctypeslib.ndpointer(
+        dtype=np.float64, flags=native_str('C_CONTIGUOUS'))
+    utilslib.lag_calc_correlate.argtypes = [
+        float_arr, long_arr, ctypes.c_long, ctypes.c_long,
+        float_arr, long_arr, ctypes.c_long, ctypes.c_long,
+        ctypes.c_int, double_arr, double_arr,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int]
+    utilslib.lag_calc_correlate.restype = ctypes.c_int
+    ret = utilslib.lag_calc_correlate(
+        templates, template_lens, n_chans, templates.shape[1],
+        images, image_lens, n_detections, images.shape[1],
+        int(interpolate), shifts, ccs, status, cores)
+    if ret != 0:
+        raise MemoryError("Could not allocate memory for lag-calc")
+    shape = (n_detections, n_chans)
+    return ((shifts * deltas).reshape(shape), ccs.reshape(shape),
+            status.reshape(shape))
+
+
+def _interpolation_warnings(status):
+    """ Warn about the interpolation of a correlation as _xcorr_interp. """
+    if status & LAG_NOT_SMOOTH:
+        print('Could not interpolate ccc, not smooth')
+    if status & LAG_FEW_SAMPLES:
+        warnings.warn("Less than 5 samples selected for fit to cross "
+                      "correlation")
+    if status & LAG_OPENS_UP:
+        warnings.warn("Fitted parabola opens upwards!")
+    if status & LAG_LARGE_RESIDUAL:
+        warnings.warn("Residual in quadratic fit to cross correlation "
+                      "maximum larger than 0.1")
+
+
 def _channel_loop(detection, template, min_cc, detection_id, interpolate, i,
                   pre_lag_ccsum=None, detect_chans=0,
                   horizontal_chans=['E', 'N', '1', '2'], vertical_chans=['Z'],
-                  debug=0):
+                  debug=0, lags=None):
     """
     Inner loop for correlating and assigning picks.
 
@@ -144,65 +256,47 @@ def _channel_loop(detection, template, min_cc, detection_id, interpolate, i,
         be made.
     :type debug: int
     :param debug: Debug output level 0-5.
+    :type lags: tuple
+    :param lags:
+        Peak times, correlations and status for each channel of the template
+        for this detection, as a row of the output of :func:`_compute_lags`.
+        Computed here if not given.
 
     :returns:
         Event object containing network, station, channel and pick information.
     :rtype: :class:`obspy.core.event.Event`
     """
-    from eqcorrscan.core.match_filter import normxcorr2
-    import math
+    if lags is None:
+        lags = [lag[0] for lag in _compute_lags(
+            detection_streams=[detection], template=template,
+            interpolate=interpolate)]
     event = Event()
     s_stachans = {}
     cccsum = 0
     checksum = 0
     used_chans = 0
-    for tr in template:
+    for tr, shift, cc_max, status in zip(template, *lags):
         temp_net = tr.stats.network
         temp_sta = tr.stats.station
         temp_chan = tr.stats.channel
         debug_print('Working on: %s.%s.%s' % (temp_net, temp_sta, temp_chan),
                     3, debug)
-        image = detection.select(station=temp_sta, channel=temp_chan)
-        if len(image) == 0 or sum(image[0].data) == 0:
+        if status & LAG_OUTCOME == LAG_NO_DATA:
             print('No match in image.')
             continue
+        image = detection.select(station=temp_sta, channel=temp_chan)
+        if status & LAG_OUTCOME == LAG_TOO_SHORT:
+            print('Could not calculate cc')
+            print('Image is %i long' % len(image[0].data))
+            print('Template is %i long' % len(tr.data))
+            continue
+        if status & LAG_OUTCOME == LAG_NAN:
+            print('Problematic trace, no cross correlation possible')
+            continue
         if interpolate:
-            try:
-                ccc = normxcorr2(tr.data, image[0].data)
-            except Exception:
-                print('Could not calculate cc')
-                print('Image is %i long' % len(image[0].data))
-                print('Template is %i long' % len(tr.data))
-                continue
-            try:
-                shift, cc_max = _xcorr_interp(ccc=ccc, dt=image[0].stats.delta)
-            except IndexError:
-                print('Could not interpolate ccc, not smooth')
-                ccc = normxcorr2(tr.data, image[0].data)
-                cc_max = np.amax(ccc)
-                shift = np.argmax(ccc) * image[0].stats.delta
-            # Convert the maximum cross-correlation time to an actual time
-            if math.isnan(cc_max):
-                print('Problematic trace, no cross correlation possible')
-                continue
-            else:
-                picktime = image[0].stats.starttime + shift
-        else:
-            # Convert the maximum cross-correlation time to an actual time
-            try:
-                ccc = normxcorr2(tr.data, image[0].data)
-            except Exception:
-                print('Could not calculate cc')
-                print('Image is %i long' % len(image[0].data))
-                print('Template is %i long' % len(tr.data))
-                continue
-            cc_max = np.amax(ccc)
-            if math.isnan(cc_max):
-                print('Problematic trace, no cross correlation possible')
-                continue
-            else:
-                picktime = image[0].stats.starttime + (
-                    np.argmax(ccc) * image[0].stats.delta)
+            _interpolation_warnings(status)
+        # Convert the maximum cross-correlation time to an actual time
+        picktime = image[0].stats.starttime + shift
         debug_print('Maximum cross-corr=%s' % cc_max, 3, debug)
         checksum += cc_max
         used_chans += 1
@@ -220,10 +314,9 @@ def _channel_loop(detection, template, min_cc, detection_id, interpolate, i,
             debug_print('Making S-pick on: %s.%s.%s' %
                         (temp_net, temp_sta, temp_chan), 4, debug)
             if temp_sta not in s_stachans.keys():
-                s_stachans[temp_sta] = ((temp_chan, np.amax(ccc),
-                                         picktime))
+                s_stachans[temp_sta] = ((temp_chan, cc_max, picktime))
             elif temp_sta in s_stachans.keys():
-                if np.amax(ccc) > s_stachans[temp_sta][1]:
+                if cc_max > s_stachans[temp_sta][1]:
                     picktime = picktime
                 else:
                     continue
@@ -287,6 +380,10 @@ def _day_loop(detection_streams, template, min_cc, detections,
     :type interpolate: bool
     :param interpolate:
         Interpolate the correlation function to achieve sub-sample precision.
+    :type cores: int
+    :param cores: Number of threads to correlate with, defaults to all.
+    :type parallel: bool
+    :param parallel: Whether to correlate using more than one thread.
     :type debug: int
     :param debug: debug output level 0-5.
 
@@ -297,45 +394,29 @@ def _day_loop(detection_streams, template, min_cc, detections,
     """
     if len(detection_streams) == 0:
         return Catalog()
-    if not cores:
+    if not parallel:
+        num_cores = 1
+    elif not cores:
         num_cores = cpu_count()
     else:
         num_cores = cores
-    if num_cores > len(detection_streams):
-        num_cores = len(detection_streams)
-    if parallel:
-        pool = Pool(processes=num_cores)
-        debug_print('Made pool of %i workers' % num_cores, 4, debug)
-        # Parallel generation of events for each detection:
-        # results will be a list of (i, event class)
-        results = [pool.apply_async(
-            _channel_loop, (detection_streams[i], ),
-            {'template': template, 'min_cc': min_cc,
-             'detection_id': detections[i].id, 'interpolate': interpolate,
-             'i': i, 'pre_lag_ccsum': detections[i].detect_val,
-             'detect_chans': detections[i].no_chans,
-             'horizontal_chans': horizontal_chans,
-             'vertical_chans': vertical_chans})
-                   for i in range(len(detection_streams))]
-        pool.close()
-        try:
-            events_list = [p.get() for p in results]
-        except KeyboardInterrupt as e:  # pragma: no cover
-            pool.terminate()
-            raise e
-        pool.join()
-        events_list.sort(key=lambda tup: tup[0])  # Sort based on index.
-    else:
-        events_list = []
-        for i in range(len(detection_streams)):
-            events_list.append(_channel_loop(
-                detection=detection_streams[i], template=template,
-                min_cc=min_cc, detection_id=detections[i].id,
-                interpolate=interpolate, i=i,
-                pre_lag_ccsum=detections[i].detect_val,
-                detect_chans=detections[i].no_chans,
-                horizontal_chans=horizontal_chans,
-                vertical_chans=vertical_chans, debug=debug))
+    # All detections are correlated together, then picks made from the peaks
+    debug_print('Correlating %i detections with %i threads' %
+                (len(detection_streams), num_cores), 4, debug)
+    shifts, ccs, status = _compute_lags(
+        detection_streams=detection_streams, template=template,
+        interpolate=interpolate, cores=num_cores)
+    events_list = []
+    for i in range(len(detection_streams)):
+        events_list.append(_channel_loop(
+            detection=detection_streams[i], template=template,
+            min_cc=min_cc, detection_id=detections[i].id,
+            interpolate=interpolate, i=i,
+            pre_lag_ccsum=detections[i].detect_val,
+            detect_chans=detections[i].no_chans,
+            horizontal_chans=horizontal_chans,
+            vertical_chans=vertical_chans, debug=debug,
+            lags=(shifts[i], ccs[i], status[i])))
     temp_catalog = Catalog()
     temp_catalog.events = [event_tup[1] for event_tup in events_list]
     return temp_catalog
@@ -485,7 +566,7 @@ def lag_calc(detections, detect_data, template_names, templates,
         be made.
     :type cores: int
     :param cores:
-        Number of cores to use in parallel processing, defaults to one.
+        Number of threads to correlate detections with, defaults to one.
     :type interpolate: bool
     :param interpolate:
         Interpolate the correlation function to achieve sub-sample precision.
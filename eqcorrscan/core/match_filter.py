@@ -23,16 +23,24 @@ import contextlib
 import copy
 import getpass
 import glob
+import multiprocessing
 import os
 import re
 import shutil
 import tarfile
 import tempfile
+import threading
 import time
+import traceback
 import warnings
-from collections import Counter
+from collections import Counter, OrderedDict
 from os.path import join
 
+try:
+    from queue import Empty, Full, Queue
+except ImportError:  # pragma: no cover
+    from Queue import Empty, Full, Queue
+
 import numpy as np
 from obspy import Trace, Catalog, UTCDateTime, Stream, read, read_events
 from obspy.core.event import (
@@ -41,23 +49,32 @@ from obspy.core.event import (
 from eqcorrscan.core import template_gen
 from eqcorrscan.core.lag_calc import lag_calc
 from eqcorrscan.utils.catalog_utils import _get_origin
-from eqcorrscan.utils.correlate import get_array_xcorr, get_stream_xcorr
+from eqcorrscan.utils.correlate import (
+    get_array_xcorr, get_stream_xcorr, StreamingCorrelator, CorrelationStats,
+    pack_stream, _get_array_dicts)
 from eqcorrscan.utils.debug_log import debug_print
-from eqcorrscan.utils.findpeaks import decluster, multi_find_peaks
+from eqcorrscan.utils.findpeaks import (
+    _decluster_positions, multi_find_peaks_compiled)
 from eqcorrscan.utils.plotting import cumulative_detections
 from eqcorrscan.utils.pre_processing import dayproc, shortproc, _check_daylong
 
 CAT_EXT_MAP = {"QUAKEML": "xml", "SC3ML": "xml"}  # , "NORDIC": "out"}
 # TODO: add in nordic support once bugs fixed upstream - 1.2.0 Obspy PR #2195
 
+# Where data are published for sharded detection, files in a tmpfs are held
+# in POSIX shared memory.
+SHARED_MEMORY_DIR = "/dev/shm" if os.path.isdir("/dev/shm") else None
+
 
 @contextlib.contextmanager
-def temporary_directory():
+def temporary_directory(parent=None):
     """ make a temporary directory, yeild its name, cleanup on exit """
-    dir_name = tempfile.mkdtemp()
-    yield dir_name
-    if os.path.exists(dir_name):
-        shutil.rmtree(dir_name)
+    dir_name = tempfile.mkdtemp(dir=parent)
+    try:
+        yield dir_name
+    finally:
+        if os.path.exists(dir_name):
+            shutil.rmtree(dir_name)
 
 
 def _spike_test(stream, percent=0.99, multiplier=1e7):
@@ -85,6 +102,22 @@ def _spike_test(stream, percent=0.99, multiplier=1e7):
             raise MatchFilterError(msg)
 
 
+def _shallow_copy(stream):
+    """
+    Copy the headers of a stream, sharing its data.
+
+    Enough to protect the callers stream from trimming and padding, which
+    replace the data of a trace rather than changing them.
+
+    :param stream: Stream to copy.
+    :type stream: :class:`obspy.core.stream.Stream`
+
+    :rtype: :class:`obspy.core.stream.Stream`
+    """
+    return Stream([Trace(data=tr.data, header=copy.deepcopy(tr.stats))
+                   for tr in stream])
+
+
 class MatchFilterError(Exception):
     """
     Default error for match-filter errors.
@@ -122,14 +155,104 @@ class MatchFilterError(Exception):
         return self.value
 
 
+class DetectionTimings(object):
+    """
+    Time spent in each stage of matched-filter detection.
+
+    Collected by :func:`match_filter` and the detect methods of
+    :class:`Template` and :class:`Tribe`, and kept as the `timings` of the
+    :class:`Party` they return.  The stages are processing of the data,
+    correlation, peak-finding and construction of the
+    :class:`Detection` objects.  `correlation` holds the counters of the
+    fftw C-code (see :class:`eqcorrscan.utils.correlate.CorrelationStats`),
+    which are only filled by the fftw backend with threaded concurrency.
+
+    .. rubric:: Example
+
+    >>> timings = DetectionTimings()
+    >>> with timings.time('peaks'):
+    ...     pass
+    >>> print(timings.calls['peaks'])
+    1
+    """
+    stages = ('processing', 'correlate', 'peaks', 'detections')
+
+    def __init__(self):
+        self.seconds = OrderedDict((stage, 0.0) for stage in self.stages)
+        self.calls = OrderedDict((stage, 0) for stage in self.stages)
+        self.correlation = CorrelationStats()
+
+    def __repr__(self):
+        return "DetectionTimings({0})".format(", ".join(
+            "{0}={1:.3f}s".format(stage, secs)
+            for stage, secs in self.seconds.items()))
+
+    def __iadd__(self, other):
+        for stage in self.stages:
+            self.seconds[stage] += other.seconds[stage]
+            self.calls[stage] += other.calls[stage]
+        self.correlation += other.correlation
+        return self
+
+    def add(self, stage, seconds):
+        """
+        Add a run of a stage.
+
+        :type stage: str
+        :param stage: One of :attr:`stages`.
+        :type seconds: float
+        :param seconds: Time spent in the stage.
+        """
+        if stage not in self.seconds:
+            raise MatchFilterError(
+                "Unknown stage {0}, must be one of {1}".format(
+                    stage, self.stages))
+        self.seconds[stage] += seconds
+        self.calls[stage] += 1
+
+    @contextlib.contextmanager
+    def time(self, stage):
+        """
+        Add the time spent in a with block to a stage.
+
+        :type stage: str
+        :param stage: One of :attr:`stages`.
+        """
+        tic = time.time()
+        try:
+            yield self
+        finally:
+            self.add(stage, time.time() - tic)
+
+    def report(self):
+        """
+        Get the timings as a dictionary.
+
+        :rtype: dict
+        :return:
+            Dictionary of `stages` (seconds in each stage, in order),
+            `calls` (number of times each stage was run), `total` (seconds)
+            and `correlation` (see
+            :meth:`eqcorrscan.utils.correlate.CorrelationStats.report`).
+        """
+        return {'stages': OrderedDict(self.seconds),
+                'calls': OrderedDict(self.calls),
+                'total': sum(self.seconds.values()),
+                'correlation': self.correlation.report()}
+
+
 class Party(object):
     """
     Container for multiple Family objects.
+
+    Parties returned by detection keep the time spent in each stage of
+    detection as `timings`, see :class:`DetectionTimings`.
     """
 
     def __init__(self, families=None):
         """Instantiate the Party object."""
         self.families = []
+        self.timings = DetectionTimings()
         if isinstance(families, Family):
             families = [families]
         if families:
@@ -224,6 +347,8 @@ class Party(object):
             families = [other]
         elif isinstance(other, Party):
             families = other.families
+            if getattr(other, 'timings', None) is not None:
+                self.timings += other.timings
         else:
             raise NotImplementedError(
                 'Ambiguous add, only allowed Party or Family additions.')
@@ -605,30 +730,25 @@ class Party(object):
                 raise MatchFilterError('metric is not cor_sum or avg_cor')
         else:
             raise MatchFilterError('timing is not detect or origin')
-        min_det = sorted([d[0] for d in detect_info])[0]
+        min_det = min(d[0] for d in detect_info)
         detect_vals = np.array([d[1] for d in detect_info])
         detect_times = np.array([
             _total_microsec(d[0].datetime, min_det.datetime)
-            for d in detect_info])
-        peaks_out = decluster(
-            peaks=detect_vals, index=detect_times, trig_int=trig_int * 10 ** 6)
+            for d in detect_info], dtype=np.int64)
         # Trig_int must be converted from seconds to micro-seconds
-        declustered_detections = [
-            all_detections[np.where(detect_times == ind[1])[0][0]]
-            for ind in peaks_out]
+        kept = _decluster_positions(
+            peaks=detect_vals, index=detect_times, trig_int=trig_int * 10 ** 6)
+        declustered_detections = [all_detections[i] for i in kept]
         # Convert this list into families
-        template_names = list(set([d.template_name
-                                   for d in declustered_detections]))
+        template_detections = {}
+        for d in declustered_detections:
+            template_detections.setdefault(d.template_name, []).append(d)
+        templates = {fam.template.name: fam.template for fam in self.families}
         new_families = []
-        for template_name in template_names:
-            template = [fam.template for fam in self.families
-                        if fam.template.name == template_name][0]
+        for template_name, detections in template_detections.items():
             new_families.append(Family(
-                template=template,
-                detections=[d for d in declustered_detections
-                            if d.template_name == template_name],
-                catalog=Catalog([d.event for d in declustered_detections
-                                 if d.template_name == template_name])))
+                template=templates[template_name], detections=detections,
+                catalog=Catalog([d.event for d in detections])))
         self.families = new_families
         return self
 
@@ -946,8 +1066,9 @@ class Party(object):
                     process_cores = cores
                 processed_streams = _group_process(
                     template_group=group, cores=process_cores,
-                    parallel=parallel, stream=stream.copy(), debug=debug,
-                    daylong=False,  ignore_length=False, overlap=lap)
+                    parallel=parallel, stream=_shallow_copy(stream),
+                    debug=debug, daylong=False,  ignore_length=False,
+                    overlap=lap)
                 processed_stream = Stream()
                 for p in processed_streams:
                     processed_stream += p
@@ -1991,8 +2112,9 @@ class Template(object):
             See tutorials for example.
         """
         party = _group_detect(
-            templates=[self], stream=stream.copy(), threshold=threshold,
-            threshold_type=threshold_type, trig_int=trig_int,
+            templates=[self], stream=_shallow_copy(stream),
+            threshold=threshold, threshold_type=threshold_type,
+            trig_int=trig_int,
             plotvar=plotvar, pre_processed=pre_processed, daylong=daylong,
             parallel_process=parallel_process, xcorr_func=xcorr_func,
             concurrency=concurrency, cores=cores, ignore_length=ignore_length,
@@ -2458,6 +2580,12 @@ class Tribe(object):
                     new_tribe.templates.extend([t for t in self.templates
                                                 if t.event == event])
                 tribes.append(new_tribe)
+        elif method == 'cluster':
+            groups = func(template_list=[
+                (t.st, i) for i, t in enumerate(self.templates)], **kwargs)
+            for group in groups:
+                tribes.append(Tribe(
+                    templates=[self.templates[i] for _, i in group]))
         return tribes
 
     def detect(self, stream, threshold, threshold_type, trig_int, plotvar,
@@ -2465,7 +2593,8 @@ class Tribe(object):
                concurrency=None, cores=None, ignore_length=False,
                group_size=None, overlap="calculate", debug=0,
                full_peaks=False, save_progress=False,
-               process_cores=None, **kwargs):
+               process_cores=None, shards=None, native_process=False,
+               **kwargs):
         """
         Detect using a Tribe of templates within a continuous stream.
 
@@ -2538,6 +2667,16 @@ class Tribe(object):
         :param process_cores:
             Number of processes to use for pre-processing (if different to
             `cores`).
+        :type shards: int
+        :param shards:
+            Number of worker processes to split the templates between, see
+            note on sharding below.  If unset all templates are run in this
+            process.
+        :type native_process: bool
+        :param native_process:
+            Whether to resample and filter the data for all channels in one
+            threaded compiled call, see
+            :func:`eqcorrscan.utils.pre_processing.shortproc`.
 
         :return:
             :class:`eqcorrscan.core.match_filter.Party` of Families of
@@ -2616,36 +2755,52 @@ class Tribe(object):
 
             where :math:`template` is a single template from the input and the
             length is the number of channels within this template.
+
+        .. note::
+            **Sharding:**
+
+            With `shards` set, each of that many worker processes owns a
+            fixed share of the templates for the whole run, and keeps their
+            spectra between chunks of data (`cache_templates`).  Data are
+            processed once, in this process, and each processed chunk is put
+            in shared memory (`/dev/shm` where available) once, for all the
+            workers to read in place.  Where possible each worker is pinned
+            to its own set of CPUs, grouped by socket, so setting `shards` to
+            the number of sockets lets each socket correlate separately.
+            `cores` is the number of threads used for correlation by each
+            worker.
         """
         party = Party()
-        template_groups = []
-        for master in self.templates:
-            for group in template_groups:
-                if master in group:
-                    break
-            else:
-                new_group = [master]
-                for slave in self.templates:
-                    if master.same_processing(slave) and master != slave:
-                        new_group.append(slave)
-                template_groups.append(new_group)
-        # template_groups will contain an empty first list
-        for group in template_groups:
-            if len(group) == 0:
-                template_groups.remove(group)
-        # now we can compute the detections for each group
-        for group in template_groups:
-            group_party = _group_detect(
-                templates=group, stream=stream.copy(), threshold=threshold,
+        template_groups = _group_templates(self.templates)
+        if shards is not None and shards > 1:
+            party = _sharded_detect(
+                template_groups=template_groups, stream=stream,
+                shards=shards, threshold=threshold,
                 threshold_type=threshold_type, trig_int=trig_int,
-                plotvar=plotvar, group_size=group_size, pre_processed=False,
-                daylong=daylong, parallel_process=parallel_process,
-                xcorr_func=xcorr_func, concurrency=concurrency, cores=cores,
+                plotvar=plotvar, group_size=group_size, daylong=daylong,
+                parallel_process=parallel_process, xcorr_func=xcorr_func,
+                concurrency=concurrency, cores=cores,
                 ignore_length=ignore_length, overlap=overlap, debug=debug,
-                full_peaks=full_peaks, process_cores=process_cores, **kwargs)
-            party += group_party
-            if save_progress:
-                party.write("eqcorrscan_temporary_party")
+                full_peaks=full_peaks, process_cores=process_cores,
+                save_progress=save_progress, native_process=native_process,
+                **kwargs)
+        else:
+            # now we can compute the detections for each group
+            for group in template_groups:
+                group_party = _group_detect(
+                    templates=group, stream=_shallow_copy(stream),
+                    threshold=threshold, threshold_type=threshold_type,
+                    trig_int=trig_int, plotvar=plotvar,
+                    group_size=group_size, pre_processed=False,
+                    daylong=daylong, parallel_process=parallel_process,
+                    xcorr_func=xcorr_func, concurrency=concurrency,
+                    cores=cores, ignore_length=ignore_length,
+                    overlap=overlap, debug=debug, full_peaks=full_peaks,
+                    process_cores=process_cores,
+                    native_process=native_process, **kwargs)
+                party += group_party
+                if save_progress:
+                    party.write("eqcorrscan_temporary_party")
         if len(party) > 0:
             for family in party:
                 if family is not None:
@@ -2659,7 +2814,8 @@ class Tribe(object):
                       concurrency=None, cores=None, ignore_length=False,
                       group_size=None, debug=0, return_stream=False,
                       full_peaks=False, save_progress=False,
-                      process_cores=None, retries=3, **kwargs):
+                      process_cores=None, retries=3, queue_depth=None,
+                      max_queue_memory=None, **kwargs):
         """
         Detect using a Tribe of templates within a continuous stream.
 
@@ -2741,6 +2897,15 @@ class Tribe(object):
         :param retries:
             Number of attempts allowed for downloading - allows for transient
             server issues.
+        :type queue_depth: int
+        :param queue_depth:
+            Number of chunks of data to download and process ahead of
+            detection, see note on pipelining below.  If unset each chunk is
+            downloaded, processed and detected in turn.
+        :type max_queue_memory: int
+        :param max_queue_memory:
+            Maximum bytes of data (downloaded and processed) to hold ahead of
+            detection when `queue_depth` is set.  One chunk is always held.
 
         :return:
             :class:`eqcorrscan.core.match_filter.Party` of Families of
@@ -2798,6 +2963,17 @@ class Tribe(object):
 
             where :math:`template` is a single template from the input and the
             length is the number of channels within this template.
+
+        .. note::
+            **Pipelining:**
+
+            With `queue_depth` set, data are downloaded in one thread and
+            processed in another while the previous chunk is correlated, so
+            that downloads, processing and correlation overlap.  Each stage
+            holds at most `queue_depth` chunks for the next, and downloads
+            wait while more than `max_queue_memory` bytes are held.  Results
+            are the same as without pipelining.  Pipelining cannot be
+            combined with `shards`.
         """
         party = Party()
         buff = 300
@@ -2841,69 +3017,68 @@ class Tribe(object):
             download_groups = int(download_groups) + 1
         else:
             download_groups = int(download_groups)
-        for i in range(download_groups):
-            bulk_info = []
-            for chan_id in template_channel_ids:
-                bulk_info.append((
-                    chan_id[0], chan_id[1], chan_id[2], chan_id[3],
-                    starttime + (i * data_length) - (pad + buff),
-                    starttime + ((i + 1) * data_length) + (pad + buff)))
-            for retry_attempt in range(retries):
-                try:
-                    st = client.get_waveforms_bulk(bulk_info)
-                    break
-                except Exception as e:
-                    print(e)
-                    continue
-            else:
+
+        def download(i):
+            return _download_chunk(
+                client=client, template_channel_ids=template_channel_ids,
+                starttime=starttime + (i * data_length) - pad,
+                endtime=starttime + ((i + 1) * data_length) + pad,
+                buff=buff, data_length=data_length, min_gap=min_gap,
+                retries=retries)
+
+        if queue_depth:
+            shards = kwargs.pop('shards', None)
+            if shards is not None and shards > 1:
                 raise MatchFilterError(
-                    "Could not download data after {0} attempts".format(
-                        retries))
-            # Get gaps and remove traces as necessary
-            if min_gap:
-                gaps = st.get_gaps(min_gap=min_gap)
-                if len(gaps) > 0:
-                    print("Large gaps in downloaded data")
-                    st.merge()
-                    gappy_channels = list(
-                        set([(gap[0], gap[1], gap[2], gap[3])
-                             for gap in gaps]))
-                    _st = Stream()
-                    for tr in st:
-                        tr_stats = (tr.stats.network, tr.stats.station,
-                                    tr.stats.location, tr.stats.channel)
-                        if tr_stats in gappy_channels:
-                            print("Removing gappy channel: %s" % str(tr))
-                        else:
-                            _st += tr
-                    st = _st
-                    st.split()
-            st.merge()
-            st.trim(starttime=starttime + (i * data_length) - pad,
-                    endtime=starttime + ((i + 1) * data_length) + pad)
-            for tr in st:
-                if not _check_daylong(tr):
-                    st.remove(tr)
-                    print("{0} contains more zeros than non-zero, "
-                          "removed".format(tr.id))
-            for tr in st:
-                if tr.stats.endtime - tr.stats.starttime < \
-                   0.8 * data_length:
-                    st.remove(tr)
-                    print("{0} is less than 80% of the required length"
-                          ", removed".format(tr.id))
+                    "queue_depth cannot be combined with shards")
+            native_process = kwargs.pop('native_process', False)
+            template_groups = _group_templates(self.templates)
+
+            def process(st):
+                return [(group, _group_process(
+                    template_group=group, parallel=parallel_process,
+                    debug=debug, cores=process_cores or cores,
+                    stream=_shallow_copy(st), daylong=daylong,
+                    ignore_length=ignore_length, overlap=0.0,
+                    native_process=native_process))
+                        for group in template_groups]
+
+            chunks = _pipeline_chunks(
+                download=download, n_chunks=download_groups, process=process,
+                queue_depth=queue_depth, max_queue_memory=max_queue_memory)
+        else:
+            chunks = ((download(i), None, 0.0)
+                      for i in range(download_groups))
+        for st, processed, processing_time in chunks:
             if return_stream:
                 stream += st
             try:
-                party += self.detect(
-                    stream=st, threshold=threshold,
-                    threshold_type=threshold_type, trig_int=trig_int,
-                    plotvar=plotvar, daylong=daylong,
-                    parallel_process=parallel_process, xcorr_func=xcorr_func,
-                    concurrency=concurrency, cores=cores,
-                    ignore_length=ignore_length, group_size=group_size,
-                    overlap=None, debug=debug, full_peaks=full_peaks,
-                    process_cores=process_cores, **kwargs)
+                if isinstance(processed, Exception):
+                    raise processed
+                elif processed is not None:
+                    chunk_party = Party()
+                    chunk_party.timings.add('processing', processing_time)
+                    for group, streams in processed:
+                        chunk_party += _detect_processed(
+                            templates=group, streams=streams,
+                            threshold=threshold,
+                            threshold_type=threshold_type, trig_int=trig_int,
+                            plotvar=plotvar, group_size=group_size,
+                            xcorr_func=xcorr_func, concurrency=concurrency,
+                            cores=cores, debug=debug, full_peaks=full_peaks,
+                            process_cores=process_cores, **kwargs)
+                    party += chunk_party
+                else:
+                    party += self.detect(
+                        stream=st, threshold=threshold,
+                        threshold_type=threshold_type, trig_int=trig_int,
+                        plotvar=plotvar, daylong=daylong,
+                        parallel_process=parallel_process,
+                        xcorr_func=xcorr_func, concurrency=concurrency,
+                        cores=cores, ignore_length=ignore_length,
+                        group_size=group_size, overlap=None, debug=debug,
+                        full_peaks=full_peaks, process_cores=process_cores,
+                        **kwargs)
                 if save_progress:
                     party.write("eqcorrscan_temporary_party")
             except Exception as e:
@@ -2993,6 +3168,282 @@ class Tribe(object):
             self.templates.append(t)
         return self
 
+    def stream_detector(self, threshold, threshold_type, trig_int,
+                        block_len='auto', cores=1, mad_window=600.0):
+        """
+        Get a detector for data arriving in packets (e.g. real-time data).
+
+        See :class:`eqcorrscan.core.match_filter.StreamingDetector` for
+        details.
+
+        :type threshold: float
+        :param threshold: As for :meth:`Tribe.detect`.
+        :type threshold_type: str
+        :param threshold_type: As for :meth:`Tribe.detect`.
+        :type trig_int: float
+        :param trig_int: As for :meth:`Tribe.detect`.
+        :type block_len: int or str
+        :param block_len:
+            Length of transforms to use, see
+            :func:`eqcorrscan.utils.correlate.fftw_block_len`
+        :type cores: int
+        :param cores: Number of threads to use for correlations.
+        :type mad_window: float
+        :param mad_window:
+            Length in seconds of recent correlation sums to compute MAD
+            thresholds from.
+
+        :return: :class:`eqcorrscan.core.match_filter.StreamingDetector`
+
+        .. rubric:: Example
+
+        >>> tribe = Tribe().read('tribe.tgz')  # doctest: +SKIP
+        >>> detector = tribe.stream_detector(  # doctest: +SKIP
+        ...     threshold=8, threshold_type='MAD', trig_int=6)
+        >>> for packet in packets:  # doctest: +SKIP
+        ...     party = detector.append(packet)
+        """
+        return StreamingDetector(
+            tribe=self, threshold=threshold, threshold_type=threshold_type,
+            trig_int=trig_int, block_len=block_len, cores=cores,
+            mad_window=mad_window)
+
+
+class StreamingDetector(object):
+    """
+    Incremental matched-filter detection for data arriving in packets.
+
+    Each call to :meth:`append` correlates only the new samples (using
+    :class:`eqcorrscan.utils.correlate.StreamingCorrelator`, which keeps the
+    end of the data and the running normalisation between packets) and only
+    searches the newly completed correlation sums for detections, so the
+    detection latency depends on the packet length rather than on the length
+    of a window of data.
+
+    :type tribe: :class:`eqcorrscan.core.match_filter.Tribe`
+    :param tribe: Templates to detect with.
+    :type threshold: float
+    :param threshold: As for :meth:`Tribe.detect`.
+    :type threshold_type: str
+    :param threshold_type: As for :meth:`Tribe.detect`.
+    :type trig_int: float
+    :param trig_int: As for :meth:`Tribe.detect`.
+    :type block_len: int or str
+    :param block_len:
+        Length of transforms to use, see
+        :func:`eqcorrscan.utils.correlate.fftw_block_len`
+    :type cores: int
+    :param cores: Number of threads to use for correlations.
+    :type mad_window: float
+    :param mad_window:
+        Length in seconds of recent correlation sums to compute MAD
+        thresholds from.
+
+    .. Note::
+        Packets must already be processed to match the templates, must
+        contain all the channels that were in the first packet, and must
+        follow on directly from the previous packet with the same number of
+        samples on every channel.  Channels of the templates that are not in
+        the first packet are not used.
+
+    .. Note::
+        Peaks are only reported once the correlation sums for `trig_int`
+        after them are known, so that only the highest peak within `trig_int`
+        is kept, as for :meth:`Tribe.detect`.  MAD thresholds are computed
+        from the most recent `mad_window` of correlation sums rather than
+        the whole of the data, so detections may differ slightly from
+        :meth:`Tribe.detect` on the same data.
+    """
+    def __init__(self, tribe, threshold, threshold_type, trig_int,
+                 block_len='auto', cores=1, mad_window=600.0):
+        if threshold_type not in ['MAD', 'absolute', 'av_chan_corr']:
+            raise MatchFilterError(
+                'threshold_type must be one of: MAD, absolute, av_chan_corr')
+        self.tribe = tribe
+        self.threshold = threshold
+        self.threshold_type = threshold_type
+        self.trig_int = trig_int
+        self.block_len = block_len
+        self.cores = cores
+        self.mad_window = mad_window
+        self.correlator = None
+        self.starttime = None
+        self.samp_rate = None
+        self.seed_ids = None
+        self.chans = None
+        self._next_time = None
+
+    def __repr__(self):
+        return ("StreamingDetector(templates={0}, starttime={1}, "
+                "next_time={2})".format(len(self.tribe), self.starttime,
+                                        self._next_time))
+
+    def _setup(self, stream):
+        """ Match template channels to the data and start correlating. """
+        stachans = set((tr.stats.network, tr.stats.station,
+                        tr.stats.location, tr.stats.channel)
+                       for tr in stream)
+        template_stachan = {}
+        templates = []
+        for template in self.tribe:
+            st = Stream([tr.copy() for tr in template.st
+                         if (tr.stats.network, tr.stats.station,
+                             tr.stats.location, tr.stats.channel) in stachans])
+            if len(st) == 0:
+                raise MatchFilterError(
+                    'No channels matching data for template {0}'.format(
+                        template.name))
+            for tr in st:
+                if tr.stats.sampling_rate != stream[0].stats.sampling_rate:
+                    raise MatchFilterError(
+                        'Template sampling rate does not match continuous '
+                        'data')
+            counts = Counter((tr.stats.network, tr.stats.station,
+                              tr.stats.location, tr.stats.channel)
+                             for tr in st)
+            for stachan, count in counts.items():
+                template_stachan[stachan] = max(
+                    count, template_stachan.get(stachan, 0))
+            templates.append(st)
+        # Pad out templates to have all channels
+        for template in templates:
+            for stachan, count in template_stachan.items():
+                n_missing = count - len(template.select(
+                    network=stachan[0], station=stachan[1],
+                    location=stachan[2], channel=stachan[3]))
+                for _ in range(n_missing):
+                    nulltrace = Trace(data=np.array(
+                        [np.NaN] * len(template[0].data), dtype=np.float32))
+                    nulltrace.stats.update(
+                        {'network': stachan[0], 'station': stachan[1],
+                         'location': stachan[2], 'channel': stachan[3],
+                         'sampling_rate': template[0].stats.sampling_rate,
+                         'starttime': template[0].stats.starttime})
+                    template += nulltrace
+            template.sort()
+        stream = Stream([tr for tr in stream
+                         if (tr.stats.network, tr.stats.station,
+                             tr.stats.location, tr.stats.channel)
+                         in template_stachan.keys()])
+        _, template_dict, pad_dict, seed_ids = _get_array_dicts(
+            templates, stream)
+        self.correlator = StreamingCorrelator(
+            template_array=template_dict, pad_array=pad_dict,
+            seed_ids=seed_ids, block_len=self.block_len,
+            cores_inner=self.cores)
+        self.seed_ids = seed_ids
+        self.chans = [[] for _ in templates]
+        for seed_id, used_chans in zip(seed_ids,
+                                       self.correlator.used_chans):
+            for chan, used in zip(self.chans, used_chans):
+                if used:
+                    chan.append((seed_id.split('.')[1],
+                                 seed_id.split('.')[-1].split('_')[0]))
+        self.samp_rate = stream[0].stats.sampling_rate
+        self.starttime = stream[0].stats.starttime
+        self._cccsums = np.zeros((len(templates), 0), dtype=np.float32)
+        self._mad_history = np.zeros((len(templates), 0), dtype=np.float32)
+        self._buffer_start = 0
+        self._searched = 0
+        self._next_time = self.starttime
+        return self._packet_dict(stream)
+
+    def _packet_dict(self, stream):
+        """ Check that a packet follows on and get its data by seed id. """
+        stream_dict = {}
+        npts = None
+        for seed_id in self.seed_ids:
+            trs = stream.select(id=seed_id.split('_')[0])
+            if len(trs) != 1:
+                raise MatchFilterError(
+                    'Need exactly one trace for {0} in every packet'.format(
+                        seed_id.split('_')[0]))
+            tr = trs[0]
+            if abs(tr.stats.starttime - self._next_time) > \
+                    0.5 / self.samp_rate:
+                raise MatchFilterError(
+                    'Data for {0} start at {1}, expected {2}'.format(
+                        tr.id, tr.stats.starttime, self._next_time))
+            if npts is None:
+                npts = tr.stats.npts
+            elif tr.stats.npts != npts:
+                raise MatchFilterError(
+                    'Packets must be the same length on all channels')
+            stream_dict[seed_id] = tr.data.astype(np.float32)
+        return stream_dict
+
+    def append(self, stream):
+        """
+        Add the next packet of data and detect within it.
+
+        :type stream: `obspy.core.stream.Stream`
+        :param stream:
+            Processed data following on directly from the previous packet.
+
+        :rtype: :class:`eqcorrscan.core.match_filter.Party`
+        :return:
+            Party of the detections completed by these data - families
+            without new detections are included.
+        """
+        if self.correlator is None:
+            stream_dict = self._setup(stream)
+        else:
+            stream_dict = self._packet_dict(stream)
+        npts = len(stream_dict[self.seed_ids[0]])
+        self._next_time = (self.starttime + (
+            self.correlator.n_samples + npts) / self.samp_rate)
+        cccsums = self.correlator.append(stream_dict)
+        return self._detect(cccsums)
+
+    def _detect(self, cccsums):
+        """ Find peaks in the correlation sums that are now complete. """
+        trig_int = int(self.trig_int * self.samp_rate)
+        self._cccsums = np.concatenate([self._cccsums, cccsums], axis=1)
+        if self.threshold_type == 'MAD':
+            mad_len = int(self.mad_window * self.samp_rate)
+            self._mad_history = np.concatenate(
+                [self._mad_history, cccsums], axis=1)[:, -mad_len:]
+            thresholds = [self.threshold * np.median(np.abs(history))
+                          for history in self._mad_history]
+        elif self.threshold_type == 'absolute':
+            thresholds = [self.threshold for _ in self._cccsums]
+        else:
+            thresholds = [self.threshold * no_chans
+                          for no_chans in self.correlator.no_chans]
+        party = Party()
+        # Peaks within trig_int of the end may yet be beaten by later peaks
+        final = self._cccsums.shape[1] - trig_int
+        if final <= self._searched:
+            return party
+        peak_arrays, peak_indexes, peak_values, _ = \
+            multi_find_peaks_compiled(
+                arr=self._cccsums, threshold=thresholds,
+                threshold_type='absolute', trig_int=trig_int,
+                cores=self.correlator.cores_outer)
+        all_peaks = [[] for _ in range(len(self._cccsums))]
+        for i, index, value in zip(peak_arrays, peak_indexes, peak_values):
+            all_peaks[i].append((value, int(index)))
+        for i, template in enumerate(self.tribe):
+            family = Family(template=template, detections=[])
+            for value, index in all_peaks[i]:
+                if not self._searched <= index < final:
+                    continue
+                detect_time = self.starttime + (
+                    self._buffer_start + index) / self.samp_rate
+                family.append(Detection(
+                    template_name=template.name, detect_time=detect_time,
+                    no_chans=self.correlator.no_chans[i], detect_val=value,
+                    threshold=thresholds[i], typeofdet='corr',
+                    chans=self.chans[i], threshold_type=self.threshold_type,
+                    threshold_input=self.threshold))
+            party += family
+        # Keep trig_int of searched sums as context for the next search
+        keep_from = max(final - trig_int, 0)
+        self._cccsums = self._cccsums[:, keep_from:]
+        self._buffer_start += keep_from
+        self._searched = final - keep_from
+        return party
+
 
 class Detection(object):
     """
@@ -3399,7 +3850,8 @@ def _group_detect(templates, stream, threshold, threshold_type, trig_int,
                   plotvar, group_size=None, pre_processed=False, daylong=False,
                   parallel_process=True, xcorr_func=None, concurrency=None,
                   cores=None, ignore_length=False, overlap="calculate",
-                  debug=0, full_peaks=False, process_cores=None, **kwargs):
+                  debug=0, full_peaks=False, process_cores=None,
+                  native_process=False, **kwargs):
     """
     Pre-process and compute detections for a group of templates.
 
@@ -3480,38 +3932,29 @@ def _group_detect(templates, stream, threshold, threshold_type, trig_int,
     :param process_cores:
         Number of processes to use for pre-processing (if different to
         `cores`).
+    :type native_process: bool
+    :param native_process:
+        Whether to pre-process all channels in one threaded compiled call.
 
     :return:
-        :class:`eqcorrscan.core.match_filter.Party` of families of detections.
+        :class:`eqcorrscan.core.match_filter.Party` of families of detections,
+        with the time spent in each stage as `timings`.
     """
-    master = templates[0]
-    # Check that they are all processed the same.
-    lap = 0.0
-    for template in templates:
-        starts = [t.stats.starttime for t in template.st.sort(['starttime'])]
-        if starts[-1] - starts[0] > lap:
-            lap = starts[-1] - starts[0]
-        if not template.same_processing(master):
-            raise MatchFilterError('Templates must be processed the same.')
-    if overlap is None:
-        overlap = 0.0
-    elif not isinstance(overlap, float) and str(overlap) == str("calculate"):
-        overlap = lap
-    elif not isinstance(overlap, float):
-        raise NotImplementedError(
-            "%s is not a recognised overlap type" % str(overlap))
+    overlap = _template_overlap(templates, overlap)
+    party = Party()
     if not pre_processed:
         if process_cores is None:
             process_cores = cores
-        streams = _group_process(
-            template_group=templates, parallel=parallel_process, debug=debug,
-            cores=process_cores, stream=stream, daylong=daylong,
-            ignore_length=ignore_length, overlap=overlap)
+        with party.timings.time('processing'):
+            streams = _group_process(
+                template_group=templates, parallel=parallel_process,
+                debug=debug, cores=process_cores, stream=stream,
+                daylong=daylong, ignore_length=ignore_length,
+                overlap=overlap, native_process=native_process)
     else:
         warnings.warn('Not performing any processing on the continuous data.')
         streams = [stream]
     detections = []
-    party = Party()
     if group_size is not None:
         n_groups = int(len(templates) / group_size)
         if n_groups * group_size < len(templates):
@@ -3543,7 +3986,8 @@ def _group_detect(templates, stream, threshold, threshold_type, trig_int,
                 xcorr_func=xcorr_func, concurrency=concurrency,
                 threshold=threshold, threshold_type=threshold_type,
                 trig_int=trig_int, plotvar=plotvar, debug=debug, cores=cores,
-                full_peaks=full_peaks, peak_cores=process_cores, **kwargs)
+                full_peaks=full_peaks, peak_cores=process_cores,
+                timings=party.timings, **kwargs)
             for template in template_group:
                 family = Family(template=template, detections=[])
                 for detection in detections:
@@ -3553,8 +3997,531 @@ def _group_detect(templates, stream, threshold, threshold_type, trig_int,
     return party
 
 
+def _group_templates(templates):
+    """
+    Group templates that were processed the same.
+
+    :type templates: list
+    :param templates: List of Templates.
+
+    :rtype: list
+    :return: List of lists of Templates, one list for each processing.
+    """
+    template_groups = []
+    for master in templates:
+        for group in template_groups:
+            if master in group:
+                break
+        else:
+            new_group = [master]
+            for slave in templates:
+                if master.same_processing(slave) and master != slave:
+                    new_group.append(slave)
+            template_groups.append(new_group)
+    # template_groups will contain an empty first list
+    for group in template_groups:
+        if len(group) == 0:
+            template_groups.remove(group)
+    return template_groups
+
+
+def _download_chunk(client, template_channel_ids, starttime, endtime, buff,
+                    data_length, min_gap=None, retries=3):
+    """
+    Download and check a chunk of data for `Tribe.client_detect`.
+
+    :param client: Any obspy client with a dataselect service.
+    :type template_channel_ids: list
+    :param template_channel_ids:
+        List of (network, station, location, channel) to download.
+    :type starttime: :class:`obspy.core.UTCDateTime`
+    :param starttime: Start of the chunk.
+    :type endtime: :class:`obspy.core.UTCDateTime`
+    :param endtime: End of the chunk.
+    :type buff: float
+    :param buff: Seconds of extra data to download either side of the chunk.
+    :type data_length: float
+    :param data_length:
+        Length of data needed, channels shorter than 80% of this are removed.
+    :type min_gap: float
+    :param min_gap: Channels with gaps longer than this are removed.
+    :type retries: int
+    :param retries: Number of attempts allowed for downloading.
+
+    :rtype: :class:`obspy.core.stream.Stream`
+    """
+    bulk_info = []
+    for chan_id in template_channel_ids:
+        bulk_info.append((
+            chan_id[0], chan_id[1], chan_id[2], chan_id[3],
+            starttime - buff, endtime + buff))
+    for retry_attempt in range(retries):
+        try:
+            st = client.get_waveforms_bulk(bulk_info)
+            break
+        except Exception as e:
+            print(e)
+            continue
+    else:
+        raise MatchFilterError(
+            "Could not download data after {0} attempts".format(retries))
+    # Get gaps and remove traces as necessary
+    if min_gap:
+        gaps = st.get_gaps(min_gap=min_gap)
+        if len(gaps) > 0:
+            print("Large gaps in downloaded data")
+            st.merge()
+            gappy_channels = list(
+                set([(gap[0], gap[1], gap[2], gap[3]) for gap in gaps]))
+            _st = Stream()
+            for tr in st:
+                tr_stats = (tr.stats.network, tr.stats.station,
+                            tr.stats.location, tr.stats.channel)
+                if tr_stats in gappy_channels:
+                    print("Removing gappy channel: %s" % str(tr))
+                else:
+                    _st += tr
+            st = _st
+            st.split()
+    st.merge()
+    st.trim(starttime=starttime, endtime=endtime)
+    for tr in st:
+        if not _check_daylong(tr):
+            st.remove(tr)
+            print("{0} contains more zeros than non-zero, "
+                  "removed".format(tr.id))
+    for tr in st:
+        if tr.stats.endtime - tr.stats.starttime < 0.8 * data_length:
+            st.remove(tr)
+            print("{0} is less than 80% of the required length"
+                  ", removed".format(tr.id))
+    return st
+
+
+class _MemoryBudget(object):
+    """
+    Bytes of data held between the stages of a pipeline.
+
+    :type limit: int
+    :param limit: Bytes to hold before waiting, None for no limit.
+    """
+    def __init__(self, limit=None):
+        self.limit = limit
+        self.held = 0
+        self._condition = threading.Condition()
+
+    def add(self, nbytes):
+        with self._condition:
+            self.held += nbytes
+
+    def release(self, nbytes):
+        with self._condition:
+            self.held -= nbytes
+            self._condition.notify_all()
+
+    def wait(self, nbytes, stop):
+        """
+        Wait until `nbytes` more can be held, or nothing is held.
+
+        :type stop: threading.Event
+        :param stop: Give up waiting when this is set.
+
+        :return: False if stopped.
+        """
+        with self._condition:
+            while (self.limit is not None and self.held > 0 and
+                   self.held + nbytes > self.limit and not stop.is_set()):
+                self._condition.wait(0.1)
+        return not stop.is_set()
+
+
+def _stream_nbytes(st):
+    """ Bytes of data in a stream. """
+    return sum(tr.data.nbytes for tr in st)
+
+
+def _pipeline_chunks(download, n_chunks, process, queue_depth=1,
+                     max_queue_memory=None):
+    """
+    Download and process chunks of data ahead of their use.
+
+    Chunks are downloaded in one thread and processed in another, each
+    stage passing chunks to the next through a queue of at most
+    `queue_depth` chunks, so that the next chunks are downloaded and
+    processed while the caller works on the last.
+
+    :type download: callable
+    :param download: Function of the chunk index returning a Stream.
+    :type n_chunks: int
+    :param n_chunks: Number of chunks to download.
+    :type process: callable
+    :param process:
+        Function of a Stream returning a list of (templates, processed
+        streams).
+    :type queue_depth: int
+    :param queue_depth: Maximum number of chunks waiting at each stage.
+    :type max_queue_memory: int
+    :param max_queue_memory:
+        Downloads wait while more than this many bytes of data, raw and
+        processed, are held ahead of the caller.  One chunk is always held.
+
+    :return:
+        Generator of (stream, processed, seconds spent processing), where
+        processed is the Exception raised if processing failed.  Errors
+        downloading are raised.
+    """
+    stop = threading.Event()
+    budget = _MemoryBudget(max_queue_memory)
+    downloaded = Queue(maxsize=queue_depth)
+    processed = Queue(maxsize=queue_depth)
+
+    def put(queue, item):
+        while not stop.is_set():
+            try:
+                queue.put(item, timeout=0.1)
+                return True
+            except Full:
+                continue
+        return False
+
+    def get(queue):
+        while not stop.is_set():
+            try:
+                return queue.get(timeout=0.1)
+            except Empty:
+                continue
+        return None
+
+    def downloader():
+        last_nbytes = 0
+        for i in range(n_chunks):
+            # Assume the next chunk is the same size as the last
+            if not budget.wait(last_nbytes, stop):
+                return
+            try:
+                st = download(i)
+            except Exception as e:
+                put(downloaded, (None, e))
+                return
+            last_nbytes = _stream_nbytes(st)
+            budget.add(last_nbytes)
+            if not put(downloaded, (st, last_nbytes)):
+                return
+        put(downloaded, None)
+
+    def processor():
+        while True:
+            item = get(downloaded)
+            if item is None or item[0] is None:
+                put(processed, item)
+                return
+            st, nbytes = item
+            tic = time.time()
+            try:
+                result = process(st)
+                processed_nbytes = sum(_stream_nbytes(chunk)
+                                       for _, streams in result
+                                       for chunk in streams)
+            except Exception as e:
+                result, processed_nbytes = e, 0
+            budget.add(processed_nbytes)
+            if not put(processed, (st, result, time.time() - tic,
+                                   nbytes + processed_nbytes)):
+                return
+
+    threads = [threading.Thread(target=downloader),
+               threading.Thread(target=processor)]
+    for thread in threads:
+        thread.daemon = True
+        thread.start()
+    try:
+        while True:
+            item = get(processed)
+            if item is None:
+                break
+            if item[0] is None:
+                raise item[1]
+            st, result, seconds, nbytes = item
+            yield st, result, seconds
+            # The caller has finished with this chunk
+            budget.release(nbytes)
+    finally:
+        stop.set()
+        for thread in threads:
+            thread.join()
+
+
+def _detect_processed(templates, streams, **kwargs):
+    """
+    Detect with a group of templates in processed chunks of data.
+
+    :type templates: list
+    :param templates: Templates, which must all be processed the same.
+    :type streams: list
+    :param streams: Chunks of data processed by `_group_process`.
+
+    Other arguments are as for `_group_detect`.
+
+    :return: :class:`eqcorrscan.core.match_filter.Party`
+    """
+    party = Party()
+    with warnings.catch_warnings():
+        # Data are processed before they are queued
+        warnings.filterwarnings(
+            'ignore', 'Not performing any processing on the continuous data.')
+        for st_chunk in streams:
+            party += _group_detect(
+                templates=templates, stream=st_chunk, pre_processed=True,
+                overlap=None, **kwargs)
+    return party
+
+
+def _template_overlap(templates, overlap):
+    """
+    Work out the overlap of chunks of data for a group of templates.
+
+    :type templates: list
+    :param templates: Templates, which must all be processed the same.
+    :type overlap: float
+    :param overlap: Either None, "calculate" or a float, see `_group_detect`.
+
+    :rtype: float
+    :return: Overlap in seconds.
+    """
+    master = templates[0]
+    # Check that they are all processed the same.
+    lap = 0.0
+    for template in templates:
+        starts = [t.stats.starttime for t in template.st.sort(['starttime'])]
+        if starts[-1] - starts[0] > lap:
+            lap = starts[-1] - starts[0]
+        if not template.same_processing(master):
+            raise MatchFilterError('Templates must be processed the same.')
+    if overlap is None:
+        overlap = 0.0
+    elif not isinstance(overlap, float) and str(overlap) == str("calculate"):
+        overlap = lap
+    elif not isinstance(overlap, float):
+        raise NotImplementedError(
+            "%s is not a recognised overlap type" % str(overlap))
+    return overlap
+
+
+def _sharded_detect(template_groups, stream, shards, daylong=False,
+                    parallel_process=True, cores=None, ignore_length=False,
+                    overlap="calculate", debug=0, process_cores=None,
+                    save_progress=False, native_process=False, **kwargs):
+    """
+    Detect with the templates split between worker processes.
+
+    Each worker process owns a fixed shard of the templates for the whole
+    run, so cached template spectra are kept between chunks of data.  Data
+    are processed once, in this process, and each processed chunk is
+    published once in shared memory for all the workers to read in place.
+
+    :type template_groups: list
+    :param template_groups:
+        Lists of Templates, each processed the same, see `Tribe.detect`.
+    :type stream: `obspy.core.stream.Stream`
+    :param stream: Continuous data to process and detect within.
+    :type shards: int
+    :param shards: Number of worker processes to split templates between.
+
+    Other arguments are as for `_group_detect`, `cores` is the number of
+    workers for correlation in each worker process.
+
+    :return:
+        :class:`eqcorrscan.core.match_filter.Party` of families of detections.
+    """
+    if process_cores is None:
+        process_cores = cores
+    kwargs.update({'cores': cores, 'debug': debug,
+                   'process_cores': process_cores})
+    # Keep template spectra in the workers between chunks
+    kwargs.setdefault('cache_templates', True)
+    # Deal the templates of each group out between shards
+    shard_groups = [[group[i::shards] for group in template_groups]
+                    for i in range(shards)]
+    party = Party()
+    results = multiprocessing.Queue()
+    workers = []
+    with temporary_directory(parent=SHARED_MEMORY_DIR) as shared_dir:
+        try:
+            for groups, cpus in zip(shard_groups, _shard_cpus(shards)):
+                tasks = multiprocessing.Queue()
+                worker = multiprocessing.Process(
+                    target=_shard_worker,
+                    args=(groups, tasks, results, cpus, kwargs))
+                worker.daemon = True
+                worker.start()
+                workers.append((worker, tasks))
+            for i, group in enumerate(template_groups):
+                with party.timings.time('processing'):
+                    streams = _group_process(
+                        template_group=group, parallel=parallel_process,
+                        debug=debug, cores=process_cores,
+                        stream=_shallow_copy(stream), daylong=daylong,
+                        ignore_length=ignore_length,
+                        overlap=_template_overlap(group, overlap),
+                        native_process=native_process)
+                published = [_publish_stream(st_chunk, shared_dir)
+                             for st_chunk in streams]
+                # Only the shared copy of the data is kept
+                del streams
+                n_tasks = 0
+                for chunk in published:
+                    for (worker, tasks), groups in zip(workers, shard_groups):
+                        if len(groups[i]) > 0:
+                            tasks.put((i, chunk))
+                            n_tasks += 1
+                for _ in range(n_tasks):
+                    party += _shard_result(results, workers)
+                for chunk in published:
+                    os.remove(chunk[0])
+                if save_progress:
+                    party.write("eqcorrscan_temporary_party")
+        except BaseException:
+            for worker, tasks in workers:
+                worker.terminate()
+                tasks.cancel_join_thread()
+            raise
+        finally:
+            for worker, tasks in workers:
+                if worker.is_alive():
+                    tasks.put(None)
+            for worker, tasks in workers:
+                worker.join()
+    return party
+
+
+def _shard_cpus(shards):
+    """
+    Split the CPUs this process may run on between shards.
+
+    CPUs are grouped by socket, so that where there are as many shards as
+    sockets each shard runs on its own socket.
+
+    :type shards: int
+    :param shards: Number of shards.
+
+    :return:
+        List of the CPUs for each shard, or of None for each shard if CPUs
+        cannot be set on this system or there are fewer CPUs than shards.
+    """
+    if not hasattr(os, 'sched_getaffinity'):
+        return [None] * shards
+    cpus = sorted(os.sched_getaffinity(0))
+    if len(cpus) < shards:
+        return [None] * shards
+
+    def _socket(cpu):
+        try:
+            with open('/sys/devices/system/cpu/cpu{0}/topology/'
+                      'physical_package_id'.format(cpu), 'r') as f:
+                return int(f.read())
+        except (IOError, ValueError):
+            return 0
+
+    cpus.sort(key=lambda cpu: (_socket(cpu), cpu))
+    n_cpus = len(cpus) // shards
+    shard_cpus = [cpus[i * n_cpus: (i + 1) * n_cpus] for i in range(shards)]
+    # Spare CPUs go to the last shard
+    shard_cpus[-1].extend(cpus[shards * n_cpus:])
+    return shard_cpus
+
+
+def _shard_worker(groups, tasks, results, cpus, kwargs):
+    """
+    Detect with a fixed shard of templates, run in a worker process.
+
+    :type groups: list
+    :param groups:
+        Templates of this shard, as a list for each processing group.
+    :param tasks:
+        Queue of (group index, published chunk of data) to detect in, None to
+        stop.
+    :param results: Queue to put (Party, error) on for each task.
+    :param cpus: CPUs to run on, or None to leave as inherited.
+    :type kwargs: dict
+    :param kwargs: Arguments for `_group_detect`.
+    """
+    if cpus is not None:
+        os.sched_setaffinity(0, cpus)
+    # Data are processed before they are published
+    warnings.filterwarnings(
+        'ignore', 'Not performing any processing on the continuous data.')
+    while True:
+        task = tasks.get()
+        if task is None:
+            break
+        i, published = task
+        try:
+            party = _group_detect(
+                templates=groups[i], stream=_attach_stream(published),
+                pre_processed=True, **kwargs)
+            results.put((party, None))
+        except Exception:
+            results.put((None, traceback.format_exc()))
+
+
+def _shard_result(results, workers):
+    """ Get the next Party from shard workers, raising errors from them. """
+    while True:
+        try:
+            party, error = results.get(timeout=1)
+        except Empty:
+            if not all(worker.is_alive() for worker, _ in workers):
+                raise MatchFilterError('Shard worker process died')
+            continue
+        if error is not None:
+            raise MatchFilterError('Error in shard worker:\n' + error)
+        return party
+
+
+def _publish_stream(stream, directory):
+    """
+    Copy the data of a stream into a file mapped into memory.
+
+    The data of the stream are replaced by views of the mapped file, so that
+    no other copy is kept.  Read with `_attach_stream`.
+
+    :type stream: `obspy.core.stream.Stream`
+    :param stream: Stream to publish.
+    :type directory: str
+    :param directory: Directory to make the file in.
+
+    :rtype: tuple
+    :return: The file name, shape of the data and headers of the traces.
+    """
+    handle, filename = tempfile.mkstemp(suffix='.dat', dir=directory)
+    os.close(handle)
+    npts = max([tr.stats.npts for tr in stream] or [0])
+    shared = np.memmap(filename, dtype=np.float32, mode='w+',
+                       shape=(max(len(stream), 1), max(npts, 1)))
+    for row, tr in zip(shared, stream):
+        row[0:tr.stats.npts] = tr.data
+        tr.data = row[0:tr.stats.npts]
+    shared.flush()
+    return filename, shared.shape, [tr.stats for tr in stream]
+
+
+def _attach_stream(published):
+    """
+    Read a stream published by `_publish_stream` without copying its data.
+
+    :type published: tuple
+    :param published: As returned by `_publish_stream`.
+
+    :rtype: `obspy.core.stream.Stream`
+    """
+    filename, shape, headers = published
+    shared = np.memmap(filename, dtype=np.float32, mode='r', shape=shape)
+    return Stream([Trace(data=row[0:header.npts], header=header)
+                   for row, header in zip(shared, headers)])
+
+
 def _group_process(template_group, parallel, debug, cores, stream, daylong,
-                   ignore_length, overlap):
+                   ignore_length, overlap, native_process=False):
     """
     Process data into chunks based on template processing length.
 
@@ -3580,8 +4547,14 @@ def _group_process(template_group, parallel, debug, cores, stream, daylong,
         ignore_length=True.  This is not recommended!
     :type overlap: float
     :param overlap: Number of seconds to overlap chunks by.
+    :type native_process: bool
+    :param native_process:
+        Whether to resample, detrend and filter all channels in one threaded
+        compiled call, see :func:`eqcorrscan.utils.pre_processing.dayproc`.
 
-    :return: list of processed streams.
+    :return:
+        list of processed streams, the data of each packed into one buffer
+        by :func:`eqcorrscan.utils.correlate.pack_stream`.
     """
     master = template_group[0]
     processed_streams = []
@@ -3589,7 +4562,7 @@ def _group_process(template_group, parallel, debug, cores, stream, daylong,
         'filt_order': master.filt_order,
         'highcut': master.highcut, 'lowcut': master.lowcut,
         'samp_rate': master.samp_rate, 'debug': debug,
-        'parallel': parallel, 'num_cores': cores}
+        'parallel': parallel, 'num_cores': cores, 'native': native_process}
     # Processing always needs to be run to account for gaps - pre-process will
     # check whether filtering and resampling needs to be done.
     if daylong:
@@ -3631,7 +4604,10 @@ def _group_process(template_group, parallel, debug, cores, stream, daylong,
         for tr in chunk_stream:
             tr.data = tr.data[0:int(
                 master.process_length * tr.stats.sampling_rate)]
-        processed_streams.append(func(st=chunk_stream, **kwargs))
+        processed = func(st=chunk_stream, **kwargs)
+        # Hold the processed data in the layout read by the correlators
+        pack_stream(processed)
+        processed_streams.append(processed)
     return processed_streams
 
 
@@ -4001,7 +4977,8 @@ def match_filter(template_names, template_list, st, threshold,
                  xcorr_func=None, concurrency=None, cores=None,
                  debug=0, plot_format='png', output_cat=False,
                  output_event=True, extract_detections=False,
-                 arg_check=True, full_peaks=False, peak_cores=None, **kwargs):
+                 arg_check=True, full_peaks=False, peak_cores=None,
+                 timings=None, **kwargs):
     """
     Main matched-filter detection function.
 
@@ -4078,8 +5055,13 @@ def match_filter(template_names, template_list, st, threshold,
     :param full_peaks: See `eqcorrscan.core.findpeaks.find_peaks2_short`.
     :type peak_cores: int
     :param peak_cores:
-        Number of processes to use for parallel peak-finding (if different to
+        Number of threads to use for parallel peak-finding (if different to
         `cores`).
+    :type timings: :class:`eqcorrscan.core.match_filter.DetectionTimings`
+    :param timings:
+        Timings to add the time spent correlating, peak-finding and making
+        detections to, including the counters of the fftw correlation
+        C-code.  Not collected if None (default).
 
     .. note::
         **Returns:**
@@ -4245,8 +5227,9 @@ def match_filter(template_names, template_list, st, threshold,
         parallel = True
     else:
         parallel = False
-    # Copy the stream here because we will muck about with it
-    stream = st.copy()
+    # Copy the stream here because we will muck about with it, data are
+    # replaced rather than changed in place, so can be shared.
+    stream = _shallow_copy(st)
     templates = copy.deepcopy(template_list)
     _template_names = copy.deepcopy(template_names)
     # Debug option to confirm that the channel names match those in the
@@ -4401,9 +5384,14 @@ def match_filter(template_names, template_list, st, threshold,
     for template in templates:
         debug_print(template.__str__(), 3, debug)
     debug_print(stream.__str__(), 3, debug)
+    if timings is None:
+        timings = DetectionTimings()
+    else:
+        kwargs.setdefault('stats', timings.correlation)
     multichannel_normxcorr = get_stream_xcorr(xcorr_func, concurrency)
-    [cccsums, no_chans, chans] = multichannel_normxcorr(
-        templates=templates, stream=stream, cores=cores, **kwargs)
+    with timings.time('correlate'):
+        [cccsums, no_chans, chans] = multichannel_normxcorr(
+            templates=templates, stream=stream, cores=cores, **kwargs)
     if len(cccsums[0]) == 0:
         raise MatchFilterError('Correlation has not run, zero length cccsum')
     outtoc = time.clock()
@@ -4416,19 +5404,21 @@ def match_filter(template_names, template_list, st, threshold,
     detections = []
     if output_cat:
         det_cat = Catalog()
-    if str(threshold_type) == str("absolute"):
-        thresholds = [threshold for _ in range(len(cccsums))]
-    elif str(threshold_type) == str('MAD'):
-        thresholds = [threshold * np.median(np.abs(cccsum))
-                      for cccsum in cccsums]
-    else:
-        thresholds = [threshold * no_chans[i] for i in range(len(cccsums))]
     if peak_cores is None:
         peak_cores = cores
-    all_peaks = multi_find_peaks(
-        arr=cccsums, thresh=thresholds, debug=debug, parallel=parallel,
-        trig_int=int(trig_int * stream[0].stats.sampling_rate),
-        full_peaks=full_peaks, cores=peak_cores)
+    if not parallel:
+        peak_cores = 1
+    with timings.time('peaks'):
+        peak_arrays, peak_indexes, peak_values, thresholds = \
+            multi_find_peaks_compiled(
+                arr=cccsums, threshold=threshold,
+                threshold_type=str(threshold_type),
+                trig_int=int(trig_int * stream[0].stats.sampling_rate),
+                no_chans=no_chans, full_peaks=full_peaks, cores=peak_cores)
+    all_peaks = [[] for _ in range(len(cccsums))]
+    for i, index, value in zip(peak_arrays, peak_indexes, peak_values):
+        all_peaks[i].append((value, int(index)))
+    tic = time.time()
     for i, cccsum in enumerate(cccsums):
         if np.abs(np.mean(cccsum)) > 0.05:
             warnings.warn('Mean is not zero!  Check this!')
@@ -4464,6 +5454,7 @@ def match_filter(template_names, template_list, st, threshold,
                     det_cat.append(detection.event)
         if extract_detections:
             detection_streams = extract_from_stream(stream, detections)
+    timings.add('detections', time.time() - tic)
     del stream, templates
     if output_cat and not extract_detections:
         return detections, det_cat
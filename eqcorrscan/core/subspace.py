@@ -17,6 +17,7 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
 import numpy as np
 import warnings
 import time
@@ -31,12 +32,19 @@ from obspy import Trace, UTCDateTime, Stream
 from obspy.core.event import Event, CreationInfo, ResourceIdentifier, Comment,\
     WaveformStreamID, Pick
 
+from future.utils import native_str
+
 from eqcorrscan.utils.clustering import svd
 from eqcorrscan.utils.debug_log import debug_print
+from eqcorrscan.utils.libnames import _load_cdll
 from eqcorrscan.utils import findpeaks, pre_processing, stacking, plotting
 from eqcorrscan.core.match_filter import Detection, extract_from_stream
 from eqcorrscan.utils.plotting import subspace_detector_plot, subspace_fc_plot
 
+# Default largest size in bytes of the statistics and bases allocated for the
+# detectors computed together by subspace_detect.
+MAX_STATS_MEMORY = 2 ** 30
+
 
 class Detector(object):
     """
@@ -443,7 +451,8 @@ class Detector(object):
 
 
 def _detect(detector, st, threshold, trig_int, moveout=0, min_trig=0,
-            process=True, extract_detections=False, cores=1, debug=0):
+            process=True, extract_detections=False, cores=1, debug=0,
+            stats=None):
     """
     Detect within continuous data using the subspace method.
 
@@ -473,6 +482,11 @@ def _detect(detector, st, threshold, trig_int, moveout=0, min_trig=0,
         detection or not, if true will return detections and streams.
     :type debug: int
     :param debug: Debug output level from 0-5.
+    :type stats: numpy.ndarray
+    :param stats:
+        Detection statistics of the detector for each channel of the
+        processed stream, as computed by :func:`_subspace_stats`.  Computed
+        here if not given.
 
     :return: list of detections
     :rtype: list of eqcorrscan.core.match_filter.Detection
@@ -500,18 +514,10 @@ def _detect(detector, st, threshold, trig_int, moveout=0, min_trig=0,
         Nc = len(detector.stachans)
     else:
         Nc = 1
-    # Here do all ffts
-    fft_vars = _do_ffts(detector, stream, Nc)
-    debug_print('Computing detection statistics', 0, debug)
-    debug_print('Preallocating stats matrix', 0, debug)
-    stats = np.zeros((len(stream[0]),
-                      (len(stream[0][0]) // Nc) - (fft_vars[4] // Nc) + 1))
-    for det_freq, data_freq_sq, data_freq, i in zip(fft_vars[0], fft_vars[1],
-                                                    fft_vars[2],
-                                                    np.arange(len(stream[0]))):
-        # Calculate det_statistic in frequency domain
-        stats[i] = _det_stat_freq(det_freq, data_freq_sq, data_freq,
-                                  fft_vars[3], Nc, fft_vars[4], fft_vars[5])
+    if stats is None:
+        debug_print('Computing detection statistics', 0, debug)
+        stats = _subspace_stats([detector], stream[0], Nc, cores=cores)[0]
+    for i in range(len(stream[0])):
         debug_print('Stats matrix is shape %s' % str(stats[i].shape), 0, debug)
         if debug >= 3:
             fig, ax = plt.subplots()
@@ -581,6 +587,108 @@ def _detect(detector, st, threshold, trig_int, moveout=0, min_trig=0,
     return detections
 
 
+def _subspace_stats(detectors, stream, Nc, cores=1):
+    """
+    Compute the detection statistics of many detectors in one compiled call.
+
+    The data are transformed once for all detectors, and the boxcar
+    denominators of all detectors come from one running sum of the energy of
+    each channel. Equivalent to :func:`_det_stat_freq` for each detector.
+
+    :type detectors: list
+    :param detectors:
+        List of :class:`eqcorrscan.core.subspace.Detector`, which must all
+        share the same channels.
+    :type stream: obspy.core.stream.Stream
+    :param stream: Stream processed according to the detectors.
+    :type Nc: int
+    :param Nc: Number of channels in data. 1 for non-multiplexed
+    :type cores: int
+    :param cores: Number of threads to use.
+
+    :return:
+        List of detection statistics for each detector, each of shape
+        (number of channels, number of windows).
+    :rtype: list
+    """
+    c_long = np.dtype(ctypes.c_long)
+    n_chans = len(stream)
+    mplen = stream[0].data.shape[0]
+    data = np.zeros((n_chans, mplen))
+    for row, tr in zip(data, stream):
+        row[0:min(mplen, len(tr.data))] = tr.data[0:mplen]
+    basis_lens = np.array(
+        [detector.data[0].shape[0] for detector in detectors], dtype=c_long)
+    max_dimension = max(max(u.shape[1] for u in detector.data)
+                        for detector in detectors)
+    bases = np.zeros((len(detectors), n_chans, max_dimension,
+                      max(basis_lens.max(), 1)))
+    dimensions = np.zeros((len(detectors), n_chans), dtype=c_long)
+    for i, detector in enumerate(detectors):
+        for j, u in enumerate(detector.data[0:n_chans]):
+            ulen = min(u.shape[0], basis_lens[i])
+            bases[i, j, 0:u.shape[1], 0:ulen] = u[0:ulen].T
+            dimensions[i, j] = u.shape[1]
+    n_outs = [len(range(ulen - 1, mplen, Nc)) for ulen in basis_lens]
+    stats = np.zeros((len(detectors), n_chans, max(max(n_outs), 1)))
+    fftlen = scipy.fftpack.next_fast_len(int(mplen + basis_lens.max() - Nc))
+
+    utilslib = _load_cdll('libutils')
+    long_arr = np.ctypeslib.ndpointer(
+        dtype=c_long, flags=native_str('C_CONTIGUOUS'))
+    double_arr = np.ctypeslib.ndpointer(
+        dtype=np.float64, flags=native_str('C_CONTIGUOUS'))
+    utilslib.subspace_statistic.argtypes = [
+        double_arr, ctypes.c_long, ctypes.c_long, double_arr, long_arr,
+        long_arr, ctypes.c_long, ctypes.c_long, ctypes.c_long, ctypes.c_long,
+        ctypes.c_long, double_arr, ctypes.c_long, ctypes.c_int]
+    utilslib.subspace_statistic.restype = ctypes.c_int
+    ret = utilslib.subspace_statistic(
+        data, mplen, n_chans, bases, basis_lens, dimensions, len(detectors),
+        bases.shape[-1], max_dimension, Nc, fftlen, stats, stats.shape[-1],
+        cores)
+    if ret != 0:
+        raise MemoryError("Could not allocate memory for subspace statistics")
+    return [detector_stats[:, 0:n_out]
+            for detector_stats, n_out in zip(stats, n_outs)]
+
+
+def _stats_batches(detectors, n_chans, mplen, max_memory):
+    """
+    Split detectors into batches for :func:`_subspace_stats`.
+
+    The statistics and zero-padded bases of each batch take at most
+    `max_memory` bytes, unless one detector alone needs more.
+
+    :type detectors: list
+    :param detectors: List of :class:`eqcorrscan.core.subspace.Detector`
+    :type n_chans: int
+    :param n_chans: Number of channels in the processed stream.
+    :type mplen: int
+    :param mplen: Number of samples in each channel of the processed stream.
+    :type max_memory: int
+    :param max_memory: Largest size of each batch in bytes.
+
+    :return: Lists of detectors.
+    :rtype: generator
+    """
+    batch, basis_len, dimension = [], 1, 1
+    for detector in detectors:
+        _basis_len = max(basis_len, detector.data[0].shape[0])
+        _dimension = max(dimension, max(u.shape[1] for u in detector.data))
+        memory = (8 * (len(batch) + 1) * n_chans *
+                  (mplen + _dimension * _basis_len))
+        if batch and memory > max_memory:
+            yield batch
+            batch = []
+            _basis_len = max(detector.data[0].shape[0], 1)
+            _dimension = max(max(u.shape[1] for u in detector.data), 1)
+        batch.append(detector)
+        basis_len, dimension = _basis_len, _dimension
+    if batch:
+        yield batch
+
+
 def _do_ffts(detector, stream, Nc):
     """
     Perform ffts on data, detector and denominator boxcar
@@ -959,7 +1067,8 @@ def align_design(design_set, shift_len, reject, multiplex, no_missed=True,
 
 
 def subspace_detect(detectors, stream, threshold, trig_int, moveout=0,
-                    min_trig=1, parallel=True, num_cores=None):
+                    min_trig=1, parallel=True, num_cores=None,
+                    max_memory=MAX_STATS_MEMORY):
     """
     Conduct subspace detection with chosen detectors.
 
@@ -983,22 +1092,28 @@ def subspace_detect(detectors, stream, threshold, trig_int, moveout=0,
         Minimum number of stations exceeding threshold for non-multiplexed,
         network detection. See note in :func:`Detector.detect`.
     :type parallel: bool
-    :param parallel: Whether to run detectors in parallel in groups.
+    :param parallel:
+        Whether to compute the statistics of detectors in parallel.
     :type num_cores: int
     :param num_cores:
-        How many cpu cores to use if parallel==True. If set to None (default),
+        How many threads to use if parallel==True. If set to None (default),
         will use all available cores.
+    :type max_memory: int
+    :param max_memory:
+        Largest size in bytes of the statistics and bases of the detectors
+        computed together.
 
     :rtype: list
     :return:
         List of :class:`eqcorrscan.core.match_filter.Detection` detections.
 
     .. Note::
-        This will loop through your detectors using their detect method.
-        If the detectors are multiplexed it will run groups of detectors with
-        the same channels at the same time.
+        Detectors with the same processing and channels are run together:
+        the data are processed once, and the statistics of as many of these
+        detectors as fit in `max_memory` are computed in one threaded
+        compiled call.
     """
-    from multiprocessing import Pool, cpu_count
+    from multiprocessing import cpu_count
     # First check that detector parameters are the same
     parameters = []
     detections = []
@@ -1023,32 +1138,22 @@ def subspace_detect(detectors, stream, threshold, trig_int, moveout=0,
                 sampling_rate=parameter_set[3], multiplex=parameter_set[4],
                 stachans=parameter_set[5], parallel=True, align=False,
                 shift_len=None, reject=False)
-        if not parallel:
-            for detector in parameter_detectors:
+        if parallel:
+            ncores = num_cores or cpu_count()
+        else:
+            ncores = 1
+        for batch in _stats_batches(
+                parameter_detectors, n_chans=len(stream[0]),
+                mplen=stream[0][0].data.shape[0], max_memory=max_memory):
+            # Nc is the number of channels when multiplexed
+            all_stats = _subspace_stats(
+                batch, stream[0],
+                Nc=len(parameter_set[5]) if parameter_set[4] else 1,
+                cores=ncores)
+            for detector, stats in zip(batch, all_stats):
                 detections += _detect(
                     detector=detector, st=stream[0], threshold=threshold,
                     trig_int=trig_int, moveout=moveout, min_trig=min_trig,
-                    process=False, extract_detections=False, debug=0)
-        else:
-            if num_cores:
-                ncores = num_cores
-            else:
-                ncores = cpu_count()
-            pool = Pool(processes=ncores)
-            results = [pool.apply_async(
-                _detect, args=(detector, stream[0], threshold, trig_int,
-                               moveout, min_trig, False, False, 0))
-                       for detector in parameter_detectors]
-            pool.close()
-            try:
-                _detections = [p.get() for p in results]
-            except KeyboardInterrupt as e:  # pragma: no cover
-                pool.terminate()
-                raise e
-            pool.join()
-            for d in _detections:
-                if isinstance(d, list):
-                    detections += d
-                else:
-                    detections.append(d)
+                    process=False, extract_detections=False, debug=0,
+                    stats=stats)
     return detections
@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+"""
+Benchmark the EQcorrscan correlation and detection routines.
+
+Writes JSON results that can be compared with an earlier run, e.g.:
+
+    benchmark_eqcorrscan.py --output new.json --compare old.json
+
+exits with status 1 if any case got slower than the tolerance.
+
+:copyright:
+    EQcorrscan developers.
+
+:license:
+    GNU Lesser General Public License, Version 3
+    (https://www.gnu.org/copyleft/lesser.html)
+"""
+
+import argparse
+import json
+import sys
+
+from eqcorrscan.utils.benchmark import (
+    BENCHMARKS, run_benchmarks, save_benchmarks, load_benchmarks,
+    compare_benchmarks)
+
+
+def main(arg_list=None):
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--templates', type=int, nargs='+', default=[10, 50],
+                        help="Numbers of templates")
+    parser.add_argument('--channels', type=int, nargs='+', default=[3, 12],
+                        help="Numbers of channels")
+    parser.add_argument('--template-lengths', type=int, nargs='+',
+                        default=[100, 400], help="Template lengths (samples)")
+    parser.add_argument('--data-lengths', type=int, nargs='+',
+                        default=[360000], help="Data lengths (samples)")
+    parser.add_argument('--threads', type=int, nargs='+', default=None,
+                        help="Numbers of threads (default 1 and all)")
+    parser.add_argument('--benchmarks', nargs='+', default=None,
+                        choices=BENCHMARKS, help="Benchmarks to run")
+    parser.add_argument('--repeats', type=int, default=3,
+                        help="Repeats of each case, the best is reported")
+    parser.add_argument('--c-harness', default=None,
+                        help="Compiled bench_multi_corr executable to run")
+    parser.add_argument('--output', default=None,
+                        help="JSON file to write results to")
+    parser.add_argument('--compare', default=None,
+                        help="JSON file of earlier results to compare to")
+    parser.add_argument('--tolerance', type=float, default=0.1,
+                        help="Fractional slow-down reported as a regression")
+    args = parser.parse_args(arg_list)
+
+    results = run_benchmarks(
+        n_templates=args.templates, n_channels=args.channels,
+        template_lens=args.template_lengths, data_lens=args.data_lengths,
+        threads=args.threads, benchmarks=args.benchmarks,
+        repeats=args.repeats, c_harness=args.c_harness, verbose=True)
+    if args.output:
+        save_benchmarks(results, args.output)
+    if args.compare:
+        regressions = compare_benchmarks(
+            load_benchmarks(args.compare), results, tolerance=args.tolerance)
+        for regression in regressions:
+            print("Regression: {0}".format(json.dumps(
+                regression, sort_keys=True)))
+        if regressions:
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
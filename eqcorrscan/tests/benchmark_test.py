@@ -0,0 +1,78 @@
+"""Test the benchmark suite."""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+from __future__ import unicode_literals
+import json
+import os
+import unittest
+
+import numpy as np
+
+
+class BenchmarkTesting(unittest.TestCase):
+    def test_synthetic_case(self):
+        """Check the shapes of the synthetic data."""
+        from eqcorrscan.utils.benchmark import synthetic_case
+        templates, data = synthetic_case(
+            n_templates=3, n_channels=2, template_len=50, data_len=2000)
+        self.assertEqual(len(templates), 3)
+        self.assertEqual(len(data), 2)
+        for template in templates:
+            self.assertEqual(len(template), 2)
+            for tr in template:
+                self.assertEqual(tr.stats.npts, 50)
+        for tr in data:
+            self.assertEqual(tr.stats.npts, 2000)
+        # Reproducible
+        _, data_again = synthetic_case(
+            n_templates=3, n_channels=2, template_len=50, data_len=2000)
+        for tr, tr_again in zip(data, data_again):
+            np.testing.assert_array_equal(tr.data, tr_again.data)
+
+    def test_run_and_compare(self):
+        """Run a small benchmark, round trip it and compare to itself."""
+        import tempfile
+        from eqcorrscan.utils.benchmark import (
+            BENCHMARKS, run_benchmarks, save_benchmarks, load_benchmarks,
+            compare_benchmarks)
+        results = run_benchmarks(
+            n_templates=[3], n_channels=[2], template_lens=[50],
+            data_lens=[3000], threads=[1, 2], repeats=1)
+        json.dumps(results)
+        self.assertEqual(len(results['results']), 2 * len(BENCHMARKS))
+        for result in results['results']:
+            self.assertGreater(result['throughput'], 0)
+            self.assertIsNotNone(result['efficiency'])
+        self.assertIn('commit', results['metadata'])
+        with tempfile.NamedTemporaryFile(suffix='.json', delete=False) as f:
+            filename = f.name
+        try:
+            save_benchmarks(results, filename)
+            self.assertEqual(load_benchmarks(filename), results)
+        finally:
+            os.remove(filename)
+        self.assertEqual(compare_benchmarks(results, results), [])
+
+    def test_compare_finds_regression(self):
+        from eqcorrscan.utils.benchmark import compare_benchmarks
+        case = {'benchmark': 'fftw_multi_normxcorr', 'n_templates': 10,
+                'n_channels': 3, 'template_len': 100, 'data_len': 1000,
+                'threads': 1}
+        old = {'results': [dict(case, throughput=100.0)]}
+        new = {'results': [dict(case, throughput=50.0),
+                           dict(case, threads=2, throughput=1.0)]}
+        regressions = compare_benchmarks(old, new, tolerance=0.1)
+        self.assertEqual(len(regressions), 1)
+        self.assertAlmostEqual(regressions[0]['change'], -0.5)
+        self.assertEqual(compare_benchmarks(old, new, tolerance=0.6), [])
+
+    def test_bad_benchmark_raises(self):
+        from eqcorrscan.utils.benchmark import run_benchmarks
+        with self.assertRaises(ValueError):
+            run_benchmarks(benchmarks=['gpu'])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -10,6 +10,7 @@ import unittest
 import numpy as np
 import os
 import shutil
+import warnings
 
 from obspy import Trace, Stream, read
 from matplotlib import path
@@ -17,7 +18,9 @@ from matplotlib import path
 from eqcorrscan.core.bright_lights import brightness, _read_tt, _resample_grid
 from eqcorrscan.core.bright_lights import _rm_similarlags, _rms, _node_loop
 from eqcorrscan.core.bright_lights import _cum_net_resp, _find_detections
-from eqcorrscan.core.bright_lights import coherence, BrightnessError
+from eqcorrscan.core.bright_lights import _stack_nodes
+from eqcorrscan.core import EQcorrscanDeprecationWarning
+from eqcorrscan.core.bright_lights import coherence
 from eqcorrscan.utils.synth_seis import generate_synth_data
 
 
@@ -141,6 +144,34 @@ class BrightnessTestMethods(unittest.TestCase):
         self.assertEqual(len(indeces), 86400)
         shutil.rmtree('tmp0')
 
+    def test_stack_nodes(self):
+        """Check the in-memory stack against the per-node energy."""
+        stations, nodes, lags = _read_tt(path=self.testing_path,
+                                         stations=['COSA', 'LABE'],
+                                         phase='S', phaseout='S')
+        st = Stream(Trace())
+        st[0].stats.station = stations[0]
+        st[0].data = np.random.randn(86400) * 3000
+        st += Trace(np.random.randn(86400) * 3000)
+        st[1].stats.station = stations[1]
+        lags = lags[:, 0:4] * 10
+        energy = np.concatenate(
+            [_node_loop(stations=stations, lags=lags[:, i], stream=st,
+                        clip_level=4)[1] for i in range(lags.shape[1])],
+            axis=0).astype(np.float64)
+        for cores in (1, 2):
+            cum_net_resp, indices = _stack_nodes(
+                stations=stations, lags=lags, stream=st, clip_level=4,
+                cores=cores)
+            self.assertEqual(len(cum_net_resp), 86400)
+            self.assertEqual(len(indices), 86400)
+            # Integer truncation can differ by one count per channel
+            self.assertTrue(np.allclose(
+                cum_net_resp, energy.max(axis=0), atol=len(st)))
+            self.assertTrue(np.allclose(
+                energy[indices, np.arange(86400)], energy.max(axis=0),
+                atol=2 * len(st)))
+
     def test_find_detections(self):
         stations, nodes, lags = _read_tt(path=self.testing_path,
                                          stations=['COSA', 'LABE'],
@@ -239,38 +270,48 @@ class TestBrightnessMain(unittest.TestCase):
         self.assertEqual(len(detections), 0)
         self.assertEqual(len(detections), len(nodes_out))
 
-    def test_fail_too_many_traces(self):
+    def test_many_traces(self):
+        """Check that there is no limit on the number of traces."""
         st = self.st.copy()
         for i in range(130):
             st += Trace(np.zeros(1))
-
-        with self.assertRaises(BrightnessError):
-            brightness(stations=self.stations, nodes=self.nodes,
-                       lags=self.lags, stream=st, threshold=1.885,
-                       thresh_type='MAD', template_length=1,
-                       template_saveloc='.', coherence_thresh=(10, 1))
-
-    def test_mem_issue(self):
-        st = self.st.copy()
         detections, nodes_out = brightness(
             stations=self.stations, nodes=self.nodes, lags=self.lags,
             stream=st, threshold=1.885, thresh_type='MAD', template_length=1,
-            template_saveloc='.', coherence_thresh=(10, 1), cores=1,
-            mem_issue=True, instance=2)
+            template_saveloc='.', coherence_thresh=(10, 1))
+        self.assertEqual(len(detections), len(nodes_out))
+
+    def test_mem_issue(self):
+        """Check that mem_issue is ignored, with a deprecation warning."""
+        st = self.st.copy()
+        with warnings.catch_warnings(record=True) as w:
+            warnings.simplefilter("always")
+            detections, nodes_out = brightness(
+                stations=self.stations, nodes=self.nodes, lags=self.lags,
+                stream=st, threshold=1.885, thresh_type='MAD',
+                template_length=1, template_saveloc='.',
+                coherence_thresh=(10, 1), cores=1, mem_issue=True,
+                instance=2)
+        self.assertTrue(any(issubclass(_w.category,
+                                       EQcorrscanDeprecationWarning)
+                            for _w in w))
         self.assertEqual(len(detections), 0)
         self.assertEqual(len(detections), len(nodes_out))
-        shutil.rmtree('tmp2')
+        self.assertFalse(os.path.isdir('tmp2'))
 
     def test_mem_issue_parallel(self):
         st = self.st.copy()
-        detections, nodes_out = brightness(
-            stations=self.stations, nodes=self.nodes, lags=self.lags,
-            stream=st, threshold=1.885, thresh_type='MAD', template_length=1,
-            template_saveloc='.', coherence_thresh=(10, 1), cores=3,
-            mem_issue=True, instance=3)
+        with warnings.catch_warnings():
+            warnings.simplefilter("ignore", EQcorrscanDeprecationWarning)
+            detections, nodes_out = brightness(
+                stations=self.stations, nodes=self.nodes, lags=self.lags,
+                stream=st, threshold=1.885, thresh_type='MAD',
+                template_length=1, template_saveloc='.',
+                coherence_thresh=(10, 1), cores=3, mem_issue=True,
+                instance=3)
         self.assertEqual(len(detections), 0)
         self.assertEqual(len(detections), len(nodes_out))
-        shutil.rmtree('tmp3')
+        self.assertFalse(os.path.isdir('tmp3'))
 
 
 if __name__ == '__main__':
@@ -13,12 +13,13 @@ import os
 import glob
 
 from obspy import UTCDateTime, read_events
-from obspy.io.nordic.core import readheader
+from obspy.io.nordic.core import readheader, read_nordic
 
 from eqcorrscan.utils.catalog_to_dd import _cc_round, _av_weight, readSTATION0
 from eqcorrscan.utils.catalog_to_dd import sfiles_to_event, write_catalog
 from eqcorrscan.utils.catalog_to_dd import write_correlations, read_phase
-from eqcorrscan.utils.catalog_to_dd import write_event
+from eqcorrscan.utils.catalog_to_dd import write_event, _correlate_picks
+from eqcorrscan.utils.catalog_to_dd import _WaveformCache
 from eqcorrscan.utils.mag_calc import dist_calc
 from eqcorrscan.utils.timer import Timer
 
@@ -141,6 +142,53 @@ class TestCatalogMethods(unittest.TestCase):
         output_check_file.close()
         os.remove('station.dat')
 
+    def test_correlate_picks(self):
+        """Check the batched pick corrections find known delays."""
+        np.random.seed(42)
+        signal = np.convolve(np.random.randn(400), np.hanning(15), 'same')
+        delays = [0, 3, -5, 7]
+        masters = [signal[100:300] for _ in delays]
+        slaves = [np.roll(signal, delay)[100:300] for delay in delays]
+        # A flat master cannot be normalised
+        masters.append(np.ones(200))
+        slaves.append(signal[0:200])
+        shifts, ccs, status = _correlate_picks(
+            masters, slaves, max_shifts=[20] * len(masters), cores=2)
+        for delay, shift, cc, stat in zip(delays, shifts, ccs, status):
+            self.assertEqual(stat, 0)
+            self.assertAlmostEqual(shift, delay, 0)
+            self.assertGreater(cc, 0.9)
+        self.assertNotEqual(status[-1], 0)
+
+    def test_correlate_picks_at_max_lag(self):
+        """Check that peaks fitted at the largest lag are not used."""
+        np.random.seed(42)
+        signal = np.convolve(np.random.randn(400), np.hanning(101), 'same')
+        # Delay beyond the largest lag
+        shifts, ccs, status = _correlate_picks(
+            [signal[100:300]], [np.roll(signal, 25)[100:300]],
+            max_shifts=[20])
+        self.assertNotEqual(status[0], 0)
+
+    def test_waveform_cache(self):
+        """Check that the waveform cache is bounded."""
+        testing_path = os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                                    'test_data', 'REA', 'TEST_')
+        wavbase = os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                               'test_data', 'WAV', 'TEST_')
+        sfile = sorted(glob.glob(os.path.join(testing_path, '*L.S??????')))[0]
+        cache = _WaveformCache(wavbase=wavbase, lowcut=2.0, highcut=10.0,
+                               max_traces=2)
+        event = read_nordic(sfile)[0]
+        stations = sorted(set(
+            pick.waveform_id.station_code for pick in event.picks))
+        tr = cache.get(0, sfile, stations[0], 'Z')
+        self.assertTrue(cache.get(0, sfile, stations[0], 'Z') is tr)
+        for station in stations[1:4]:
+            cache.get(0, sfile, station, 'Z')
+        self.assertEqual(len(cache), 2)
+        self.assertIsNone(cache.get(0, sfile, 'NOTASTATION', 'Z'))
+
     def test_failed_write_event(self):
         """
         Check that we fail elegantly without an origin.
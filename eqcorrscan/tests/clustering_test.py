@@ -8,6 +8,7 @@ from __future__ import unicode_literals
 
 import unittest
 import pytest
+import numpy as np
 import os
 import glob
 import warnings
@@ -85,6 +86,27 @@ class ClusteringTests(unittest.TestCase):
         self.assertEqual(dist_mat.shape[0], len(stream_list))
         self.assertEqual(dist_mat.shape[1], len(stream_list))
 
+    def test_distance_matrix_native(self):
+        """Check the compiled all-pairs distance matrix."""
+        testing_path = os.path.join(self.testing_path, 'WAV', 'TEST_')
+        stream_files = glob.glob(os.path.join(testing_path, '*DFDPC*'))[0:10]
+        stream_list = [read(stream_file) for stream_file in stream_files]
+        dist_mat = distance_matrix(stream_list=stream_list, cores=2)
+        native_mat = distance_matrix(stream_list=stream_list, cores=2,
+                                     native=True, tile=3)
+        self.assertTrue(np.allclose(dist_mat, native_mat, atol=1e-5))
+        self.assertTrue(np.allclose(native_mat, native_mat.T))
+        shifted = distance_matrix(stream_list=stream_list, cores=2,
+                                  native=True, allow_shift=True,
+                                  shift_len=0.2)
+        self.assertTrue(np.all(np.diag(shifted) == 0))
+        self.assertEqual(shifted.shape, dist_mat.shape)
+        out = np.zeros_like(dist_mat)
+        returned = distance_matrix(stream_list=stream_list, native=True,
+                                   out=out)
+        self.assertTrue(returned is out)
+        self.assertTrue(np.allclose(out, native_mat))
+
     def test_unclustered(self):
         """Test clustering on unclustered data..."""
         testing_path = os.path.join(self.testing_path, 'WAV', 'TEST_')
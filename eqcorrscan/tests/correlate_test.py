@@ -5,6 +5,7 @@ from __future__ import unicode_literals
 
 import copy
 import itertools
+import os
 import warnings
 from collections import defaultdict
 from functools import wraps
@@ -131,6 +132,15 @@ def print_class_name(request):
         print('\nstarting tests contained in class %s\n%s' % (cls_name, dash))
 
 
+@pytest.fixture(scope='module', autouse=True)
+def correlation_profile(tmpdir_factory):
+    """ Calibrate the auto backend into a temporary profile file """
+    profile = tmpdir_factory.mktemp('profile').join('profile.json')
+    previous = corr.set_correlation_profile(str(profile))
+    yield str(profile)
+    corr.set_correlation_profile(previous)
+
+
 # array fixtures
 
 starting_index = 500
@@ -437,6 +447,851 @@ class TestStreamCorrelateFunctions:
                 np.save("cc_1.npy", cc_1)
                 assert np.allclose(cc_1, cc, atol=self.atol * 100)
 
+
+class TestPreparedTemplates:
+    """ Check that cached template spectra give the same correlations """
+    atol = TestArrayCorrelateFunctions.atol
+
+    # fixtures
+    @pytest.fixture
+    def array_dicts(self, multichannel_templates, multichannel_stream):
+        return corr._get_array_dicts(multichannel_templates,
+                                     multichannel_stream)
+
+    @pytest.fixture(autouse=True)
+    def clear_cache(self):
+        yield
+        corr.clear_prepared_templates()
+
+    # tests
+    def test_cached_matches_uncached(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        uncached, used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1)
+        for _ in range(2):
+            cached, cached_used = corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), stream_dict, pad_dict,
+                seed_ids, cores_inner=1, cores_outer=1,
+                cache_templates=True)
+            assert np.allclose(uncached, cached, atol=self.atol)
+            assert np.array_equal(used, cached_used)
+        assert len(corr.PREPARED_TEMPLATES) == 1
+
+    def test_changed_templates_invalidate(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        template_dict = copy.deepcopy(template_dict)
+        corr.fftw_multi_normxcorr(
+            template_dict, stream_dict, pad_dict, seed_ids, cores_inner=1,
+            cores_outer=1, cache_templates=True)
+        prepared = list(corr.PREPARED_TEMPLATES.values())[0]
+        assert prepared.matches(template_dict, seed_ids, prepared.fft_len)
+        template_dict[seed_ids[0]][0] *= 2
+        assert not prepared.matches(template_dict, seed_ids, prepared.fft_len)
+        corr.fftw_multi_normxcorr(
+            template_dict, stream_dict, pad_dict, seed_ids, cores_inner=1,
+            cores_outer=1, cache_templates=True)
+        assert len(corr.PREPARED_TEMPLATES) == 2
+
+    def test_blocked_cached_matches_uncached(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        uncached, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1)
+        cached, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1, cache_templates=True,
+            block_len='auto')
+        prepared = list(corr.PREPARED_TEMPLATES.values())[0]
+        assert prepared.fft_len < stream_len
+        assert np.allclose(uncached, cached, atol=self.atol)
+
+    def test_too_short_data_raises(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        prepared = corr.PreparedTemplates(
+            template_dict, seed_ids, fft_len=template_len * 2)
+        with pytest.raises(corr.CorrelationError):
+            prepared._correlate(None, template_len - 1, None, None, None, 1,
+                                1, None)
+        prepared.free()
+
+    def test_short_fft_len_raises(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        with pytest.raises(corr.CorrelationError):
+            corr.PreparedTemplates(
+                template_dict, seed_ids, fft_len=template_len - 2)
+
+
+class TestOverlapSave:
+    """ Check that correlating in blocks gives the same as one transform """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def array_dicts(self, multichannel_templates, multichannel_stream):
+        return corr._get_array_dicts(multichannel_templates,
+                                     multichannel_stream)
+
+    def test_block_len(self):
+        full = corr.fftw_block_len(200, 100000)
+        assert full >= 100199
+        assert corr.fftw_block_len(200, 100000, None) == full
+        assert corr.fftw_block_len(200, 100000, 'auto') == \
+            corr.MIN_BLOCK_LEN
+        assert corr.fftw_block_len(200, 100000, 100) >= 400
+        assert corr.fftw_block_len(200, 1000, 10000) == \
+            corr.fftw_block_len(200, 1000)
+        with pytest.raises(ValueError):
+            corr.fftw_block_len(200, 1000, 'big')
+
+    @pytest.mark.parametrize("block_len", [400, 1000, 'auto'])
+    def test_blocked_matches_full(self, array_dicts, block_len):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        full, used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1)
+        blocked, blocked_used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=2, cores_outer=2, block_len=block_len)
+        assert np.allclose(full, blocked, atol=self.atol)
+        assert np.array_equal(used, blocked_used)
+
+    def test_blocked_stream_xcorr(self, multichannel_templates,
+                                  multichannel_stream, stream_cc_dict):
+        func = corr.get_stream_xcorr('fftw')
+        cccsums, no_chans, _ = func(
+            multichannel_templates, multichannel_stream, cores=1,
+            block_len='auto')
+        assert np.allclose(cccsums, stream_cc_dict['fftw_stream_xcorr.1'],
+                           atol=self.atol)
+
+
+class TestOuterSplit:
+    """ Check that splitting templates between outer threads gives the same
+    as splitting channels """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def array_dicts(self, multichannel_templates, multichannel_stream):
+        return corr._get_array_dicts(multichannel_templates,
+                                     multichannel_stream)
+
+    @pytest.mark.parametrize("cores_outer", [2, 3, 4])
+    def test_template_split_matches_channel_split(self, array_dicts,
+                                                  cores_outer):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        by_channel, used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=cores_outer, outer_split='channels')
+        by_template, template_used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=cores_outer, outer_split='templates',
+            block_len='auto')
+        assert np.allclose(by_channel, by_template, atol=self.atol)
+        assert np.array_equal(used, template_used)
+
+    def test_bad_split_raises(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        with pytest.raises(ValueError):
+            corr.fftw_multi_normxcorr(
+                template_dict, stream_dict, pad_dict, seed_ids,
+                cores_inner=1, cores_outer=2, outer_split='stations')
+
+    def test_outer_scaling(self):
+        """ Time both schedules over a range of outer threads. """
+        n_templates, n_channels, template_len = 40, 12, 200
+        templates = random.randn(n_templates, n_channels, template_len)
+        stream = random.randn(n_channels, 100000)
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        stream_dict = {str(c): stream[c].astype(np.float32)
+                       for c in range(n_channels)}
+        pad_dict = {str(c): [0] * n_templates for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        reference = None
+        for cores_outer in sorted({1, 2, cpu_count()}):
+            for split in ('channels', 'templates'):
+                cccs, _ = time_func(
+                    corr.fftw_multi_normxcorr,
+                    "{0} outer threads splitting {1}".format(
+                        cores_outer, split),
+                    copy.deepcopy(template_dict), stream_dict, pad_dict,
+                    seed_ids, cores_inner=1, cores_outer=cores_outer,
+                    outer_split=split, block_len='auto')
+                if reference is None:
+                    reference = cccs
+                assert np.allclose(reference, cccs, atol=self.atol)
+
+
+class TestBatchedEngine:
+    """ Check that the batched fftw engine gives the same as the per-channel
+    engine """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def array_dicts(self, multichannel_templates, multichannel_stream):
+        return corr._get_array_dicts(multichannel_templates,
+                                     multichannel_stream)
+
+    @pytest.mark.parametrize("layout", ["channel-major", "template-major"])
+    @pytest.mark.parametrize("block_len", ["auto", 2048])
+    def test_batched_matches_per_channel(self, array_dicts, layout,
+                                         block_len):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        per_channel, used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1, block_len=block_len)
+        batched, batched_used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=2, cores_outer=1, block_len=block_len,
+            batch_layout=layout)
+        assert np.allclose(per_channel, batched, atol=self.atol)
+        assert np.array_equal(used, batched_used)
+
+    def test_bad_layout_raises(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        with pytest.raises(ValueError):
+            corr.fftw_multi_normxcorr(
+                template_dict, stream_dict, pad_dict, seed_ids,
+                cores_inner=1, cores_outer=1, batch_layout='row-major')
+
+    def test_short_fft_len_returns_error(self, array_dicts, monkeypatch):
+        """ The C-code must not loop forever on too short transforms """
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        monkeypatch.setattr(corr, 'fftw_block_len',
+                            lambda template_len, *args: template_len - 2)
+        with pytest.raises(MemoryError):
+            corr.fftw_multi_normxcorr(
+                template_dict, stream_dict, pad_dict, seed_ids,
+                cores_inner=1, cores_outer=1, batch_layout='channel-major')
+
+    def test_layout_timing(self):
+        """ Time the batched layouts against the per-channel engine. """
+        n_templates, n_channels, template_len = 40, 12, 200
+        templates = random.randn(n_templates, n_channels, template_len)
+        stream = random.randn(n_channels, 100000)
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        stream_dict = {str(c): stream[c].astype(np.float32)
+                       for c in range(n_channels)}
+        pad_dict = {str(c): [0] * n_templates for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        reference = None
+        for layout in (None, 'channel-major', 'template-major'):
+            cccs, _ = time_func(
+                corr.fftw_multi_normxcorr,
+                "batch layout {0}".format(layout),
+                copy.deepcopy(template_dict), stream_dict, pad_dict,
+                seed_ids, cores_inner=cpu_count(), cores_outer=1,
+                block_len='auto', batch_layout=layout)
+            if reference is None:
+                reference = cccs
+            assert np.allclose(reference, cccs, atol=self.atol)
+
+
+class TestTimeDomainKernel:
+    """ Check that the tiled time-domain kernel gives the same as fftw """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def arrays(self):
+        n_templates, n_channels, template_len = 7, 3, 100
+        templates = random.randn(n_templates, n_channels, template_len)
+        # One unused template-channel
+        templates[2, 1] = np.nan
+        stream = random.randn(n_channels, 20000) + 10
+        # Flat and zeroed sections to check unused correlations
+        stream[0, 5000:6000] = 1.0
+        stream[2, 9000:9500] = 0.0
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        stream_dict = {str(c): stream[c].astype(np.float32)
+                       for c in range(n_channels)}
+        # Pads longer than the blocks of lags
+        pad_dict = {str(c): [c * 2500 + t for t in range(n_templates)]
+                    for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        return template_dict, stream_dict, pad_dict, seed_ids
+
+    @pytest.fixture
+    def reset_level(self):
+        yield
+        corr.set_simd_level('auto')
+
+    def _correlate(self, arrays, **kwargs):
+        template_dict, stream_dict, pad_dict, seed_ids = arrays
+        with warnings.catch_warnings():
+            warnings.simplefilter("ignore")
+            return corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), copy.deepcopy(stream_dict),
+                pad_dict, seed_ids, **kwargs)
+
+    @pytest.mark.parametrize("cores", [1, 3])
+    def test_time_matches_fftw(self, arrays, cores):
+        fftw, used = self._correlate(arrays, cores_inner=1, cores_outer=1)
+        time, time_used = self._correlate(
+            arrays, cores_inner=cores, cores_outer=1, kernel='time')
+        assert np.allclose(fftw, time, atol=self.atol * 10)
+        assert np.array_equal(used, time_used)
+
+    def test_threads_match(self, arrays):
+        serial, _ = self._correlate(
+            arrays, cores_inner=1, cores_outer=1, kernel='time')
+        threaded, _ = self._correlate(
+            arrays, cores_inner=2, cores_outer=2, kernel='time')
+        assert np.array_equal(serial, threaded)
+
+    def test_levels_match(self, arrays, reset_level):
+        best = corr.set_simd_level('auto')
+        reference = None
+        for level in corr.SIMD_LEVELS[:corr.SIMD_LEVELS.index(best) + 1]:
+            corr.set_simd_level(level)
+            cccs, _ = self._correlate(
+                arrays, cores_inner=1, cores_outer=1, kernel='time')
+            if reference is None:
+                reference = cccs
+            assert np.array_equal(reference, cccs)
+
+    def test_bad_kernel_raises(self, arrays):
+        with pytest.raises(ValueError):
+            self._correlate(
+                arrays, cores_inner=1, cores_outer=1, kernel='numpy')
+
+    @pytest.mark.parametrize("threaded", [False, True])
+    def test_long_templates_match_numpy(self, threaded, reset_level):
+        """ Dot products of long templates are accumulated in double """
+        templates = random.randn(5, 5000).astype(np.float32)
+        # An offset needs the precision to cancel the mean
+        stream = (random.randn(30000) + 100).astype(np.float32)
+        pads = [0, 10, 20, 30, 40]
+        expected, _ = corr.numpy_normxcorr(templates, stream, pads)
+        best = corr.set_simd_level('auto')
+        for level in corr.SIMD_LEVELS[:corr.SIMD_LEVELS.index(best) + 1]:
+            corr.set_simd_level(level)
+            cccs, _ = corr.time_multi_normxcorr(
+                templates, stream, pads, threaded=threaded)
+            assert np.allclose(expected, cccs, atol=self.atol)
+
+    def test_time_stream_xcorr(self, multichannel_templates,
+                               multichannel_stream):
+        fftw = corr.get_stream_xcorr('fftw', 'concurrent')
+        time = corr.get_stream_xcorr('time_domain', 'concurrent')
+        fftw_cccs, fftw_no_chans, fftw_chans = fftw(
+            multichannel_templates, multichannel_stream, cores=1)
+        time_cccs, time_no_chans, time_chans = time(
+            multichannel_templates, multichannel_stream, cores=2)
+        assert np.allclose(fftw_cccs, time_cccs, atol=self.atol * 10)
+        assert np.array_equal(fftw_no_chans, time_no_chans)
+        assert fftw_chans == time_chans
+
+    def test_kernel_timing(self):
+        """ Time the time-domain kernel against fftw for short templates. """
+        n_templates, n_channels, template_len = 40, 12, 100
+        templates = random.randn(n_templates, n_channels, template_len)
+        stream = random.randn(n_channels, 100000)
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        stream_dict = {str(c): stream[c].astype(np.float32)
+                       for c in range(n_channels)}
+        pad_dict = {str(c): [0] * n_templates for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        reference = None
+        for kernel in corr.MULTI_KERNELS:
+            cccs, _ = time_func(
+                corr.fftw_multi_normxcorr, "{0} kernel".format(kernel),
+                copy.deepcopy(template_dict), stream_dict, pad_dict,
+                seed_ids, cores_inner=cpu_count(), cores_outer=1,
+                kernel=kernel)
+            if reference is None:
+                reference = cccs
+            assert np.allclose(reference, cccs, atol=self.atol * 10)
+
+
+class TestAutoBackend:
+    """ Check the cost model and automatic selection of kernels """
+    atol = TestArrayCorrelateFunctions.atol
+    profile = {'version': corr.CORRELATION_PROFILE_VERSION, 'cores': 4,
+               'time_per_mac': 2e-10, 'fftw_per_op': 1e-9,
+               'time_efficiency': 0.9, 'inner_efficiency': 0.3,
+               'outer_efficiency': 0.95}
+
+    def test_calibration_saved(self, correlation_profile):
+        profile = corr.calibrate_correlation(cores=2)
+        assert os.path.isfile(correlation_profile)
+        corr.set_correlation_profile(correlation_profile)
+        assert corr.get_correlation_profile() == profile
+        for key in corr.DEFAULT_CORRELATION_PROFILE:
+            assert profile[key] > 0
+
+    def test_bad_profile_recalibrated(self, tmpdir):
+        filename = str(tmpdir.join('profile.json'))
+        with open(filename, 'w') as f:
+            f.write('{"version": 0}')
+        previous = corr.set_correlation_profile(filename)
+        try:
+            with pytest.warns(UserWarning):
+                profile = corr.get_correlation_profile()
+            assert profile['version'] == corr.CORRELATION_PROFILE_VERSION
+        finally:
+            corr.set_correlation_profile(previous)
+
+    def test_short_templates_use_time(self):
+        choice = corr.choose_correlation(
+            n_templates=40, n_channels=12, template_len=50,
+            image_len=360000, cores=4, profile=self.profile)
+        assert choice['kernel'] == 'time'
+
+    def test_long_templates_use_fftw(self):
+        choice = corr.choose_correlation(
+            n_templates=40, n_channels=12, template_len=2000,
+            image_len=360000, cores=4, profile=self.profile)
+        assert choice['kernel'] == 'fftw'
+        # Inner threads scale poorly in this profile
+        assert choice['cores_outer'] == 4
+        assert choice['cores_inner'] == 1
+
+    def test_fixed_layout(self):
+        choice = corr.choose_correlation(
+            n_templates=40, n_channels=12, template_len=2000,
+            image_len=360000, cores=4, cores_outer=1, kernels=['fftw'],
+            profile=self.profile)
+        assert choice['cores_outer'] == 1
+        assert choice['cores_inner'] == 4
+
+    def test_layouts_searched_for_every_kernel(self):
+        kwargs = dict(n_templates=40, n_channels=12, template_len=2000,
+                      image_len=360000, cores=4, profile=self.profile)
+        fftw_only = corr.choose_correlation(kernels=['fftw'], **kwargs)
+        choice = corr.choose_correlation(kernels=['time', 'fftw'], **kwargs)
+        assert choice == fftw_only
+
+    def test_no_idle_cores(self):
+        for cores in (3, 5, 6):
+            choice = corr.choose_correlation(
+                n_templates=40, n_channels=12, template_len=2000,
+                image_len=360000, cores=cores, kernels=['fftw'],
+                profile=self.profile)
+            assert choice['cores_outer'] * choice['cores_inner'] == cores
+
+    def test_auto_stream_xcorr(self, multichannel_templates,
+                               multichannel_stream):
+        fftw = corr.get_stream_xcorr('fftw', 'concurrent')
+        auto = corr.get_stream_xcorr('auto', 'concurrent')
+        fftw_cccs, fftw_no_chans, fftw_chans = fftw(
+            multichannel_templates, multichannel_stream, cores=1)
+        auto_cccs, auto_no_chans, auto_chans = auto(
+            multichannel_templates, multichannel_stream, cores=2)
+        assert np.allclose(fftw_cccs, auto_cccs, atol=self.atol * 10)
+        assert np.array_equal(fftw_no_chans, auto_no_chans)
+        assert fftw_chans == auto_chans
+
+
+class TestCorrelatorWorkspace:
+    """ Check that correlator workspaces are re-used and give the same
+    results """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def array_dicts(self, multichannel_templates, multichannel_stream):
+        return corr._get_array_dicts(multichannel_templates,
+                                     multichannel_stream)
+
+    @pytest.fixture
+    def clear(self):
+        corr.clear_workspaces()
+        yield
+        corr.clear_workspaces()
+
+    def test_workspace_reused(self, array_dicts, clear):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        first, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=2)
+        assert len(corr.WORKSPACES) == 1
+        workspace = list(corr.WORKSPACES.values())[0]
+        assert workspace.nbytes > 0
+        second, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=2)
+        assert list(corr.WORKSPACES.values()) == [workspace]
+        assert np.array_equal(first, second)
+
+    def test_workspace_in_use(self, array_dicts, clear):
+        """ A workspace in use by another thread should not be shared. """
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        reference, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1)
+        workspace = list(corr.WORKSPACES.values())[0]
+        with workspace.lock:
+            cccs, _ = corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), stream_dict, pad_dict,
+                seed_ids, cores_inner=1, cores_outer=1)
+        assert np.array_equal(reference, cccs)
+
+    def test_workspace_lru(self, array_dicts, clear):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        for block_len in [2048, 4096, 8192]:
+            corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), stream_dict, pad_dict,
+                seed_ids, cores_inner=1, cores_outer=1, block_len=block_len)
+        assert len(corr.WORKSPACES) == corr.WORKSPACES_SIZE
+
+    def test_peak_memory(self, array_dicts, clear):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        # Other objects may hold workspaces: after a reset the peak is the
+        # memory currently held
+        corr.get_workspace_peak_memory(reset=True)
+        held = corr.get_workspace_peak_memory()
+        corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1, block_len=2048)
+        workspace = list(corr.WORKSPACES.values())[0]
+        peak = corr.get_workspace_peak_memory()
+        assert 0 < peak - held <= workspace.nbytes
+        corr.clear_workspaces()
+        # Peak is kept until reset
+        assert corr.get_workspace_peak_memory(reset=True) == peak
+        assert corr.get_workspace_peak_memory() <= held
+
+
+class TestSIMDLevels:
+    """ Check that all vector instruction sets give the same correlations """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def arrays(self):
+        n_templates, n_channels, template_len = 5, 3, 200
+        templates = random.randn(n_templates, n_channels, template_len)
+        stream = random.randn(n_channels, 50000)
+        # Flat and zeroed sections to check unused correlations
+        stream[0, 10000:12000] = 1.0
+        stream[1, 20000:21000] = 0.0
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        stream_dict = {str(c): stream[c].astype(np.float32)
+                       for c in range(n_channels)}
+        pad_dict = {str(c): [c * 3] * n_templates
+                    for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        return template_dict, stream_dict, pad_dict, seed_ids
+
+    @pytest.fixture
+    def reset_level(self):
+        yield
+        corr.set_simd_level('auto')
+
+    def test_bad_level_raises(self):
+        with pytest.raises(ValueError):
+            corr.set_simd_level('neon')
+
+    def test_levels_match(self, arrays, reset_level):
+        template_dict, stream_dict, pad_dict, seed_ids = arrays
+        best = corr.set_simd_level('auto')
+        assert corr.get_simd_level() == best
+        reference = None
+        for level in corr.SIMD_LEVELS[:corr.SIMD_LEVELS.index(best) + 1]:
+            assert corr.set_simd_level(level) == level
+            cccs, used = corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), stream_dict, pad_dict,
+                seed_ids, cores_inner=1, cores_outer=1)
+            if reference is None:
+                reference = cccs
+            assert np.allclose(reference, cccs, atol=self.atol)
+
+    def test_threaded_stats_match(self, arrays):
+        template_dict, stream_dict, pad_dict, seed_ids = arrays
+        serial, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1)
+        threaded, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=4, cores_outer=1)
+        assert np.allclose(serial, threaded, atol=self.atol)
+
+
+class TestFFTWPlanning:
+    """ Check that cached and measured FFTW plans give the same answers """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture(autouse=True)
+    def reset_planning(self):
+        yield
+        corr.set_fftw_planning('estimate')
+        corr._FFTW_WISDOM['file'] = None
+        corr.clear_fftw_plans()
+
+    def test_measured_plans_match(self, array_template, array_stream, pads):
+        estimated, _ = corr.fftw_normxcorr(array_template, array_stream, pads)
+        corr.set_fftw_planning('measure')
+        corr.clear_fftw_plans()
+        for _ in range(2):
+            measured, _ = corr.fftw_normxcorr(
+                array_template, array_stream, pads)
+            assert np.allclose(estimated, measured, atol=self.atol)
+
+    def test_wisdom_round_trip(self, tmpdir, array_template, array_stream,
+                               pads):
+        wisdom_file = os.path.join(str(tmpdir), 'fftw.wisdom')
+        corr.set_fftw_planning('measure', wisdom_file=wisdom_file)
+        corr.fftw_normxcorr(array_template, array_stream, pads)
+        corr.save_fftw_wisdom()
+        assert os.path.isfile(wisdom_file)
+        corr.clear_fftw_plans()
+        corr.load_fftw_wisdom(wisdom_file)
+        corr.set_fftw_planning('measure', wisdom_file=wisdom_file)
+
+    def test_more_groups_than_cached_plans(self):
+        """ Plans held by a call must not be evicted by its later plans """
+        corr.clear_fftw_plans()
+        rng = np.random.RandomState(42)
+        image = rng.randn(1, 1000).astype(np.float32)
+        groups = []
+        for n_templates in range(1, 41):
+            templates = {'NZ.A..EHZ': rng.randn(n_templates, 32)}
+            groups.append((templates, corr.PreparedTemplates(
+                templates, ['NZ.A..EHZ'], fft_len=256)))
+        for templates, prepared in groups:
+            n_templates = prepared.n_templates
+            cccs = np.zeros((n_templates, 1000 - 32 + 1), dtype=np.float32)
+            ret = prepared._correlate(
+                image, 1000, cccs, np.ones(n_templates, dtype=np.intc),
+                np.zeros(n_templates, dtype=np.intc), 1, 1,
+                np.zeros(1, dtype=np.intc))
+            assert ret == 0
+            expected, _ = corr.fftw_normxcorr(
+                templates['NZ.A..EHZ'].astype(np.float32), image[0],
+                [0] * n_templates)
+            assert np.allclose(cccs, expected, atol=self.atol)
+            prepared.free()
+
+    def test_bad_effort_raises(self):
+        with pytest.raises(ValueError):
+            corr.set_fftw_planning('exhaustive')
+
+    def test_missing_wisdom_raises(self, tmpdir):
+        with pytest.raises(IOError):
+            corr.load_fftw_wisdom(os.path.join(str(tmpdir), 'not_a_file'))
+
+
+class TestCorrelationStats:
+    """ Check the counters from the fftw C-code """
+    @pytest.fixture
+    def arrays(self):
+        n_templates, n_channels, template_len = 5, 3, 100
+        templates = random.randn(n_templates, n_channels, template_len)
+        stream = random.randn(n_channels, 20000)
+        # Zeroed section to check skipped correlations
+        stream[1, 5000:8000] = 0.0
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        stream_dict = {str(c): stream[c].astype(np.float32)
+                       for c in range(n_channels)}
+        pad_dict = {str(c): [0] * n_templates for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        return template_dict, stream_dict, pad_dict, seed_ids
+
+    def _correlate(self, arrays, **kwargs):
+        template_dict, stream_dict, pad_dict, seed_ids = arrays
+        with warnings.catch_warnings():
+            warnings.simplefilter("ignore")
+            return corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), copy.deepcopy(stream_dict),
+                pad_dict, seed_ids, cores_inner=1, **kwargs)
+
+    @pytest.mark.parametrize("outer_split", ['channels', 'templates'])
+    @pytest.mark.parametrize("block_len", [None, 'auto'])
+    def test_stats_collected(self, arrays, outer_split, block_len):
+        stats = corr.CorrelationStats()
+        cccs, used = self._correlate(
+            arrays, cores_outer=2, outer_split=outer_split,
+            block_len=block_len, stats=stats)
+        expected, _ = self._correlate(
+            arrays, cores_outer=2, outer_split=outer_split,
+            block_len=block_len)
+        assert np.allclose(cccs, expected, atol=1e-6)
+        report = stats.report()
+        assert report['calls'] == 1
+        assert list(report['stages'].keys()) == list(corr.CORRELATION_STAGES)
+        assert report['stages']['inverse_fft'] > 0
+        assert report['wall'] > 0
+        assert sum(report['thread_busy']) > 0
+        # The zeroed section (less the first template length) is flat
+        n_passes = 2 if outer_split == 'templates' else 1
+        assert report['skipped_samples'] == (3000 - 99) * n_passes
+        assert report['flatline_samples'] == report['skipped_samples']
+
+    def test_stats_accumulate(self, arrays):
+        stats = corr.CorrelationStats()
+        self._correlate(arrays, cores_outer=1, stats=stats)
+        first = stats.report()
+        self._correlate(arrays, cores_outer=1, stats=stats)
+        report = stats.report()
+        assert report['calls'] == 2
+        assert report['skipped_samples'] == 2 * first['skipped_samples']
+        total = corr.CorrelationStats()
+        total += stats
+        total += stats
+        assert total.report()['calls'] == 4
+        stats.reset()
+        assert stats.report()['calls'] == 0
+        assert stats.report()['wall'] == 0
+
+    def test_stream_xcorr_stats(self, multichannel_templates,
+                                multichannel_stream):
+        stats = corr.CorrelationStats()
+        stream_func = corr.get_stream_xcorr('fftw', 'concurrent')
+        stream_func(multichannel_templates, multichannel_stream, cores=1,
+                    stats=stats)
+        assert stats.report()['calls'] == 1
+
+
+class TestPackedStreams:
+    """ Check that packed data are correlated in place """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def arrays(self):
+        n_templates, n_channels, template_len = 5, 3, 100
+        templates = random.randn(n_templates, n_channels, template_len)
+        # Rows longer than the data to check the offsets are used
+        packed = random.randn(n_channels, 20100).astype(np.float32)
+        template_dict = {str(c): templates[:, c].astype(np.float32)
+                         for c in range(n_channels)}
+        pad_dict = {str(c): [0] * n_templates for c in range(n_channels)}
+        seed_ids = [str(c) for c in range(n_channels)]
+        return template_dict, packed, pad_dict, seed_ids
+
+    @pytest.fixture(autouse=True)
+    def clear_cache(self):
+        yield
+        corr.clear_prepared_templates()
+
+    @pytest.mark.parametrize("kwargs", [
+        {}, {'kernel': 'time'}, {'batch_layout': 'channel-major'},
+        {'cache_templates': True}, {'block_len': 'auto'}])
+    def test_packed_matches_copied(self, arrays, kwargs):
+        template_dict, packed, pad_dict, seed_ids = arrays
+        # Channels out of row order
+        rows = {'0': packed[2, 0:20000], '1': packed[0, 100:20100],
+                '2': packed[1, 50:20050]}
+        assert corr._packed_rows(
+            [rows[x] for x in seed_ids], 20000) is not None
+        copied = {x: rows[x].copy() for x in seed_ids}
+        assert corr._packed_rows(
+            [copied[x] for x in seed_ids], 20000) is None
+        expected, used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), copied, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1, **kwargs)
+        cccs, packed_used = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), rows, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1, **kwargs)
+        assert np.allclose(cccs, expected, atol=self.atol)
+        assert np.array_equal(used, packed_used)
+
+    def test_gain_not_applied_in_place(self, arrays):
+        template_dict, packed, pad_dict, seed_ids = arrays
+        packed *= 1e-6
+        original = packed.copy()
+        rows = {x: packed[i, 0:20000] for i, x in enumerate(seed_ids)}
+        with warnings.catch_warnings(record=True) as w:
+            warnings.simplefilter("always")
+            corr.fftw_multi_normxcorr(
+                copy.deepcopy(template_dict), rows, pad_dict, seed_ids,
+                cores_inner=1, cores_outer=1)
+        assert any("Low variance" in str(_w.message) for _w in w)
+        assert np.array_equal(packed, original)
+
+    def test_array_dicts_copy_streams(self):
+        stream = Stream([
+            Trace(data=random.randn(1000).astype(np.float32),
+                  header={'station': sta}) for sta in ('A', 'B')])
+        template = Stream([Trace(data=tr.data[100:200].copy(),
+                                 header={'station': tr.stats.station})
+                           for tr in stream])
+        originals = [tr.data.copy() for tr in stream]
+        stream_dict, _, _, _ = corr._get_array_dicts([template], stream)
+        for data in stream_dict.values():
+            data *= 2
+        for tr, original in zip(stream, originals):
+            assert np.array_equal(tr.data, original)
+        stream_dict, _, _, _ = corr._get_array_dicts(
+            [template], stream, copy_streams=False)
+        for tr, data in zip(stream, stream_dict.values()):
+            assert np.shares_memory(tr.data, data)
+
+    def test_pack_stream(self):
+        stream = Stream([
+            Trace(data=random.randn(n), header={'station': sta})
+            for n, sta in ((1000, 'B'), (800, 'A'), (1000, 'C'))])
+        originals = {tr.stats.station: tr.data.copy() for tr in stream}
+        packed = corr.pack_stream(stream)
+        assert packed.shape == (3, 1000)
+        assert packed.dtype == np.float32
+        assert [tr.stats.station for tr in stream] == ['A', 'B', 'C']
+        for row, tr in zip(packed, stream):
+            assert np.shares_memory(tr.data, packed)
+            assert tr.stats.npts == len(originals[tr.stats.station])
+            assert np.allclose(tr.data, originals[tr.stats.station])
+            assert np.all(row[tr.stats.npts:] == 0)
+        buffer, offsets = corr._packed_rows(
+            [tr.data for tr in stream], 800)
+        assert buffer is packed
+        assert list(offsets) == [0, 1000, 2000]
+
+
+class TestStreamingCorrelator:
+    """ Check that correlating in packets gives the same as all at once """
+    atol = TestArrayCorrelateFunctions.atol
+
+    @pytest.fixture
+    def array_dicts(self, multichannel_templates, multichannel_stream):
+        return corr._get_array_dicts(multichannel_templates,
+                                     multichannel_stream)
+
+    @pytest.mark.parametrize("block_len", [1000, 'auto'])
+    def test_streaming_matches_full(self, array_dicts, block_len):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        pad_dict = {seed_id: [i * 3 for i in range(len(pads))]
+                    for seed_id, pads in pad_dict.items()}
+        full, _ = corr.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), stream_dict, pad_dict, seed_ids,
+            cores_inner=1, cores_outer=1)
+        correlator = corr.StreamingCorrelator(
+            template_dict, pad_dict, seed_ids, block_len=block_len)
+        packet_sizes = itertools.cycle([50, 1500, 7, 4000, 199])
+        cccs, start = [], 0
+        while start < stream_len:
+            end = start + next(packet_sizes)
+            cccs.append(correlator.append(
+                {seed_id: stream_dict[seed_id][start:end]
+                 for seed_id in seed_ids}))
+            start = end
+        cccs = np.concatenate(cccs, axis=1)
+        assert correlator.n_samples == stream_len
+        assert correlator.n_correlations == cccs.shape[1]
+        assert cccs.shape[1] == full.shape[1] - correlator.max_pad
+        assert np.allclose(cccs, full[:, 0:cccs.shape[1]], atol=self.atol)
+
+    def test_reset(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        correlator = corr.StreamingCorrelator(
+            template_dict, pad_dict, seed_ids)
+        packet = {seed_id: stream_dict[seed_id][0:5000]
+                  for seed_id in seed_ids}
+        first = correlator.append(packet)
+        correlator.reset()
+        assert correlator.n_samples == 0
+        assert np.array_equal(first, correlator.append(packet))
+
+    def test_short_packets(self, array_dicts):
+        stream_dict, template_dict, pad_dict, seed_ids = array_dicts
+        correlator = corr.StreamingCorrelator(
+            template_dict, pad_dict, seed_ids)
+        out = correlator.append({seed_id: stream_dict[seed_id][0:10]
+                                 for seed_id in seed_ids})
+        assert out.shape == (n_templates, 0)
+
+
 class TestXcorrContextManager:
     # fake_cache = copy.deepcopy(corr.XCOR_FUNCS)
 
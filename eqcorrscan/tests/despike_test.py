@@ -22,6 +22,37 @@ class DespikeTesting(unittest.TestCase):
         self.assertNotEqual(despiked.data[400], 40)
         self.assertNotEqual(despiked.data[450], -40)
 
+    def test_median_filter_stream(self):
+        """Check despiking a stream against each window in turn."""
+        from obspy import read, Stream
+        import os
+        import numpy as np
+        from eqcorrscan.utils.despike import (
+            median_filter, _median_window, _interp_gap)
+        testing_path = os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                                    'test_data')
+        spiked = read(os.path.join(testing_path, 'random_spiked.ms'))[0]
+        filt = spiked.copy()
+        filt.detrend('linear')
+        filt.filter('bandpass', freqmin=10.0,
+                    freqmax=(spiked.stats.sampling_rate / 2) - 1)
+        windowlength = int(0.5 * spiked.stats.sampling_rate)
+        expected = spiked.copy()
+        for chunk in range(len(filt.data) // windowlength):
+            peaks = _median_window(
+                filt.data[chunk * windowlength:(chunk + 1) * windowlength],
+                chunk * windowlength, 2, spiked.stats.starttime,
+                spiked.stats.sampling_rate)
+            for peak in peaks:
+                expected.data = _interp_gap(
+                    expected.data, peak[1],
+                    int(0.05 * spiked.stats.sampling_rate))
+        despiked = median_filter(
+            tr=Stream([spiked.copy(), spiked.copy()]), multiplier=2,
+            windowlength=0.5, interp_len=0.05, cores=2)
+        for tr in despiked:
+            self.assertTrue(np.allclose(tr.data, expected.data))
+
     def test_template_remove(self):
         """Test the despiker based on correlations."""
         from obspy import read
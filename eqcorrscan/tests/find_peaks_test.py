@@ -12,7 +12,8 @@ import numpy as np
 import pytest
 
 from eqcorrscan.utils.findpeaks import (
-    find_peaks2_short, coin_trig, multi_find_peaks)
+    find_peaks2_short, coin_trig, multi_find_peaks, multi_find_peaks_compiled,
+    decluster)
 from eqcorrscan.utils.timer import time_func
 
 
@@ -63,6 +64,153 @@ class TestStandardPeakFinding:
         assert len(full_peak_array) == 315
 
 
+class TestCompiledPeakFinding:
+    """ Check the compiled peak-finding against find_peaks2_short """
+    trig_index = 10
+
+    @pytest.fixture
+    def cc_array(self):
+        """ load the test cc array case """
+        return np.load(join(pytest.test_data_path, 'test_ccc.npy'))
+
+    @pytest.fixture
+    def multi_array(self):
+        """ spiky arrays with repeated values """
+        random = np.random.RandomState(42)
+        arr = random.randn(6, 50000) ** 3
+        arr[:, random.randint(0, 50000, 200)] = 4.0
+        return arr.astype(np.float32)
+
+    @staticmethod
+    def _per_array(n_arrays, peak_arrays, peak_indexes, peak_values):
+        return [[(value, index) for value, index in zip(
+            peak_values[peak_arrays == i], peak_indexes[peak_arrays == i])]
+            for i in range(n_arrays)]
+
+    @pytest.mark.parametrize("full_peaks", [False, True])
+    def test_matches_find_peaks(self, cc_array, full_peaks):
+        expected = find_peaks2_short(
+            arr=cc_array, thresh=0.2, trig_int=self.trig_index,
+            full_peaks=full_peaks)
+        peaks = self._per_array(1, *multi_find_peaks_compiled(
+            arr=cc_array[np.newaxis, :], threshold=0.2,
+            threshold_type='absolute', trig_int=self.trig_index,
+            full_peaks=full_peaks)[0:3])
+        assert peaks[0] == expected
+
+    @pytest.mark.parametrize("threshold_type", ['absolute', 'MAD',
+                                                'av_chan_corr'])
+    @pytest.mark.parametrize("full_peaks", [False, True])
+    def test_thresholds(self, multi_array, threshold_type, full_peaks):
+        no_chans = [3, 4, 5, 6, 7, 8]
+        if threshold_type == 'absolute':
+            expected_thresholds = [2.0 for _ in multi_array]
+        elif threshold_type == 'MAD':
+            expected_thresholds = [2.0 * np.median(np.abs(arr))
+                                   for arr in multi_array]
+        else:
+            expected_thresholds = [2.0 * n for n in no_chans]
+        # Power of two trig_int keeps the python decluster exact
+        expected = multi_find_peaks(
+            arr=multi_array, thresh=expected_thresholds, trig_int=64,
+            parallel=False, full_peaks=full_peaks)
+        peak_arrays, peak_indexes, peak_values, thresholds = \
+            multi_find_peaks_compiled(
+                arr=multi_array, threshold=2.0, threshold_type=threshold_type,
+                trig_int=64, no_chans=no_chans, full_peaks=full_peaks,
+                cores=2)
+        assert np.allclose(thresholds, expected_thresholds)
+        assert self._per_array(
+            len(multi_array), peak_arrays, peak_indexes,
+            peak_values) == expected
+
+    def test_exact_trig_int_separation(self):
+        """ Peaks exactly trig_int apart are both kept """
+        arr = np.zeros((1, 200), dtype=np.float32)
+        arr[0, [42, 84, 100]] = [1, 2, 1.5]
+        _, peak_indexes, _, _ = multi_find_peaks_compiled(
+            arr=arr, threshold=0.5, threshold_type='absolute', trig_int=42)
+        assert list(peak_indexes) == [42, 84]
+
+    def test_output_grows(self, multi_array):
+        """ More peaks than the initial output space are all returned """
+        peak_arrays, _, _, _ = multi_find_peaks_compiled(
+            arr=multi_array, threshold=0.01, threshold_type='absolute',
+            trig_int=1)
+        expected = multi_find_peaks(
+            arr=multi_array, thresh=[0.01] * len(multi_array), trig_int=1,
+            parallel=False)
+        assert len(peak_arrays) == sum(len(p) for p in expected)
+        assert len(peak_arrays) > 1024 * len(multi_array)
+
+    def test_empty_arrays(self):
+        """ Arrays of no samples have no peaks """
+        peak_arrays, _, _, thresholds = multi_find_peaks_compiled(
+            arr=np.zeros((2, 0), dtype=np.float32), threshold=2.0,
+            threshold_type='MAD', trig_int=10)
+        assert len(peak_arrays) == 0
+        assert len(thresholds) == 2
+
+    def test_thresholds_not_changed(self, multi_array):
+        threshold = np.full(len(multi_array), 2.0)
+        multi_find_peaks_compiled(
+            arr=multi_array, threshold=threshold, threshold_type='MAD',
+            trig_int=10)
+        assert np.all(threshold == 2.0)
+
+    def test_bad_threshold_type(self, multi_array):
+        with pytest.raises(ValueError):
+            multi_find_peaks_compiled(
+                arr=multi_array, threshold=2.0, threshold_type='bob',
+                trig_int=10)
+        with pytest.raises(ValueError):
+            multi_find_peaks_compiled(
+                arr=multi_array, threshold=2.0, threshold_type='av_chan_corr',
+                trig_int=10)
+
+
+def _brute_force_decluster(peaks, index, trig_int):
+    """ Reference declustering, checking every kept peak. """
+    order = sorted(range(len(peaks)), key=lambda i: abs(peaks[i]),
+                   reverse=True)
+    kept = []
+    for i in order:
+        if all(abs(index[i] - index[j]) >= trig_int for j in kept):
+            kept.append(i)
+    return [(peaks[i], index[i]) for i in kept]
+
+
+class TestDecluster:
+    """ Check the declustering kernel """
+    @pytest.mark.parametrize("trig_int", [0, 1, 7, 50])
+    def test_matches_brute_force(self, trig_int):
+        random = np.random.RandomState(trig_int)
+        for _ in range(20):
+            n = random.randint(1, 200)
+            peaks = np.round(random.randn(n), 1)  # Lots of equal values
+            index = random.randint(0, 1000, n)  # Some equal indexes
+            assert decluster(peaks, index, trig_int) == \
+                _brute_force_decluster(peaks, index, trig_int)
+
+    def test_large_indexes(self):
+        """ Microsecond timestamps over many years are kept exact """
+        index = np.array([0, 10 ** 15, 10 ** 15 + 999999, 10 ** 15 + 10 ** 6],
+                         dtype=np.int64)
+        peaks = np.array([1., 2., 3., 1.5])
+        assert decluster(peaks, index, 10 ** 6) == [
+            (3., 10 ** 15 + 999999), (1., 0)]
+
+    def test_many_peaks(self):
+        random = np.random.RandomState(42)
+        peaks = random.randn(1000000)
+        index = random.randint(0, 10 ** 12, 1000000)
+        declustered = time_func(
+            decluster, "decluster", peaks=peaks, index=index,
+            trig_int=10 ** 6)
+        kept = np.sort(np.array([p[1] for p in declustered]))
+        assert np.all(np.diff(kept) >= 10 ** 6)
+
+
 class TestCoincidenceTrigger:
     # fixtures
     @pytest.fixture
@@ -175,6 +323,14 @@ class TestPeakFindSpeeds:
             trig_int=600, parallel=True)
         assert serial_peaks == parallel_peaks
 
+    def test_compiled_speed(self, dataset_2d, request):
+        """ time the compiled multi-array peak-finding """
+        print('starting find_peak profiling on: ' + request.node.name)
+        peaks = time_func(
+            multi_find_peaks_compiled, name="compiled", arr=dataset_2d,
+            threshold=10, threshold_type='MAD', trig_int=600)
+        print('Found %i peaks' % len(peaks[0]))
+
     def test_noisy_timings(self, noisy_multi_array):
         threshold = [np.median(np.abs(d)) for d in noisy_multi_array]
         print("Running serial loop")
@@ -16,6 +16,8 @@ from obspy.io.nordic.core import readwavename
 
 from eqcorrscan.core.lag_calc import _channel_loop, _xcorr_interp, LagCalcError
 from eqcorrscan.core.lag_calc import _day_loop, _prepare_data
+from eqcorrscan.core.lag_calc import (
+    _compute_lags, LAG_OK, LAG_OUTCOME, LAG_NOT_SMOOTH)
 from eqcorrscan.core.match_filter import normxcorr2, Detection
 from eqcorrscan.core.template_gen import from_meta_file
 
@@ -165,6 +167,28 @@ class TestMethods(unittest.TestCase):
         with self.assertRaises(IndexError):
             _xcorr_interp(ccc, 0.01)
 
+    def test_compute_lags(self):
+        """Check the compiled correlations against normxcorr2."""
+        for interpolate in (False, True):
+            shifts, ccs, status = _compute_lags(
+                detection_streams=[self.detection], template=self.template,
+                interpolate=interpolate, cores=2)
+            self.assertEqual(shifts.shape, (1, len(self.template)))
+            self.assertTrue(np.any(status & LAG_OUTCOME == LAG_OK))
+            for j, tr in enumerate(self.template):
+                if status[0, j] & LAG_OUTCOME != LAG_OK:
+                    continue
+                image = self.detection.select(
+                    station=tr.stats.station, channel=tr.stats.channel)[0]
+                ccc = normxcorr2(tr.data, image.data)
+                if interpolate and not status[0, j] & LAG_NOT_SMOOTH:
+                    shift, cc_max = _xcorr_interp(ccc, image.stats.delta)
+                else:
+                    shift = np.argmax(ccc) * image.stats.delta
+                    cc_max = np.amax(ccc)
+                self.assertAlmostEqual(shift, shifts[0, j], 3)
+                self.assertAlmostEqual(cc_max, ccs[0, j], 3)
+
     def test_day_loop_serial(self):
         """Test various implementations of parallel and non-parallel."""
         catalog = _day_loop(
@@ -23,6 +23,9 @@ from eqcorrscan.core.match_filter import read_detections, get_catalog
 from eqcorrscan.core.match_filter import write_catalog, extract_from_stream
 from eqcorrscan.core.match_filter import Tribe, Template, Party, Family
 from eqcorrscan.core.match_filter import read_party, read_tribe, _spike_test
+from eqcorrscan.core.match_filter import DetectionTimings
+from eqcorrscan.core.match_filter import (
+    _publish_stream, _attach_stream, _shard_cpus, temporary_directory)
 from eqcorrscan.utils import pre_processing, catalog_utils
 from eqcorrscan.utils.correlate import fftw_normxcorr, numpy_normxcorr
 from eqcorrscan.utils.catalog_utils import filter_picks
@@ -96,6 +99,36 @@ class TestCoreMethods(unittest.TestCase):
         ccc = normxcorr2(template=[0, 1, 2, 3, 4], image='bob')
         self.assertEqual(ccc, 'NaN')
 
+    def test_publish_stream(self):
+        """Test that published data are read back without copying."""
+        stream = Stream([
+            Trace(data=np.random.randn(n).astype(np.float32),
+                  header={'station': sta, 'sampling_rate': 10.0})
+            for n, sta in ((100, 'A'), (80, 'B'))])
+        originals = [tr.data.copy() for tr in stream]
+        with temporary_directory() as shared_dir:
+            published = _publish_stream(stream, shared_dir)
+            for tr, original in zip(stream, originals):
+                self.assertTrue(np.array_equal(tr.data, original))
+            attached = _attach_stream(published)
+            self.assertEqual(len(attached), 2)
+            for tr, original in zip(attached, originals):
+                self.assertEqual(tr.stats.npts, len(original))
+                self.assertTrue(np.array_equal(tr.data, original))
+                self.assertFalse(tr.data.flags.writeable)
+            del attached
+            os.remove(published[0])
+
+    def test_shard_cpus(self):
+        """Test that each shard gets CPUs of its own."""
+        shard_cpus = _shard_cpus(1)
+        self.assertEqual(len(shard_cpus), 1)
+        shard_cpus = _shard_cpus(2)
+        self.assertEqual(len(shard_cpus), 2)
+        if shard_cpus[0] is not None:
+            self.assertEqual(
+                len(set(shard_cpus[0]).intersection(shard_cpus[1])), 0)
+
     def test_spike_test(self):
         """Check that an error is raised!"""
         stream = read()
@@ -646,6 +679,36 @@ class TestMatchObjectHeavy(unittest.TestCase):
             party=party, party_in=self.party, float_tol=0.05,
             check_event=True)
 
+    def test_tribe_detect_timings(self):
+        """Test that the time in each stage is kept on the Party"""
+        party = self.tribe.detect(
+            stream=self.unproc_st, threshold=8.0, threshold_type='MAD',
+            trig_int=6.0, daylong=False, plotvar=False, parallel_process=False,
+            xcorr_func='fftw', concurrency='concurrent')
+        report = party.timings.report()
+        self.assertEqual(list(report['stages'].keys()),
+                         list(DetectionTimings.stages))
+        for stage in DetectionTimings.stages:
+            self.assertGreater(report['calls'][stage], 0)
+        self.assertGreater(report['stages']['processing'], 0)
+        self.assertGreater(report['stages']['correlate'], 0)
+        self.assertGreater(report['correlation']['calls'], 0)
+        self.assertGreater(
+            report['correlation']['stages']['inverse_fft'], 0)
+
+    @pytest.mark.serial
+    def test_tribe_detect_sharded(self):
+        """Test that sharded detection gives the same as one process"""
+        party = self.tribe.detect(
+            stream=self.unproc_st, threshold=8.0, threshold_type='MAD',
+            trig_int=6.0, daylong=False, plotvar=False, parallel_process=False,
+            shards=2)
+        self.assertEqual(len(party), 4)
+        compare_families(
+            party=party, party_in=self.party, float_tol=0.05,
+            check_event=True)
+        self.assertGreater(party.timings.report()['calls']['correlate'], 0)
+
     @pytest.mark.serial
     def test_tribe_detect_parallel_process(self):
         """Test the detect method on Tribe objects"""
@@ -700,6 +763,42 @@ class TestMatchObjectHeavy(unittest.TestCase):
             party=party, party_in=self.party, float_tol=0.05,
             check_event=False)
 
+    def test_tribe_stream_detector(self):
+        """Check that detecting packet-by-packet matches detecting at once."""
+        tribe = self.tribe.copy()
+        for template in tribe:
+            template.lowcut = None
+            template.highcut = None
+        party = tribe.detect(
+            stream=self.st, threshold=0.4, threshold_type='av_chan_corr',
+            trig_int=6.0, daylong=False, plotvar=False,
+            parallel_process=False)
+        detector = tribe.stream_detector(
+            threshold=0.4, threshold_type='av_chan_corr', trig_int=6.0)
+        samp_rate = self.st[0].stats.sampling_rate
+        packet_len = int(60 * samp_rate)
+        stream_party = Party()
+        for start in range(0, self.st[0].stats.npts, packet_len):
+            packet = self.st.copy()
+            for tr in packet:
+                tr.data = tr.data[start:start + packet_len]
+                tr.stats.starttime += start / samp_rate
+            stream_party += detector.append(packet)
+        # Detections in the last trig_int of data are not finalised yet
+        cutoff = self.st[0].stats.endtime - 10
+        detections = sorted([(d.template_name, d.detect_time)
+                             for f in party for d in f
+                             if d.detect_time < cutoff])
+        stream_detections = sorted([(d.template_name, d.detect_time)
+                                    for f in stream_party for d in f
+                                    if d.detect_time < cutoff])
+        self.assertEqual(len(detections), len(stream_detections))
+        for detection, stream_detection in zip(detections,
+                                               stream_detections):
+            self.assertEqual(detection[0], stream_detection[0])
+            self.assertLess(abs(detection[1] - stream_detection[1]),
+                            1.0 / samp_rate)
+
     @pytest.mark.flaky(reruns=2)
     @pytest.mark.network
     def test_client_detect(self):
@@ -730,6 +829,24 @@ class TestMatchObjectHeavy(unittest.TestCase):
             party=party, party_in=self.party, float_tol=0.05,
             check_event=False)
 
+    def test_client_detect_pipelined(self):
+        """Test that pipelined client_detect matches the serial loop."""
+        client = StreamClient(self.unproc_st)
+        tribe = self.tribe.copy()
+        # Shorter chunks to run the pipeline over several chunks
+        for template in tribe:
+            template.process_length = 900
+        kwargs = dict(
+            client=client, starttime=self.t1 + 2.75, endtime=self.t2,
+            threshold=8.0, threshold_type='MAD', trig_int=6.0,
+            daylong=False, plotvar=False, parallel_process=False)
+        party = tribe.client_detect(**kwargs)
+        pipelined = tribe.client_detect(queue_depth=2, **kwargs)
+        compare_families(party=pipelined, party_in=party, check_event=False)
+        limited = tribe.client_detect(
+            queue_depth=1, max_queue_memory=1, **kwargs)
+        compare_families(party=limited, party_in=party, check_event=False)
+
     @pytest.mark.network
     def test_party_lag_calc(self):
         """Test the lag-calc method on Party objects."""
@@ -972,6 +1089,20 @@ class TestMatchObjectLight(unittest.TestCase):
         self.assertEqual(self.party.__repr__(), 'Party of 4 Families.')
         self.assertFalse(self.party != self.party)
 
+    def test_party_timings(self):
+        """Test that timings are added with parties."""
+        party_a = Party()
+        party_b = Party()
+        party_a.timings.add('correlate', 1.0)
+        party_b.timings.add('correlate', 2.0)
+        party_b.timings.add('peaks', 0.5)
+        party_a += party_b
+        self.assertEqual(party_a.timings.seconds['correlate'], 3.0)
+        self.assertEqual(party_a.timings.calls['correlate'], 2)
+        self.assertEqual(party_a.timings.report()['total'], 3.5)
+        with self.assertRaises(MatchFilterError):
+            party_a.timings.add('bob', 1.0)
+
     def test_party_add(self):
         """Test getting items and adding them to party objects, and sorting"""
         test_party = self.party.copy()
@@ -1194,6 +1325,20 @@ class TestMatchObjectLight(unittest.TestCase):
                 os.remove('test_family.tgz')
 
 
+class StreamClient(object):
+    """ Local stand-in for an obspy client serving data from a Stream. """
+    def __init__(self, st):
+        self.st = st
+
+    def get_waveforms_bulk(self, bulk):
+        st = Stream()
+        for network, station, location, channel, starttime, endtime in bulk:
+            st += self.st.select(
+                network=network, station=station, location=location,
+                channel=channel).slice(starttime, endtime).copy()
+        return st
+
+
 def compare_families(party, party_in, float_tol=0.001, check_event=True):
     party.sort()
     party_in.sort()
@@ -197,6 +197,39 @@ class TestPreProcessing(unittest.TestCase):
             self.assertEqual(UTCDateTime(self.day_start), tr.stats.starttime)
             self.assertEqual(tr.stats.npts, 86400)
 
+    def test_shortproc_native(self):
+        """Test that native processing matches process."""
+        kwargs = dict(lowcut=0.1, highcut=0.4, filt_order=4, samp_rate=1,
+                      debug=0, parallel=True, num_cores=2)
+        processed = shortproc(self.short_stream.copy(), **kwargs)
+        native = shortproc(self.short_stream.copy(), native=True, **kwargs)
+        self.assertEqual(len(native), self.nchans)
+        for tr, native_tr in zip(processed, native):
+            self.assertEqual(tr.stats.starttime, native_tr.stats.starttime)
+            self.assertEqual(tr.stats.sampling_rate,
+                             native_tr.stats.sampling_rate)
+            self.assertEqual(tr.stats.npts, native_tr.stats.npts)
+            self.assertTrue(np.allclose(
+                tr.data, native_tr.data, atol=1e-5 * np.abs(tr.data).max()))
+
+    def test_dayproc_native(self):
+        """Test native day processing of padded and gappy data."""
+        st = self.st.copy()
+        st[0] = self.gappy_trace.copy()
+        st[1].trim(st[1].stats.starttime + 3600, st[1].stats.endtime)
+        kwargs = dict(lowcut=0.1, highcut=0.4, filt_order=3, samp_rate=1,
+                      starttime=self.day_start, debug=0, parallel=False,
+                      ignore_length=True)
+        processed = dayproc(st=st.copy(), **kwargs)
+        native = dayproc(st=st.copy(), native=True, **kwargs)
+        self.assertEqual(len(native), self.nchans)
+        for tr, native_tr in zip(processed, native):
+            self.assertEqual(UTCDateTime(self.day_start),
+                             native_tr.stats.starttime)
+            self.assertEqual(native_tr.stats.npts, 86400)
+            self.assertTrue(np.allclose(
+                tr.data, native_tr.data, atol=1e-5 * np.abs(tr.data).max()))
+
     def test_process(self):
         """Test a basic process implementation."""
         processed = process(tr=self.st[0].copy(), lowcut=0.1, highcut=0.4,
@@ -12,6 +12,7 @@ import os
 import glob
 
 from obspy import Stream, Trace, read
+from scipy.signal import hilbert
 
 from eqcorrscan.utils.stacking import linstack, PWS_stack, align_traces
 
@@ -49,6 +50,25 @@ class TestStackingMethods(unittest.TestCase):
         # Check length is preserved
         self.assertEqual(len(self.synth[0].data), len(stack[0].data))
 
+    def test_phase_weighted_stack_analytic(self):
+        """Check the compiled phase stack against scipy's analytic signal."""
+        streams = [self.synth.copy() for i in range(4)]
+        for i, st in enumerate(streams):
+            st[0].data = np.roll(st[0].data, i) + 0.01 * np.sin(i + 1)
+        lin = np.zeros(len(self.synth[0].data))
+        phase = np.zeros(len(self.synth[0].data), dtype=np.complex128)
+        for st in streams:
+            data = st[0].data
+            lin += data / np.sqrt(np.mean(np.square(data)))
+            analytic = hilbert(data)
+            instaphase = analytic / np.sqrt(np.square(analytic) +
+                                            np.square(data))
+            phase += instaphase / np.sqrt(np.mean(np.square(instaphase)))
+        for cores in (1, 2):
+            stack = PWS_stack(streams, weight=2, normalize=True, cores=cores)
+            self.assertTrue(np.allclose(stack[0].data,
+                                        lin * np.abs(phase ** 2)))
+
     def test_align_traces(self):
         """Test the utils.stacking.align_traces function."""
         # Generate synth data
@@ -68,6 +88,10 @@ class TestStackingMethods(unittest.TestCase):
         shifts, ccs = align_traces(traces, shift_len=11, master=False)
         for shift_in, shift_out in zip(shifts_in, shifts):
             self.assertEqual(-1 * shift_in, shift_out)
+        threaded_shifts, threaded_ccs = align_traces(
+            traces, shift_len=11, master=False, cores=2)
+        self.assertEqual(shifts, threaded_shifts)
+        self.assertTrue(np.allclose(ccs, threaded_ccs))
 
 
 class TestAlignRealData(unittest.TestCase):
@@ -96,6 +96,53 @@ class SimpleSubspaceMethods(unittest.TestCase):
                                        fft_vars[5])
         self.assertEqual((stat.max().round(6) - 0.229755).round(6), 0)
 
+    def test_batched_stat(self):
+        """Test that batched statistics match the numpy statistic."""
+        detector = subspace.Detector()
+        detector.read(os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                                   'test_data', 'subspace',
+                                   'stat_test_detector.h5'))
+        stream = read(os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                                   'test_data', 'subspace', 'test_trace.ms'))
+        detectors = [copy.deepcopy(detector).partition(dim)
+                     for dim in (1, 2)]
+        nc = len(detector.stachans)
+        batched = subspace._subspace_stats(detectors, stream, nc, cores=2)
+        self.assertEqual(len(batched), len(detectors))
+        for _detector, stats in zip(detectors, batched):
+            fft_vars = subspace._do_ffts(_detector, [stream], nc)
+            stat = subspace._det_stat_freq(
+                fft_vars[0][0], fft_vars[1][0], fft_vars[2][0], fft_vars[3],
+                nc, fft_vars[4], fft_vars[5])
+            self.assertEqual(stats.shape, (1, len(stat)))
+            self.assertTrue(np.allclose(stats[0], stat, atol=1e-8))
+        self.assertEqual((batched[1].max().round(6) - 0.229755).round(6), 0)
+
+    def test_stats_batches(self):
+        """Test that detectors are split to fit the memory limit."""
+        detector = subspace.Detector()
+        detector.read(os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                                   'test_data', 'subspace',
+                                   'stat_test_detector.h5'))
+        stream = read(os.path.join(os.path.abspath(os.path.dirname(__file__)),
+                                   'test_data', 'subspace', 'test_trace.ms'))
+        detectors = [copy.deepcopy(detector).partition(dim)
+                     for dim in (1, 2, 1)]
+        nc = len(detector.stachans)
+        mplen = stream[0].data.shape[0]
+        one = 8 * nc * (mplen + 2 * detector.data[0].shape[0])
+        self.assertEqual(
+            [len(batch) for batch in subspace._stats_batches(
+                detectors, nc, mplen, max_memory=10 * one)], [3])
+        batches = list(subspace._stats_batches(
+            detectors, nc, mplen, max_memory=one))
+        self.assertEqual([len(batch) for batch in batches], [1, 1, 1])
+        unbatched = subspace._subspace_stats(detectors, stream, nc)
+        batched = [stats for batch in batches
+                   for stats in subspace._subspace_stats(batch, stream, nc)]
+        for stats, _stats in zip(unbatched, batched):
+            self.assertTrue(np.allclose(stats, _stats))
+
 
 @pytest.mark.network
 class SubspaceTestingMethods(unittest.TestCase):
@@ -0,0 +1,411 @@
+"""
+Benchmarks of the correlation and detection routines.
+
+Synthetic templates and continuous data are generated with
+:mod:`eqcorrscan.utils.synth_seis` for every combination of template count,
+channel count, template length, data length and thread count requested, and
+the best of several repeats is timed for each routine.  Results are JSON
+serialisable, so that runs can be saved and compared between commits with
+:func:`compare_benchmarks`.
+
+:copyright:
+    EQcorrscan developers.
+
+:license:
+    GNU Lesser General Public License, Version 3
+    (https://www.gnu.org/copyleft/lesser.html)
+"""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+from __future__ import unicode_literals
+
+import copy
+import datetime
+import itertools
+import json
+import os
+import platform
+import subprocess
+from multiprocessing import cpu_count
+
+import numpy as np
+from obspy import Stream, Trace, UTCDateTime
+
+import eqcorrscan
+from eqcorrscan.utils import correlate
+from eqcorrscan.utils.findpeaks import multi_find_peaks
+from eqcorrscan.utils.synth_seis import template_grid
+from eqcorrscan.utils.timer import Timer
+
+try:
+    import resource
+except ImportError:  # pragma: no cover
+    # Not available on Windows
+    resource = None
+
+BENCHMARKS = ('fftw_normxcorr', 'time_multi_normxcorr',
+              'fftw_multi_normxcorr', 'multi_find_peaks', 'Tribe.detect')
+# Parameters identifying a benchmark case, used to match cases between runs
+CASE_KEYS = ('benchmark', 'n_templates', 'n_channels', 'template_len',
+             'data_len', 'threads')
+
+
+def synthetic_case(n_templates, n_channels, template_len, data_len,
+                   samp_rate=100.0, seed=42):
+    """
+    Generate synthetic templates and continuous data to benchmark with.
+
+    Templates are generated with
+    :func:`eqcorrscan.utils.synth_seis.template_grid` for random source
+    locations and travel-times, and copies of each are seeded into noisy
+    continuous data.
+
+    :type n_templates: int
+    :param n_templates: Number of templates.
+    :type n_channels: int
+    :param n_channels: Number of channels (one per station).
+    :type template_len: int
+    :param template_len: Template length in samples.
+    :type data_len: int
+    :param data_len: Length of continuous data in samples.
+    :type samp_rate: float
+    :param samp_rate: Sampling rate in Hz.
+    :type seed: int
+    :param seed: Random seed, so that cases are reproducible.
+
+    :returns: List of :class:`obspy.core.stream.Stream` templates
+    :rtype: list
+    :returns: Continuous data
+    :rtype: :class:`obspy.core.stream.Stream`
+    """
+    state = np.random.get_state()
+    np.random.seed(seed)
+    try:
+        stations = ['S{0:03d}'.format(i) for i in range(n_channels)]
+        nodes = list(zip(np.random.random(n_templates) * 90.0,
+                         np.random.random(n_templates) * 90.0,
+                         np.random.random(n_templates) * 40.0))
+        travel_times = np.random.random([n_channels, n_templates]) * (
+            template_len / samp_rate)
+        templates = template_grid(
+            stations=stations, nodes=nodes, travel_times=travel_times,
+            phase='S', samp_rate=samp_rate, flength=template_len)
+        data = Stream()
+        for i, station in enumerate(stations):
+            tr = Trace(data=np.random.randn(data_len) * 0.1)
+            tr.stats.station = station
+            tr.stats.channel = templates[0][i].stats.channel
+            tr.stats.sampling_rate = samp_rate
+            tr.stats.starttime = UTCDateTime(0)
+            data += tr
+        # Seed a copy of each template into the data
+        for template in templates:
+            start = np.random.randint(0, max(data_len - 2 * template_len, 1))
+            for tr, template_tr in zip(data, template):
+                end = min(start + len(template_tr.data), data_len)
+                tr.data[start:end] += template_tr.data[0:end - start]
+        for tr in data:
+            tr.data = tr.data.astype(np.float32)
+        for template in templates:
+            for tr in template:
+                tr.data = tr.data.astype(np.float32)
+    finally:
+        np.random.set_state(state)
+    return templates, data
+
+
+def peak_rss():
+    """
+    Peak resident set size of this process.
+
+    :rtype: int
+    :return: Bytes, or None if not available.
+    """
+    if resource is None:  # pragma: no cover
+        return None
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if platform.system() == 'Darwin':  # pragma: no cover
+        return int(rss)
+    return int(rss) * 1024
+
+
+def _time_case(func, repeats):
+    """ Times of repeats of func(). """
+    times = []
+    for _ in range(repeats):
+        with Timer() as timer:
+            func()
+        times.append(timer.secs)
+    return times
+
+
+def _case_runner(benchmark, templates, data, threads):
+    """ Get a callable running one benchmark case. """
+    template_arrays = np.array(
+        [template[0].data for template in templates], dtype=np.float32)
+    pads = [0] * len(templates)
+    if benchmark == 'fftw_normxcorr':
+        return lambda: correlate.fftw_normxcorr(
+            template_arrays, data[0].data.copy(), pads,
+            threaded=threads > 1)
+    elif benchmark == 'time_multi_normxcorr':
+        return lambda: correlate.time_multi_normxcorr(
+            template_arrays, data[0].data.copy(), pads,
+            threaded=threads > 1, cores=threads)
+    elif benchmark == 'fftw_multi_normxcorr':
+        stream_dict, template_dict, pad_dict, seed_ids = \
+            correlate._get_array_dicts(templates, data)
+        return lambda: correlate.fftw_multi_normxcorr(
+            copy.deepcopy(template_dict), copy.deepcopy(stream_dict),
+            pad_dict, seed_ids, cores_inner=threads, cores_outer=1)
+    elif benchmark == 'multi_find_peaks':
+        rng = np.random.RandomState(42)
+        cccsums = rng.randn(
+            len(templates), len(data[0].data)).astype(np.float32)
+        thresholds = [4.0 * np.median(np.abs(c)) for c in cccsums]
+        return lambda: multi_find_peaks(
+            arr=cccsums, thresh=thresholds, trig_int=len(templates[0][0]),
+            parallel=threads > 1, cores=threads)
+    elif benchmark == 'Tribe.detect':
+        from eqcorrscan.core.match_filter import Template, Tribe
+
+        samp_rate = data[0].stats.sampling_rate
+        tribe = Tribe([Template(
+            name='template_{0}'.format(i), st=template, lowcut=None,
+            highcut=None, samp_rate=samp_rate, filt_order=4,
+            process_length=len(data[0].data) / samp_rate, prepick=0.0)
+            for i, template in enumerate(templates)])
+        return lambda: tribe.detect(
+            stream=data.copy(), threshold=8.0, threshold_type='MAD',
+            trig_int=len(templates[0][0]) / samp_rate, plotvar=False,
+            parallel_process=threads > 1, cores=threads)
+    raise ValueError("benchmark must be one of {0}, not {1}".format(
+        BENCHMARKS, benchmark))
+
+
+def _scaling_efficiency(results):
+    """ Add the efficiency relative to one thread to each result. """
+    serial = {}
+    for result in results:
+        if result['threads'] == 1:
+            serial[tuple(result[k] for k in CASE_KEYS if k != 'threads')] = \
+                result['seconds']
+    for result in results:
+        one = serial.get(
+            tuple(result[k] for k in CASE_KEYS if k != 'threads'))
+        if one is None:
+            result['efficiency'] = None
+        else:
+            result['efficiency'] = one / (result['threads'] *
+                                          result['seconds'])
+    return results
+
+
+def benchmark_metadata():
+    """
+    Describe the version, build and machine benchmarks were run with.
+
+    :rtype: dict
+    """
+    commit = None
+    try:
+        commit = subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'], stderr=subprocess.STDOUT,
+            cwd=os.path.dirname(os.path.abspath(__file__))).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        pass
+    return {
+        'eqcorrscan_version': eqcorrscan.__version__, 'commit': commit,
+        'numpy_version': np.__version__, 'python': platform.python_version(),
+        'machine': platform.machine(), 'processor': platform.processor(),
+        'system': platform.system(), 'cpu_count': cpu_count(),
+        'simd_level': correlate.get_simd_level(),
+        'date': datetime.datetime.utcnow().isoformat()}
+
+
+def run_benchmarks(n_templates=(10, 50), n_channels=(3, 12),
+                   template_lens=(100, 400), data_lens=(360000, ),
+                   threads=None, benchmarks=None, repeats=3, c_harness=None,
+                   verbose=False):
+    """
+    Time the correlation and detection routines over a grid of cases.
+
+    Every combination of the parameters is run for every benchmark, apart
+    from the single-channel routines ('fftw_normxcorr' and
+    'time_multi_normxcorr'), which only use the first channel.
+
+    :type n_templates: list
+    :param n_templates: Numbers of templates.
+    :type n_channels: list
+    :param n_channels: Numbers of channels.
+    :type template_lens: list
+    :param template_lens: Template lengths in samples.
+    :type data_lens: list
+    :param data_lens: Lengths of continuous data in samples.
+    :type threads: list
+    :param threads:
+        Numbers of threads, defaults to one and all.  Include 1 to get the
+        scaling efficiency.
+    :type benchmarks: list
+    :param benchmarks: Benchmarks to run from :data:`BENCHMARKS`, default all.
+    :type repeats: int
+    :param repeats: Number of times to run each case, the best is reported.
+    :type c_harness: str
+    :param c_harness:
+        Path to the compiled stand-alone harness
+        (`eqcorrscan/utils/src/bench_multi_corr.c`) to also time
+        `multi_normxcorr_fftw` without Python, see :func:`run_c_harness`.
+    :type verbose: bool
+    :param verbose: Print each result as it is run.
+
+    :rtype: dict
+    :return:
+        Dictionary of 'metadata' (see :func:`benchmark_metadata`) and
+        'results', a list of one dictionary per case giving the case
+        parameters, the best time ('seconds') and all 'times', the
+        'throughput' in samples times templates per second, the 'peak_rss'
+        of the process after the case in bytes and the scaling 'efficiency'
+        relative to one thread.
+    """
+    threads = threads or sorted(set([1, cpu_count()]))
+    benchmarks = benchmarks or BENCHMARKS
+    for benchmark in benchmarks:
+        if benchmark not in BENCHMARKS:
+            raise ValueError("benchmark must be one of {0}, not {1}".format(
+                BENCHMARKS, benchmark))
+    results = []
+    for n_t, n_c, t_len, d_len in itertools.product(
+            n_templates, n_channels, template_lens, data_lens):
+        templates, data = synthetic_case(n_t, n_c, t_len, d_len)
+        for benchmark, n_threads in itertools.product(benchmarks, threads):
+            single = benchmark in ('fftw_normxcorr', 'time_multi_normxcorr')
+            if single and n_c != n_channels[0]:
+                continue
+            run = _case_runner(benchmark, templates, data, n_threads)
+            times = _time_case(run, repeats)
+            result = {
+                'benchmark': benchmark, 'n_templates': n_t,
+                'n_channels': 1 if single else n_c, 'template_len': t_len,
+                'data_len': d_len, 'threads': n_threads,
+                'seconds': min(times), 'times': times,
+                'throughput': (n_t * d_len * (1 if single else n_c) /
+                               max(min(times), 1e-9)),
+                'peak_rss': peak_rss()}
+            if verbose:
+                print(json.dumps(result, sort_keys=True))
+            results.append(result)
+        if c_harness is not None:
+            for n_threads in threads:
+                result = run_c_harness(
+                    c_harness, n_t, n_c, t_len, d_len, threads_inner=n_threads,
+                    repeats=repeats)
+                if verbose:
+                    print(json.dumps(result, sort_keys=True))
+                results.append(result)
+    return {'metadata': benchmark_metadata(),
+            'results': _scaling_efficiency(results)}
+
+
+def run_c_harness(executable, n_templates, n_channels, template_len,
+                  data_len, fft_len=0, threads_outer=1, threads_inner=1,
+                  repeats=3):
+    """
+    Run the stand-alone C benchmark of `multi_normxcorr_fftw`.
+
+    Build the harness from `eqcorrscan/utils/src/bench_multi_corr.c`, see the
+    comments at the top of that file.
+
+    :type executable: str
+    :param executable: Path to the compiled harness.
+    :type fft_len: int
+    :param fft_len: Transform length, 0 for the whole data at once.
+    :type threads_outer: int
+    :param threads_outer: Number of outer threads.
+    :type threads_inner: int
+    :param threads_inner: Number of inner threads.
+
+    Other parameters as :func:`run_benchmarks`.
+
+    :rtype: dict
+    :return:
+        Result as :func:`run_benchmarks`, with the best time without a
+        workspace in 'seconds' and with a re-used workspace in
+        'seconds_workspace'.
+    """
+    output = subprocess.check_output(
+        [executable] + [str(int(arg)) for arg in (
+            n_templates, n_channels, template_len, data_len, fft_len,
+            threads_outer, threads_inner, repeats)])
+    result = json.loads(output.decode().strip().splitlines()[-1])
+    result['benchmark'] = 'c:multi_normxcorr_fftw'
+    result['peak_rss'] = None
+    return result
+
+
+def save_benchmarks(benchmarks, filename):
+    """
+    Write benchmark results to a JSON file.
+
+    :type benchmarks: dict
+    :param benchmarks: Output of :func:`run_benchmarks`.
+    :type filename: str
+    :param filename: File to write to.
+    """
+    with open(filename, 'w') as f:
+        json.dump(benchmarks, f, indent=2, sort_keys=True)
+
+
+def load_benchmarks(filename):
+    """
+    Read benchmark results written by :func:`save_benchmarks`.
+
+    :type filename: str
+    :param filename: File to read.
+
+    :rtype: dict
+    """
+    with open(filename, 'r') as f:
+        return json.load(f)
+
+
+def compare_benchmarks(reference, current, tolerance=0.1):
+    """
+    Find cases that have got slower between two benchmark runs.
+
+    :type reference: dict
+    :param reference: Earlier output of :func:`run_benchmarks`.
+    :type current: dict
+    :param current: Later output of :func:`run_benchmarks`.
+    :type tolerance: float
+    :param tolerance:
+        Fractional drop in throughput allowed before a case is reported.
+
+    :rtype: list
+    :return:
+        One dictionary per slower case, giving the case parameters, the
+        'reference' and 'current' throughput and the fractional 'change'.
+    """
+    def _key(result):
+        return tuple(result.get(k) for k in CASE_KEYS)
+
+    reference_results = {_key(r): r for r in reference['results']}
+    regressions = []
+    for result in current['results']:
+        old = reference_results.get(_key(result))
+        if old is None:
+            continue
+        change = result['throughput'] / old['throughput'] - 1
+        if change < -tolerance:
+            regression = {k: result.get(k) for k in CASE_KEYS}
+            regression.update({
+                'reference': old['throughput'],
+                'current': result['throughput'], 'change': change})
+            regressions.append(regression)
+    return regressions
+
+
+if __name__ == '__main__':
+    import doctest
+    doctest.testmod()
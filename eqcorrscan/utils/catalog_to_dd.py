@@ -7,11 +7,12 @@ file (event.dat), station information file (station.dat), and a correlation
 oiutput file correlated every event in the catalogue with every other event to
 optimize the picks (dt.cc).
 
-The correlation routine relies on obspy's xcorr_pick_correction function from
-the obspy.signal.cross_correlation module.  This function optimizes picks to
-better than sample accuracy by interpolating the correlation function and
-finding the maximum of this rather than the true maximum correlation value.
-The output from this function is stored in the dt.cc file.
+The correlation routine follows obspy's xcorr_pick_correction function from
+the obspy.signal.cross_correlation module, computed in batches in compiled
+code.  This optimizes picks to better than sample accuracy by interpolating
+the correlation function and finding the maximum of this rather than the true
+maximum correlation value.  The output from this function is stored in the
+dt.cc file.
 
 Information for the station.dat file is read from SEISAN's STATION0.HYP file
 
@@ -36,21 +37,28 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
 import os
 import glob
 import warnings
-import matplotlib.pyplot as plt
+from collections import OrderedDict
 
-from obspy import read, UTCDateTime
+import matplotlib.pyplot as plt
+import numpy as np
+from future.utils import native_str
+from obspy import read, Stream, UTCDateTime
 from obspy.core.event import (
     Catalog, Event, Origin, Magnitude, Pick, WaveformStreamID, Arrival,
     OriginQuality)
-from obspy.signal.cross_correlation import xcorr_pick_correction
+from obspy.signal.invsim import cosine_taper
 try:
     from obspy.io.nordic.core import read_nordic, readheader, readwavename
 except ImportError:
     raise ImportError("Needs obspy >= 1.1.0")
 
+from eqcorrscan.core.lag_calc import (
+    LAG_OUTCOME, LAG_NOT_SMOOTH, LAG_OPENS_UP, LAG_AT_EDGE)
+from eqcorrscan.utils.libnames import _load_cdll
 from eqcorrscan.utils.mag_calc import dist_calc
 
 
@@ -396,9 +404,179 @@ def write_catalog(event_list, max_sep=8, min_link=8, debug=0):
     return list(set(stations))
 
 
+class _WaveformCache(object):
+    """
+    Bounded least-recently-used cache of processed waveforms.
+
+    Traces are keyed by event id, station and component, and processed as
+    :func:`obspy.signal.cross_correlation.xcorr_pick_correction` processes
+    them before correlating (demean, 10% cosine taper and bandpass), so each
+    channel of each event is read and filtered once while it stays in the
+    cache.
+
+    :type wavbase: str
+    :param wavbase: Path to the seisan wave directory
+    :type lowcut: float
+    :param lowcut: Lowcut in Hz
+    :type highcut: float
+    :param highcut: Highcut in Hz
+    :type max_traces: int
+    :param max_traces: Maximum number of processed traces to keep.
+    """
+    def __init__(self, wavbase, lowcut, highcut, max_traces=1000):
+        self.wavbase = wavbase
+        self.lowcut = lowcut
+        self.highcut = highcut
+        self.max_traces = max_traces
+        self._traces = OrderedDict()
+        # The last stream read, so that misses for the channels of one event
+        # only read its files once.
+        self._last_read = (None, None)
+
+    def __len__(self):
+        return len(self._traces)
+
+    def _read(self, event_id, sfile):
+        if self._last_read[0] != event_id:
+            self._last_read = (event_id, _read_wavefiles(self.wavbase, sfile))
+        return self._last_read[1]
+
+    def get(self, event_id, sfile, station, component):
+        """
+        Get the processed trace for a station and component of an event.
+
+        :returns: Processed trace, or None if there are no data.
+        :rtype: obspy.core.trace.Trace
+        """
+        key = (event_id, station, component)
+        try:
+            tr = self._traces.pop(key)
+        except KeyError:
+            tr = self._read(event_id, sfile).select(
+                station=station, channel='*' + component)
+            if len(tr) == 0:
+                tr = None
+            else:
+                tr = tr[0].copy()
+                tr.data = tr.data.astype(np.float64)
+                tr.detrend(type='demean')
+                tr.data *= cosine_taper(len(tr), 0.1)
+                tr.filter(type='bandpass', freqmin=self.lowcut,
+                          freqmax=self.highcut)
+        self._traces[key] = tr
+        while len(self._traces) > self.max_traces:
+            self._traces.popitem(last=False)
+        return tr
+
+
+def _read_wavefiles(wavbase, sfile):
+    """
+    Read all the waveform files of an s-file.
+
+    :type wavbase: str
+    :param wavbase: Path to the seisan wave directory
+    :type sfile: str
+    :param sfile: Path to the s-file
+
+    :returns: stream
+    :rtype: obspy.core.stream.Stream
+    """
+    wavefiles = readwavename(sfile)
+    stream = Stream()
+    for i, wavefile in enumerate(wavefiles):
+        try:
+            stream += read(wavbase + os.sep + wavefile)
+        except Exception:
+            if i == 0:
+                raise IOError('No wavefile found: ' + wavefile + ' ' + sfile)
+            print('No waveform found: %s' % (wavbase + os.sep + wavefile))
+    return stream
+
+
+def _pick_window(pick_time, tr, t_before, t_after, shift_len):
+    """
+    Cut the data around a pick as xcorr_pick_correction.
+
+    :returns: Data, or None if the trace does not cover the window.
+    :rtype: numpy.ndarray
+    """
+    start = pick_time - t_before - (shift_len / 2.0)
+    end = pick_time + t_after + (shift_len / 2.0)
+    if tr.stats.starttime > start or tr.stats.endtime < end:
+        return None
+    first = int(round((start - tr.stats.starttime) * tr.stats.sampling_rate))
+    last = int(round((end - tr.stats.starttime) * tr.stats.sampling_rate))
+    return tr.data[first:last + 1]
+
+
+def _correlate_picks(master_windows, slave_windows, max_shifts, cores=1):
+    """
+    Correlate pairs of pick windows and find the interpolated peaks.
+
+    All pairs are correlated in one call to the C routine, with the
+    normalisation and parabolic peak fit of
+    :func:`obspy.signal.cross_correlation.xcorr_pick_correction`.
+
+    :type master_windows: list
+    :param master_windows: List of numpy.ndarray of master data
+    :type slave_windows: list
+    :param slave_windows: List of numpy.ndarray of slave data
+    :type max_shifts: list
+    :param max_shifts: Largest lag of each pair in samples
+    :type cores: int
+    :param cores: Number of threads to correlate with.
+
+    :returns:
+        Arrays of the lag of the peak of each correlation in samples
+        (positive when the slave is late), of the correlation at the peak
+        and of the status of each correlation, where zero is a good
+        interpolated peak.
+    :rtype: tuple
+    """
+    c_long = np.dtype(ctypes.c_long)
+    n_pairs = len(master_windows)
+    master_lens = np.array([len(w) for w in master_windows], dtype=c_long)
+    slave_lens = np.array([len(w) for w in slave_windows], dtype=c_long)
+    stride = max(int(max(master_lens.max(), slave_lens.max())), 1)
+    masters = np.zeros((n_pairs, stride), dtype=np.float32)
+    slaves = np.zeros((n_pairs, stride), dtype=np.float32)
+    for row, window in zip(masters, master_windows):
+        row[0:len(window)] = window
+    for row, window in zip(slaves, slave_windows):
+        row[0:len(window)] = window
+    shifts = np.zeros(n_pairs)
+    ccs = np.zeros(n_pairs)
+    status = np.zeros(n_pairs, dtype=np.intc)
+
+    utilslib = _load_cdll('libutils')
+    float_arr = np.ctypeslib.ndpointer(
+        dtype=np.float32, flags=native_str('C_CONTIGUOUS'))
+    long_arr = np.ctypeslib.ndpointer(
+        dtype=c_long, flags=native_str('C_CONTIGUOUS'))
+    double_arr = np.ctypeslib.ndpointer(
+        dtype=np.float64, flags=native_str('C_CONTIGUOUS'))
+    utilslib.pick_correction_correlate.argtypes = [
+        float_arr, long_arr, float_arr, long_arr, ctypes.c_long,
+        ctypes.c_long, long_arr, double_arr, double_arr,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int]
+    utilslib.pick_correction_correlate.restype = ctypes.c_int
+    ret = utilslib.pick_correction_correlate(
+        masters, master_lens, slaves, slave_lens, n_pairs, stride,
+        np.array(max_shifts, dtype=c_long), shifts, ccs, status, cores)
+    if ret != 0:
+        raise MemoryError("Could not allocate memory for pick corrections")
+    # Fits that obspy would reject stop a correction being used, other
+    # warnings do not
+    status &= (LAG_OUTCOME | LAG_NOT_SMOOTH | LAG_OPENS_UP | LAG_AT_EDGE)
+    return shifts, ccs, status
+
+
 def write_correlations(event_list, wavbase, extract_len, pre_pick, shift_len,
                        lowcut=1.0, highcut=10.0, max_sep=8, min_link=8,
-                       cc_thresh=0.0, plotvar=False, debug=0):
+                       cc_thresh=0.0, plotvar=False, debug=0, cores=1,
+                       cache_size=1000):
     """
     Write a dt.cc file for hypoDD input for a given list of events.
 
@@ -429,11 +607,26 @@ def write_correlations(event_list, wavbase, extract_len, pre_pick, shift_len,
     :type cc_thresh: float
     :param cc_thresh: Threshold to include cross-correlation results.
     :type plotvar: bool
-    :param plotvar: To show the pick-correction plots, defualts to False.
+    :param plotvar:
+        To show a histogram of the squared correlations, defaults to False.
     :type debug: int
     :param debug: Variable debug levels from 0-5, higher=more output.
+    :type cores: int
+    :param cores: Number of threads to correlate with.
+    :type cache_size: int
+    :param cache_size:
+        Maximum number of processed channels of waveform data to keep in
+        memory between event pairs.
 
-    .. warning:: This is not a fast routine!
+    .. note::
+        Processed waveforms are kept in a least-recently-used cache of
+        `cache_size` channels, so the waveform files of an event are read
+        and filtered again only once its channels have been evicted. All
+        the (master pick, slave pick) windows of one master event for a
+        station and phase are correlated in one threaded compiled call, and
+        the master's event pairs are written out as soon as they are done.
+        The correlations follow
+        :func:`obspy.signal.cross_correlation.xcorr_pick_correction`.
 
     .. warning::
         In contrast to seisan's corr routine, but in accordance with the
@@ -450,177 +643,160 @@ def write_correlations(event_list, wavbase, extract_len, pre_pick, shift_len,
         desire this functionality, you should apply the taper before calling
         this.  Note the :func:`obspy.Trace.taper` functions.
     """
-    warnings.filterwarnings(action="ignore",
-                            message="Maximum of cross correlation " +
-                                    "lower than 0.8: *")
+    event_list = list(event_list)
     corr_list = []
+    cache = _WaveformCache(wavbase=wavbase, lowcut=lowcut, highcut=highcut,
+                           max_traces=cache_size)
+    # Read the events once
+    events = [read_nordic(event[1])[0] for event in event_list]
+    locations = [(event.origins[0].latitude, event.origins[0].longitude,
+                  event.origins[0].depth / 1000.0) for event in events]
     f = open('dt.cc', 'w')
     f2 = open('dt.cc2', 'w')
-    k_events = len(list(event_list))
-    for i, master in enumerate(event_list):
-        master_sfile = master[1]
+    for i, (master_event_id, master_sfile) in enumerate(event_list):
         if debug > 1:
             print('Computing correlations for master: %s' % master_sfile)
-        master_event_id = master[0]
-        master_event = read_nordic(master_sfile)[0]
-        master_picks = master_event.picks
+        master_event = events[i]
         master_ori_time = master_event.origins[0].time
-        master_location = (master_event.origins[0].latitude,
-                           master_event.origins[0].longitude,
-                           master_event.origins[0].depth / 1000.0)
-        master_wavefiles = readwavename(master_sfile)
-        masterpath = glob.glob(wavbase + os.sep + master_wavefiles[0])
-        if masterpath:
-            masterstream = read(masterpath[0])
-        if len(master_wavefiles) > 1:
-            for wavefile in master_wavefiles:
-                try:
-                    masterstream += read(os.join(wavbase, wavefile))
-                except:
-                    raise IOError("Couldn't find wavefile")
-                    continue
-        for j in range(i + 1, k_events):
+        master_picks = []
+        for pick in master_event.picks:
+            if not hasattr(pick, 'phase_hint') or len(pick.phase_hint) == 0:
+                warnings.warn('No phase-hint for pick:')
+                print(pick)
+                continue
+            if pick.phase_hint[0].upper() not in ['P', 'S']:
+                # Only use P and S picks, not amplitude or 'other'
+                warnings.warn('Will only use P or S phase picks')
+                print(pick)
+                continue
+            master_picks.append(pick)
+        # Windows of every slave pick for each station and phase:
+        # (slave index, master pick, slave pick, master, slave, shift)
+        batches = OrderedDict()
+        slaves = []
+        for j in range(i + 1, len(event_list)):
             # Use this tactic to only output unique event pairings
-            slave_sfile = event_list[j][1]
+            slave_event_id, slave_sfile = event_list[j]
             if debug > 2:
                 print('Comparing to event: %s' % slave_sfile)
-            slave_event_id = event_list[j][0]
-            slave_wavefiles = readwavename(slave_sfile)
-            try:
-                slavestream = read(wavbase + os.sep + slave_wavefiles[0])
-            except:
-                raise IOError('No wavefile found: ' + slave_wavefiles[0] +
-                              ' ' + slave_sfile)
-            if len(slave_wavefiles) > 1:
-                for wavefile in slave_wavefiles:
-                    try:
-                        slavestream += read(wavbase + os.sep + wavefile)
-                    except IOError:
-                        print('No waveform found: %s' %
-                              (wavbase + os.sep + wavefile))
-                        continue
-            # Write out the header line
-            event_text = '#' + str(master_event_id).rjust(10) +\
-                str(slave_event_id).rjust(10) + ' 0.0   \n'
-            event_text2 = '#' + str(master_event_id).rjust(10) +\
-                str(slave_event_id).rjust(10) + ' 0.0   \n'
-            slave_event = read_nordic(slave_sfile)[0]
-            slave_picks = slave_event.picks
-            slave_ori_time = slave_event.origins[0].time
-            slave_location = (slave_event.origins[0].latitude,
-                              slave_event.origins[0].longitude,
-                              slave_event.origins[0].depth / 1000.0)
-            if dist_calc(master_location, slave_location) > max_sep:
+            separation = dist_calc(locations[i], locations[j])
+            if separation > max_sep:
                 if debug > 0:
-                    print('Seperation exceeds max_sep: %s' %
-                          (dist_calc(master_location, slave_location)))
+                    print('Seperation exceeds max_sep: %s' % separation)
                 continue
-            links = 0
-            phases = 0
+            slaves.append(j)
+            slave_event = events[j]
             for pick in master_picks:
-                if not hasattr(pick, 'phase_hint') or \
-                                len(pick.phase_hint) == 0:
-                    warnings.warn('No phase-hint for pick:')
-                    print(pick)
-                    continue
-                if pick.phase_hint[0].upper() not in ['P', 'S']:
-                    warnings.warn('Will only use P or S phase picks')
-                    print(pick)
-                    continue
-                    # Only use P and S picks, not amplitude or 'other'
                 # Find station, phase pairs
-                # Added by Carolin
-                slave_matches = [p for p in slave_picks
+                slave_matches = [p for p in slave_event.picks
                                  if hasattr(p, 'phase_hint') and
                                  p.phase_hint == pick.phase_hint and
                                  p.waveform_id.station_code ==
                                  pick.waveform_id.station_code]
-
-                if masterstream.select(station=pick.waveform_id.station_code,
-                                       channel='*' +
-                                       pick.waveform_id.channel_code[-1]):
-                    mastertr = masterstream.\
-                        select(station=pick.waveform_id.station_code,
-                               channel='*' +
-                               pick.waveform_id.channel_code[-1])[0]
-                elif debug > 1:
-                    print('No waveform data for ' +
-                          pick.waveform_id.station_code + '.' +
-                          pick.waveform_id.channel_code)
-                    print(pick.waveform_id.station_code +
-                          '.' + pick.waveform_id.channel_code +
-                          ' ' + slave_sfile + ' ' + master_sfile)
-                    break
-                # Loop through the matches
+                if len(slave_matches) == 0:
+                    continue
+                mastertr = cache.get(
+                    master_event_id, master_sfile,
+                    pick.waveform_id.station_code,
+                    pick.waveform_id.channel_code[-1])
+                if mastertr is None:
+                    if debug > 1:
+                        print('No waveform data for ' +
+                              pick.waveform_id.station_code + '.' +
+                              pick.waveform_id.channel_code)
+                    continue
                 for slave_pick in slave_matches:
-                    if slavestream.select(station=slave_pick.waveform_id.
-                                          station_code,
-                                          channel='*' + slave_pick.waveform_id.
-                                          channel_code[-1]):
-                        slavetr = slavestream.\
-                            select(station=slave_pick.waveform_id.station_code,
-                                   channel='*' + slave_pick.waveform_id.
-                                   channel_code[-1])[0]
-                    else:
+                    slavetr = cache.get(
+                        slave_event_id, slave_sfile,
+                        slave_pick.waveform_id.station_code,
+                        slave_pick.waveform_id.channel_code[-1])
+                    if slavetr is None:
                         print('No slave data for ' +
                               slave_pick.waveform_id.station_code + '.' +
                               slave_pick.waveform_id.channel_code)
-                        print(pick.waveform_id.station_code +
-                              '.' + pick.waveform_id.channel_code +
-                              ' ' + slave_sfile + ' ' + master_sfile)
                         break
-                    # Correct the picks
-                    try:
-                        correction, cc =\
-                            xcorr_pick_correction(
-                                pick.time, mastertr, slave_pick.time,
-                                slavetr, pre_pick, extract_len - pre_pick,
-                                shift_len, filter="bandpass",
-                                filter_options={'freqmin': lowcut,
-                                                'freqmax': highcut},
-                                plot=plotvar)
-                        # Get the differential travel time using the
-                        # corrected time.
-                        # Check that the correction is within the allowed shift
-                        # This can occur in the obspy routine when the
-                        # correlation function is increasing at the end of the
-                        # window.
-                        if abs(correction) > shift_len:
-                            warnings.warn('Shift correction too large, ' +
-                                          'will not use')
-                            continue
-                        correction = (pick.time - master_ori_time) -\
-                            (slave_pick.time + correction - slave_ori_time)
-                        links += 1
-                        if cc >= cc_thresh:
-                            weight = cc
-                            phases += 1
-                            # added by Caro
-                            event_text += pick.waveform_id.station_code.\
-                                ljust(5) + _cc_round(correction, 3).\
-                                rjust(11) + _cc_round(weight, 3).rjust(8) +\
-                                ' ' + pick.phase_hint + '\n'
-                            event_text2 += pick.waveform_id.station_code\
-                                .ljust(5) + _cc_round(correction, 3).\
-                                rjust(11) +\
-                                _cc_round(weight * weight, 3).rjust(8) +\
-                                ' ' + pick.phase_hint + '\n'
-                            if debug > 3:
-                                print(event_text)
-                        else:
-                            print('cc too low: %s' % cc)
-                        corr_list.append(cc * cc)
-                    except:
-                        msg = "Couldn't compute correlation correction"
-                        warnings.warn(msg)
+                    if slavetr.stats.sampling_rate != \
+                            mastertr.stats.sampling_rate:
+                        warnings.warn("Couldn't compute correlation "
+                                      "correction")
                         continue
+                    windows = [_pick_window(
+                        pick_time, tr, pre_pick, extract_len - pre_pick,
+                        shift_len) for pick_time, tr in (
+                        (pick.time, mastertr), (slave_pick.time, slavetr))]
+                    max_shift = int(shift_len * mastertr.stats.sampling_rate)
+                    if windows[0] is None or windows[1] is None or \
+                            max_shift < 1:
+                        warnings.warn("Couldn't compute correlation "
+                                      "correction")
+                        continue
+                    batches.setdefault(
+                        (pick.waveform_id.station_code, pick.phase_hint),
+                        []).append((j, pick, slave_pick, windows[0],
+                                    windows[1], max_shift))
+        # Correlate each station and phase in one call
+        results = dict((j, []) for j in slaves)
+        for batch in batches.values():
+            shifts, ccs, status = _correlate_picks(
+                master_windows=[b[3] for b in batch],
+                slave_windows=[b[4] for b in batch],
+                max_shifts=[b[5] for b in batch], cores=cores)
+            for (j, pick, slave_pick, _, _, max_shift), shift, cc, stat in \
+                    zip(batch, shifts, ccs, status):
+                if stat != 0:
+                    warnings.warn("Couldn't compute correlation correction")
+                    continue
+                # Samples to seconds as the lag times of the correlation
+                correction = shift * shift_len / max_shift
+                results[j].append((pick, slave_pick, correction, cc))
+        # Write out the pairs of this master in the order of the picks
+        order = dict((id(pick), k) for k, pick in enumerate(master_picks))
+        for j in slaves:
+            slave_event_id = event_list[j][0]
+            slave_ori_time = events[j].origins[0].time
+            event_text = '#' + str(master_event_id).rjust(10) +\
+                str(slave_event_id).rjust(10) + ' 0.0   \n'
+            event_text2 = event_text
+            links = 0
+            phases = 0
+            for pick, slave_pick, correction, cc in sorted(
+                    results[j], key=lambda result: order[id(result[0])]):
+                # Check that the correction is within the allowed shift
+                # This can occur when the correlation function is
+                # increasing at the end of the window.
+                if abs(correction) > shift_len:
+                    warnings.warn('Shift correction too large, ' +
+                                  'will not use')
+                    continue
+                # Get the differential travel time using the corrected time.
+                correction = (pick.time - master_ori_time) -\
+                    (slave_pick.time + correction - slave_ori_time)
+                links += 1
+                if cc >= cc_thresh:
+                    weight = cc
+                    phases += 1
+                    event_text += pick.waveform_id.station_code.\
+                        ljust(5) + _cc_round(correction, 3).\
+                        rjust(11) + _cc_round(weight, 3).rjust(8) +\
+                        ' ' + pick.phase_hint + '\n'
+                    event_text2 += pick.waveform_id.station_code\
+                        .ljust(5) + _cc_round(correction, 3).\
+                        rjust(11) +\
+                        _cc_round(weight * weight, 3).rjust(8) +\
+                        ' ' + pick.phase_hint + '\n'
+                    if debug > 3:
+                        print(event_text)
+                else:
+                    print('cc too low: %s' % cc)
+                corr_list.append(cc * cc)
             if links >= min_link and phases > 0:
                 f.write(event_text)
                 f2.write(event_text2)
+        f.flush()
+        f2.flush()
     if plotvar:
         plt.hist(corr_list, 150)
         plt.show()
-    # f.write('\n')
     f.close()
     f2.close()
     return
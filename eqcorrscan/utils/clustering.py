@@ -13,6 +13,7 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
 import os
 import warnings
 from multiprocessing import Pool, cpu_count
@@ -21,12 +22,15 @@ import matplotlib.pyplot as plt
 import numpy as np
 from obspy import Stream, Catalog, UTCDateTime, Trace
 from obspy.signal.cross_correlation import xcorr
+from future.utils import native_str
 from scipy.cluster.hierarchy import linkage, dendrogram, fcluster
+from scipy.fftpack import next_fast_len
 from scipy.spatial.distance import squareform
 
 from eqcorrscan.utils import stacking
 from eqcorrscan.utils.archive_read import read_data
 from eqcorrscan.utils.correlate import get_array_xcorr
+from eqcorrscan.utils.libnames import _load_cdll
 from eqcorrscan.utils.mag_calc import dist_calc
 
 
@@ -90,7 +94,8 @@ def cross_chan_coherence(st1, st2, allow_shift=False, shift_len=0.2, i=0,
         return 0, i
 
 
-def distance_matrix(stream_list, allow_shift=False, shift_len=0, cores=1):
+def distance_matrix(stream_list, allow_shift=False, shift_len=0, cores=1,
+                    native=False, out=None, tile=64):
     """
     Compute distance matrix for waveforms based on cross-correlations.
 
@@ -109,18 +114,50 @@ def distance_matrix(stream_list, allow_shift=False, shift_len=0, cores=1):
     :param shift_len: How many seconds for templates to shift
     :type cores: int
     :param cores: Number of cores to parallel process using, defaults to 1.
+    :type native: bool
+    :param native:
+        Compute all pairs in one threaded compiled call, see note.
+    :type out: numpy.ndarray
+    :param out:
+        Optional C-contiguous float64 array of shape (len(stream_list),
+        len(stream_list)) to write the distance matrix into, for example a
+        :class:`numpy.memmap` for matrices too large for memory.
+    :type tile: int
+    :param tile:
+        Number of streams per block of pairs when `native=True`.
 
     :returns: distance matrix
     :rtype: :class:`numpy.ndarray`
 
+    .. Note::
+        With `native=True` each channel is prepared once (and transformed
+        once if `allow_shift=True`), and only the upper triangle of the
+        matrix is correlated, in blocks of `tile` streams, using `cores`
+        threads. Without shifts the result is the same as the default.
+        With shifts the correlation at each lag is normalised by the energy
+        of the whole of both channels, rather than by
+        :func:`obspy.signal.cross_correlation.xcorr`, and the value with the
+        largest magnitude within the shift is used, so values may differ
+        slightly.
+
     .. warning::
         Because distance is given as :math:`1-abs(coherence)`, negatively
         correlated and positively correlated objects are given the same
         distance.
     """
     # Initialize square matrix
-    dist_mat = np.array([np.array([0.0] * len(stream_list))] *
-                        len(stream_list))
+    if out is None:
+        dist_mat = np.zeros((len(stream_list), len(stream_list)))
+    else:
+        if out.shape != (len(stream_list), len(stream_list)):
+            raise ValueError("out must have shape (%i, %i)" % (
+                len(stream_list), len(stream_list)))
+        dist_mat = out
+    if native:
+        _native_distance_matrix(
+            stream_list=stream_list, allow_shift=allow_shift,
+            shift_len=shift_len, cores=cores, out=dist_mat, tile=tile)
+        return dist_mat
     for i, master in enumerate(stream_list):
         # Start a parallel processing pool
         pool = Pool(processes=cores)
@@ -149,8 +186,94 @@ def distance_matrix(stream_list, allow_shift=False, shift_len=0, cores=1):
     return dist_mat
 
 
+def _native_distance_matrix(stream_list, allow_shift, shift_len, cores, out,
+                            tile=64):
+    """
+    Compute the distance matrix of all streams in one compiled call.
+
+    Equivalent to :func:`cross_chan_coherence` for every pair of streams in
+    the upper triangle; see :func:`distance_matrix`.
+
+    :type stream_list: list
+    :param stream_list: List of :class:`obspy.core.stream.Stream`.
+    :type allow_shift: bool
+    :param allow_shift: Whether to allow the channels to shift.
+    :type shift_len: float
+    :param shift_len: Seconds to shift, only used if `allow_shift=True`
+    :type cores: int
+    :param cores: Number of threads to use.
+    :type out: numpy.ndarray
+    :param out: C-contiguous float64 square array to write the matrix into.
+    :type tile: int
+    :param tile: Number of streams per block of pairs.
+    """
+    c_long = np.dtype(ctypes.c_long)
+    keys = {}
+    sampling_rates = {}
+    traces, row_keys, stream_rows = [], [], [0]
+    key_rows = []
+    for st in stream_list:
+        first_rows = {}
+        for tr in st:
+            key = keys.setdefault(
+                (tr.stats.station, tr.stats.channel), len(keys))
+            if sampling_rates.setdefault(
+                    key, tr.stats.sampling_rate) != tr.stats.sampling_rate:
+                warnings.warn('Sampling rates do not match for: %s.%s' % (
+                    tr.stats.station, tr.stats.channel))
+            first_rows.setdefault(key, len(traces))
+            traces.append(tr)
+            row_keys.append(key)
+        stream_rows.append(len(traces))
+        key_rows.append(first_rows)
+    n_rows = len(traces)
+    row_lens = np.array([len(tr.data) for tr in traces], dtype=c_long)
+    max_len = int(row_lens.max()) if n_rows else 0
+    data = np.zeros((n_rows, max(max_len, 1)), dtype=np.float32)
+    for row, tr in zip(data, traces):
+        row[0:len(tr.data)] = tr.data
+    row_shifts = np.array(
+        [int(shift_len * tr.stats.sampling_rate) if allow_shift else 0
+         for tr in traces], dtype=c_long)
+    key_table = np.full((len(stream_list), max(len(keys), 1)), -1,
+                        dtype=c_long)
+    for i, first_rows in enumerate(key_rows):
+        for key, row in first_rows.items():
+            key_table[i, key] = row
+    fft_len = 2
+    if allow_shift:
+        fft_len = next_fast_len(
+            max(max_len + (int(row_shifts.max()) if n_rows else 0), 2))
+        # Real transforms need an even length
+        while fft_len % 2:
+            fft_len = next_fast_len(fft_len + 1)
+
+    utilslib = _load_cdll('libutils')
+    long_arr = np.ctypeslib.ndpointer(
+        dtype=c_long, flags=native_str('C_CONTIGUOUS'))
+    utilslib.distance_matrix_fftw.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags=native_str('C_CONTIGUOUS')),
+        long_arr, ctypes.c_long, long_arr, long_arr, long_arr,
+        ctypes.c_long, ctypes.c_long, ctypes.c_int, long_arr, ctypes.c_long,
+        ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int]
+    utilslib.distance_matrix_fftw.restype = ctypes.c_int
+    ret = utilslib.distance_matrix_fftw(
+        data, row_lens, data.shape[1], np.array(row_keys, dtype=c_long),
+        row_shifts, np.array(stream_rows, dtype=c_long), len(stream_list),
+        key_table.shape[1], int(allow_shift), key_table, fft_len, tile, out,
+        cores)
+    if ret != 0:
+        raise MemoryError("Could not allocate memory for distance matrix")
+    return out
+
+
 def cluster(template_list, show=True, corr_thresh=0.3, allow_shift=False,
-            shift_len=0, save_corrmat=False, cores='all', debug=1):
+            shift_len=0, save_corrmat=False, cores='all', debug=1,
+            native=False):
     """
     Cluster template waveforms based on average correlations.
 
@@ -190,6 +313,10 @@ def cluster(template_list, show=True, corr_thresh=0.3, allow_shift=False,
     :param debug:
         Level of debugging from 1-5, higher is more output,
         currently only level 1 implemented.
+    :type native: bool
+    :param native:
+        Compute the distance matrix in one threaded compiled call, see
+        :func:`eqcorrscan.utils.clustering.distance_matrix`.
 
     :returns:
         List of groups. Each group is a list of
@@ -205,7 +332,7 @@ def cluster(template_list, show=True, corr_thresh=0.3, allow_shift=False,
     if debug >= 1:
         print('Computing the distance matrix using %i cores' % num_cores)
     dist_mat = distance_matrix(stream_list, allow_shift, shift_len,
-                               cores=num_cores)
+                               cores=num_cores, native=native)
     if save_corrmat:
         np.save('dist_mat.npy', dist_mat)
         if debug >= 1:
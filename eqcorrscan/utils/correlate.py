@@ -24,11 +24,16 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import atexit
 import contextlib
 import copy
 import ctypes
+import hashlib
+import json
 import os
+import threading
 import warnings
+from collections import OrderedDict
 from multiprocessing import Pool as ProcessPool, cpu_count
 from multiprocessing.pool import ThreadPool
 
@@ -36,6 +41,7 @@ import numpy as np
 from future.utils import native_str
 
 from eqcorrscan.utils.libnames import _load_cdll
+from eqcorrscan.utils.timer import Timer
 
 # This is for building docs on readthedocs, which has an old version of
 # scipy - without this, this module cannot be imported, which breaks the docs
@@ -57,6 +63,31 @@ XCORR_STREAM_METHODS = ('multithread', 'multiprocess', 'concurrent',
 # these implement the array interface
 XCOR_ARRAY_METHODS = ('array_xcorr')
 
+# cache of prepared template spectra for the fftw routines, keyed by the
+# fingerprint of the templates and the fft length.
+PREPARED_TEMPLATES = OrderedDict()
+PREPARED_TEMPLATES_SIZE = 2  # Maximum number of template sets to keep
+
+# cache of workspaces for the fftw routines, keyed by shape and threads
+WORKSPACES = OrderedDict()
+WORKSPACES_SIZE = 2  # Maximum number of workspaces to keep
+
+# block lengths for overlap-save correlation with block_len='auto'
+BLOCK_LEN_FACTOR = 8  # Multiple of template length
+MIN_BLOCK_LEN = 4096
+
+# row orders of the batched fftw engine, see fftw_multi_normxcorr
+BATCH_LAYOUTS = {'channel-major': 0, 'template-major': 1}
+
+# kernels available to fftw_multi_normxcorr
+MULTI_KERNELS = ('fftw', 'time')
+
+# stages timed by the fftw C-code, in the order of CorrelationStats.stage_ns
+CORRELATION_STAGES = (
+    'setup', 'plan', 'template_fft', 'image_fft', 'multiply', 'inverse_fft',
+    'statistics', 'normalise')
+STATS_MAX_THREADS = 64  # Outer threads with their own busy time
+
 
 class CorrelationError(Exception):
     """ Error handling for correlation functions. """
@@ -146,6 +177,157 @@ class _Context:
 set_xcorr = _Context(XCOR_FUNCS, 'default')
 
 
+# ------------------ FFTW planning control
+
+FFTW_PLANNING_EFFORTS = {'estimate': 0, 'measure': 1, 'patient': 2}
+_FFTW_WISDOM = {'file': None, 'registered': False}
+
+
+def set_fftw_planning(effort='estimate', wisdom_file=None):
+    """
+    Set how much effort FFTW spends planning transforms for the fftw routines.
+
+    Plans are cached for the life of the process and re-used whenever a
+    transform of the same size, number of templates and threads is needed,
+    so the planning cost is only paid once per shape.  Measured plans can be
+    markedly faster for the long transforms used for day-long data, but take
+    a while to plan - store the accumulated wisdom in a file to re-use it
+    between processes.
+
+    :type effort: str
+    :param effort:
+        One of 'estimate' (the default, no measurement), 'measure' or
+        'patient'.
+    :type wisdom_file: str
+    :param wisdom_file:
+        Path to an FFTW wisdom file.  If the file exists it is loaded now,
+        and wisdom will be written back to it when Python exits.
+
+    .. Note::
+        Measured plans can choose different algorithms to estimated plans,
+        so correlations may differ at the level of floating-point rounding.
+    """
+    if effort not in FFTW_PLANNING_EFFORTS.keys():
+        raise ValueError("effort must be one of {0}".format(
+            list(FFTW_PLANNING_EFFORTS.keys())))
+    utilslib = _load_cdll('libutils')
+    utilslib.set_fftw_planning.argtypes = [ctypes.c_int]
+    utilslib.set_fftw_planning.restype = None
+    utilslib.set_fftw_planning(FFTW_PLANNING_EFFORTS[effort])
+    if wisdom_file is not None:
+        if os.path.isfile(wisdom_file):
+            load_fftw_wisdom(wisdom_file)
+        _FFTW_WISDOM['file'] = wisdom_file
+        if not _FFTW_WISDOM['registered']:
+            atexit.register(_save_fftw_wisdom_at_exit)
+            _FFTW_WISDOM['registered'] = True
+
+
+def load_fftw_wisdom(filename):
+    """
+    Load FFTW wisdom for single-precision transforms from a file.
+
+    :type filename: str
+    :param filename: Wisdom file to read.
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.import_fftw_wisdom.argtypes = [ctypes.c_char_p]
+    utilslib.import_fftw_wisdom.restype = ctypes.c_int
+    ret = utilslib.import_fftw_wisdom(filename.encode('utf-8'))
+    if ret != 0:
+        raise IOError("Could not read FFTW wisdom from {0}".format(filename))
+
+
+def save_fftw_wisdom(filename=None):
+    """
+    Save the FFTW wisdom accumulated by this process to a file.
+
+    :type filename: str
+    :param filename:
+        File to write to, defaults to the file given to
+        :func:`set_fftw_planning`.
+    """
+    filename = filename or _FFTW_WISDOM['file']
+    if filename is None:
+        raise IOError("No wisdom file given")
+    utilslib = _load_cdll('libutils')
+    utilslib.export_fftw_wisdom.argtypes = [ctypes.c_char_p]
+    utilslib.export_fftw_wisdom.restype = ctypes.c_int
+    ret = utilslib.export_fftw_wisdom(filename.encode('utf-8'))
+    if ret != 0:
+        raise IOError("Could not write FFTW wisdom to {0}".format(filename))
+
+
+def _save_fftw_wisdom_at_exit():
+    if _FFTW_WISDOM['file'] is None:
+        return
+    try:
+        save_fftw_wisdom()
+    except IOError as e:  # pragma: no cover
+        warnings.warn(str(e))
+
+
+def clear_fftw_plans():
+    """
+    Destroy all cached FFTW plans - accumulated wisdom is kept.
+
+    Plans in use by running correlations are destroyed when they finish.
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.clear_fftw_plan_cache.argtypes = []
+    utilslib.clear_fftw_plan_cache.restype = None
+    utilslib.clear_fftw_plan_cache()
+
+
+# ------------------ Vector instruction set control
+
+SIMD_LEVELS = ['scalar', 'sse2', 'avx2', 'avx512']
+
+
+def get_simd_level():
+    """
+    Get the vector instruction set used by the fftw routines.
+
+    :rtype: str
+    :return: One of :data:`SIMD_LEVELS`
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.get_simd_level.argtypes = []
+    utilslib.get_simd_level.restype = ctypes.c_int
+    return SIMD_LEVELS[utilslib.get_simd_level()]
+
+
+def set_simd_level(level='auto'):
+    """
+    Set the vector instruction set used by the fftw routines.
+
+    The spectral multiplication and normalisation in the fftw routines are
+    vectorised, the best instruction set supported by the CPU is used by
+    default.  All levels give the same correlations, lower levels are
+    mostly useful for testing and benchmarking.
+
+    :type level: str
+    :param level:
+        One of :data:`SIMD_LEVELS`, or 'auto' to use the best available.
+        Levels that the CPU (or the build) do not support fall back to the
+        best available.
+
+    :rtype: str
+    :return: The level now in use.
+    """
+    if level == 'auto':
+        level_int = -1
+    elif level in SIMD_LEVELS:
+        level_int = SIMD_LEVELS.index(level)
+    else:
+        raise ValueError("level must be 'auto' or one of {0}".format(
+            SIMD_LEVELS))
+    utilslib = _load_cdll('libutils')
+    utilslib.set_simd_level.argtypes = [ctypes.c_int]
+    utilslib.set_simd_level.restype = ctypes.c_int
+    return SIMD_LEVELS[utilslib.set_simd_level(level_int)]
+
+
 # ---------------------- generic concurrency functions
 
 @contextlib.contextmanager
@@ -404,6 +586,10 @@ def time_multi_normxcorr(templates, stream, pads, threaded=False, *args,
     """
     Compute cross-correlations in the time-domain using C routine.
 
+    Window statistics are computed with running sums, and several templates
+    are correlated on each pass through the data, using vector instructions
+    (see :func:`eqcorrscan.utils.correlate.set_simd_level`).
+
     :param templates: 2D Array of templates
     :type templates: np.ndarray
     :param stream: 1D array of continuous data
@@ -417,51 +603,76 @@ def time_multi_normxcorr(templates, stream, pads, threaded=False, *args,
     :return: np.ndarray channels used
     """
     used_chans = ~np.isnan(templates).any(axis=1)
-
-    utilslib = _load_cdll('libutils')
-
-    argtypes = [
-        np.ctypeslib.ndpointer(dtype=np.float32, ndim=1,
-                               flags=native_str('C_CONTIGUOUS')),
-        ctypes.c_int, ctypes.c_int,
-        np.ctypeslib.ndpointer(dtype=np.float32, ndim=1,
-                               flags=native_str('C_CONTIGUOUS')),
-        ctypes.c_int,
-        np.ctypeslib.ndpointer(dtype=np.float32, ndim=1,
-                               flags=native_str('C_CONTIGUOUS'))]
-    restype = ctypes.c_int
-    if threaded:
-        func = utilslib.multi_normxcorr_time_threaded
-        argtypes.append(ctypes.c_int)
-    else:
-        func = utilslib.multi_normxcorr_time
-    func.argtypes = argtypes
-    func.restype = restype
-    # Need to de-mean everything
-    templates_means = templates.mean(axis=1).astype(np.float32)[:, np.newaxis]
-    stream_mean = stream.mean().astype(np.float32)
-    templates = templates.astype(np.float32) - templates_means
-    stream = stream.astype(np.float32) - stream_mean
     template_len = templates.shape[1]
-    n_templates = templates.shape[0]
     image_len = stream.shape[0]
-    ccc = np.ascontiguousarray(
-        np.empty((image_len - template_len + 1) * n_templates), np.float32)
-    t_array = np.ascontiguousarray(templates.flatten(), np.float32)
-    time_args = [t_array, template_len, n_templates,
-                 np.ascontiguousarray(stream, np.float32), image_len, ccc]
     if threaded:
-        time_args.append(kwargs.get('cores', cpu_count()))
-    func(*time_args)
-    ccc[np.isnan(ccc)] = 0.0
-    ccc = ccc.reshape((n_templates, image_len - template_len + 1))
-    for i in range(len(pads)):
-        ccc[i] = np.append(ccc[i], np.zeros(pads[i]))[pads[i]:]
-    templates += templates_means
-    stream += stream_mean
+        cores = kwargs.get('cores', cpu_count())
+    else:
+        cores = 1
+    ccc = np.zeros((templates.shape[0], image_len - template_len + 1),
+                   np.float32)
+    variance_warnings = np.zeros(1, dtype=np.intc)
+    # Check that stream is non-zero and above variance threshold
+    if not np.all(stream == 0) and np.var(stream) < 1e-8:
+        # Apply gain
+        stream = stream * 1e8
+        warnings.warn("Low variance found for, applying gain "
+                      "to stabilise correlations")
+    ret = _time_multi_normxcorr_c(
+        templates=np.ascontiguousarray(
+            _normalise_templates(templates), dtype=np.float32),
+        stream=np.ascontiguousarray(stream, dtype=np.float32), ccc=ccc,
+        used_chans=np.ascontiguousarray(used_chans, dtype=np.intc),
+        pads=np.ascontiguousarray(pads, dtype=np.intc), cores=cores,
+        variance_warnings=variance_warnings)
+    _check_multi_fftw_return(ret, ccc, variance_warnings, template_len,
+                             ['stream'])
     return ccc, used_chans
 
 
+def _time_multi_normxcorr_c(templates, stream, ccc, used_chans, pads, cores,
+                            variance_warnings, image_len=None,
+                            image_offsets=None):
+    """
+    Call the tiled multi-channel time-domain C routine.
+
+    :param templates:
+        3D array (channels, templates, samples) of normalised templates
+        (see `_normalise_templates`), or 2D for one channel.
+    :param stream: 2D array (channels, samples) or 1D for one channel.
+    :param ccc: Zeroed 2D array (templates, correlations) to stack into.
+    :param used_chans: Array of used flags, shaped as templates[..., 0].
+    :param pads: Array of pads, shaped as templates[..., 0].
+    :param cores: Number of threads to use.
+    :param variance_warnings: Array of low-variance counts, one per channel.
+    :param image_len: Length of data for each channel, if not the rows.
+    :param image_offsets:
+        Index of the start of each channel in `stream`, or None if the
+        channels are the rows (see `_packed_rows`).
+
+    :return: Return code of the C routine.
+    """
+    utilslib = _load_cdll('libutils')
+    float_arr = np.ctypeslib.ndpointer(
+        dtype=np.float32, flags=native_str('C_CONTIGUOUS'))
+    int_arr = np.ctypeslib.ndpointer(
+        dtype=np.intc, flags=native_str('C_CONTIGUOUS'))
+    utilslib.multi_normxcorr_time_tiled.argtypes = [
+        float_arr, ctypes.c_long, ctypes.c_long, ctypes.c_long, float_arr,
+        ctypes.c_long, ctypes.POINTER(ctypes.c_longlong), float_arr, int_arr,
+        int_arr, ctypes.c_int, int_arr]
+    utilslib.multi_normxcorr_time_tiled.restype = ctypes.c_int
+    n_templates, template_len = templates.shape[-2:]
+    if image_offsets is not None:
+        n_channels = len(image_offsets)
+    else:
+        n_channels = 1 if stream.ndim == 1 else stream.shape[0]
+    return utilslib.multi_normxcorr_time_tiled(
+        templates, n_templates, template_len, n_channels, stream,
+        image_len or stream.shape[-1], _offsets_pointer(image_offsets), ccc,
+        used_chans, pads, cores, variance_warnings)
+
+
 @register_array_xcorr('fftw', is_default=True)
 def fftw_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
     """
@@ -539,8 +750,8 @@ def fftw_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
 
     # Check that stream is non-zero and above variance threshold
     if not np.all(stream == 0) and np.var(stream) < 1e-8:
-        # Apply gain
-        stream *= 1e8
+        # Apply gain to a copy, the data may be shared with the caller
+        stream = stream * 1e8
         warnings.warn("Low variance found for, applying gain "
                       "to stabilise correlations")
     ret = func(
@@ -573,7 +784,7 @@ def fftw_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
 @time_multi_normxcorr.register('concurrent')
 def _time_threaded_normxcorr(templates, stream, *args, **kwargs):
     """
-    Use the threaded time-domain routine for concurrency
+    Use the threaded multi-channel time-domain routine for concurrency
 
     :type templates: list
     :param templates:
@@ -595,23 +806,8 @@ def _time_threaded_normxcorr(templates, stream, *args, **kwargs):
         list of list of tuples of station, channel for all cross-correlations.
     :rtype: list
     """
-    no_chans = np.zeros(len(templates))
-    chans = [[] for _ in range(len(templates))]
-    array_dict_tuple = _get_array_dicts(templates, stream)
-    stream_dict, template_dict, pad_dict, seed_ids = array_dict_tuple
-    cccsums = np.zeros([len(templates),
-                        len(stream[0]) - len(templates[0][0]) + 1])
-    for seed_id in seed_ids:
-        tr_cc, tr_chans = time_multi_normxcorr(
-            template_dict[seed_id], stream_dict[seed_id], pad_dict[seed_id],
-            True)
-        cccsums = np.sum([cccsums, tr_cc], axis=0)
-        no_chans += tr_chans.astype(np.int)
-        for chan, state in zip(chans, tr_chans):
-            if state:
-                chan.append((seed_id.split('.')[1],
-                             seed_id.split('.')[-1].split('_')[0]))
-    return cccsums, no_chans, chans
+    kwargs['kernel'] = 'time'
+    return _fftw_stream_xcorr(templates, stream, *args, **kwargs)
 
 
 @fftw_normxcorr.register('stream_xcorr')
@@ -657,13 +853,20 @@ def _fftw_stream_xcorr(templates, stream, *args, **kwargs):
         num_cores_inner = 1
 
     chans = [[] for _i in range(len(templates))]
-    array_dict_tuple = _get_array_dicts(templates, stream)
+    # fftw_multi_normxcorr does not change the data, so packed streams can be
+    # correlated where they are
+    array_dict_tuple = _get_array_dicts(templates, stream, copy_streams=False)
     stream_dict, template_dict, pad_dict, seed_ids = array_dict_tuple
     assert set(seed_ids)
     cccsums, tr_chans = fftw_multi_normxcorr(
         template_array=template_dict, stream_array=stream_dict,
         pad_array=pad_dict, seed_ids=seed_ids, cores_inner=num_cores_inner,
-        cores_outer=num_cores_outer)
+        cores_outer=num_cores_outer,
+        cache_templates=kwargs.get('cache_templates', False),
+        block_len=kwargs.get('block_len'),
+        outer_split=kwargs.get('outer_split', 'auto'),
+        batch_layout=kwargs.get('batch_layout'),
+        kernel=kwargs.get('kernel', 'fftw'), stats=kwargs.get('stats'))
     no_chans = np.sum(np.array(tr_chans).astype(np.int), axis=0)
     for seed_id, tr_chan in zip(seed_ids, tr_chans):
         for chan, state in zip(chans, tr_chan):
@@ -674,7 +877,9 @@ def _fftw_stream_xcorr(templates, stream, *args, **kwargs):
 
 
 def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
-                         cores_inner, cores_outer):
+                         cores_inner, cores_outer, cache_templates=False,
+                         block_len=None, outer_split='auto',
+                         batch_layout=None, kernel='fftw', stats=None):
     """
     Use a C loop rather than a Python loop - in some cases this will be fast.
 
@@ -686,6 +891,54 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
     :param pad_array:
     :type seed_ids: list
     :param seed_ids:
+    :type cache_templates: bool
+    :param cache_templates:
+        Whether to keep the normalised template spectra for re-use in later
+        calls with the same templates and fft-length (e.g. successive chunks
+        of continuous data). See
+        :class:`eqcorrscan.utils.correlate.PreparedTemplates`.
+    :type block_len: int or str
+    :param block_len:
+        Length of transform to use for overlap-save correlation of the data
+        in blocks, or 'auto' to select a block length from the template
+        length.  If None (default) the whole of the data are transformed at
+        once.  See :func:`eqcorrscan.utils.correlate.fftw_block_len`.
+    :type outer_split: str
+    :param outer_split:
+        How to share work between the `cores_outer` threads: 'channels' gives
+        each thread whole channels, with all threads stacking into the same
+        correlation sums; 'templates' gives each thread a slice of the
+        templates to correlate with every channel, so that threads never
+        write to the same sums, at the cost of transforming the data once
+        per thread.  'auto' (default) uses 'templates' when there are at
+        least as many templates as outer threads.  Template-splitting is not
+        available with `cache_templates`.
+    :type batch_layout: str
+    :param batch_layout:
+        Use the batched engine, which transforms all templates of all
+        channels in one call, the data for all channels in one call, and
+        inverse transforms all correlations in one call, using all
+        `cores_inner * cores_outer` threads.  The transforms are ordered
+        either 'channel-major' (the templates for each channel together) or
+        'template-major' (the channels for each template together). Memory
+        scales with the number of templates times the number of channels
+        times the transform length, so `block_len` defaults to 'auto' for
+        the batched engine. If None (default) the channels are correlated
+        one at a time.  Not used with `cache_templates`.
+    :type kernel: str
+    :param kernel:
+        'fftw' (default) to correlate in the frequency domain, or 'time' to
+        correlate in the time domain, which is faster for short templates.
+        The time-domain kernel uses `cores_inner * cores_outer` threads over
+        blocks of the data, and does not use `cache_templates`, `block_len`,
+        `outer_split` or `batch_layout`.
+    :type stats: :class:`eqcorrscan.utils.correlate.CorrelationStats`
+    :param stats:
+        Counters to add the time spent in each stage of the correlation, the
+        busy time of each outer thread, memory allocated and the number of
+        samples that could not be normalised to. Only the default engine
+        (`kernel='fftw'` without `cache_templates` or `batch_layout`) is
+        instrumented.
 
     rtype: np.ndarray, list
     :return: 3D Array of cross-correlations and list of used channels.
@@ -698,7 +951,7 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
         ctypes.c_long, ctypes.c_long, ctypes.c_long,
         np.ctypeslib.ndpointer(dtype=np.float32,
                                flags=native_str('C_CONTIGUOUS')),
-        ctypes.c_long,
+        ctypes.c_long, ctypes.POINTER(ctypes.c_longlong),
         np.ctypeslib.ndpointer(dtype=np.float32,
                                flags=native_str('C_CONTIGUOUS')),
         ctypes.c_long,
@@ -708,8 +961,15 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
                                flags=native_str('C_CONTIGUOUS')),
         ctypes.c_int, ctypes.c_int,
         np.ctypeslib.ndpointer(dtype=np.intc,
-                               flags=native_str('C_CONTIGUOUS'))]
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int, ctypes.c_void_p,
+        ctypes.POINTER(CorrelationStats)]
     utilslib.multi_normxcorr_fftw.restype = ctypes.c_int
+    utilslib.multi_normxcorr_fftw_batched.argtypes = (
+        utilslib.multi_normxcorr_fftw.argtypes[0:11] +
+        [ctypes.c_int, np.ctypeslib.ndpointer(
+            dtype=np.intc, flags=native_str('C_CONTIGUOUS')), ctypes.c_int])
+    utilslib.multi_normxcorr_fftw_batched.restype = ctypes.c_int
     '''
     Arguments are:
         templates (stacked [ch_1-t_1, ch_1-t_2, ..., ch_2-t_1, ch_2-t_2, ...])
@@ -718,53 +978,170 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
         number of channels
         image (stacked [ch_1, ch_2, ..., ch_n])
         image length
+        image offsets (start of each channel in image, or NULL if stacked)
         cross-correlations (stacked as per image)
         fft-length
         used channels (stacked as per templates)
         pad array (stacked as per templates)
+        outer threads
+        inner threads
+        variance warnings (one per channel)
+        split templates rather than channels between outer threads
+        workspace (or NULL to allocate for this call)
+        stats (or NULL to not collect counters)
+    The batched engine takes the same, but with a single number of threads
+    and the layout in place of the split and workspace.
     '''
+    if outer_split not in ('auto', 'channels', 'templates'):
+        raise ValueError("outer_split must be one of 'auto', 'channels' or "
+                         "'templates', not {0}".format(outer_split))
+    if batch_layout is not None and batch_layout not in BATCH_LAYOUTS:
+        raise ValueError("batch_layout must be None or one of {0}".format(
+            list(BATCH_LAYOUTS.keys())))
+    if kernel not in MULTI_KERNELS:
+        raise ValueError("kernel must be one of {0}, not {1}".format(
+            MULTI_KERNELS, kernel))
+    if kernel == 'time':
+        cache_templates, batch_layout, block_len = False, None, None
+    if stats is not None:
+        _check_stats_layout(utilslib)
+    if batch_layout is not None and cache_templates:
+        batch_layout = None
+    if batch_layout is not None and block_len is None:
+        block_len = 'auto'
 
     # pre processing
-    used_chans = []
     template_len = template_array[seed_ids[0]].shape[1]
-    for seed_id in seed_ids:
-        used_chans.append(~np.isnan(template_array[seed_id]).any(axis=1))
-        template_array[seed_id] = (
-            (template_array[seed_id] -
-             template_array[seed_id].mean(axis=-1, keepdims=True)) / (
-                template_array[seed_id].std(axis=-1, keepdims=True) *
-                template_len))
-        template_array[seed_id] = np.nan_to_num(template_array[seed_id])
     n_channels = len(seed_ids)
     n_templates = template_array[seed_ids[0]].shape[0]
     image_len = stream_array[seed_ids[0]].shape[0]
-    fft_len = next_fast_len(template_len + image_len - 1)
-    template_array = np.ascontiguousarray([template_array[x]
-                                           for x in seed_ids],
-                                          dtype=np.float32)
-    for x in seed_ids:
-        # Check that stream is non-zero and above variance threshold
-        if not np.all(stream_array[x] == 0) and np.var(stream_array[x]) < 1e-8:
-            # Apply gain
-            stream_array *= 1e8
-            warnings.warn("Low variance found for {0}, applying gain "
-                          "to stabilise correlations".format(x))
-    stream_array = np.ascontiguousarray([stream_array[x] for x in seed_ids],
-                                        dtype=np.float32)
-    cccs = np.zeros((n_templates, image_len - template_len + 1),
-                    np.float32)
-    used_chans_np = np.ascontiguousarray(used_chans, dtype=np.intc)
-    pad_array_np = np.ascontiguousarray([pad_array[seed_id]
-                                         for seed_id in seed_ids],
-                                        dtype=np.intc)
-    variance_warnings = np.ascontiguousarray(
-        np.zeros(n_channels), dtype=np.intc)
-
-    # call C function
-    ret = utilslib.multi_normxcorr_fftw(
-        template_array, n_templates, template_len, n_channels, stream_array,
-        image_len, cccs, fft_len, used_chans_np, pad_array_np, cores_outer,
-        cores_inner, variance_warnings)
+    fft_len = fftw_block_len(template_len, image_len, block_len)
+    if outer_split == 'auto':
+        split_templates = n_templates >= cores_outer > 1
+    else:
+        split_templates = outer_split == 'templates'
+    prepared = None
+    if cache_templates:
+        fingerprint = _template_fingerprint(template_array, seed_ids, fft_len)
+        prepared = PREPARED_TEMPLATES.get(fingerprint)
+        if prepared is None:
+            prepared = PreparedTemplates(
+                template_array=template_array, seed_ids=seed_ids,
+                fft_len=fft_len, cores=cores_inner, fingerprint=fingerprint)
+            PREPARED_TEMPLATES[fingerprint] = prepared
+            while len(PREPARED_TEMPLATES) > PREPARED_TEMPLATES_SIZE:
+                PREPARED_TEMPLATES.popitem(last=False)[1].free()
+        else:
+            # Mark as most recently used
+            PREPARED_TEMPLATES.pop(fingerprint)
+            PREPARED_TEMPLATES[fingerprint] = prepared
+        used_chans = prepared.used_chans
+        split_templates = False
+    workspace = None
+    if batch_layout is None and kernel == 'fftw':
+        workspace = _get_workspace(
+            n_templates=n_templates, template_len=template_len,
+            n_channels=n_channels, fft_len=fft_len, cores_outer=cores_outer,
+            split_templates=split_templates,
+            with_templates=prepared is None)
+        if not workspace.lock.acquire(False):
+            # In use by another thread
+            workspace = None
+    try:
+        if prepared is None:
+            used_chans = []
+            for seed_id in seed_ids:
+                used_chans.append(
+                    ~np.isnan(template_array[seed_id]).any(axis=1))
+            if workspace is None:
+                template_array = np.ascontiguousarray(
+                    [_normalise_templates(template_array[x])
+                     for x in seed_ids], dtype=np.float32)
+            else:
+                norm = workspace.buffer(
+                    'templates', (n_channels, n_templates, template_len))
+                for i, x in enumerate(seed_ids):
+                    norm[i] = _normalise_templates(template_array[x])
+                template_array = norm
+        gains = set()
+        for x in seed_ids:
+            # Check that stream is non-zero and above variance threshold
+            if not np.all(stream_array[x] == 0) and \
+                    np.var(stream_array[x]) < 1e-8:
+                # Apply gain to a copy, not to the data passed in
+                gains.add(x)
+                warnings.warn("Low variance found for {0}, applying gain "
+                              "to stabilise correlations".format(x))
+        packed = None
+        if not gains:
+            # Correlate rows of a packed stream where they are
+            packed = _packed_rows([stream_array[x] for x in seed_ids],
+                                  image_len)
+        if packed is not None:
+            stream_array, image_offsets = packed
+        else:
+            image_offsets = None
+            if workspace is None:
+                stream = np.ascontiguousarray(
+                    [stream_array[x] for x in seed_ids], dtype=np.float32)
+            else:
+                stream = workspace.buffer('stream', (n_channels, image_len))
+                for i, x in enumerate(seed_ids):
+                    stream[i] = stream_array[x]
+            for i, x in enumerate(seed_ids):
+                if x in gains:
+                    stream[i] *= 1e8
+            stream_array = stream
+        cccs = np.zeros((n_templates, image_len - template_len + 1),
+                        np.float32)
+        used_chans_np = np.ascontiguousarray(used_chans, dtype=np.intc)
+        pad_array_np = np.ascontiguousarray([pad_array[seed_id]
+                                             for seed_id in seed_ids],
+                                            dtype=np.intc)
+        variance_warnings = np.ascontiguousarray(
+            np.zeros(n_channels), dtype=np.intc)
+        handle = None if workspace is None else workspace._handle
+
+        # call C function
+        if prepared is not None:
+            ret = prepared._correlate(
+                stream_array, image_len, cccs, used_chans_np, pad_array_np,
+                cores_outer, cores_inner, variance_warnings, handle,
+                image_offsets=image_offsets)
+        elif kernel == 'time':
+            ret = _time_multi_normxcorr_c(
+                templates=template_array, stream=stream_array, ccc=cccs,
+                used_chans=used_chans_np, pads=pad_array_np,
+                cores=cores_outer * cores_inner,
+                variance_warnings=variance_warnings, image_len=image_len,
+                image_offsets=image_offsets)
+        elif batch_layout is not None:
+            ret = utilslib.multi_normxcorr_fftw_batched(
+                template_array, n_templates, template_len, n_channels,
+                stream_array, image_len, _offsets_pointer(image_offsets),
+                cccs, fft_len, used_chans_np, pad_array_np,
+                cores_outer * cores_inner, variance_warnings,
+                BATCH_LAYOUTS[batch_layout])
+        else:
+            ret = utilslib.multi_normxcorr_fftw(
+                template_array, n_templates, template_len, n_channels,
+                stream_array, image_len, _offsets_pointer(image_offsets),
+                cccs, fft_len, used_chans_np,
+                pad_array_np, cores_outer, cores_inner, variance_warnings,
+                int(split_templates), handle,
+                None if stats is None else ctypes.byref(stats))
+    finally:
+        if workspace is not None:
+            workspace.lock.release()
+    _check_multi_fftw_return(ret, cccs, variance_warnings, template_len,
+                             seed_ids)
+
+    return cccs, used_chans
+
+
+def _check_multi_fftw_return(ret, cccs, variance_warnings, template_len,
+                             seed_ids):
+    """ Raise or warn for the return of the multi-channel fftw C-code. """
     if ret < 0:
         raise MemoryError("Memory allocation failed in correlation C-code")
     elif ret not in [0, 999]:
@@ -783,7 +1160,959 @@ def fftw_multi_normxcorr(template_array, stream_array, pad_array, seed_ids,
                           " check result.".format(variance_warning,
                                                   seed_ids[i]))
 
-    return cccs, used_chans
+
+def fftw_block_len(template_len, image_len, block_len=None):
+    """
+    Get the length of transform to use for the fftw routines.
+
+    With `block_len=None` the data are transformed in one go, which for long
+    data (e.g. day-long, 100 Hz data) means multi-million point transforms
+    with every thread holding `n_templates` of them.  Giving a `block_len`
+    correlates the data in overlapping blocks of that length instead
+    (overlap-save), so memory depends on the block length rather than the
+    length of the data.  The results are the same to within floating-point
+    rounding.
+
+    :type template_len: int
+    :param template_len: Length of templates in samples.
+    :type image_len: int
+    :param image_len:
+        Length of continuous data in samples, or None if unknown (e.g. for
+        streaming data), in which case `block_len` must be given.
+    :type block_len: int or str
+    :param block_len:
+        Requested length of transform, or 'auto' to use
+        `BLOCK_LEN_FACTOR` times the template length (at least
+        `MIN_BLOCK_LEN`).  Blocks are always at least twice the template
+        length and are rounded up to a fast transform length.
+
+    :rtype: int
+    :return: Length of transform.
+    """
+    if image_len is None:
+        if block_len is None:
+            raise ValueError("block_len must be given if image_len is not")
+        fft_len = None
+    else:
+        fft_len = next_fast_len(template_len + image_len - 1)
+    if block_len is None:
+        return fft_len
+    if block_len == 'auto':
+        block_len = max(BLOCK_LEN_FACTOR * template_len, MIN_BLOCK_LEN)
+    elif not isinstance(block_len, (int, np.integer)):
+        raise ValueError("block_len must be an int, 'auto' or None")
+    block_len = next_fast_len(max(int(block_len), 2 * template_len))
+    if fft_len is None:
+        return block_len
+    return min(block_len, fft_len)
+
+
+def _normalise_templates(templates):
+    """ Normalise a 2D array of templates for the fftw routines. """
+    template_len = templates.shape[1]
+    norm = ((templates - templates.mean(axis=-1, keepdims=True)) / (
+        templates.std(axis=-1, keepdims=True) * template_len))
+    return np.nan_to_num(norm)
+
+
+def _template_fingerprint(template_array, seed_ids, fft_len):
+    """ Hash the raw templates, channel order and fft length. """
+    fingerprint = hashlib.sha1()
+    fingerprint.update(str(fft_len).encode('utf-8'))
+    for seed_id in seed_ids:
+        templates = np.ascontiguousarray(template_array[seed_id])
+        fingerprint.update(str(seed_id).encode('utf-8'))
+        fingerprint.update(str(templates.shape).encode('utf-8'))
+        fingerprint.update(templates.view(np.uint8))
+    return fingerprint.hexdigest()
+
+
+def clear_prepared_templates():
+    """ Free all cached template spectra. """
+    while len(PREPARED_TEMPLATES) > 0:
+        PREPARED_TEMPLATES.popitem()[1].free()
+
+
+def _get_workspace(**kwargs):
+    """ Get a workspace from the cache, creating it if needed. """
+    key = tuple(sorted(kwargs.items()))
+    workspace = WORKSPACES.pop(key, None)
+    if workspace is None:
+        workspace = CorrelatorWorkspace(**kwargs)
+    # Mark as most recently used
+    WORKSPACES[key] = workspace
+    while len(WORKSPACES) > WORKSPACES_SIZE:
+        WORKSPACES.popitem(last=False)[1].free()
+    return workspace
+
+
+def clear_workspaces():
+    """ Free all cached correlator workspaces. """
+    while len(WORKSPACES) > 0:
+        WORKSPACES.popitem()[1].free()
+
+
+def get_workspace_peak_memory(reset=False):
+    """
+    Get the most memory held by correlator workspaces at once.
+
+    Only the C memory is counted, see
+    :attr:`eqcorrscan.utils.correlate.CorrelatorWorkspace.nbytes` for the
+    memory of individual workspaces including their data buffers.
+
+    :type reset: bool
+    :param reset:
+        Reset the peak to the memory currently held, e.g. to measure the
+        peak of the next detection run.
+
+    :rtype: int
+    :return: Peak memory in bytes.
+    """
+    utilslib = _load_cdll('libutils')
+    utilslib.get_workspace_peak_memory.argtypes = [ctypes.c_int]
+    utilslib.get_workspace_peak_memory.restype = ctypes.c_longlong
+    return int(utilslib.get_workspace_peak_memory(int(reset)))
+
+
+class CorrelatorWorkspace(object):
+    """
+    Buffers for the fftw routines, held for re-use between calls.
+
+    Every call of the fftw routines needs transform buffers and running
+    statistics for each outer thread, and contiguous copies of the templates
+    and data.  A workspace holds these so that they are allocated once for
+    each shape of correlation rather than for every channel, call and chunk
+    of data.  :func:`fftw_multi_normxcorr` keeps the most recently used
+    workspaces automatically (see :func:`clear_workspaces`).
+
+    :type n_templates: int
+    :param n_templates: Number of templates.
+    :type template_len: int
+    :param template_len: Length of templates in samples.
+    :type n_channels: int
+    :param n_channels: Number of channels.
+    :type fft_len: int
+    :param fft_len: Length of transforms.
+    :type cores_outer: int
+    :param cores_outer: Number of outer threads that will be used.
+    :type split_templates: bool
+    :param split_templates:
+        Whether templates will be split between outer threads, see
+        `outer_split` in :func:`fftw_multi_normxcorr`.
+    :type with_templates: bool
+    :param with_templates:
+        Whether to hold buffers for transforming templates, not needed with
+        :class:`PreparedTemplates`.
+
+    .. Note::
+        A workspace must only be used by one call at a time, acquire
+        :attr:`lock` before use.
+    """
+    def __init__(self, n_templates, template_len, n_channels, fft_len,
+                 cores_outer=1, split_templates=False, with_templates=True):
+        utilslib = _load_cdll('libutils')
+        utilslib.create_correlator_workspace.argtypes = [
+            ctypes.c_long, ctypes.c_long, ctypes.c_long, ctypes.c_long,
+            ctypes.c_int, ctypes.c_int, ctypes.c_int]
+        utilslib.create_correlator_workspace.restype = ctypes.c_void_p
+        utilslib.free_correlator_workspace.argtypes = [ctypes.c_void_p]
+        utilslib.free_correlator_workspace.restype = None
+        utilslib.correlator_workspace_bytes.argtypes = [ctypes.c_void_p]
+        utilslib.correlator_workspace_bytes.restype = ctypes.c_longlong
+        self._utilslib = utilslib
+        self.n_templates = n_templates
+        self.template_len = template_len
+        self.n_channels = n_channels
+        self.fft_len = fft_len
+        self.lock = threading.Lock()
+        self._buffers = {}
+        self._handle = utilslib.create_correlator_workspace(
+            n_templates, template_len, n_channels, fft_len, cores_outer or 1,
+            int(split_templates), int(with_templates))
+        if not self._handle:
+            raise MemoryError(
+                "Memory allocation failed creating correlator workspace")
+
+    def __repr__(self):
+        return ("CorrelatorWorkspace(n_templates={0}, n_channels={1}, "
+                "template_len={2}, fft_len={3})".format(
+                    self.n_templates, self.n_channels, self.template_len,
+                    self.fft_len))
+
+    def __del__(self):
+        self.free()
+
+    @property
+    def nbytes(self):
+        """ Memory held in bytes, including data buffers. """
+        nbytes = sum(buf.nbytes for buf in self._buffers.values())
+        if self._handle:
+            nbytes += self._utilslib.correlator_workspace_bytes(self._handle)
+        return int(nbytes)
+
+    def buffer(self, name, shape):
+        """
+        Get a float32 buffer, re-used between calls with the same shape.
+
+        :type name: str
+        :param name: Name of buffer.
+        :type shape: tuple
+        :param shape: Shape of buffer.
+
+        :rtype: np.ndarray
+        """
+        buf = self._buffers.get(name)
+        if buf is None or buf.shape != tuple(shape):
+            buf = np.empty(shape, dtype=np.float32)
+            self._buffers[name] = buf
+        return buf
+
+    def free(self):
+        """ Release the memory held. """
+        handle = getattr(self, '_handle', None)
+        if handle:
+            self._utilslib.free_correlator_workspace(handle)
+        self._handle = None
+        self._buffers = {}
+
+
+def _check_stats_layout(utilslib):
+    """ Check that CorrelationStats matches the struct in the C-code. """
+    utilslib.correlation_stats_size.argtypes = []
+    utilslib.correlation_stats_size.restype = ctypes.c_longlong
+    c_size = utilslib.correlation_stats_size()
+    if c_size != ctypes.sizeof(CorrelationStats):
+        raise CorrelationError(
+            "CorrelationStats is {0} bytes, but {1} bytes in libutils, "
+            "rebuild EQcorrscan".format(ctypes.sizeof(CorrelationStats),
+                                        c_size))
+
+
+class CorrelationStats(ctypes.Structure):
+    """
+    Counters collected by the fftw correlation C-code.
+
+    Pass to :func:`fftw_multi_normxcorr`, or as the `stats` keyword argument
+    of the fftw stream functions, to collect the time spent in each stage of
+    the correlation.  Each call adds to the counts, so one instance can be
+    used for a whole detection run.  Collecting the counters costs a few
+    clock reads per block of data.
+
+    Stage times are summed over the outer threads, so with `cores_outer > 1`
+    their total can exceed the wall time.
+
+    .. rubric:: Example
+
+    >>> stats = CorrelationStats()
+    >>> print(stats.report()['calls'])
+    0
+    """
+    _fields_ = [
+        (native_str('stage_ns'),
+         ctypes.c_longlong * len(CORRELATION_STAGES)),
+        (native_str('thread_busy_ns'), ctypes.c_longlong * STATS_MAX_THREADS),
+        (native_str('wall_ns'), ctypes.c_longlong),
+        (native_str('bytes_allocated'), ctypes.c_longlong),
+        (native_str('skipped_samples'), ctypes.c_longlong),
+        (native_str('flatline_samples'), ctypes.c_longlong),
+        (native_str('n_calls'), ctypes.c_longlong),
+        (native_str('n_threads'), ctypes.c_int)]
+
+    def __repr__(self):
+        return "CorrelationStats(calls={0}, wall={1:.3f}s)".format(
+            self.n_calls, self.wall_ns * 1e-9)
+
+    def __iadd__(self, other):
+        for name, field_type in self._fields_:
+            if hasattr(field_type, '_length_'):
+                counts = getattr(self, name)
+                for i, count in enumerate(getattr(other, name)):
+                    counts[i] += count
+            elif name == 'n_threads':
+                self.n_threads = max(self.n_threads, other.n_threads)
+            else:
+                setattr(self, name, getattr(self, name) + getattr(other, name))
+        return self
+
+    def reset(self):
+        """ Zero all counters. """
+        ctypes.memset(ctypes.addressof(self), 0, ctypes.sizeof(self))
+
+    def report(self):
+        """
+        Get the counters in seconds.
+
+        :rtype: dict
+        :return:
+            Dictionary of `stages` (seconds in each stage, in order),
+            `wall` (seconds in the C-code), `thread_busy` (seconds each
+            outer thread spent correlating), `bytes_allocated`,
+            `skipped_samples` (samples of data that could not be
+            normalised, counted each time a channel is correlated, so once
+            per outer thread with `outer_split='templates'`),
+            `flatline_samples` (of which were flat data) and `calls`.
+        """
+        n_threads = min(self.n_threads, STATS_MAX_THREADS)
+        return {
+            'stages': OrderedDict(
+                (name, self.stage_ns[i] * 1e-9)
+                for i, name in enumerate(CORRELATION_STAGES)),
+            'wall': self.wall_ns * 1e-9,
+            'thread_busy': [self.thread_busy_ns[i] * 1e-9
+                            for i in range(n_threads)],
+            'bytes_allocated': int(self.bytes_allocated),
+            'skipped_samples': int(self.skipped_samples),
+            'flatline_samples': int(self.flatline_samples),
+            'calls': int(self.n_calls)}
+
+
+class PreparedTemplates(object):
+    """
+    Normalised template spectra held in C memory for re-use.
+
+    The templates are normalised, flipped, zero-padded to `fft_len` and
+    transformed once.  Subsequent correlations only need to transform the
+    continuous data, which is useful when running the same templates through
+    many chunks of data of the same length.
+
+    Memory required is roughly
+    `n_channels * n_templates * (fft_len / 2 + 1) * 8` bytes, so for long
+    chunks of data use a block length from
+    :func:`eqcorrscan.utils.correlate.fftw_block_len` as the `fft_len`.
+
+    :type template_array: dict
+    :param template_array:
+        Dictionary of 2D arrays of templates keyed by seed_id, as returned by
+        :func:`eqcorrscan.utils.correlate._get_array_dicts`
+    :type seed_ids: list
+    :param seed_ids: Ordered list of seed ids to use.
+    :type fft_len: int
+    :param fft_len:
+        Length of transform - data longer than `fft_len - template_len + 1`
+        samples are correlated in overlapping blocks of this length.
+    :type cores: int
+    :param cores: Number of threads to use when transforming the templates.
+    :type fingerprint: str
+    :param fingerprint:
+        Pre-computed fingerprint of the templates, will be computed if not
+        given.
+
+    .. Note::
+        Spectra are invalidated by changing the templates: use
+        :meth:`matches` to check whether a set of templates can use these
+        spectra.  Within :func:`fftw_multi_normxcorr` this is handled
+        automatically when `cache_templates=True`.
+    """
+    def __init__(self, template_array, seed_ids, fft_len, cores=1,
+                 fingerprint=None):
+        utilslib = _load_cdll('libutils')
+        utilslib.prepare_template_spectra.argtypes = [
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_long, ctypes.c_long, ctypes.c_long, ctypes.c_long,
+            ctypes.c_int]
+        utilslib.prepare_template_spectra.restype = ctypes.c_void_p
+        utilslib.free_template_spectra.argtypes = [ctypes.c_void_p]
+        utilslib.free_template_spectra.restype = None
+        utilslib.multi_normxcorr_fftw_prepared.argtypes = [
+            ctypes.c_void_p,
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_long, ctypes.POINTER(ctypes.c_longlong),
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags=native_str('C_CONTIGUOUS')),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags=native_str('C_CONTIGUOUS')),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_int, ctypes.c_int,
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_void_p]
+        utilslib.multi_normxcorr_fftw_prepared.restype = ctypes.c_int
+        utilslib.multi_normxcorr_fftw_stream.argtypes = [
+            ctypes.c_void_p,
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_long, ctypes.POINTER(ctypes.c_longlong),
+            np.ctypeslib.ndpointer(dtype=np.float32,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_long,
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags=native_str('C_CONTIGUOUS')),
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_int, ctypes.c_int,
+            np.ctypeslib.ndpointer(dtype=np.intc,
+                                   flags=native_str('C_CONTIGUOUS')),
+            np.ctypeslib.ndpointer(dtype=np.float64,
+                                   flags=native_str('C_CONTIGUOUS')),
+            ctypes.c_void_p]
+        utilslib.multi_normxcorr_fftw_stream.restype = ctypes.c_int
+        self._utilslib = utilslib
+
+        self.seed_ids = list(seed_ids)
+        self.fft_len = fft_len
+        self.fingerprint = fingerprint or _template_fingerprint(
+            template_array, seed_ids, fft_len)
+        self.template_len = template_array[seed_ids[0]].shape[1]
+        self.n_templates = template_array[seed_ids[0]].shape[0]
+        self.used_chans = [~np.isnan(template_array[seed_id]).any(axis=1)
+                           for seed_id in seed_ids]
+        norm = np.ascontiguousarray(
+            [_normalise_templates(template_array[x]) for x in seed_ids],
+            dtype=np.float32)
+        self._handle = utilslib.prepare_template_spectra(
+            norm, self.n_templates, self.template_len, len(self.seed_ids),
+            fft_len, cores or 1)
+        if not self._handle and fft_len < self.template_len:
+            raise CorrelationError(
+                "fft_len must be at least the template length")
+        if not self._handle:
+            raise MemoryError(
+                "Memory allocation failed preparing template spectra")
+
+    def __repr__(self):
+        return ("PreparedTemplates(n_templates={0}, n_channels={1}, "
+                "template_len={2}, fft_len={3})".format(
+                    self.n_templates, len(self.seed_ids), self.template_len,
+                    self.fft_len))
+
+    def __del__(self):
+        self.free()
+
+    def matches(self, template_array, seed_ids, fft_len):
+        """
+        Check whether these spectra can be used for a set of templates.
+
+        :type template_array: dict
+        :param template_array: Templates keyed by seed_id.
+        :type seed_ids: list
+        :param seed_ids: Ordered list of seed ids.
+        :type fft_len: int
+        :param fft_len: Length of transform.
+
+        :rtype: bool
+        """
+        return self.fingerprint == _template_fingerprint(
+            template_array, seed_ids, fft_len)
+
+    def free(self):
+        """ Release the C memory holding the spectra. """
+        handle = getattr(self, '_handle', None)
+        if handle:
+            self._utilslib.free_template_spectra(handle)
+        self._handle = None
+
+    def _correlate(self, stream_array, image_len, cccs, used_chans, pads,
+                   cores_outer, cores_inner, variance_warnings,
+                   workspace=None, image_offsets=None):
+        """ Call the C routine - inputs as prepared by fftw_multi_normxcorr,
+        workspace is the handle of a CorrelatorWorkspace or None, and
+        image_offsets the start of each channel in stream_array, or None if
+        the channels are its rows. """
+        if not self._handle:
+            raise CorrelationError("Template spectra have been freed")
+        if image_len < self.template_len:
+            raise CorrelationError(
+                "Data are shorter than the templates")
+        return self._utilslib.multi_normxcorr_fftw_prepared(
+            self._handle, stream_array, image_len,
+            _offsets_pointer(image_offsets), cccs, used_chans, pads,
+            cores_outer, cores_inner, variance_warnings, workspace)
+
+    def _stream_correlate(self, stream_array, image_len, cccs, used_chans,
+                          pads, cores_outer, cores_inner, variance_warnings,
+                          running_stats, workspace=None):
+        """ Call the C routine for the next piece of a continuous stream -
+        inputs as prepared by StreamingCorrelator. """
+        if not self._handle:
+            raise CorrelationError("Template spectra have been freed")
+        return self._utilslib.multi_normxcorr_fftw_stream(
+            self._handle, stream_array, image_len, None, cccs, cccs.shape[1],
+            used_chans, pads, cores_outer, cores_inner, variance_warnings,
+            running_stats, workspace)
+
+
+class StreamingCorrelator(object):
+    """
+    Incremental fftw correlation of continuous data arriving in pieces.
+
+    The template spectra are computed once, then each call to :meth:`append`
+    correlates only the new samples.  The last `template_len - 1` samples of
+    each channel are kept between calls, along with the running mean and
+    variance used to normalise the correlations, so the correlation sums are
+    the same (to within floating-point rounding) as those from correlating
+    all the data at once with :func:`fftw_multi_normxcorr`.
+
+    Templates are shifted by their pads (moveout) before stacking, so the
+    correlation sum at a given sample is only complete once data for the
+    largest pad beyond it have arrived: partial sums are held back until
+    then.
+
+    :type template_array: dict
+    :param template_array:
+        Dictionary of 2D arrays of templates keyed by seed_id, as returned by
+        :func:`eqcorrscan.utils.correlate._get_array_dicts`
+    :type pad_array: dict
+    :param pad_array: Dictionary of pads keyed by seed_id.
+    :type seed_ids: list
+    :param seed_ids: Ordered list of seed ids to use.
+    :type block_len: int or str
+    :param block_len:
+        Length of transforms to use, see
+        :func:`eqcorrscan.utils.correlate.fftw_block_len`
+    :type cores_inner: int
+    :param cores_inner: Number of threads to use within each channel.
+    :type cores_outer: int
+    :param cores_outer: Number of channels to correlate in parallel.
+    """
+    def __init__(self, template_array, pad_array, seed_ids, block_len='auto',
+                 cores_inner=1, cores_outer=1):
+        self.seed_ids = list(seed_ids)
+        self.template_len = template_array[seed_ids[0]].shape[1]
+        self.n_templates = template_array[seed_ids[0]].shape[0]
+        self.cores_inner = cores_inner
+        self.cores_outer = cores_outer
+        self.prepared = PreparedTemplates(
+            template_array=template_array, seed_ids=seed_ids,
+            fft_len=fftw_block_len(self.template_len, None, block_len),
+            cores=cores_inner)
+        self.used_chans = self.prepared.used_chans
+        self.no_chans = np.sum(
+            np.array(self.used_chans).astype(np.int), axis=0)
+        pads = np.array([pad_array[seed_id] for seed_id in seed_ids],
+                        dtype=np.intc)
+        self.max_pad = int(pads.max())
+        # Negative pads offset each correlation into the held-back sums
+        self._pads = np.ascontiguousarray(pads - self.max_pad, dtype=np.intc)
+        self._used_chans = np.ascontiguousarray(
+            self.used_chans, dtype=np.intc)
+        self.workspace = CorrelatorWorkspace(
+            n_templates=self.n_templates, template_len=self.template_len,
+            n_channels=len(self.seed_ids), fft_len=self.prepared.fft_len,
+            cores_outer=cores_outer, with_templates=False)
+        self.reset()
+
+    def __repr__(self):
+        return ("StreamingCorrelator(n_templates={0}, n_channels={1}, "
+                "n_samples={2})".format(self.n_templates, len(self.seed_ids),
+                                        self.n_samples))
+
+    def reset(self):
+        """ Forget all data, the next data appended start a new stream. """
+        n_channels = len(self.seed_ids)
+        self._history = np.zeros((n_channels, 0), dtype=np.float32)
+        self._running_stats = np.zeros((n_channels, 5), dtype=np.float64)
+        self._partial = np.zeros((self.n_templates, self.max_pad),
+                                 dtype=np.float32)
+        self._to_drop = self.max_pad
+        self.n_samples = 0
+        self.n_correlations = 0
+
+    def append(self, stream_array):
+        """
+        Correlate the next samples of continuous data.
+
+        :type stream_array: dict
+        :param stream_array:
+            Dictionary of 1D arrays of new data keyed by seed_id, all the same
+            length and following on directly from the previous data.
+
+        :rtype: np.ndarray
+        :return:
+            2D array (n_templates x n) of the correlation sums that have been
+            completed by these data.  The first column is correlation sum
+            number :attr:`n_correlations` (before this call) of the stream.
+        """
+        new = np.array([stream_array[seed_id] for seed_id in self.seed_ids],
+                       dtype=np.float32)
+        if new.ndim != 2:
+            raise CorrelationError("New data must be the same length for all "
+                                   "channels")
+        image = np.ascontiguousarray(
+            np.concatenate([self._history, new], axis=1), dtype=np.float32)
+        self.n_samples += new.shape[1]
+        image_len = image.shape[1]
+        if image_len < self.template_len:
+            self._history = image
+            return np.zeros((self.n_templates, 0), dtype=np.float32)
+        n_corr = image_len - self.template_len + 1
+        cccs = np.zeros((self.n_templates, self.max_pad + n_corr),
+                        dtype=np.float32)
+        cccs[:, 0:self.max_pad] = self._partial
+        variance_warnings = np.zeros(len(self.seed_ids), dtype=np.intc)
+        ret = self.prepared._stream_correlate(
+            image, image_len, cccs, self._used_chans, self._pads,
+            self.cores_outer, self.cores_inner, variance_warnings,
+            self._running_stats, self.workspace._handle)
+        _check_multi_fftw_return(ret, cccs, variance_warnings,
+                                 self.template_len, self.seed_ids)
+        self._history = image[:, n_corr:]
+        self._partial = cccs[:, n_corr:].copy()
+        drop = min(self._to_drop, n_corr)
+        self._to_drop -= drop
+        complete = cccs[:, drop:n_corr]
+        self.n_correlations += complete.shape[1]
+        return complete
+
+
+# ------------------ Automatic selection of kernel and threading
+
+CORRELATION_PROFILE_VERSION = 1
+# Environment variable giving the calibration profile file to use
+CORRELATION_PROFILE_ENV = 'EQCORRSCAN_CORRELATION_PROFILE'
+# Model used until a calibration is run: seconds per unit of work on one
+# thread, and the fraction of an extra thread's worth of speed-up gained
+# for each extra thread.
+DEFAULT_CORRELATION_PROFILE = {
+    'version': CORRELATION_PROFILE_VERSION, 'cores': 1,
+    'time_per_mac': 2.5e-10, 'fftw_per_op': 1.5e-9,
+    'time_efficiency': 0.9, 'inner_efficiency': 0.5,
+    'outer_efficiency': 0.9}
+_CORRELATION_PROFILE = {'file': None, 'profile': None}
+
+
+def _correlation_profile_file(filename=None):
+    """ Get the calibration profile file in use. """
+    return (filename or _CORRELATION_PROFILE['file'] or
+            os.environ.get(CORRELATION_PROFILE_ENV) or
+            os.path.join(os.path.expanduser('~'), '.eqcorrscan',
+                         'correlation_profile.json'))
+
+
+def set_correlation_profile(filename=None):
+    """
+    Set the calibration profile file used by the "auto" backend.
+
+    :type filename: str
+    :param filename:
+        Profile file to use, or None to use the file given by the
+        `EQCORRSCAN_CORRELATION_PROFILE` environment variable, or
+        `~/.eqcorrscan/correlation_profile.json` if that is not set.  The
+        profile is read (or calibrated, if the file does not exist) when
+        next needed.
+
+    :rtype: str
+    :return: The previous profile file set, or None.
+    """
+    previous = _CORRELATION_PROFILE['file']
+    _CORRELATION_PROFILE['file'] = filename
+    _CORRELATION_PROFILE['profile'] = None
+    return previous
+
+
+def _time_kernel_work(n_templates, n_channels, template_len, image_len):
+    """ Multiply-adds for the time-domain kernel. """
+    return (float(n_templates) * n_channels * template_len *
+            (image_len - template_len + 1))
+
+
+def _fftw_kernel_work(n_templates, n_channels, template_len, image_len,
+                      block_len=None, split=1):
+    """ Transform work (length times log length) for the fftw kernel. """
+    fft_len = fftw_block_len(template_len, image_len, block_len)
+    n_corr = image_len - template_len + 1
+    n_blocks = -(-n_corr // (fft_len - template_len + 1))
+    # The data are transformed once per template-splitting thread
+    transforms = n_channels * (n_templates + n_blocks * (n_templates + split))
+    return float(transforms) * fft_len * np.log2(fft_len)
+
+
+def _speed_up(threads, efficiency):
+    return 1.0 + (threads - 1) * efficiency
+
+
+def predict_correlation_time(kernel, n_templates, n_channels, template_len,
+                             image_len, cores_outer=1, cores_inner=1,
+                             block_len=None, profile=None):
+    """
+    Predict the time taken to correlate using the calibrated cost model.
+
+    :type kernel: str
+    :param kernel: One of :data:`MULTI_KERNELS`.
+    :type n_templates: int
+    :param n_templates: Number of templates.
+    :type n_channels: int
+    :param n_channels: Number of channels.
+    :type template_len: int
+    :param template_len: Length of templates in samples.
+    :type image_len: int
+    :param image_len: Length of continuous data in samples.
+    :type cores_outer: int
+    :param cores_outer: Number of outer threads for the fftw kernel.
+    :type cores_inner: int
+    :param cores_inner: Number of inner threads for the fftw kernel.
+    :type block_len: int or str
+    :param block_len:
+        Block length for the fftw kernel, see
+        :func:`eqcorrscan.utils.correlate.fftw_block_len`.
+    :type profile: dict
+    :param profile:
+        Cost model, defaults to the calibrated profile (see
+        :func:`eqcorrscan.utils.correlate.get_correlation_profile`).
+
+    :rtype: float
+    :return: Predicted time in seconds.
+    """
+    profile = profile or get_correlation_profile()
+    if kernel == 'time':
+        work = _time_kernel_work(
+            n_templates, n_channels, template_len, image_len)
+        return work * profile['time_per_mac'] / _speed_up(
+            cores_outer * cores_inner, profile['time_efficiency'])
+    elif kernel != 'fftw':
+        raise ValueError("kernel must be one of {0}, not {1}".format(
+            MULTI_KERNELS, kernel))
+    # As outer_split='auto'
+    split_templates = n_templates >= cores_outer > 1
+    outer = min(cores_outer,
+                n_templates if split_templates else n_channels)
+    work = _fftw_kernel_work(
+        n_templates, n_channels, template_len, image_len, block_len,
+        split=cores_outer if split_templates else 1)
+    return work * profile['fftw_per_op'] / (
+        _speed_up(outer, profile['outer_efficiency']) *
+        _speed_up(cores_inner, profile['inner_efficiency']))
+
+
+def choose_correlation(n_templates, n_channels, template_len, image_len,
+                       cores=None, cores_outer=None, block_len=None,
+                       kernels=None, profile=None):
+    """
+    Choose the correlation kernel and thread layout with the lowest cost.
+
+    Every kernel and every even split of `cores` between outer and inner
+    threads (so that no cores are left idle) is costed with
+    :func:`predict_correlation_time`.
+
+    :type n_templates: int
+    :param n_templates: Number of templates.
+    :type n_channels: int
+    :param n_channels: Number of channels.
+    :type template_len: int
+    :param template_len: Length of templates in samples.
+    :type image_len: int
+    :param image_len: Length of continuous data in samples.
+    :type cores: int
+    :param cores: Number of threads available, defaults to all.
+    :type cores_outer: int
+    :param cores_outer:
+        Number of outer threads to use, or None (default) to choose.
+    :type block_len: int or str
+    :param block_len: Block length for the fftw kernel.
+    :type kernels: list
+    :param kernels: Kernels to choose from, defaults to all.
+    :type profile: dict
+    :param profile: Cost model, defaults to the calibrated profile.
+
+    :rtype: dict
+    :return:
+        Dictionary of the `kernel`, `cores_outer` and `cores_inner` to use,
+        and the `predicted` time in seconds.
+    """
+    profile = profile or get_correlation_profile()
+    cores = cores or cpu_count()
+    best = None
+    for kernel in kernels or MULTI_KERNELS:
+        # The time-domain kernel shares all threads across blocks of data
+        if kernel == 'time':
+            layouts = [1]
+        elif cores_outer is not None:
+            layouts = [cores_outer]
+        else:
+            layouts = [outer for outer in range(1, cores + 1)
+                       if cores % outer == 0]
+        for outer in layouts:
+            inner = max(cores // outer, 1)
+            predicted = predict_correlation_time(
+                kernel, n_templates, n_channels, template_len, image_len,
+                cores_outer=outer, cores_inner=inner, block_len=block_len,
+                profile=profile)
+            if best is None or predicted < best['predicted']:
+                best = {'kernel': kernel, 'cores_outer': outer,
+                        'cores_inner': inner, 'predicted': predicted}
+    return best
+
+
+def calibrate_correlation(filename=None, cores=None, save=True):
+    """
+    Calibrate the cost model used by the "auto" backend.
+
+    Times the time-domain and fftw kernels on one thread, and with all
+    threads as inner and as outer threads, on a small random problem and
+    saves the resulting model to the profile file.  This takes a few seconds
+    and is run automatically the first time the "auto" backend is used
+    without a profile.
+
+    :type filename: str
+    :param filename:
+        Profile file to write, defaults to the file in use (see
+        :func:`set_correlation_profile`).
+    :type cores: int
+    :param cores: Number of threads to calibrate for, defaults to all.
+    :type save: bool
+    :param save: Whether to write the profile to file.
+
+    :rtype: dict
+    :return: The calibrated profile.
+    """
+    cores = cores or cpu_count()
+    n_templates, n_channels, template_len, image_len = 16, 4, 100, 50000
+    rng = np.random.RandomState(42)
+    seed_ids = [str(c) for c in range(n_channels)]
+    template_dict = {
+        sid: rng.randn(n_templates, template_len).astype(np.float32)
+        for sid in seed_ids}
+    stream_dict = {sid: rng.randn(image_len).astype(np.float32)
+                   for sid in seed_ids}
+    pad_dict = {sid: [0] * n_templates for sid in seed_ids}
+
+    def _best_time(**kwargs):
+        times = []
+        for _ in range(3):
+            with Timer() as timer:
+                fftw_multi_normxcorr(
+                    copy.deepcopy(template_dict), copy.deepcopy(stream_dict),
+                    pad_dict, seed_ids, block_len='auto', **kwargs)
+            times.append(timer.secs)
+        return max(min(times), 1e-6)
+
+    def _efficiency(serial, parallel, threads):
+        efficiency = (serial / parallel - 1) / (threads - 1)
+        return float(min(max(efficiency, 0.05), 1.0))
+
+    profile = copy.copy(DEFAULT_CORRELATION_PROFILE)
+    profile['cores'] = cores
+    serial_time = _best_time(kernel='time', cores_inner=1, cores_outer=1)
+    serial_fftw = _best_time(kernel='fftw', cores_inner=1, cores_outer=1)
+    profile['time_per_mac'] = serial_time / _time_kernel_work(
+        n_templates, n_channels, template_len, image_len)
+    profile['fftw_per_op'] = serial_fftw / _fftw_kernel_work(
+        n_templates, n_channels, template_len, image_len, 'auto')
+    if cores > 1:
+        profile['time_efficiency'] = _efficiency(serial_time, _best_time(
+            kernel='time', cores_inner=cores, cores_outer=1), cores)
+        profile['inner_efficiency'] = _efficiency(serial_fftw, _best_time(
+            kernel='fftw', cores_inner=cores, cores_outer=1), cores)
+        # Outer threads split templates, transforming the data once each
+        outer_time = _best_time(
+            kernel='fftw', cores_inner=1, cores_outer=cores)
+        extra = _fftw_kernel_work(
+            n_templates, n_channels, template_len, image_len, 'auto',
+            split=cores) / _fftw_kernel_work(
+            n_templates, n_channels, template_len, image_len, 'auto')
+        profile['outer_efficiency'] = _efficiency(
+            serial_fftw * extra, outer_time, cores)
+    if save:
+        filename = _correlation_profile_file(filename)
+        try:
+            if not os.path.isdir(os.path.dirname(filename)):
+                os.makedirs(os.path.dirname(filename))
+            with open(filename, 'w') as f:
+                json.dump(profile, f, indent=2, sort_keys=True)
+        except (IOError, OSError) as e:
+            warnings.warn("Could not save correlation profile to {0}: "
+                          "{1}".format(filename, e))
+    _CORRELATION_PROFILE['profile'] = profile
+    return profile
+
+
+def get_correlation_profile(filename=None):
+    """
+    Get the cost model used by the "auto" backend.
+
+    The profile is read from the profile file (see
+    :func:`set_correlation_profile`) the first time it is needed, and
+    calibrated with :func:`calibrate_correlation` if the file does not exist
+    or was written by an incompatible version.
+
+    :type filename: str
+    :param filename: Profile file to read, defaults to the file in use.
+
+    :rtype: dict
+    :return: The profile.
+    """
+    if filename is None and _CORRELATION_PROFILE['profile'] is not None:
+        return _CORRELATION_PROFILE['profile']
+    profile = None
+    path = _correlation_profile_file(filename)
+    if os.path.isfile(path):
+        try:
+            with open(path, 'r') as f:
+                profile = json.load(f)
+        except (IOError, OSError, ValueError):
+            profile = None
+    if profile is None or \
+            profile.get('version') != CORRELATION_PROFILE_VERSION or \
+            not set(DEFAULT_CORRELATION_PROFILE).issubset(profile):
+        warnings.warn("Calibrating correlation backends, saving to "
+                      "{0}".format(path))
+        return calibrate_correlation(filename=path)
+    _CORRELATION_PROFILE['profile'] = profile
+    return profile
+
+
+@register_array_xcorr('auto')
+def auto_normxcorr(templates, stream, pads, threaded=False, *args, **kwargs):
+    """
+    Use the time-domain or fftw routine, whichever is predicted to be faster.
+
+    See :func:`eqcorrscan.utils.correlate.choose_correlation`.
+
+    :param templates: 2D Array of templates
+    :type templates: np.ndarray
+    :param stream: 1D array of continuous data
+    :type stream: np.ndarray
+    :param pads: List of ints of pad lengths in the same order as templates
+    :type pads: list
+    :param threaded: Whether to use the threaded routines or not
+    :type threaded: bool
+
+    :return: np.ndarray of cross-correlations
+    :return: np.ndarray channels used
+    """
+    choice = choose_correlation(
+        n_templates=templates.shape[0], n_channels=1,
+        template_len=templates.shape[1], image_len=stream.shape[0],
+        cores=kwargs.get('cores', cpu_count()) if threaded else 1)
+    if choice['kernel'] == 'time':
+        return time_multi_normxcorr(
+            templates, stream, pads, threaded, *args, **kwargs)
+    return fftw_normxcorr(templates, stream, pads, threaded, *args, **kwargs)
+
+
+@auto_normxcorr.register('stream_xcorr')
+@auto_normxcorr.register('multithread')
+@auto_normxcorr.register('concurrent')
+def _auto_stream_xcorr(templates, stream, *args, **kwargs):
+    """
+    Apply the multi-channel routine with the kernel and thread layout
+    predicted to be fastest.
+
+    If both `cores` and `cores_outer` are given the thread layout is kept and
+    only the kernel chosen, if `kernel` is given it is kept and only the
+    thread layout chosen.  Otherwise as
+    :func:`eqcorrscan.utils.correlate._fftw_stream_xcorr`.
+    """
+    cores = kwargs.get('cores')
+    cores_outer = kwargs.get('cores_outer')
+    if cores is None and cores_outer is None:
+        cores = int(os.getenv("OMP_NUM_THREADS", cpu_count()))
+    fixed_layout = cores is not None and cores_outer is not None
+    choice = choose_correlation(
+        n_templates=len(templates), n_channels=len(stream),
+        template_len=len(templates[0][0]), image_len=len(stream[0]),
+        cores=(cores or 1) * (cores_outer or 1),
+        cores_outer=cores_outer if fixed_layout else None,
+        block_len=kwargs.get('block_len'),
+        kernels=[kwargs['kernel']] if 'kernel' in kwargs else None)
+    kwargs['kernel'] = choice['kernel']
+    if not fixed_layout:
+        kwargs['cores'] = choice['cores_inner']
+        kwargs['cores_outer'] = choice['cores_outer']
+    return _fftw_stream_xcorr(templates, stream, *args, **kwargs)
+
 
 # ------------------------------- stream_xcorr functions
 
@@ -819,8 +2148,94 @@ def get_stream_xcorr(name_or_func=None, concurrency=None):
 # --------------------------- stream prep functions
 
 
+def pack_stream(stream):
+    """
+    Pack the data of a stream into one channel-major float32 buffer.
+
+    The data of each trace are replaced by a view of a row of the buffer, so
+    the stream holds a single copy of its data, in the form read by the
+    correlation routines: rows of a packed stream are correlated where they
+    are, rather than being copied into new arrays for every call.  Traces are
+    sorted by id, and traces shorter than the longest are views of the start
+    of their row.  Masked data are filled with zeros.
+
+    :type stream: `obspy.core.stream.Stream`
+    :param stream: Stream to pack, works in place.
+
+    :rtype: np.ndarray
+    :return: Buffer of shape (number of traces, length of longest trace).
+
+    .. rubric:: Example
+
+    >>> from obspy import read
+    >>> st = read()
+    >>> packed = pack_stream(st)
+    >>> print(packed.shape)
+    (3, 3000)
+    >>> print(np.shares_memory(st[0].data, packed))
+    True
+    """
+    stream.sort(['network', 'station', 'location', 'channel'])
+    npts = max([tr.stats.npts for tr in stream] or [0])
+    packed = np.zeros((len(stream), npts), dtype=np.float32)
+    for row, tr in zip(packed, stream):
+        data = tr.data
+        if isinstance(data, np.ma.MaskedArray):
+            data = data.filled(0)
+        row[0:len(data)] = data
+        tr.data = row[0:len(data)]
+    return packed
+
+
+def _packed_rows(arrays, length):
+    """
+    Find the buffer that arrays are rows of, e.g. from :func:`pack_stream`.
+
+    :type arrays: list
+    :param arrays: 1D arrays, one per channel.
+    :type length: int
+    :param length: Length of data needed from each array.
+
+    :return:
+        Tuple of the buffer and the index of the start of each array in it,
+        or None if the arrays are not all float32 views of one contiguous
+        buffer, in which case they must be copied.
+    """
+    buffer = None
+    for arr in arrays:
+        if not isinstance(arr, np.ndarray) or \
+                isinstance(arr, np.ma.MaskedArray) or \
+                arr.dtype != np.float32 or arr.ndim != 1 or \
+                not arr.flags.c_contiguous or arr.shape[0] < length:
+            return None
+        base = arr
+        while isinstance(base.base, np.ndarray):
+            base = base.base
+        if buffer is None:
+            buffer = base
+        elif base is not buffer:
+            return None
+    if buffer is None or buffer.dtype != np.float32 or \
+            not buffer.flags.c_contiguous:
+        return None
+    start = buffer.__array_interface__['data'][0]
+    offsets = np.array(
+        [(arr.__array_interface__['data'][0] - start) // buffer.itemsize
+         for arr in arrays], dtype=np.int64)
+    return buffer, offsets
+
+
+def _offsets_pointer(offsets):
+    """ Get image offsets as a pointer for the C routines, or None. """
+    if offsets is None:
+        return None
+    return offsets.ctypes.data_as(ctypes.POINTER(ctypes.c_longlong))
+
+
 def _get_array_dicts(templates, stream, copy_streams=True):
-    """ prepare templates and stream, return dicts """
+    """ prepare templates and stream, return dicts - the stream data are
+    copied unless copy_streams is False, in which case float32 data (e.g.
+    from pack_stream) are shared and must not be changed by the caller """
     # Do some reshaping
     # init empty structures for data storage
     template_dict = {}
@@ -829,6 +2244,9 @@ def _get_array_dicts(templates, stream, copy_streams=True):
     t_starts = []
 
     stream.sort(['network', 'station', 'location', 'channel'])
+    stream_traces = {}
+    for tr in stream:
+        stream_traces.setdefault(tr.id, tr)
     for template in templates:
         template.sort(['network', 'station', 'location', 'channel'])
         t_starts.append(min([tr.stats.starttime for tr in template]))
@@ -837,11 +2255,11 @@ def _get_array_dicts(templates, stream, copy_streams=True):
     # pull common channels out of streams and templates and put in dicts
     for i, seed_id in enumerate(seed_ids):
         temps_with_seed = [template[i].data for template in templates]
-        t_ar = np.array(temps_with_seed).astype(np.float32)
+        t_ar = np.array(temps_with_seed, dtype=np.float32)
         template_dict.update({seed_id: t_ar})
         stream_dict.update(
-            {seed_id: stream.select(
-                id=seed_id.split('_')[0])[0].data.astype(np.float32)})
+            {seed_id: stream_traces[seed_id.split('_')[0]].data.astype(
+                np.float32, copy=copy_streams)})
         pad_list = [
             int(round(template[i].stats.sampling_rate *
                       (template[i].stats.starttime - t_starts[j])))
@@ -21,17 +21,18 @@ import warnings
 import numpy as np
 import matplotlib.pyplot as plt
 
-from multiprocessing import Pool, cpu_count
+from multiprocessing import cpu_count
 from obspy import Trace
 
 from eqcorrscan.utils.timer import Timer
 from eqcorrscan.utils.plotting import peaks_plot
 from eqcorrscan.core.match_filter import normxcorr2
-from eqcorrscan.utils.findpeaks import find_peaks2_short
+from eqcorrscan.utils.findpeaks import (
+    find_peaks2_short, multi_find_peaks_compiled)
 
 
 def median_filter(tr, multiplier=10, windowlength=0.5,
-                  interp_len=0.05, debug=0):
+                  interp_len=0.05, debug=0, cores=None):
     """
     Filter out spikes in data above a multiple of MAD of the data.
 
@@ -40,7 +41,9 @@ def median_filter(tr, multiplier=10, windowlength=0.5,
     more appropriate.  Works in-place on data.
 
     :type tr: obspy.core.trace.Trace
-    :param tr: trace to despike
+    :param tr:
+        trace to despike, or a :class:`obspy.core.stream.Stream` to despike
+        every trace of.
     :type multiplier: float
     :param multiplier:
         median absolute deviation multiplier to find spikes above.
@@ -50,52 +53,66 @@ def median_filter(tr, multiplier=10, windowlength=0.5,
     :param interp_len: Length in seconds to interpolate around spikes.
     :type debug: int
     :param debug: Debug output level between 0 and 5, higher is more output.
+    :type cores: int
+    :param cores: Number of threads to use, defaults to the number of cpus.
 
     :returns: :class:`obspy.core.trace.Trace`
 
+    .. note::
+        The spikes in every window of every trace are found in one threaded
+        compiled call, see
+        :func:`eqcorrscan.utils.findpeaks.multi_find_peaks_compiled`, with the
+        threshold and peak-finding of :func:`_median_window` for each window.
+
     .. warning::
         Not particularly effective, and may remove earthquake signals, use with
         caution.
     """
-    num_cores = cpu_count()
+    num_cores = cores or cpu_count()
+    traces = [tr] if isinstance(tr, Trace) else list(tr)
     if debug >= 1:
-        data_in = tr.copy()
-    # Note - might be worth finding spikes in filtered data
-    filt = tr.copy()
-    filt.detrend('linear')
-    try:
-        filt.filter('bandpass', freqmin=10.0,
-                    freqmax=(tr.stats.sampling_rate / 2) - 1)
-    except Exception as e:
-        print("Could not filter due to error: {0}".format(e))
-    data = filt.data
-    del filt
-    # Loop through windows
-    _windowlength = int(windowlength * tr.stats.sampling_rate)
-    _interp_len = int(interp_len * tr.stats.sampling_rate)
-    peaks = []
+        data_in = [_tr.copy() for _tr in traces]
     with Timer() as t:
-        pool = Pool(processes=num_cores)
-        results = [pool.apply_async(_median_window,
-                                    args=(data[chunk * _windowlength:
-                                               (chunk + 1) * _windowlength],
-                                          chunk * _windowlength, multiplier,
-                                          tr.stats.starttime + windowlength,
-                                          tr.stats.sampling_rate,
-                                          debug))
-                   for chunk in range(int(len(data) / _windowlength))]
-        pool.close()
-        for p in results:
-            peaks += p.get()
-        pool.join()
-        for peak in peaks:
-            tr.data = _interp_gap(tr.data, peak[1], _interp_len)
+        # Windows of each length, of every trace, are searched together
+        windows = {}
+        for i, _tr in enumerate(traces):
+            # Note - might be worth finding spikes in filtered data
+            filt = _tr.copy()
+            filt.detrend('linear')
+            try:
+                filt.filter('bandpass', freqmin=10.0,
+                            freqmax=(_tr.stats.sampling_rate / 2) - 1)
+            except Exception as e:
+                print("Could not filter due to error: {0}".format(e))
+            _windowlength = int(windowlength * _tr.stats.sampling_rate)
+            n_windows = len(filt.data) // _windowlength
+            windows.setdefault(_windowlength, []).append(
+                (i, filt.data[0:n_windows * _windowlength].reshape(
+                    n_windows, _windowlength)))
+        for _windowlength, chunks in windows.items():
+            data = np.concatenate([chunk for _, chunk in chunks], axis=0)
+            arrays, indexes, _, thresholds = multi_find_peaks_compiled(
+                data, threshold=multiplier, threshold_type='MAD', trig_int=5,
+                cores=num_cores)
+            if debug >= 2:
+                print('Thresholds for windows are: ' + str(thresholds))
+            # Window number in the concatenated array to trace and start
+            owners = np.concatenate(
+                [np.full(len(chunk), i) for i, chunk in chunks])
+            starts = np.concatenate(
+                [np.arange(len(chunk)) * _windowlength for _, chunk in chunks])
+            for array, index in zip(arrays, indexes):
+                _tr = traces[owners[array]]
+                _interp_len = int(interp_len * _tr.stats.sampling_rate)
+                _tr.data = _interp_gap(
+                    _tr.data, int(starts[array] + index), _interp_len)
     print("Despiking took: %s s" % t.secs)
     if debug >= 1:
-        plt.plot(data_in.data, 'r', label='raw')
-        plt.plot(tr.data, 'k', label='despiked')
-        plt.legend()
-        plt.show()
+        for raw, _tr in zip(data_in, traces):
+            plt.plot(raw.data, 'r', label='raw')
+            plt.plot(_tr.data, 'k', label='despiked')
+            plt.legend()
+            plt.show()
     return tr
 
 
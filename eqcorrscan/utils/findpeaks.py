@@ -20,7 +20,6 @@ from obspy import UTCDateTime
 from scipy import ndimage
 from multiprocessing import Pool
 from future.utils import native_str
-from itertools import compress
 
 from eqcorrscan.utils.correlate import pool_boy
 from eqcorrscan.utils.libnames import _load_cdll
@@ -223,44 +222,184 @@ def multi_find_peaks(arr, thresh, trig_int, debug=0, starttime=False,
     return peaks
 
 
+THRESHOLD_TYPES = {'absolute': 0, 'MAD': 1, 'av_chan_corr': 2}
+
+
+def multi_find_peaks_compiled(arr, threshold, threshold_type, trig_int,
+                              no_chans=None, full_peaks=False, cores=1):
+    """
+    Find peaks in multiple arrays using compiled, threaded, routines.
+
+    Computes the thresholds and finds peaks as for
+    :func:`eqcorrscan.utils.findpeaks.find_peaks2_short` for every array in
+    one call, without copying float32 arrays.
+
+    :type arr: numpy.ndarray
+    :param arr: 2-D numpy array is required
+    :type threshold: float or list
+    :param threshold:
+        Threshold input, either one value for all arrays or one per array.
+    :type threshold_type: str
+    :param threshold_type:
+        'absolute' to use the threshold as is, 'MAD' to multiply it by the
+        median absolute value of each array, or 'av_chan_corr' to multiply it
+        by `no_chans`, as for
+        :func:`eqcorrscan.core.match_filter.match_filter`.
+    :type trig_int: int
+    :param trig_int:
+        The minimum difference in samples between triggers, if multiple
+        peaks within this window this code will find the highest.
+    :type no_chans: list
+    :param no_chans:
+        Number of channels used for each array, required for 'av_chan_corr'.
+    :type full_peaks: bool
+    :param full_peaks: See `eqcorrscan.utils.findpeaks.find_peaks2_short`
+    :type cores: int
+    :param cores: Number of threads to use.
+
+    :returns:
+        Arrays of the array number, index and value of each peak, ordered by
+        array then index, and the threshold used for each array.
+    :rtype: tuple
+
+    >>> arr = np.zeros((2, 100), dtype=np.float32)
+    >>> arr[0, 40] = 20
+    >>> arr[1, [10, 12, 60]] = [50, -60, 100]
+    >>> arrays, indexes, values, thresholds = multi_find_peaks_compiled(
+    ...     arr, threshold=10, threshold_type='absolute', trig_int=3)
+    >>> print(list(zip(arrays, indexes, values)))
+    [(0, 40, 20.0), (1, 12, -60.0), (1, 60, 100.0)]
+    """
+    utilslib = _load_cdll('libutils')
+
+    arr = np.ascontiguousarray(arr, dtype=np.float32)
+    if arr.ndim != 2:
+        raise IndexError("arr must be two-dimensional")
+    n_arrays, length = arr.shape
+    if threshold_type not in THRESHOLD_TYPES:
+        raise ValueError("threshold_type must be one of {0}, not {1}".format(
+            list(THRESHOLD_TYPES.keys()), threshold_type))
+    # Copied, the thresholds used are written to this
+    thresholds = np.array(
+        np.broadcast_to(np.asarray(threshold, dtype=np.float64), n_arrays))
+    if threshold_type == 'av_chan_corr':
+        if no_chans is None:
+            raise ValueError("no_chans is required for av_chan_corr")
+        no_chans = np.ascontiguousarray(no_chans, dtype=np.intc)
+    else:
+        no_chans = np.zeros(n_arrays, dtype=np.intc)
+
+    utilslib.multi_find_peaks_compiled.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long, ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long, ctypes.c_int, ctypes.c_int, ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=np.int64,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.POINTER(ctypes.c_long), ctypes.POINTER(ctypes.c_void_p)]
+    utilslib.multi_find_peaks_compiled.restype = ctypes.c_int
+    utilslib.copy_found_peaks.argtypes = [
+        ctypes.c_void_p,
+        np.ctypeslib.ndpointer(dtype=np.intc,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=np.int64,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=np.float32,
+                               flags=native_str('C_CONTIGUOUS'))]
+    utilslib.copy_found_peaks.restype = ctypes.c_int
+    utilslib.free_found_peaks.argtypes = [ctypes.c_void_p]
+    utilslib.free_found_peaks.restype = None
+
+    # Peaks are at least trig_int apart, so this is usually enough space
+    capacity = n_arrays * min(length // max(trig_int, 1) + 1, 1024)
+    n_peaks = ctypes.c_long(0)
+    pending = ctypes.c_void_p()
+    peak_arrays = np.zeros(capacity, dtype=np.intc)
+    peak_indexes = np.zeros(capacity, dtype=np.int64)
+    peak_values = np.zeros(capacity, dtype=np.float32)
+    ret = utilslib.multi_find_peaks_compiled(
+        arr, length, n_arrays, thresholds, THRESHOLD_TYPES[threshold_type],
+        no_chans, trig_int, int(full_peaks), cores, capacity, peak_arrays,
+        peak_indexes, peak_values, ctypes.byref(n_peaks),
+        ctypes.byref(pending))
+    if ret == 2:
+        # The peaks are held in C, only copy them out to longer arrays
+        try:
+            peak_arrays = np.zeros(n_peaks.value, dtype=np.intc)
+            peak_indexes = np.zeros(n_peaks.value, dtype=np.int64)
+            peak_values = np.zeros(n_peaks.value, dtype=np.float32)
+        except MemoryError:
+            utilslib.free_found_peaks(pending)
+            raise
+        ret = utilslib.copy_found_peaks(
+            pending, peak_arrays, peak_indexes, peak_values)
+    if ret != 0:
+        raise MemoryError("Issue with c-routine, returned %i" % ret)
+    n_peaks = n_peaks.value
+    return (peak_arrays[:n_peaks], peak_indexes[:n_peaks],
+            peak_values[:n_peaks], thresholds)
+
+
 def decluster(peaks, index, trig_int):
     """
     Decluster peaks based on an enforced minimum separation.
     :type peaks: np.array
     :param peaks: array of peak values
     :type index: np.ndarray
-    :param index: locations of peaks
+    :param index: locations of peaks, treated as integers
     :type trig_int: int
     :param trig_int: Minimum trigger interval in samples
 
-    :return: list of tuples of (value, sample)
+    :return: list of tuples of (value, sample), from largest to smallest value
+
+    >>> decluster(peaks=[1, 5, -3, 2], index=[10, 12, 30, 100], trig_int=5)
+    [(5, 12), (-3, 30), (2, 100)]
+    """
+    kept = _decluster_positions(peaks=peaks, index=index, trig_int=trig_int)
+    return [(peaks[i], index[i]) for i in kept]
+
+
+def _decluster_positions(peaks, index, trig_int):
+    """
+    Decluster peaks, returning the positions of the peaks kept.
+
+    Peaks are kept from the largest absolute value down (equal values in
+    input order), dropping those less than trig_int from a peak already
+    kept.
+
+    :returns: numpy.ndarray of positions in peaks, largest peak first.
     """
     utilslib = _load_cdll('libutils')
 
-    length = np.int32(len(peaks))
-    utilslib.find_peaks.argtypes = [
-        np.ctypeslib.ndpointer(dtype=np.float32, shape=(length,),
+    length = len(peaks)
+    utilslib.decluster.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float64, shape=(length,),
                                flags=native_str('C_CONTIGUOUS')),
-        np.ctypeslib.ndpointer(dtype=np.float32, shape=(length,),
+        np.ctypeslib.ndpointer(dtype=np.int64, shape=(length,),
                                flags=native_str('C_CONTIGUOUS')),
-        ctypes.c_int, ctypes.c_float, ctypes.c_float,
-        np.ctypeslib.ndpointer(dtype=np.uint32, shape=(length,),
-                               flags=native_str('C_CONTIGUOUS'))]
-    utilslib.find_peaks.restype = ctypes.c_int
-    peaks_sort = sorted(zip(peaks, index),
-                        key=lambda amplitude: abs(amplitude[0]),
-                        reverse=True)
-    arr, inds = zip(*peaks_sort)
-    arr = np.ascontiguousarray(arr, dtype=np.float32)
-    inds = np.array(inds, dtype=np.float32) / trig_int
-    inds = np.ascontiguousarray(inds, dtype=np.float32)
-    out = np.zeros(len(arr), dtype=np.uint32)
-    ret = utilslib.find_peaks(
-        arr, inds, length, 0, np.float32(1), out)
+        ctypes.c_long, ctypes.c_longlong,
+        np.ctypeslib.ndpointer(dtype=np.int64, shape=(length,),
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.POINTER(ctypes.c_long)]
+    utilslib.decluster.restype = ctypes.c_int
+    arr = np.ascontiguousarray(peaks, dtype=np.float64)
+    inds = np.ascontiguousarray(np.round(index), dtype=np.int64)
+    kept = np.zeros(length, dtype=np.int64)
+    n_kept = ctypes.c_long(0)
+    ret = utilslib.decluster(
+        arr, inds, length, int(round(trig_int)), kept, ctypes.byref(n_kept))
     if ret != 0:
         raise MemoryError("Issue with c-routine, returned %i" % ret)
-    peaks_out = list(compress(peaks_sort, out))
-    return peaks_out
+    return kept[:n_kept.value]
 
 
 def coin_trig(peaks, stachans, samp_rate, moveout, min_trig, trig_int):
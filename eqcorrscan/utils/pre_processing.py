@@ -14,14 +14,19 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
+import warnings
 import numpy as np
 import datetime as dt
 
 from multiprocessing import Pool, cpu_count
+from future.utils import native_str
+from scipy.signal import iirfilter, zpk2sos
 
 from obspy import Stream, Trace, UTCDateTime
 from obspy.signal.filter import bandpass, lowpass, highpass
 from eqcorrscan.utils.debug_log import debug_print
+from eqcorrscan.utils.libnames import _load_cdll
 
 
 def _check_daylong(tr):
@@ -55,7 +60,7 @@ def _check_daylong(tr):
 
 def shortproc(st, lowcut, highcut, filt_order, samp_rate, debug=0,
               parallel=False, num_cores=False, starttime=None, endtime=None,
-              seisan_chan_names=False, fill_gaps=True):
+              seisan_chan_names=False, fill_gaps=True, native=False):
     """
     Basic function to bandpass and downsample.
 
@@ -94,6 +99,12 @@ def shortproc(st, lowcut, highcut, filt_order, samp_rate, debug=0,
         rather than SEED convention of three) - defaults to True.
     :type fill_gaps: bool
     :param fill_gaps: Whether to pad any gaps found with zeros or not.
+    :type native: bool
+    :param native:
+        Whether to resample, detrend and filter all channels in one threaded
+        compiled call rather than with obspy in separate processes, see
+        :func:`_native_process`. Uses `num_cores` threads if `parallel` is
+        set.
 
     :return: Processed stream
     :rtype: :class:`obspy.core.stream.Stream`
@@ -176,7 +187,13 @@ def shortproc(st, lowcut, highcut, filt_order, samp_rate, debug=0,
             st.remove(tr)
             debug_print('No data for %s.%s after trim' %
                         (tr.stats.station, tr.stats.channel), 1, debug)
-    if parallel:
+    if native:
+        st = _native_process(
+            st, lowcut=lowcut, highcut=highcut, filt_order=filt_order,
+            samp_rate=samp_rate, debug=debug, starttime=False, clip=False,
+            seisan_chan_names=seisan_chan_names, fill_gaps=fill_gaps,
+            num_cores=_native_cores(parallel, num_cores, len(st)))
+    elif parallel:
         if not num_cores:
             num_cores = cpu_count()
         if num_cores > len(st):
@@ -210,7 +227,7 @@ def shortproc(st, lowcut, highcut, filt_order, samp_rate, debug=0,
 
 def dayproc(st, lowcut, highcut, filt_order, samp_rate, starttime, debug=0,
             parallel=True, num_cores=False, ignore_length=False,
-            seisan_chan_names=False, fill_gaps=True):
+            seisan_chan_names=False, fill_gaps=True, native=False):
     """
     Wrapper for dayproc to parallel multiple traces in a stream.
 
@@ -247,6 +264,12 @@ def dayproc(st, lowcut, highcut, filt_order, samp_rate, starttime, debug=0,
         rather than SEED convention of three) - defaults to True.
     :type fill_gaps: bool
     :param fill_gaps: Whether to pad any gaps found with zeros or not.
+    :type native: bool
+    :param native:
+        Whether to resample, detrend and filter all channels in one threaded
+        compiled call rather than with obspy in separate processes, see
+        :func:`_native_process`. Uses `num_cores` threads if `parallel` is
+        set.
 
     :return: Processed stream.
     :rtype: :class:`obspy.core.stream.Stream`
@@ -330,7 +353,14 @@ def dayproc(st, lowcut, highcut, filt_order, samp_rate, starttime, debug=0,
         if not len(set(startdates)) == 1:
             raise NotImplementedError('Traces start on different days')
         starttime = UTCDateTime(startdates[0])
-    if parallel:
+    if native:
+        st = _native_process(
+            st, lowcut=lowcut, highcut=highcut, filt_order=filt_order,
+            samp_rate=samp_rate, debug=debug, starttime=starttime, clip=True,
+            length=86400, ignore_length=ignore_length,
+            seisan_chan_names=seisan_chan_names, fill_gaps=fill_gaps,
+            num_cores=_native_cores(parallel, num_cores, len(st)))
+    elif parallel:
         if not num_cores:
             num_cores = cpu_count()
         if num_cores > len(st):
@@ -422,7 +452,43 @@ def process(tr, lowcut, highcut, filt_order, samp_rate, debug,
     # Add sanity check
     if highcut and highcut >= 0.5 * samp_rate:
         raise IOError('Highcut must be lower than the nyquist')
+    tr, state = _prepare_trace(
+        tr=tr, debug=debug, starttime=starttime, clip=clip, length=length,
+        ignore_length=ignore_length)
+    # Check sampling rate and resample
+    if tr.stats.sampling_rate != samp_rate:
+        debug_print('Resampling', 1, debug)
+        tr.resample(samp_rate)
+    # Filtering section
+    tr = tr.detrend('simple')    # Detrend data again before filtering
+    if highcut and lowcut:
+        debug_print('Bandpassing', 1, debug)
+        tr.data = bandpass(tr.data, lowcut, highcut,
+                           tr.stats.sampling_rate, filt_order, True)
+    elif highcut:
+        debug_print('Lowpassing', 1, debug)
+        tr.data = lowpass(tr.data, highcut, tr.stats.sampling_rate,
+                          filt_order, True)
+    elif lowcut:
+        debug_print('Highpassing', 1, debug)
+        tr.data = highpass(tr.data, lowcut, tr.stats.sampling_rate,
+                           filt_order, True)
+    else:
+        debug_print('No filters applied', 2, debug)
+    return _finish_trace(
+        tr=tr, state=state, debug=debug, clip=clip, length=length,
+        seisan_chan_names=seisan_chan_names, fill_gaps=fill_gaps)
+
+
+def _prepare_trace(tr, debug, starttime=False, clip=False, length=86400,
+                   ignore_length=False):
+    """
+    Fill gaps, check, detrend and pad a trace ready for resampling.
 
+    :return:
+        Trace and a dict of the gaps and pads to re-apply with
+        :func:`_finish_trace`.
+    """
     # Define the start-time
     if starttime:
         # Be nice and allow a datetime object.
@@ -439,6 +505,7 @@ def process(tr, lowcut, highcut, filt_order, samp_rate, debug,
         tr.plot()
     # Check if the trace is gappy and pad if it is.
     gappy = False
+    gaps = []
     if isinstance(tr.data, np.ma.MaskedArray):
         gappy = True
         gaps, tr = _fill_gaps(tr)
@@ -457,6 +524,7 @@ def process(tr, lowcut, highcut, filt_order, samp_rate, debug,
 
     # Sanity check to ensure files are daylong
     padded = False
+    pre_pad_secs, post_pad_secs = (0, 0)
     if clip:
         tr = tr.trim(starttime, starttime + length, nearest_sample=True)
     if float(tr.stats.npts / tr.stats.sampling_rate) != length and clip:
@@ -494,40 +562,35 @@ def process(tr, lowcut, highcut, filt_order, samp_rate, debug,
                                  tr.stats.station + '.' + tr.stats.channel)
         debug_print('I now have %i data points after enforcing length'
                     % len(tr.data), 0, debug)
-    # Check sampling rate and resample
-    if tr.stats.sampling_rate != samp_rate:
-        debug_print('Resampling', 1, debug)
-        tr.resample(samp_rate)
-    # Filtering section
-    tr = tr.detrend('simple')    # Detrend data again before filtering
-    if highcut and lowcut:
-        debug_print('Bandpassing', 1, debug)
-        tr.data = bandpass(tr.data, lowcut, highcut,
-                           tr.stats.sampling_rate, filt_order, True)
-    elif highcut:
-        debug_print('Lowpassing', 1, debug)
-        tr.data = lowpass(tr.data, highcut, tr.stats.sampling_rate,
-                          filt_order, True)
-    elif lowcut:
-        debug_print('Highpassing', 1, debug)
-        tr.data = highpass(tr.data, lowcut, tr.stats.sampling_rate,
-                           filt_order, True)
-    else:
-        debug_print('No filters applied', 2, debug)
+    state = {'day': day, 'starttime': starttime, 'gappy': gappy,
+             'gaps': gaps, 'padded': padded, 'pre_pad_secs': pre_pad_secs,
+             'post_pad_secs': post_pad_secs}
+    return tr, state
+
+
+def _finish_trace(tr, state, debug, clip=False, length=86400,
+                  seisan_chan_names=False, fill_gaps=True):
+    """
+    Re-apply the pads and gaps recorded by :func:`_prepare_trace` to a
+    resampled and filtered trace.
+    """
+    starttime = state['starttime']
     # Account for two letter channel names in s-files and therefore templates
     if seisan_chan_names:
         tr.stats.channel = tr.stats.channel[0] + tr.stats.channel[-1]
 
     # Sanity check the time header
-    if tr.stats.starttime.day != day and clip:
+    if tr.stats.starttime.day != state['day'] and clip:
         debug_print("Time headers do not match expected date: {0}".format(
             tr.stats.starttime), 2, debug)
 
-    if padded:
+    if state['padded']:
         debug_print("Reapplying zero pads post processing", 1, debug)
         debug_print(str(tr), 2, debug)
-        pre_pad = np.zeros(int(pre_pad_secs * tr.stats.sampling_rate))
-        post_pad = np.zeros(int(post_pad_secs * tr.stats.sampling_rate))
+        pre_pad = np.zeros(
+            int(state['pre_pad_secs'] * tr.stats.sampling_rate))
+        post_pad = np.zeros(
+            int(state['post_pad_secs'] * tr.stats.sampling_rate))
         pre_pad_len = len(pre_pad)
         post_pad_len = len(post_pad)
         debug_print("Taking only valid data between %i and %i samples" %
@@ -552,14 +615,133 @@ def process(tr, lowcut, highcut, filt_order, samp_rate, debug,
                 raise ValueError('Data are not daylong for ' +
                                  tr.stats.station + '.' + tr.stats.channel)
     # Replace the gaps with zeros
-    if gappy:
-        tr = _zero_pad_gaps(tr, gaps, fill_gaps=fill_gaps)
+    if state['gappy']:
+        tr = _zero_pad_gaps(tr, state['gaps'], fill_gaps=fill_gaps)
     # Final visual check for debug
     if debug > 4:
         tr.plot()
     return tr
 
 
+def _filter_sos(lowcut, highcut, filt_order, samp_rate):
+    """
+    Design the Butterworth filter applied by :func:`process`.
+
+    Follows :func:`obspy.signal.filter.bandpass`, `lowpass` and `highpass`.
+
+    :return:
+        Second-order sections, shape (n_sections, 6), with no rows if no
+        filter is to be applied.
+    """
+    fe = 0.5 * samp_rate
+    if highcut and lowcut:
+        if highcut / fe - 1.0 > -1e-6:
+            warnings.warn(
+                "Selected high corner frequency ({0}) of bandpass is at or "
+                "above Nyquist ({1}). Applying a high-pass instead.".format(
+                    highcut, fe))
+            return _filter_sos(lowcut, None, filt_order, samp_rate)
+        if lowcut / fe > 1:
+            raise ValueError("Selected low corner frequency is above Nyquist.")
+        z, p, k = iirfilter(filt_order, [lowcut / fe, highcut / fe],
+                            btype='band', ftype='butter', output='zpk')
+    elif highcut:
+        f = highcut / fe
+        if f > 1:
+            f = 1.0
+            warnings.warn(
+                "Selected corner frequency is above Nyquist. Setting Nyquist "
+                "as high corner.")
+        z, p, k = iirfilter(filt_order, f, btype='lowpass', ftype='butter',
+                            output='zpk')
+    elif lowcut:
+        if lowcut / fe > 1:
+            raise ValueError("Selected corner frequency is above Nyquist.")
+        z, p, k = iirfilter(filt_order, lowcut / fe, btype='highpass',
+                            ftype='butter', output='zpk')
+    else:
+        return np.zeros((0, 6))
+    return np.ascontiguousarray(zpk2sos(z, p, k), dtype=np.float64)
+
+
+def _native_cores(parallel, num_cores, n_traces):
+    """ Number of threads for :func:`_native_process`. """
+    if not parallel:
+        return 1
+    if not num_cores:
+        num_cores = cpu_count()
+    return max(min(num_cores, n_traces), 1)
+
+
+def _native_process(st, lowcut, highcut, filt_order, samp_rate, debug,
+                    starttime=False, clip=False, length=86400,
+                    seisan_chan_names=False, ignore_length=False,
+                    fill_gaps=True, num_cores=1):
+    """
+    Process all traces in a stream as :func:`process`, resampling,
+    detrending and filtering every channel in one threaded compiled call.
+
+    Gaps, checks and pads are handled per-trace as in :func:`process`, the
+    data are then copied into one shared buffer that is processed without
+    holding the GIL or pickling traces between processes. Results match
+    :func:`process` to within floating point precision.
+
+    :type num_cores: int
+    :param num_cores: Number of channels to process concurrently.
+
+    Other parameters are as for :func:`process`.
+
+    :return: Processed stream.
+    :rtype: :class:`obspy.core.stream.Stream`
+    """
+    prepared = [_prepare_trace(
+        tr=tr, debug=debug, starttime=starttime, clip=clip, length=length,
+        ignore_length=ignore_length) for tr in st]
+    if len(prepared) == 0:
+        return Stream()
+    c_long = np.dtype(ctypes.c_long)
+    data_lens = np.array([tr.stats.npts for tr, _ in prepared], dtype=c_long)
+    # As obspy.core.trace.Trace.resample
+    out_lens = np.array([
+        tr.stats.npts if tr.stats.sampling_rate == samp_rate else
+        int(tr.stats.npts / (tr.stats.sampling_rate / float(samp_rate)))
+        for tr, _ in prepared], dtype=c_long)
+    sampling_rates = np.array(
+        [tr.stats.sampling_rate for tr, _ in prepared], dtype=np.float64)
+    data = np.zeros((len(prepared), max(data_lens.max(), 1)))
+    for row, (tr, _) in zip(data, prepared):
+        row[0:tr.stats.npts] = tr.data
+    out = np.zeros((len(prepared), max(out_lens.max(), 1)))
+    sos = _filter_sos(lowcut, highcut, filt_order, samp_rate)
+    debug_print('Processing %i channels on %i threads' %
+                (len(prepared), num_cores), 1, debug)
+
+    utilslib = _load_cdll('libutils')
+    long_arr = np.ctypeslib.ndpointer(
+        dtype=c_long, flags=native_str('C_CONTIGUOUS'))
+    double_arr = np.ctypeslib.ndpointer(
+        dtype=np.float64, flags=native_str('C_CONTIGUOUS'))
+    utilslib.process_channels.argtypes = [
+        double_arr, long_arr, ctypes.c_long, double_arr, long_arr,
+        ctypes.c_long, ctypes.c_long, double_arr, ctypes.c_double,
+        double_arr, ctypes.c_int, ctypes.c_int]
+    utilslib.process_channels.restype = ctypes.c_int
+    ret = utilslib.process_channels(
+        data, data_lens, data.shape[1], out, out_lens, out.shape[1],
+        len(prepared), sampling_rates, samp_rate, sos, sos.shape[0],
+        num_cores)
+    if ret != 0:
+        raise MemoryError("Could not allocate memory for pre-processing")
+    processed = Stream()
+    for row, out_len, (tr, state) in zip(out, out_lens, prepared):
+        tr.data = row[0:out_len]
+        tr.stats.sampling_rate = samp_rate
+        processed += _finish_trace(
+            tr=tr, state=state, debug=debug, clip=clip, length=length,
+            seisan_chan_names=seisan_chan_names, fill_gaps=fill_gaps)
+    return processed
+
+
 def _zero_pad_gaps(tr, gaps, fill_gaps=True):
     """
     Replace padded parts of trace with zeros.
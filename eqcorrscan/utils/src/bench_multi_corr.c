@@ -0,0 +1,217 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bench_multi_corr.c
+ *
+ *        Purpose:  Stand-alone benchmark of multi_normxcorr_fftw without Python
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ *
+ * Not part of libutils. Build against the libutils sources, e.g.:
+ *
+ *   gcc -O2 -fopenmp -msse2 -o bench_multi_corr bench_multi_corr.c multi_corr.c \
+ *       time_corr.c find_peaks.c -lfftw3f -lfftw3f_threads -lfftw3 -lfftw3_threads -lm
+ *
+ * Usage:
+ *
+ *   bench_multi_corr n_templates n_channels template_len image_len fft_len \
+ *       threads_outer threads_inner [repeats] [split_templates]
+ *
+ * with fft_len of 0 to transform the whole image at once. Prints one line of
+ * JSON with the best time with and without a re-used workspace, as read by
+ * eqcorrscan.utils.benchmark.run_c_harness.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#if defined(_OPENMP)
+    #include <omp.h>
+#else
+    #include <time.h>
+#endif
+
+// From multi_corr.c: workspaces and stats are only passed through, so are opaque here
+int multi_normxcorr_fftw(float*, long, long, long, float*, long, long long*, float*, long, int*,
+                         int*, int, int, int*, int, void*, void*);
+
+void* create_correlator_workspace(long, long, long, long, int, int, int);
+
+void free_correlator_workspace(void*);
+
+long long get_workspace_peak_memory(int);
+
+
+static double wall_time(void) {
+    #if defined(_OPENMP)
+    return omp_get_wtime();
+    #else
+    return (double) clock() / CLOCKS_PER_SEC;
+    #endif
+}
+
+
+static long fast_len(long n) {
+    /* Smallest 2^a 3^b 5^c at least n */
+    long best = 1, p2, p3, p5;
+
+    while (best < n) {
+        best *= 2;
+    }
+    for (p5 = 1; p5 < 2 * n; p5 *= 5) {
+        for (p3 = p5; p3 < 2 * n; p3 *= 3) {
+            for (p2 = p3; p2 < best; p2 *= 2) {
+                if (p2 >= n) {
+                    best = p2;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+
+static void normalise_templates(float *templates, long n_rows, long template_len) {
+    /* As eqcorrscan.utils.correlate._normalise_templates */
+    long r, i;
+
+    for (r = 0; r < n_rows; ++r) {
+        float *row = &templates[r * template_len];
+        double mean = 0.0, var = 0.0;
+
+        for (i = 0; i < template_len; ++i) {
+            mean += row[i];
+        }
+        mean /= template_len;
+        for (i = 0; i < template_len; ++i) {
+            var += (row[i] - mean) * (row[i] - mean);
+        }
+        var = sqrt(var / template_len) * template_len;
+        for (i = 0; i < template_len; ++i) {
+            row[i] = (float) ((row[i] - mean) / var);
+        }
+    }
+}
+
+
+static float noise(void) {
+    return (float) rand() / RAND_MAX - 0.5f;
+}
+
+
+int main(int argc, char **argv) {
+    long n_templates, n_channels, template_len, image_len, fft_len, i;
+    int threads_outer, threads_inner, repeats = 3, split_templates = 0, r, ret = 0;
+    float *templates, *image, *ncc;
+    int *used_chans, *pad_array, *variance_warning;
+    double best_fresh = -1.0, best_reused = -1.0, t0, elapsed;
+    void *workspace;
+
+    if (argc < 8) {
+        fprintf(stderr, "Usage: %s n_templates n_channels template_len image_len fft_len "
+                "threads_outer threads_inner [repeats] [split_templates]\n", argv[0]);
+        return 2;
+    }
+    n_templates = atol(argv[1]);
+    n_channels = atol(argv[2]);
+    template_len = atol(argv[3]);
+    image_len = atol(argv[4]);
+    fft_len = atol(argv[5]);
+    threads_outer = atoi(argv[6]);
+    threads_inner = atoi(argv[7]);
+    if (argc > 8) {
+        repeats = atoi(argv[8]);
+    }
+    if (argc > 9) {
+        split_templates = atoi(argv[9]);
+    }
+    if (fft_len <= 0) {
+        fft_len = fast_len(template_len + image_len - 1);
+    }
+
+    templates = (float*) malloc((size_t) n_templates * n_channels * template_len * sizeof(float));
+    image = (float*) malloc((size_t) n_channels * image_len * sizeof(float));
+    ncc = (float*) malloc((size_t) n_templates * (image_len - template_len + 1) * sizeof(float));
+    used_chans = (int*) malloc((size_t) n_templates * n_channels * sizeof(int));
+    pad_array = (int*) calloc((size_t) n_templates * n_channels, sizeof(int));
+    variance_warning = (int*) calloc(n_channels, sizeof(int));
+    if (templates == NULL || image == NULL || ncc == NULL || used_chans == NULL ||
+        pad_array == NULL || variance_warning == NULL) {
+        fprintf(stderr, "Error allocating memory\n");
+        return 1;
+    }
+    srand(42);
+    for (i = 0; i < n_templates * n_channels * template_len; ++i) {
+        templates[i] = noise();
+    }
+    for (i = 0; i < n_channels * image_len; ++i) {
+        image[i] = noise();
+    }
+    for (i = 0; i < n_templates * n_channels; ++i) {
+        used_chans[i] = 1;
+    }
+    normalise_templates(templates, n_templates * n_channels, template_len);
+
+    workspace = create_correlator_workspace(n_templates, template_len, n_channels, fft_len,
+                                            threads_outer, split_templates, 1);
+    get_workspace_peak_memory(1);
+    for (r = 0; r < repeats && ret == 0; ++r) {
+        // Without a workspace buffers are allocated for the call
+        for (i = 0; i < n_templates * (image_len - template_len + 1); ++i) {
+            ncc[i] = 0.0;
+        }
+        t0 = wall_time();
+        ret = multi_normxcorr_fftw(templates, n_templates, template_len, n_channels, image,
+                                   image_len, NULL, ncc, fft_len, used_chans, pad_array, threads_outer,
+                                   threads_inner, variance_warning, split_templates, NULL, NULL);
+        elapsed = wall_time() - t0;
+        if (best_fresh < 0 || elapsed < best_fresh) {
+            best_fresh = elapsed;
+        }
+        if (ret != 0 && ret != 999) {
+            break;
+        }
+        for (i = 0; i < n_templates * (image_len - template_len + 1); ++i) {
+            ncc[i] = 0.0;
+        }
+        t0 = wall_time();
+        ret = multi_normxcorr_fftw(templates, n_templates, template_len, n_channels, image,
+                                   image_len, NULL, ncc, fft_len, used_chans, pad_array, threads_outer,
+                                   threads_inner, variance_warning, split_templates, workspace, NULL);
+        elapsed = wall_time() - t0;
+        if (best_reused < 0 || elapsed < best_reused) {
+            best_reused = elapsed;
+        }
+        if (ret == 999) {
+            ret = 0;
+        }
+    }
+    printf("{\"benchmark\": \"multi_normxcorr_fftw\", \"n_templates\": %ld, \"n_channels\": %ld, "
+           "\"template_len\": %ld, \"data_len\": %ld, \"fft_len\": %ld, \"threads_outer\": %d, "
+           "\"threads_inner\": %d, \"threads\": %d, \"split_templates\": %d, "
+           "\"seconds\": %.9f, \"seconds_workspace\": %.9f, \"throughput\": %.6e, "
+           "\"workspace_peak\": %lld, \"status\": %d}\n",
+           n_templates, n_channels, template_len, image_len, fft_len, threads_outer,
+           threads_inner, threads_outer * threads_inner, split_templates, best_fresh,
+           best_reused, (double) n_templates * n_channels * image_len / best_reused,
+           get_workspace_peak_memory(0), ret);
+
+    free_correlator_workspace(workspace);
+    free(templates);
+    free(image);
+    free(ncc);
+    free(used_chans);
+    free(pad_array);
+    free(variance_warning);
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  brightness.c
+ *
+ *        Purpose:  In-memory delay-and-stack of energy envelopes for brightness
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Prototypes
+int brightness_stack(double*, long, long, int*, long, double, double*, long*, int);
+
+// Peak of each normalised energy trace, as in eqcorrscan.core.bright_lights
+#define ENERGY_PEAK 500
+
+
+int brightness_stack(double *energy, long npts, long n_chans, int *shifts, long n_nodes,
+                     double clip_level, double *cum_net_resp, long *peak_nodes, int num_threads){
+    /*
+    Delay-and-stack the energy of each channel for every node and keep the
+    maximum network response and the node it came from at each sample, as
+    eqcorrscan.core.bright_lights._node_loop and _cum_net_resp without storing
+    the response of every node.
+
+    For each node and channel the energy is advanced by the node's lag (zero
+    padded at the end), clipped at clip_level times its mean, scaled to peak at
+    ENERGY_PEAK and truncated to an integer before summing across channels.
+
+    energy:         Energy (squared amplitude) of each channel, one row of npts samples
+    npts:           Number of samples in each channel
+    n_chans:        Number of channels
+    shifts:         Lag in samples of each channel for each node, row node of n_chans
+    n_nodes:        Number of nodes
+    clip_level:     Energy is clipped at this multiple of its mean
+    cum_net_resp:   Output, maximum network response at each sample
+    peak_nodes:     Output, first node with the maximum response at each sample
+    num_threads:    Number of node blocks to stack in parallel
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int node, ret = 0;
+    long c, t;
+    // Sums and maxima of energy from each sample to the end give the mean and the
+    // peak of any advanced trace without touching the data
+    double *tail_sum = (double*) malloc((size_t) n_chans * (npts + 1) * sizeof(double));
+    double *tail_max = (double*) malloc((size_t) n_chans * (npts + 1) * sizeof(double));
+
+    if (tail_sum == NULL || tail_max == NULL){
+        printf("Error allocating memory for brightness\n");
+        free(tail_sum);
+        free(tail_max);
+        return -1;
+    }
+    for (c = 0; c < n_chans; ++c){
+        double *chan_energy = &energy[c * npts];
+        double *chan_sum = &tail_sum[c * (npts + 1)], *chan_max = &tail_max[c * (npts + 1)];
+
+        chan_sum[npts] = 0.0;
+        chan_max[npts] = 0.0;
+        for (t = npts - 1; t >= 0; --t){
+            chan_sum[t] = chan_sum[t + 1] + chan_energy[t];
+            chan_max[t] = (chan_energy[t] > chan_max[t + 1]) ? chan_energy[t] : chan_max[t + 1];
+        }
+    }
+    for (t = 0; t < npts; ++t){
+        cum_net_resp[t] = -1.0;
+        peak_nodes[t] = 0;
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        // Running maximum over this thread's block of nodes
+        int *stack = (int*) malloc((size_t) npts * sizeof(int));
+        int *best = (int*) malloc((size_t) npts * sizeof(int));
+        long *best_node = (long*) malloc((size_t) npts * sizeof(long));
+        int have_nodes = 0;
+        long chan, i;
+
+        if (stack == NULL || best == NULL || best_node == NULL){
+            #pragma omp critical (brightness_memory)
+            ret = -1;
+        }
+        #pragma omp for schedule(static)
+        for (node = 0; node < (int) n_nodes; ++node){
+            int *node_shifts = &shifts[(long) node * n_chans];
+
+            if (stack == NULL || best == NULL || best_node == NULL){
+                continue;
+            }
+            memset(stack, 0, (size_t) npts * sizeof(int));
+            for (chan = 0; chan < n_chans; ++chan){
+                long shift = node_shifts[chan], n_valid = npts - shift;
+                double *chan_energy = &energy[chan * npts + shift];
+                double cap, peak, scale;
+
+                if (shift < 0 || n_valid <= 0){
+                    continue;
+                }
+                cap = clip_level * tail_sum[chan * (npts + 1) + shift] / npts;
+                peak = tail_max[chan * (npts + 1) + shift];
+                if (cap < peak){
+                    peak = cap;
+                }
+                if (peak <= 0){
+                    continue;
+                }
+                scale = ENERGY_PEAK / peak;
+                for (i = 0; i < n_valid; ++i){
+                    double value = chan_energy[i];
+
+                    stack[i] += (int) (((value < cap) ? value : cap) * scale);
+                }
+            }
+            if (have_nodes == 0){
+                memcpy(best, stack, (size_t) npts * sizeof(int));
+                for (i = 0; i < npts; ++i){
+                    best_node[i] = node;
+                }
+                have_nodes = 1;
+                continue;
+            }
+            // Nodes arrive in increasing order, so ties keep the earlier node
+            for (i = 0; i < npts; ++i){
+                if (stack[i] > best[i]){
+                    best[i] = stack[i];
+                    best_node[i] = node;
+                }
+            }
+        }
+        if (have_nodes){
+            #pragma omp critical (brightness_reduce)
+            {
+                for (i = 0; i < npts; ++i){
+                    if (best[i] > cum_net_resp[i] ||
+                        (best[i] == cum_net_resp[i] && best_node[i] < peak_nodes[i])){
+                        cum_net_resp[i] = best[i];
+                        peak_nodes[i] = best_node[i];
+                    }
+                }
+            }
+        }
+        free(stack);
+        free(best);
+        free(best_node);
+    }
+    free(tail_sum);
+    free(tail_max);
+    if (ret != 0){
+        printf("Error allocating memory for brightness stacks\n");
+    }
+    return ret;
+}
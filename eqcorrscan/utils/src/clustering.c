@@ -0,0 +1,285 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  clustering.c
+ *
+ *        Purpose:  All-pairs cross-channel coherence for waveform clustering
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fftw3.h>
+
+// Prototypes
+int distance_matrix_fftw(float*, long*, long, long*, long*, long*, long, long, int, long*, long,
+                         long, double*, int);
+
+static double pair_correlation(float*, long*, long, double*, double*, double*, fftwf_complex*,
+                               long, int, long, long, long, fftwf_complex*, float*, fftwf_plan);
+
+// Define minimum variance to compute correlations, as in multi_corr.c
+#define ACCEPTED_DIFF 1e-10
+
+
+static double pair_correlation(float *data, long *row_lens, long row_stride, double *means,
+                               double *energies, double *scales, fftwf_complex *spectra,
+                               long n_complex, int allow_shift, long max_shift, long row_a,
+                               long row_b, fftwf_complex *product, float *ccc, fftwf_plan pb){
+    /*
+    Correlation of two rows: at zero lag over the shorter row, or the largest
+    magnitude correlation within +/- max_shift samples of the demeaned rows.
+    */
+    long len_a = row_lens[row_a], len_b = row_lens[row_b], min_len, k, fft_len;
+    float *a = &data[row_a * row_stride], *b = &data[row_b * row_stride];
+    double sum_a = 0.0, sum_b = 0.0, sum_ab = 0.0, sum_a2 = 0.0, sum_b2 = 0.0, var_a, var_b, cc;
+
+    if (allow_shift){
+        fftwf_complex *spec_a = &spectra[row_a * n_complex], *spec_b = &spectra[row_b * n_complex];
+        double best = 0.0;
+
+        if (scales[row_a] == 0 || scales[row_b] == 0){
+            return 0.0;
+        }
+        fft_len = 2 * (n_complex - 1);
+        // Cross-spectrum, conj(a) * b, so that ccc[k] is a[t] against b[t + k]
+        for (k = 0; k < n_complex; ++k){
+            product[k][0] = spec_a[k][0] * spec_b[k][0] + spec_a[k][1] * spec_b[k][1];
+            product[k][1] = spec_a[k][0] * spec_b[k][1] - spec_a[k][1] * spec_b[k][0];
+        }
+        fftwf_execute_dft_c2r(pb, product, ccc);
+        for (k = -max_shift; k <= max_shift; ++k){
+            cc = ccc[(k + fft_len) % fft_len];
+            if (fabs(cc) > fabs(best)){
+                best = cc;
+            }
+        }
+        return best * scales[row_a] * scales[row_b] / fft_len;
+    }
+    if (len_a == len_b){
+        // Pearson correlation from the row means and energies
+        if (energies[row_a] / len_a < ACCEPTED_DIFF || energies[row_b] / len_b < ACCEPTED_DIFF){
+            return 0.0;
+        }
+        for (k = 0; k < len_a; ++k){
+            sum_ab += (a[k] - means[row_a]) * (b[k] - means[row_b]);
+        }
+        return sum_ab / sqrt(energies[row_a] * energies[row_b]);
+    }
+    min_len = (len_a < len_b) ? len_a : len_b;
+    for (k = 0; k < min_len; ++k){
+        sum_a += a[k];
+        sum_b += b[k];
+        sum_ab += (double) a[k] * b[k];
+        sum_a2 += (double) a[k] * a[k];
+        sum_b2 += (double) b[k] * b[k];
+    }
+    var_a = sum_a2 / min_len - (sum_a / min_len) * (sum_a / min_len);
+    var_b = sum_b2 / min_len - (sum_b / min_len) * (sum_b / min_len);
+    if (var_a < ACCEPTED_DIFF || var_b < ACCEPTED_DIFF){
+        return 0.0;
+    }
+    cc = (sum_ab / min_len - (sum_a / min_len) * (sum_b / min_len)) / sqrt(var_a * var_b);
+    return cc;
+}
+
+
+int distance_matrix_fftw(float *data, long *row_lens, long row_stride, long *row_keys,
+                         long *row_shifts, long *stream_rows, long n_streams, long n_keys,
+                         int allow_shift, long *key_rows, long fft_len, long tile,
+                         double *dist_mat, int num_threads){
+    /*
+    Compute the waveform distance matrix of many streams as
+    eqcorrscan.utils.clustering.distance_matrix: one minus the mean correlation
+    of the channels that each pair of streams share, rounded to six decimals.
+
+    Only the upper triangle is correlated, in square tiles of streams so that the
+    rows of both tiles are reused while they are in cache, and each pair is
+    written to both halves of the output. When shifts are allowed every row is
+    transformed once up front.
+
+    data:           Channels of all streams, one per row of row_stride samples
+    row_lens:       Number of samples in each row
+    row_stride:     Samples per row
+    row_keys:       Index of the station and channel of each row
+    row_shifts:     Maximum shift in samples for each row, when it is the first of a pair
+    stream_rows:    Rows of stream i are stream_rows[i] to stream_rows[i + 1] - 1
+    n_streams:      Number of streams
+    n_keys:         Number of distinct stations and channels
+    allow_shift:    Whether to take the largest correlation within the shifts
+    key_rows:       First row of stream i for key k at i * n_keys + k, -1 if none
+    fft_len:        Transform length, at least the longest row plus the largest shift
+    tile:           Number of streams per tile
+    dist_mat:       Output, n_streams x n_streams distance matrix
+    num_threads:    Number of threads to use
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int pair, n_tile_pairs, ret = 0;
+    long r, k, ti, tj, n_rows = stream_rows[n_streams], n_tiles, n_complex = fft_len / 2 + 1;
+    long *tile_pairs = NULL;
+    double *means = (double*) malloc((size_t) n_rows * sizeof(double));
+    double *energies = (double*) malloc((size_t) n_rows * sizeof(double));
+    double *scales = (double*) malloc((size_t) n_rows * sizeof(double));
+    fftwf_complex *spectra = NULL;
+    float *real_buf = NULL;
+    fftwf_plan pa = NULL, pb = NULL;
+
+    if (tile < 1){
+        tile = 1;
+    }
+    n_tiles = (n_streams + tile - 1) / tile;
+    n_tile_pairs = (int) (n_tiles * (n_tiles + 1) / 2);
+    tile_pairs = (long*) malloc((size_t) 2 * (n_tile_pairs + 1) * sizeof(long));
+    if (allow_shift){
+        spectra = (fftwf_complex*) fftwf_malloc((size_t) n_rows * n_complex * sizeof(fftwf_complex));
+        real_buf = (float*) fftwf_malloc((size_t) fft_len * sizeof(float));
+    }
+    if (means == NULL || energies == NULL || scales == NULL || tile_pairs == NULL ||
+        (allow_shift && (spectra == NULL || real_buf == NULL))){
+        printf("Error allocating memory for distance matrix\n");
+        free(means);
+        free(energies);
+        free(scales);
+        free(tile_pairs);
+        fftwf_free(spectra);
+        fftwf_free(real_buf);
+        return -1;
+    }
+    if (allow_shift){
+        // The planner is not thread-safe, share its lock with multi_corr.c
+        #pragma omp critical (fftw_planner)
+        {
+            // Rows of spectra need not share the alignment of the first
+            pa = fftwf_plan_dft_r2c_1d((int) fft_len, real_buf, spectra,
+                                       FFTW_ESTIMATE | FFTW_UNALIGNED);
+            pb = fftwf_plan_dft_c2r_1d((int) fft_len, spectra, real_buf, FFTW_ESTIMATE);
+        }
+    }
+    // Demean every row once, and transform it if shifts are allowed
+    for (r = 0; r < n_rows; ++r){
+        float *row = &data[r * row_stride];
+
+        means[r] = 0.0;
+        energies[r] = 0.0;
+        for (k = 0; k < row_lens[r]; ++k){
+            means[r] += row[k];
+        }
+        means[r] /= (row_lens[r] > 0) ? row_lens[r] : 1;
+        for (k = 0; k < row_lens[r]; ++k){
+            energies[r] += (row[k] - means[r]) * (row[k] - means[r]);
+        }
+        scales[r] = (row_lens[r] > 0 && energies[r] / row_lens[r] >= ACCEPTED_DIFF) ?
+                    1.0 / sqrt(energies[r]) : 0.0;
+        if (allow_shift){
+            memset(real_buf, 0, (size_t) fft_len * sizeof(float));
+            for (k = 0; k < row_lens[r]; ++k){
+                real_buf[k] = (float) (row[k] - means[r]);
+            }
+            fftwf_execute_dft_r2c(pa, real_buf, &spectra[r * n_complex]);
+        }
+    }
+    k = 0;
+    for (ti = 0; ti < n_tiles; ++ti){
+        for (tj = ti; tj < n_tiles; ++tj){
+            tile_pairs[2 * k] = ti;
+            tile_pairs[2 * k + 1] = tj;
+            ++k;
+        }
+    }
+    for (k = 0; k < n_streams; ++k){
+        dist_mat[k * n_streams + k] = 0.0;
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        fftwf_complex *product = NULL;
+        float *ccc = NULL;
+
+        if (allow_shift){
+            product = (fftwf_complex*) fftwf_malloc((size_t) n_complex * sizeof(fftwf_complex));
+            ccc = (float*) fftwf_malloc((size_t) fft_len * sizeof(float));
+            if (product == NULL || ccc == NULL){
+                #pragma omp critical (clustering_memory)
+                ret = -1;
+            }
+        }
+        #pragma omp for schedule(dynamic)
+        for (pair = 0; pair < n_tile_pairs; ++pair){
+            long i, j, i_end, j_start, j_end, q, row, n_chans;
+            double coherence;
+
+            if (allow_shift && (product == NULL || ccc == NULL)){
+                continue;
+            }
+            i_end = (tile_pairs[2 * pair] + 1) * tile;
+            j_end = (tile_pairs[2 * pair + 1] + 1) * tile;
+            if (i_end > n_streams){
+                i_end = n_streams;
+            }
+            if (j_end > n_streams){
+                j_end = n_streams;
+            }
+            for (i = tile_pairs[2 * pair] * tile; i < i_end; ++i){
+                j_start = tile_pairs[2 * pair + 1] * tile;
+                if (j_start <= i){
+                    j_start = i + 1;
+                }
+                for (j = j_start; j < j_end; ++j){
+                    coherence = 0.0;
+                    n_chans = 0;
+                    // Every channel of the first stream against the first matching
+                    // channel of the second
+                    for (row = stream_rows[i]; row < stream_rows[i + 1]; ++row){
+                        q = key_rows[j * n_keys + row_keys[row]];
+                        if (q < 0){
+                            continue;
+                        }
+                        coherence += pair_correlation(
+                            data, row_lens, row_stride, means, energies, scales, spectra,
+                            n_complex, allow_shift, row_shifts[row], row, q, product, ccc,
+                            pb);
+                        n_chans++;
+                    }
+                    if (n_chans > 0){
+                        coherence = rint(coherence / n_chans * 1e6) / 1e6;
+                    }
+                    dist_mat[i * n_streams + j] = 1.0 - coherence;
+                    dist_mat[j * n_streams + i] = 1.0 - coherence;
+                }
+            }
+        }
+        fftwf_free(product);
+        fftwf_free(ccc);
+    }
+    if (allow_shift){
+        #pragma omp critical (fftw_planner)
+        {
+            fftwf_destroy_plan(pa);
+            fftwf_destroy_plan(pb);
+        }
+    }
+    free(means);
+    free(energies);
+    free(scales);
+    free(tile_pairs);
+    fftwf_free(spectra);
+    fftwf_free(real_buf);
+    if (ret != 0){
+        printf("Error allocating memory for distance matrix\n");
+    }
+    return ret;
+}
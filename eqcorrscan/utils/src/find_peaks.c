@@ -20,36 +20,504 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#if defined(__linux__) || defined(__linux) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    #include <omp.h>
+    #ifndef N_THREADS
+        #define N_THREADS omp_get_max_threads()
+    #endif
+#endif
+// Threshold types for multi_find_peaks_compiled
+#define THRESHOLD_ABSOLUTE 0
+#define THRESHOLD_MAD 1
+#define THRESHOLD_AV_CHAN_CORR 2
+
+typedef struct {
+    float value;
+    long long index;
+} Peak;
+
+typedef struct {
+    double abs_value;
+    long long index;
+    long position;
+} Candidate;
+
+// Peaks of each array, held between calls if the outputs were too short.
+typedef struct {
+    long n_arrays;
+    long *counts;
+    Peak **found;
+} FoundPeaks;
 
  // Prototypes
-int find_peaks(float*, float*, int, float, float, unsigned int*);
+int multi_find_peaks_compiled(float*, long, long, double*, int, int*, long, int, int, long,
+                              int*, long long*, float*, long*, FoundPeaks**);
+
+int copy_found_peaks(FoundPeaks*, int*, long long*, float*);
+
+void free_found_peaks(FoundPeaks*);
+
+static float median_abs(float*, long, float*);
+
+static long find_array_peaks(float*, long, float, long, int, Peak**);
+
+static long decluster_peaks(Peak*, long, long);
+
+int decluster(double*, long long*, long, long long, long long*, long*);
+
+static long decluster_candidates(Candidate*, long, long long, long long*);
 
 // Functions
-// Longs could be unsigned ints...
-int find_peaks(float *arr, float *indexes, int len, float thresh, float trig_int,
-               unsigned int *out){
-    // Takes a sorted array an the indexes
-    int i, j, keep;
-    float step;
-    // Take first (highest) peak
-    out[0] = 1;
-    for (i = 1; i < len; ++i){
-        keep = 1;
-        // Threshold is for absolute values
-//        if (-1 * thresh < arr[i] && arr[i] < thresh){
-//            break;
-//        }
-        for (j = 0; j < len; ++j){
-            step = indexes[i] - indexes[j];
-            if (step < 0){step *= -1;}
-            if (i != j && trig_int > step && out[j] == 1){
-                keep = 0;
-                break;
-            }
-        }
-        if (keep == 1){out[i] = 1;}
-        else {out[i] = 0;}
+static float median_abs(float *arr, long len, float *work){
+    /* Median of the absolute values of arr, as numpy.median, using
+     * quickselect on a copy in work (length len). */
+    long i, j, left = 0, right = len - 1, k = len / 2;
+    float pivot, tmp, lower;
+
+    if (len < 1){
+        return 0.0f;
+    }
+    for (i = 0; i < len; ++i){
+        work[i] = fabsf(arr[i]);
+    }
+    while (left < right){
+        // Median of three pivot
+        long mid = left + (right - left) / 2;
+        if (work[mid] < work[left]){tmp = work[mid]; work[mid] = work[left]; work[left] = tmp;}
+        if (work[right] < work[left]){tmp = work[right]; work[right] = work[left]; work[left] = tmp;}
+        if (work[right] < work[mid]){tmp = work[right]; work[right] = work[mid]; work[mid] = tmp;}
+        pivot = work[mid];
+        i = left;
+        j = right;
+        while (i <= j){
+            while (work[i] < pivot){++i;}
+            while (work[j] > pivot){--j;}
+            if (i <= j){
+                tmp = work[i]; work[i] = work[j]; work[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+        if (k <= j){
+            right = j;
+        } else if (k >= i){
+            left = i;
+        } else {
+            break;
+        }
+    }
+    if (len % 2 == 1){
+        return work[k];
+    }
+    // Even length: average with the largest value below the k'th
+    lower = work[0];
+    for (i = 1; i < k; ++i){
+        if (work[i] > lower){lower = work[i];}
+    }
+    return (lower + work[k]) / 2.0f;
+}
+
+
+static int compare_candidate_value(const void *a, const void *b){
+    /* Sort by descending absolute value, ties in input order */
+    const Candidate *ca = (const Candidate *) a;
+    const Candidate *cb = (const Candidate *) b;
+
+    if (ca->abs_value > cb->abs_value){return -1;}
+    if (ca->abs_value < cb->abs_value){return 1;}
+    if (ca->position < cb->position){return -1;}
+    if (ca->position > cb->position){return 1;}
+    return 0;
+}
+
+
+static int compare_candidate_index(const void *a, const void *b){
+    /* Sort by index, ties in input order */
+    const Candidate *ca = (const Candidate *) a;
+    const Candidate *cb = (const Candidate *) b;
+
+    if (ca->index < cb->index){return -1;}
+    if (ca->index > cb->index){return 1;}
+    if (ca->position < cb->position){return -1;}
+    if (ca->position > cb->position){return 1;}
+    return 0;
+}
+
+
+static int compare_peak_index(const void *a, const void *b){
+    const Peak *pa = (const Peak *) a;
+    const Peak *pb = (const Peak *) b;
+
+    if (pa->index < pb->index){return -1;}
+    if (pa->index > pb->index){return 1;}
+    return 0;
+}
+
+
+static long decluster_candidates(Candidate *candidates, long n, long long trig_int,
+                                 long long *kept){
+    /* Keep candidates from largest to smallest absolute value, dropping any
+     * within trig_int (exclusive) of a candidate already kept. Kept peaks
+     * are counted in a Fenwick tree over the index-sorted candidates, so
+     * each check is O(log n).
+     * candidates are re-ordered. The positions of the kept candidates are
+     * written to kept in the order they were accepted, and the number kept
+     * is returned, or -1 on memory error. */
+    long i, n_kept = 0;
+    long *rank = NULL, *tree = NULL;
+    long long *sorted_index = NULL;
+
+    rank = (long *) malloc(n * sizeof(long));
+    tree = (long *) calloc(n + 1, sizeof(long));
+    sorted_index = (long long *) malloc(n * sizeof(long long));
+    if (rank == NULL || tree == NULL || sorted_index == NULL){
+        free(rank); free(tree); free(sorted_index);
+        return -1;
+    }
+    qsort(candidates, n, sizeof(Candidate), compare_candidate_index);
+    for (i = 0; i < n; ++i){
+        rank[candidates[i].position] = i;
+        sorted_index[i] = candidates[i].index;
+    }
+    qsort(candidates, n, sizeof(Candidate), compare_candidate_value);
+    for (i = 0; i < n; ++i){
+        long r = rank[candidates[i].position];
+        long long index = candidates[i].index;
+        long lo, hi, first, last, j, count = 0;
+
+        if (trig_int > 0){
+            // first rank with sorted_index > index - trig_int
+            lo = 0; hi = r;
+            while (lo < hi){
+                long mid = lo + (hi - lo) / 2;
+                if (sorted_index[mid] > index - trig_int){hi = mid;}
+                else {lo = mid + 1;}
+            }
+            first = lo;
+            // first rank with sorted_index >= index + trig_int
+            lo = r; hi = n;
+            while (lo < hi){
+                long mid = lo + (hi - lo) / 2;
+                if (sorted_index[mid] >= index + trig_int){hi = mid;}
+                else {lo = mid + 1;}
+            }
+            last = lo;
+            // count kept in ranks [first, last)
+            for (j = last; j > 0; j -= j & (-j)){count += tree[j];}
+            for (j = first; j > 0; j -= j & (-j)){count -= tree[j];}
+            if (count > 0){
+                continue;
+            }
+        }
+        for (j = r + 1; j <= n; j += j & (-j)){tree[j]++;}
+        kept[n_kept] = candidates[i].position;
+        n_kept++;
+    }
+    free(rank);
+    free(tree);
+    free(sorted_index);
+    return n_kept;
+}
+
+
+int decluster(double *values, long long *indexes, long len, long long trig_int,
+              long long *kept, long *n_kept){
+  /*
+  Purpose: decluster peaks by enforcing a minimum separation, keeping the
+           largest (absolute) peaks.
+  Args:
+    values:     Peak values
+    indexes:    Peak locations (e.g. samples or microseconds)
+    len:        Number of peaks
+    trig_int:   Minimum separation of peaks, in the units of indexes
+    kept:       Output: positions (in values) of the peaks kept, from largest
+                to smallest - must be len long
+    n_kept:     Output: number of peaks kept
+  Returns:
+    0 on success, 1 on memory error
+  */
+    long i;
+    Candidate *candidates = (Candidate *) malloc(len * sizeof(Candidate));
+
+    if (candidates == NULL){
+        printf("Error allocating memory in decluster\n");
+        return 1;
+    }
+    for (i = 0; i < len; ++i){
+        candidates[i].abs_value = fabs(values[i]);
+        candidates[i].index = indexes[i];
+        candidates[i].position = i;
+    }
+    *n_kept = decluster_candidates(candidates, len, trig_int, kept);
+    free(candidates);
+    if (*n_kept < 0){
+        printf("Error allocating memory in decluster\n");
+        *n_kept = 0;
+        return 1;
     }
     return 0;
 }
+
+
+static long decluster_peaks(Peak *peaks, long n_peaks, long trig_int){
+    /* Decluster peaks sorted by index: kept peaks are moved to the start of
+     * the array, in index order, and the number kept is returned. Returns -1
+     * on memory error. */
+    long i, n_kept = 0;
+    long long *kept = NULL;
+    char *keep = NULL;
+    Candidate *candidates = NULL;
+
+    if (n_peaks < 2){
+        return n_peaks;
+    }
+    candidates = (Candidate *) malloc(n_peaks * sizeof(Candidate));
+    kept = (long long *) malloc(n_peaks * sizeof(long long));
+    keep = (char *) calloc(n_peaks, sizeof(char));
+    if (candidates == NULL || kept == NULL || keep == NULL){
+        free(candidates); free(kept); free(keep);
+        return -1;
+    }
+    for (i = 0; i < n_peaks; ++i){
+        candidates[i].abs_value = fabs((double) peaks[i].value);
+        candidates[i].index = peaks[i].index;
+        candidates[i].position = i;
+    }
+    n_kept = decluster_candidates(candidates, n_peaks, trig_int, kept);
+    if (n_kept >= 0){
+        for (i = 0; i < n_kept; ++i){
+            keep[kept[i]] = 1;
+        }
+        n_kept = 0;
+        for (i = 0; i < n_peaks; ++i){
+            if (keep[i]){
+                peaks[n_kept] = peaks[i];
+                n_kept++;
+            }
+        }
+    }
+    free(candidates);
+    free(kept);
+    free(keep);
+    return n_kept;
+}
+
+
+static long find_array_peaks(float *arr, long len, float thresh, long trig_int,
+                             int full_peaks, Peak **peaks_out){
+    /* Find peaks in one array as find_peaks2_short: the largest absolute
+     * value in each run of samples at or above thresh (or all samples of
+     * runs longer than trig_int, declustered, if full_peaks), declustered
+     * by trig_int. Peaks are allocated into peaks_out (NULL if none), and
+     * the number of peaks is returned, or -1 on memory error. */
+    long i, start, n_peaks = 0, capacity = 64, n_region;
+    int any_above = 0;
+    Peak *peaks = NULL;
+
+    *peaks_out = NULL;
+    for (i = 0; i < len; ++i){
+        if (fabsf(arr[i]) > thresh){
+            any_above = 1;
+            break;
+        }
+    }
+    if (!any_above){
+        return 0;
+    }
+    peaks = (Peak *) malloc(capacity * sizeof(Peak));
+    if (peaks == NULL){
+        return -1;
+    }
+    i = 0;
+    while (i < len){
+        float value = fabsf(arr[i]);
+        if (!(value >= thresh) || value == 0){
+            ++i;
+            continue;
+        }
+        start = i;
+        while (i < len && fabsf(arr[i]) >= thresh && arr[i] != 0){
+            ++i;
+        }
+        // Region is [start, i)
+        n_region = (full_peaks && i - start > trig_int) ? i - start : 1;
+        if (n_peaks + n_region > capacity){
+            Peak *grown;
+            while (n_peaks + n_region > capacity){
+                capacity *= 2;
+            }
+            grown = (Peak *) realloc(peaks, capacity * sizeof(Peak));
+            if (grown == NULL){
+                free(peaks);
+                return -1;
+            }
+            peaks = grown;
+        }
+        if (n_region > 1){
+            long j, n_kept;
+            for (j = start; j < i; ++j){
+                peaks[n_peaks + j - start].value = arr[j];
+                peaks[n_peaks + j - start].index = j;
+            }
+            n_kept = decluster_peaks(&peaks[n_peaks], n_region, trig_int);
+            if (n_kept < 0){
+                free(peaks);
+                return -1;
+            }
+            n_peaks += n_kept;
+        } else {
+            long j, max_j = start;
+            for (j = start + 1; j < i; ++j){
+                if (fabsf(arr[j]) > fabsf(arr[max_j])){max_j = j;}
+            }
+            peaks[n_peaks].value = arr[max_j];
+            peaks[n_peaks].index = max_j;
+            n_peaks++;
+        }
+    }
+    // Region peaks are in index order
+    qsort(peaks, n_peaks, sizeof(Peak), compare_peak_index);
+    n_peaks = decluster_peaks(peaks, n_peaks, trig_int);
+    if (n_peaks <= 0){
+        free(peaks);
+        return n_peaks;
+    }
+    *peaks_out = peaks;
+    return n_peaks;
+}
+
+
+int multi_find_peaks_compiled(float *arr, long len, long n_arrays, double *thresholds,
+                              int threshold_type, int *no_chans, long trig_int,
+                              int full_peaks, int num_threads, long capacity,
+                              int *peak_arrays, long long *peak_indexes,
+                              float *peak_values, long *n_peaks, FoundPeaks **pending){
+  /*
+  Purpose: find peaks in many arrays (e.g. correlation sums for many
+           templates) in parallel.
+  Args:
+    arr:            Arrays to find peaks in, stacked (n_arrays x len)
+    len:            Length of each array
+    n_arrays:       Number of arrays
+    thresholds:     Threshold input for each array, replaced by the threshold
+                    used: multiplied by the median absolute value of the array
+                    for THRESHOLD_MAD, or by no_chans for
+                    THRESHOLD_AV_CHAN_CORR.
+    threshold_type: THRESHOLD_ABSOLUTE, THRESHOLD_MAD or THRESHOLD_AV_CHAN_CORR
+    no_chans:       Number of channels for each array, used for
+                    THRESHOLD_AV_CHAN_CORR, otherwise may be NULL
+    trig_int:       Minimum separation of peaks in samples
+    full_peaks:     Whether to decluster within long regions above threshold
+                    rather than taking their maximum (as find_peaks2_short)
+    num_threads:    Number of threads to use
+    capacity:       Length of the output arrays
+    peak_arrays:    Output: array number of each peak
+    peak_indexes:   Output: index of each peak
+    peak_values:    Output: value of each peak
+    n_peaks:        Output: number of peaks found. Peaks are ordered by array
+                    then index.
+    pending:        Output: if the output arrays are too short the peaks found,
+                    to be written by copy_found_peaks, otherwise NULL.
+  Returns:
+    0 on success, 1 on memory error, 2 if the output arrays are too short to
+    hold n_peaks peaks, in which case nothing is written to them.
+  */
+    long i;
+    long total = 0;
+    int status = 0;
+    FoundPeaks *results = (FoundPeaks *) malloc(sizeof(FoundPeaks));
+
+    *pending = NULL;
+    if (results == NULL){
+        printf("Error allocating memory in multi_find_peaks_compiled\n");
+        return 1;
+    }
+    results->n_arrays = n_arrays;
+    results->counts = (long *) calloc(n_arrays > 0 ? n_arrays : 1, sizeof(long));
+    results->found = (Peak **) calloc(n_arrays > 0 ? n_arrays : 1, sizeof(Peak *));
+    if (results->counts == NULL || results->found == NULL){
+        printf("Error allocating memory in multi_find_peaks_compiled\n");
+        free_found_peaks(results);
+        return 1;
+    }
+    #ifndef N_THREADS
+    num_threads = 1;
+    #endif
+
+    #pragma omp parallel for reduction(+:status) num_threads(num_threads) schedule(dynamic)
+    for (i = 0; i < n_arrays; ++i){
+        float *sub_arr = &arr[(size_t) i * len];
+
+        if (threshold_type == THRESHOLD_MAD){
+            float *work = (float *) malloc((len > 0 ? len : 1) * sizeof(float));
+            if (work == NULL){
+                printf("Error allocating memory in multi_find_peaks_compiled\n");
+                status += 1;
+                continue;
+            }
+            thresholds[i] *= (double) median_abs(sub_arr, len, work);
+            free(work);
+        } else if (threshold_type == THRESHOLD_AV_CHAN_CORR){
+            thresholds[i] *= no_chans[i];
+        }
+        results->counts[i] = find_array_peaks(sub_arr, len, (float) thresholds[i], trig_int,
+                                              full_peaks, &results->found[i]);
+        if (results->counts[i] < 0){
+            printf("Error allocating memory in multi_find_peaks_compiled\n");
+            results->counts[i] = 0;
+            status += 1;
+        }
+    }
+    for (i = 0; i < n_arrays; ++i){
+        total += results->counts[i];
+    }
+    *n_peaks = total;
+    if (status != 0){
+        free_found_peaks(results);
+        return 1;
+    }
+    if (total > capacity){
+        // Keep the peaks so that only the copy is repeated
+        *pending = results;
+        return 2;
+    }
+    return copy_found_peaks(results, peak_arrays, peak_indexes, peak_values);
+}
+
+
+int copy_found_peaks(FoundPeaks *results, int *peak_arrays, long long *peak_indexes,
+                     float *peak_values){
+    /* Write the peaks held by multi_find_peaks_compiled to outputs long enough
+     * for all of them, ordered by array then index, and free them. */
+    long i, j, k = 0;
+
+    for (i = 0; i < results->n_arrays; ++i){
+        for (j = 0; j < results->counts[i]; ++j){
+            peak_arrays[k] = (int) i;
+            peak_indexes[k] = results->found[i][j].index;
+            peak_values[k] = results->found[i][j].value;
+            k++;
+        }
+    }
+    free_found_peaks(results);
+    return 0;
+}
+
+
+void free_found_peaks(FoundPeaks *results){
+    long i;
+
+    if (results == NULL){
+        return;
+    }
+    if (results->found != NULL){
+        for (i = 0; i < results->n_arrays; ++i){
+            free(results->found[i]);
+        }
+    }
+    free(results->found);
+    free(results->counts);
+    free(results);
+}
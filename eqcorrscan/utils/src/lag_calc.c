@@ -0,0 +1,373 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  lag_calc.c
+ *
+ *        Purpose:  Batched correlation and peak refinement for lag-calc and dt.cc
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#if (defined(_MSC_VER))
+    #include <float.h>
+    #define isnan(x) _isnan(x)
+#endif
+
+// Prototypes
+int lag_calc_correlate(float*, long*, long, long, float*, long*, long, long, int, double*,
+                       double*, int*, int);
+
+int pick_correction_correlate(float*, long*, float*, long*, long, long, long*, double*, double*,
+                              int*, int);
+
+static int refine_peak(double*, long, int, double*, double*);
+
+// Define minimum variance to compute correlations, as in multi_corr.c
+#define ACCEPTED_DIFF 1e-10
+
+// Status of each correlation, as in eqcorrscan.core.lag_calc. The low bits are
+// exclusive outcomes, the high bits are warnings about the interpolation.
+#define LAG_OK 0
+#define LAG_NO_DATA 1
+#define LAG_TOO_SHORT 2
+#define LAG_NAN 3
+#define LAG_NOT_SMOOTH 8
+#define LAG_FEW_SAMPLES 16
+#define LAG_OPENS_UP 32
+#define LAG_LARGE_RESIDUAL 64
+#define LAG_AT_EDGE 128
+
+
+static int refine_peak(double *ccc, long n_steps, int interpolate, double *shift, double *cc_max){
+    /*
+    Find the peak of a correlation, optionally by fitting a parabola to the
+    samples around the maximum with negative curvature, as
+    eqcorrscan.core.lag_calc._xcorr_interp. Shift is in samples.
+    */
+    long k, peak = 0, first, last, n_fit;
+    double s[5] = {0.0, 0.0, 0.0, 0.0, 0.0}, t[3] = {0.0, 0.0, 0.0};
+    double det, a, b, c, x, residual = 0.0, misfit;
+    int flags = LAG_OK;
+
+    for (k = 0; k < n_steps; ++k){
+        if (isnan(ccc[k])){
+            return LAG_NAN;
+        }
+        if (ccc[k] > ccc[peak]){
+            peak = k;
+        }
+    }
+    *shift = (double) peak;
+    *cc_max = ccc[peak];
+    if (interpolate == 0){
+        return LAG_OK;
+    }
+    // Extend while the curvature (second difference, zero at the ends) is negative
+    first = peak;
+    while (first > 0 && (first - 1 == 0 ? 0.0 :
+           ccc[first] - 2 * ccc[first - 1] + ccc[first - 2]) <= 0){
+        first--;
+    }
+    last = peak;
+    while (last < n_steps - 1 && (last + 1 == n_steps - 1 ? 0.0 :
+           ccc[last + 2] - 2 * ccc[last + 1] + ccc[last]) <= 0){
+        last++;
+    }
+    if (first == 0 || last == n_steps - 1){
+        // Fitting at the maximum lag, the peak may be outside the window
+        flags |= LAG_AT_EDGE;
+    }
+    n_fit = last - first + 1;
+    if (n_fit < 3){
+        // Keep the maximum sample
+        return flags | LAG_NOT_SMOOTH;
+    }
+    if (n_fit < 5){
+        flags |= LAG_FEW_SAMPLES;
+    }
+    // Least-squares parabola in samples relative to the peak
+    for (k = first; k <= last; ++k){
+        x = (double) (k - peak);
+        s[0] += 1.0;
+        s[1] += x;
+        s[2] += x * x;
+        s[3] += x * x * x;
+        s[4] += x * x * x * x;
+        t[0] += ccc[k];
+        t[1] += x * ccc[k];
+        t[2] += x * x * ccc[k];
+    }
+    det = s[4] * (s[2] * s[0] - s[1] * s[1]) - s[3] * (s[3] * s[0] - s[1] * s[2]) +
+          s[2] * (s[3] * s[1] - s[2] * s[2]);
+    a = (t[2] * (s[2] * s[0] - s[1] * s[1]) - s[3] * (t[1] * s[0] - s[1] * t[0]) +
+         s[2] * (t[1] * s[1] - s[2] * t[0])) / det;
+    b = (s[4] * (t[1] * s[0] - s[1] * t[0]) - t[2] * (s[3] * s[0] - s[1] * s[2]) +
+         s[2] * (s[3] * t[0] - t[1] * s[2])) / det;
+    c = (s[4] * (s[2] * t[0] - t[1] * s[1]) - s[3] * (s[3] * t[0] - t[1] * s[2]) +
+         t[2] * (s[3] * s[1] - s[2] * s[2])) / det;
+    for (k = first; k <= last; ++k){
+        x = (double) (k - peak);
+        misfit = ccc[k] - (a * x * x + b * x + c);
+        residual += misfit * misfit;
+    }
+    if (residual > 0.1){
+        flags |= LAG_LARGE_RESIDUAL;
+    }
+    if (a == 0){
+        // No vertex, keep the maximum sample
+        return flags | LAG_OPENS_UP;
+    }
+    if (a > 0){
+        flags |= LAG_OPENS_UP;
+    }
+    // Vertex of the parabola
+    *shift = (double) peak - b / 2.0 / a;
+    *cc_max = (4 * a * c - b * b) / (4 * a);
+    return flags;
+}
+
+
+int lag_calc_correlate(float *templates, long *template_lens, long n_chans, long template_stride,
+                       float *images, long *image_lens, long n_detections, long image_stride,
+                       int interpolate, double *shifts, double *ccs, int *status, int num_threads){
+    /*
+    Correlate each channel of a template with the data around each of a set of
+    detections, and find the (optionally interpolated) peak of each correlation.
+
+    templates:      Template channels, one per row of template_stride samples
+    template_lens:  Number of samples used in each template row
+    n_chans:        Number of template channels
+    images:         Detection windows, row (detection * n_chans + channel) holds
+                    the data for that channel of that detection
+    image_lens:     Number of samples in each image row, zero if there are no data
+    n_detections:   Number of detections
+    image_stride:   Samples per image row
+    interpolate:    Whether to fit a parabola to the peak of the correlation
+    shifts:         Output, samples from the start of each image row to the peak
+    ccs:            Output, correlation at the peak
+    status:         Output, LAG_* outcome of each correlation
+    num_threads:    Number of threads to correlate with
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int pair, n_pairs = (int) (n_detections * n_chans), ret = 0;
+    long c, p, max_steps = 1;
+    double *norm_templates = (double*) malloc((size_t) n_chans * template_stride * sizeof(double));
+    double *auto_a = (double*) malloc((size_t) n_chans * sizeof(double));
+
+    if (norm_templates == NULL || auto_a == NULL){
+        printf("Error allocating memory for lag-calc templates\n");
+        free(norm_templates);
+        free(auto_a);
+        return -1;
+    }
+    // Remove the mean of the templates once
+    for (c = 0; c < n_chans; ++c){
+        double mean = 0.0;
+        float *template_row = &templates[c * template_stride];
+        double *norm_row = &norm_templates[c * template_stride];
+
+        for (p = 0; p < template_lens[c]; ++p){
+            mean += template_row[p];
+        }
+        mean /= template_lens[c] > 0 ? template_lens[c] : 1;
+        auto_a[c] = 0.0;
+        for (p = 0; p < template_lens[c]; ++p){
+            norm_row[p] = template_row[p] - mean;
+            auto_a[c] += norm_row[p] * norm_row[p];
+        }
+    }
+    for (pair = 0; pair < n_pairs; ++pair){
+        c = pair % n_chans;
+        if (image_lens[pair] - template_lens[c] + 1 > max_steps){
+            max_steps = image_lens[pair] - template_lens[c] + 1;
+        }
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        double *ccc = (double*) malloc((size_t) max_steps * sizeof(double));
+
+        if (ccc == NULL){
+            #pragma omp critical (lag_calc_memory)
+            ret = -1;
+        }
+        #pragma omp for schedule(dynamic)
+        for (pair = 0; pair < n_pairs; ++pair){
+            long chan = pair % n_chans, tl = template_lens[chan], n_steps, k, q;
+            float *image = &images[(long) pair * image_stride];
+            double *template_row = &norm_templates[chan * template_stride];
+            double sum = 0.0, sum_sq = 0.0, mean, var, numerator;
+
+            shifts[pair] = 0.0;
+            ccs[pair] = 0.0;
+            if (ccc == NULL){
+                continue;
+            }
+            if (image_lens[pair] == 0 || tl == 0){
+                status[pair] = LAG_NO_DATA;
+                continue;
+            }
+            if (image_lens[pair] < tl){
+                status[pair] = LAG_TOO_SHORT;
+                continue;
+            }
+            if (auto_a[chan] == 0){
+                // Flat templates cannot be normalised
+                status[pair] = LAG_NAN;
+                continue;
+            }
+            n_steps = image_lens[pair] - tl + 1;
+            for (q = 0; q < tl; ++q){
+                sum += image[q];
+                sum_sq += (double) image[q] * image[q];
+            }
+            for (k = 0; k < n_steps; ++k){
+                if (k > 0){
+                    // Running sums of the window
+                    sum += (double) image[k + tl - 1] - image[k - 1];
+                    sum_sq += (double) image[k + tl - 1] * image[k + tl - 1] -
+                              (double) image[k - 1] * image[k - 1];
+                }
+                mean = sum / tl;
+                var = sum_sq / tl - mean * mean;
+                if (var < ACCEPTED_DIFF){
+                    ccc[k] = 0.0;
+                    continue;
+                }
+                // Template is zero-mean, so the image mean does not contribute
+                numerator = 0.0;
+                for (q = 0; q < tl; ++q){
+                    numerator += template_row[q] * image[k + q];
+                }
+                ccc[k] = numerator / sqrt(auto_a[chan] * var * tl);
+            }
+            status[pair] = refine_peak(ccc, n_steps, interpolate, &shifts[pair], &ccs[pair]);
+        }
+        free(ccc);
+    }
+    free(norm_templates);
+    free(auto_a);
+    if (ret != 0){
+        printf("Error allocating memory for lag-calc correlations\n");
+    }
+    return ret;
+}
+
+
+int pick_correction_correlate(float *masters, long *master_lens, float *slaves, long *slave_lens,
+                              long n_pairs, long stride, long *max_shifts, double *shifts,
+                              double *ccs, int *status, int num_threads){
+    /*
+    Correlate pairs of pick windows and find the interpolated peak of each
+    correlation, as obspy.signal.cross_correlation.xcorr_pick_correction: the
+    windows are demeaned, correlated directly at lags of -max_shift to max_shift
+    samples (positive when the slave is late), normalised by the energy of the
+    whole windows and the peak refined by the parabola fit of refine_peak.
+    Fits that open upwards or reach the largest lag are flagged, where obspy
+    raises.
+
+    masters:        Master windows, one per row of stride samples
+    master_lens:    Number of samples in each master window
+    slaves:         Slave windows, one per row of stride samples
+    slave_lens:     Number of samples in each slave window
+    n_pairs:        Number of pairs of windows
+    stride:         Samples per row
+    max_shifts:     Largest lag for each pair in samples
+    shifts:         Output, lag of the peak in samples
+    ccs:            Output, correlation at the peak
+    status:         Output, LAG_* outcome of each correlation
+    num_threads:    Number of threads to correlate with
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int pair, ret = 0;
+    long max_steps = 1;
+
+    for (pair = 0; pair < (int) n_pairs; ++pair){
+        if (2 * max_shifts[pair] + 1 > max_steps){
+            max_steps = 2 * max_shifts[pair] + 1;
+        }
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        double *ccc = (double*) malloc((size_t) max_steps * sizeof(double));
+        double *demeaned = (double*) malloc((size_t) 2 * stride * sizeof(double));
+
+        if (ccc == NULL || demeaned == NULL){
+            #pragma omp critical (lag_calc_memory)
+            ret = -1;
+        }
+        #pragma omp for schedule(dynamic)
+        for (pair = 0; pair < (int) n_pairs; ++pair){
+            long len_a = master_lens[pair], len_b = slave_lens[pair], s = max_shifts[pair];
+            long k, q, first, last;
+            float *master = &masters[(long) pair * stride], *slave = &slaves[(long) pair * stride];
+            double *a = demeaned, *b = &demeaned[stride];
+            double mean_a = 0.0, mean_b = 0.0, energy_a = 0.0, energy_b = 0.0, norm, sum;
+
+            shifts[pair] = 0.0;
+            ccs[pair] = 0.0;
+            if (ccc == NULL || demeaned == NULL){
+                continue;
+            }
+            if (len_a == 0 || len_b == 0){
+                status[pair] = LAG_NO_DATA;
+                continue;
+            }
+            for (q = 0; q < len_a; ++q){
+                mean_a += master[q];
+            }
+            for (q = 0; q < len_b; ++q){
+                mean_b += slave[q];
+            }
+            mean_a /= len_a;
+            mean_b /= len_b;
+            for (q = 0; q < len_a; ++q){
+                a[q] = master[q] - mean_a;
+                energy_a += a[q] * a[q];
+            }
+            for (q = 0; q < len_b; ++q){
+                b[q] = slave[q] - mean_b;
+                energy_b += b[q] * b[q];
+            }
+            norm = sqrt(energy_a * energy_b);
+            if (norm == 0){
+                status[pair] = LAG_NAN;
+                continue;
+            }
+            for (k = -s; k <= s; ++k){
+                // Master sample q against slave sample q + k where both exist
+                first = (k < 0) ? -k : 0;
+                last = (len_b - k < len_a) ? len_b - k : len_a;
+                sum = 0.0;
+                for (q = first; q < last; ++q){
+                    sum += a[q] * b[q + k];
+                }
+                ccc[k + s] = sum / norm;
+            }
+            status[pair] = refine_peak(ccc, 2 * s + 1, 1, &shifts[pair], &ccs[pair]);
+            shifts[pair] -= s;
+        }
+        free(ccc);
+        free(demeaned);
+    }
+    if (ret != 0){
+        printf("Error allocating memory for pick-correction correlations\n");
+    }
+    return ret;
+}
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #if (defined(_MSC_VER))
     #include <float.h>
     #define isnanf(x) _isnan(x)
@@ -31,6 +32,22 @@
     #define isnanf isnan
 #endif
 #include <fftw3.h>
+// Vector kernels: SSE2 is part of x86-64, wider instruction sets are
+// compiled separately and selected at run-time where the compiler allows.
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+    #include <immintrin.h>
+    #define SIMD_DISPATCH 1
+    #define SIMD_SSE2_AVAILABLE 1
+    // Wider instruction sets bring FMA, which gcc would otherwise contract to
+    #if defined(__clang__)
+        #define SIMD_TARGET(isa) __attribute__((target(isa)))
+    #else
+        #define SIMD_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+    #endif
+#elif (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64)))
+    #include <emmintrin.h>
+    #define SIMD_SSE2_AVAILABLE 1
+#endif
 #if defined(__linux__) || defined(__linux) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
     #include <omp.h>
     #ifndef N_THREADS
@@ -50,14 +67,139 @@
 #define ACCEPTED_DIFF 1e-10 //1e-15
 // Define difference to warn user on
 #define WARN_DIFF 1e-8 //1e-10
+// Running normalisation state kept per channel for streaming correlation:
+// valid flag, mean, variance, flatline count and next sample to leave the window
+#define RUNNING_STATS_LEN 5
+// Stages timed in CorrelationStats
+#define STAGE_SETUP 0
+#define STAGE_PLAN 1
+#define STAGE_TEMPLATE_FFT 2
+#define STAGE_IMAGE_FFT 3
+#define STAGE_MULTIPLY 4
+#define STAGE_INVERSE_FFT 5
+#define STAGE_STATISTICS 6
+#define STAGE_NORMALISE 7
+#define N_STAGES 8
+#define STATS_MAX_THREADS 64
+
+// Counters collected by multi_normxcorr_fftw when given a CorrelationStats.
+// Counts are added to, so one struct can be used over several calls. Stage
+// times are summed over the outer threads, so can exceed the wall time.
+typedef struct {
+    long long stage_ns[N_STAGES];
+    long long thread_busy_ns[STATS_MAX_THREADS];    /* per outer thread */
+    long long wall_ns;
+    long long bytes_allocated;      /* allocated for the call, not workspaces passed in */
+    long long skipped_samples;      /* windows not normalised, each time a channel is correlated */
+    long long flatline_samples;     /* of which had flat data */
+    long long n_calls;
+    int n_threads;                  /* most outer threads used */
+} CorrelationStats;
+
+// Normalised, flipped template spectra held between calls.
+typedef struct {
+    long n_templates;
+    long template_len;
+    long n_channels;
+    long fft_len;
+    float *norm_sums;           /* n_channels x n_templates */
+    fftwf_complex *spectra;     /* n_channels x n_templates x (fft_len / 2 + 1) */
+} TemplateSpectra;
+
+// Buffers for correlating one channel at a time, N2 = fft_len / 2 + 1 and
+// n_stats = fft_len - template_len + 1.
+typedef struct {
+    float *template_ext;        /* n_templates x fft_len, NULL for prepared spectra */
+    fftwf_complex *outa;        /* n_templates x N2, NULL for prepared spectra */
+    float *image_ext;           /* fft_len */
+    fftwf_complex *outb;        /* N2 */
+    fftwf_complex *out;         /* n_templates x N2 */
+    float *ccc;                 /* n_templates x fft_len */
+    float *norm_sums;           /* n_templates */
+    double *mean;               /* n_stats */
+    double *var;                /* n_stats */
+    double *stdev;              /* n_stats */
+    double *weight;             /* n_stats */
+    int *flatline_count;        /* n_stats */
+} ChannelWorkspace;
+
+// Workspaces for all outer threads, kept between calls with the same shape.
+typedef struct {
+    long n_templates;           /* Templates (rows) per worker */
+    long template_len;
+    long fft_len;
+    int n_workers;
+    int with_templates;         /* Whether template buffers are allocated */
+    size_t nbytes;              /* Total memory held */
+    ChannelWorkspace *workers;
+} CorrelatorWorkspace;
+
+// FFTW plans are kept between calls and executed using the new-array
+// interface, so only the shape, threads and alignment need to match. All
+// plans are batches of 1D transforms of contiguous rows. Plans are held by
+// each call that uses them and only idle plans are evicted, least recently
+// used first, once the cache holds PLAN_CACHE_SIZE plans.
+#define PLAN_CACHE_SIZE 32
+#define PLAN_CACHE_SLOTS 256
+#define PLAN_TEMPLATE_R2C 0
+#define PLAN_IMAGE_R2C 1
+#define PLAN_C2R 2
+
+typedef struct {
+    int kind;
+    long fft_len;
+    long howmany;
+    int n_threads;
+    int alignment;
+    unsigned flags;
+    int refs;                   /* Calls holding the plan */
+    int stale;                  /* Cleared while held, destroy when released */
+    fftwf_plan plan;
+} CachedPlan;
+
+// Row order of the batched transforms in multi_normxcorr_fftw_batched
+#define LAYOUT_CHANNEL_MAJOR 0
+#define LAYOUT_TEMPLATE_MAJOR 1
+
+// Instruction sets for the spectral multiply and normalisation kernels
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+// Windows per chunk of the sliding statistics, each chunk can be run in parallel
+#define MIN_STATS_CHUNK 4096
+
+typedef void (*complex_multiply_func)(fftwf_complex*, fftwf_complex*, fftwf_complex*, long);
+
+typedef int (*normalise_row_func)(float*, double, double, double*, double*, double*, float*, long);
+
+static CachedPlan plan_cache[PLAN_CACHE_SLOTS];
+static int plan_cache_len = 0;
+static unsigned planning_flags = FFTW_ESTIMATE;
+static int fftw_threads_ready = 0;
+// Memory held by all correlator workspaces, and the most held at once
+static size_t workspace_bytes_live = 0;
+static size_t workspace_bytes_peak = 0;
 
 // Prototypes
 int normxcorr_fftw(float*, long, long, float*, long, float*, long, int*, int*, int*);
 
-static inline int set_ncc(long t, long i, long template_len, long image_len, float value, int *used_chans, int *pad_array, float *ncc);
+static inline int set_ncc(long t, long i, long template_len, long image_len, float value, int *used_chans, int *pad_array, float *ncc, int stack_atomic);
+
+static inline int stack_ncc(float*, float, int);
+
+int normxcorr_fftw_main(float*, long, long, float*, long, float*, long, ChannelWorkspace*,
+        fftwf_plan, fftwf_plan, fftwf_plan, int*, int*, int, int*, int, CorrelationStats*);
+
+long long correlation_stats_size(void);
+
+CorrelatorWorkspace* create_correlator_workspace(long, long, long, long, int, int, int);
+
+void free_correlator_workspace(CorrelatorWorkspace*);
 
-int normxcorr_fftw_main(float*, long, long, float*, long, float*, long, float*, float*, float*,
-        fftwf_complex*, fftwf_complex*, fftwf_complex*, fftwf_plan, fftwf_plan, fftwf_plan, int*, int*, int, int*);
+long long correlator_workspace_bytes(CorrelatorWorkspace*);
+
+long long get_workspace_peak_memory(int);
 
 int normxcorr_fftw_threaded(float*, long, long, float*, long, float*, long, int*, int*, int*);
 
@@ -65,9 +207,519 @@ void free_fftwf_arrays(int, float**, float**, float**, fftwf_complex**, fftwf_co
 
 void free_fftw_arrays(int, double**, double**, double**, fftw_complex**, fftw_complex**, fftw_complex**);
 
-int multi_normxcorr_fftw(float*, long, long, long, float*, long, float*, long, int*, int*, int, int, int*);
+static void set_thread_layout(long n_channels, int *num_threads_outer, int *num_threads_inner) {
+    /* Check the outer/inner thread split */
+    #ifdef N_THREADS
+    /* num_threads_outer cannot be greater than the number of channels */
+    if (*num_threads_outer > n_channels) {
+        *num_threads_outer = (int) n_channels;
+    }
+
+    /* Outer loop parallelism seems to cause issues on OSX */
+    if (OUTER_SAFE != 1 && *num_threads_outer > 1){
+        printf("WARNING\tMULTI_NORMXCORR_FFTW\tOuter loop threading disabled for this system\n");
+        *num_threads_inner *= *num_threads_outer;
+        printf("WARNING\tMULTI_NORMXCORR_FFTW\tSetting inner threading to %i and outer threading to 1\n", *num_threads_inner);
+        *num_threads_outer = 1;
+    }
+    if (*num_threads_inner > 1 && *num_threads_outer > 1) {
+        /* explicitly enable nested OpenMP loops */
+        omp_set_nested(1);
+    }
+
+    /* warn if the total number of threads is higher than the number of cores */
+    if (*num_threads_outer * *num_threads_inner > N_THREADS) {
+        printf("Warning: requesting more threads than available - this could negatively impact performance\n");
+    }
+    #else
+    /* threading/OpenMP is disabled */
+    *num_threads_outer = 1;
+    *num_threads_inner = 1;
+    #endif
+}
+
+
+static int combine_channel_results(int *results, long n_channels) {
+    /* Combine per-channel return codes: 999 flags unused correlations,
+     * anything else non-zero is an internal error. */
+    long i;
+    int r = 0;
+
+    for (i = 0; i < n_channels; ++i){
+        if (results[i] != 999 && results[i] != 0){
+            // Some error internally, must catch this
+            r += results[i];
+        } else if (results[i] == 999 && r == 0){
+            // First time unused correlation raised and no prior errors
+            r = results[i];
+        } else if (r == 999 && results[i] == 999){
+            // Unused correlations raised multiple times
+            r = 999;
+        } else if (r == 999 && results[i] != 999){
+            // Some error internally.
+            r += results[i];
+        } else if (r != 0){
+            // Any other error
+            r += results[i];
+        }
+    }
+    return r;
+}
+
+
+static inline float* channel_image(float *image, long long *image_offsets, long c, long image_len) {
+    /* Start of the image for channel c: at image_offsets[c] if given,
+     * otherwise the images are stacked [ch_1, ch_2, ..., ch_n] */
+    if (image_offsets != NULL) {
+        return &image[image_offsets[c]];
+    }
+    return &image[(size_t) image_len * c];
+}
+
+
+static inline double stats_clock(void) {
+    #ifdef N_THREADS
+    return omp_get_wtime();
+    #else
+    return (double) clock() / CLOCKS_PER_SEC;
+    #endif
+}
+
+
+static inline void stats_add(long long *counter, long long value) {
+    /* Counters are shared between outer threads */
+    #pragma omp atomic
+    *counter += value;
+}
+
+
+static inline double stats_lap(CorrelationStats *stats, int stage, double start) {
+    /* Add the time since start to stage, returning the time now */
+    double now;
+
+    if (stats == NULL) {
+        return start;
+    }
+    now = stats_clock();
+    stats_add(&stats->stage_ns[stage], (long long) ((now - start) * 1e9));
+    return now;
+}
+
+
+long long correlation_stats_size(void) {
+    /* Size of CorrelationStats, to check the layout used by callers */
+    return (long long) sizeof(CorrelationStats);
+}
+
+
+int multi_normxcorr_fftw(float*, long, long, long, float*, long, long long*, float*, long, int*, int*, int, int,
+        int*, int, CorrelatorWorkspace*, CorrelationStats*);
+
+int multi_normxcorr_fftw_batched(float*, long, long, long, float*, long, long long*, float*, long, int*, int*, int,
+        int*, int);
+
+static int template_spectra_fftw(float*, long, long, long, float*, fftwf_complex*, float*, fftwf_plan);
+
+static int normxcorr_fftw_spectra(fftwf_complex*, float*, long, long, float*, long, float*, long, ChannelWorkspace*,
+        fftwf_plan, fftwf_plan, int*, int*, int, int*, long, double*, int, CorrelationStats*);
+
+static int combine_channel_results(int*, long);
+
+static void set_thread_layout(long, int*, int*);
+
+static size_t spectra_stride(long, long);
+
+static fftwf_plan get_cached_plan(int, long, long, int, void*, void*);
+
+static void release_cached_plan(fftwf_plan);
+
+static void remove_cached_plan(int);
+
+void set_fftw_planning(int);
+
+int import_fftw_wisdom(char*);
+
+int export_fftw_wisdom(char*);
+
+void clear_fftw_plan_cache(void);
+
+TemplateSpectra* prepare_template_spectra(float*, long, long, long, long, int);
+
+void free_template_spectra(TemplateSpectra*);
+
+int multi_normxcorr_fftw_prepared(TemplateSpectra*, float*, long, long long*, float*, int*, int*, int, int, int*,
+        CorrelatorWorkspace*);
+
+int multi_normxcorr_fftw_stream(TemplateSpectra*, float*, long, long long*, float*, long, int*, int*, int, int, int*,
+        double*, CorrelatorWorkspace*);
+
+int get_simd_level(void);
+
+int set_simd_level(int);
+
+static void sliding_stats(float*, long, long, long, double*, double*, int*, int);
+
+static int block_statistics(float*, long, long, long, double*, double*, double*, int*, double*,
+        double*, int*, int);
 
 // Functions
+static void remove_cached_plan(int i) {
+    /* Destroy entry i of the plan cache - call in the fftw_planner section */
+    fftwf_destroy_plan(plan_cache[i].plan);
+    memmove(&plan_cache[i], &plan_cache[i + 1], (size_t) (plan_cache_len - i - 1) * sizeof(CachedPlan));
+    plan_cache_len--;
+}
+
+
+static fftwf_plan get_cached_plan(int kind, long fft_len, long howmany, int n_threads,
+                                  void *in, void *out) {
+  /*
+  Purpose: get a plan from the process-wide cache, planning if needed
+  Args:
+    kind:           PLAN_TEMPLATE_R2C, PLAN_IMAGE_R2C or PLAN_C2R
+    fft_len:        Size for fft
+    howmany:        Number of transforms in the batch: real rows are fft_len
+                    apart and complex rows fft_len / 2 + 1 apart
+    n_threads:      Number of threads for FFTW to use
+    in:             Input array - used for planning only, so with measured
+                    planning the contents will be overwritten: plan before
+                    filling the arrays.
+    out:            Output array - as for in
+  Returns:
+    Plan to be used with the fftwf_execute_dft_* functions, or NULL if it
+    could not be planned. Plans are owned by the cache: the caller must not
+    destroy them, and must hand each one back with release_cached_plan once
+    it is done with it.
+  */
+    int i, alignment;
+    int n = (int) fft_len;
+    int n_complex = (int) (fft_len / 2 + 1);
+    unsigned flags;
+    fftwf_plan plan = NULL;
+    CachedPlan entry;
+
+    // New-array execution requires the same alignment (to 16 bytes) as planning
+    alignment = (int) ((((size_t) in % 16) << 8) | ((size_t) out % 16));
+    #pragma omp critical (fftw_planner)
+    {
+    flags = planning_flags;
+    for (i = 0; i < plan_cache_len; ++i) {
+        if (plan_cache[i].stale == 0 && plan_cache[i].kind == kind &&
+            plan_cache[i].fft_len == fft_len && plan_cache[i].howmany == howmany &&
+            plan_cache[i].n_threads == n_threads && plan_cache[i].alignment == alignment &&
+            plan_cache[i].flags == flags) {
+            // Move to the most recently used end
+            entry = plan_cache[i];
+            entry.refs++;
+            memmove(&plan_cache[i], &plan_cache[i + 1],
+                    (size_t) (plan_cache_len - i - 1) * sizeof(CachedPlan));
+            plan_cache[plan_cache_len - 1] = entry;
+            plan = entry.plan;
+            break;
+        }
+    }
+    if (plan == NULL) {
+        // Evict idle plans, least recently used first
+        i = 0;
+        while (plan_cache_len >= PLAN_CACHE_SIZE && i < plan_cache_len) {
+            if (plan_cache[i].refs == 0) {
+                remove_cached_plan(i);
+            } else {
+                ++i;
+            }
+        }
+        if (plan_cache_len < PLAN_CACHE_SLOTS) {
+            #ifdef N_THREADS
+            if (fftw_threads_ready == 0) {
+                fftwf_init_threads();
+                fftw_threads_ready = 1;
+            }
+            fftwf_plan_with_nthreads(n_threads);
+            #endif
+            if (kind == PLAN_C2R) {
+                plan = fftwf_plan_many_dft_c2r(1, &n, (int) howmany, (fftwf_complex *) in, NULL, 1,
+                                               n_complex, (float *) out, NULL, 1, n, flags);
+            } else {
+                plan = fftwf_plan_many_dft_r2c(1, &n, (int) howmany, (float *) in, NULL, 1, n,
+                                               (fftwf_complex *) out, NULL, 1, n_complex, flags);
+            }
+        } else {
+            printf("Error: all %d cached FFTW plans are in use\n", PLAN_CACHE_SLOTS);
+        }
+        if (plan != NULL) {
+            entry.kind = kind;
+            entry.fft_len = fft_len;
+            entry.howmany = howmany;
+            entry.n_threads = n_threads;
+            entry.alignment = alignment;
+            entry.flags = flags;
+            entry.refs = 1;
+            entry.stale = 0;
+            entry.plan = plan;
+            plan_cache[plan_cache_len] = entry;
+            plan_cache_len++;
+        }
+    }
+    }
+    return plan;
+}
+
+
+static void release_cached_plan(fftwf_plan plan) {
+    /* Hand back a plan from get_cached_plan, NULL is ignored */
+    int i;
+
+    if (plan == NULL) {
+        return;
+    }
+    #pragma omp critical (fftw_planner)
+    {
+    for (i = 0; i < plan_cache_len; ++i) {
+        if (plan_cache[i].plan == plan) {
+            plan_cache[i].refs--;
+            if (plan_cache[i].refs <= 0 && plan_cache[i].stale) {
+                remove_cached_plan(i);
+            }
+            break;
+        }
+    }
+    }
+}
+
+
+void set_fftw_planning(int effort) {
+    /* Set the planning effort for new plans: 0 = FFTW_ESTIMATE,
+     * 1 = FFTW_MEASURE, 2 = FFTW_PATIENT. */
+    #pragma omp critical (fftw_planner)
+    {
+    if (effort >= 2) {
+        planning_flags = FFTW_PATIENT;
+    } else if (effort == 1) {
+        planning_flags = FFTW_MEASURE;
+    } else {
+        planning_flags = FFTW_ESTIMATE;
+    }
+    }
+}
+
+
+int import_fftw_wisdom(char *filename) {
+    /* Returns 0 on success */
+    int ret;
+    #pragma omp critical (fftw_planner)
+    {
+    ret = fftwf_import_wisdom_from_filename(filename);
+    }
+    return (ret == 1) ? 0 : 1;
+}
+
+
+int export_fftw_wisdom(char *filename) {
+    /* Returns 0 on success */
+    int ret;
+    #pragma omp critical (fftw_planner)
+    {
+    ret = fftwf_export_wisdom_to_filename(filename);
+    }
+    return (ret == 1) ? 0 : 1;
+}
+
+
+void clear_fftw_plan_cache(void) {
+    /* Destroy all cached plans - accumulated wisdom is kept. Plans held by
+     * running calls are destroyed when they are released. */
+    int i = 0;
+    #pragma omp critical (fftw_planner)
+    {
+    while (i < plan_cache_len) {
+        if (plan_cache[i].refs == 0) {
+            remove_cached_plan(i);
+        } else {
+            plan_cache[i].stale = 1;
+            ++i;
+        }
+    }
+    }
+}
+
+
+static void* workspace_alloc(size_t bytes, size_t *total) {
+    /* Aligned allocation, counted in total */
+    void *buffer = fftwf_malloc(bytes);
+
+    if (buffer != NULL) {
+        *total += bytes;
+    }
+    return buffer;
+}
+
+
+CorrelatorWorkspace* create_correlator_workspace(long n_templates, long template_len, long n_channels,
+        long fft_len, int num_threads_outer, int split_templates, int with_templates) {
+  /*
+  Purpose: allocate the buffers for multi_normxcorr_fftw (with_templates set)
+           or multi_normxcorr_fftw_prepared and multi_normxcorr_fftw_stream
+           (with_templates unset) once, to re-use for every channel, call
+           and chunk of the same shape.
+  Args:
+    n_templates:        Number of templates
+    template_len:       Length of templates
+    n_channels:         Number of channels
+    fft_len:            Size for fft
+    num_threads_outer:  Number of outer threads that will be used
+    split_templates:    Whether templates will be split between outer threads
+    with_templates:     Whether to allocate buffers for template transforms
+  Returns:
+    Pointer to the workspace, or NULL if memory allocation failed. Must be
+    freed using free_correlator_workspace.
+  */
+    long n_rows = n_templates;
+    long n_stats = fft_len - template_len + 1;
+    size_t N2 = (size_t) fft_len / 2 + 1;
+    size_t nbytes = 0;
+    int i, failed = 0, n_workers = num_threads_outer;
+    CorrelatorWorkspace *workspace;
+
+    // Size for the most workers multi_normxcorr_fftw can schedule
+    if (n_workers < 1 || OUTER_SAFE != 1) {
+        n_workers = 1;
+    }
+    #ifndef N_THREADS
+    n_workers = 1;
+    #endif
+    if (split_templates) {
+        if (n_workers > n_templates) {
+            n_workers = (int) n_templates;
+        }
+        n_rows = (n_templates + n_workers - 1) / n_workers;
+        n_workers = (int) ((n_templates + n_rows - 1) / n_rows);
+    } else if (n_workers > n_channels) {
+        n_workers = (int) n_channels;
+    }
+    workspace = (CorrelatorWorkspace*) malloc(sizeof(CorrelatorWorkspace));
+    if (workspace == NULL) {
+        printf("Error allocating correlator workspace\n");
+        return NULL;
+    }
+    workspace->n_templates = n_rows;
+    workspace->template_len = template_len;
+    workspace->fft_len = fft_len;
+    workspace->n_workers = n_workers;
+    workspace->with_templates = with_templates;
+    workspace->workers = (ChannelWorkspace*) calloc(n_workers, sizeof(ChannelWorkspace));
+    if (workspace->workers == NULL) {
+        printf("Error allocating correlator workspace\n");
+        free(workspace);
+        return NULL;
+    }
+    nbytes = sizeof(CorrelatorWorkspace) + n_workers * sizeof(ChannelWorkspace);
+    for (i = 0; i < n_workers && !failed; ++i) {
+        ChannelWorkspace *work = &workspace->workers[i];
+
+        if (with_templates) {
+            work->template_ext = (float*) workspace_alloc((size_t) fft_len * n_rows * sizeof(float), &nbytes);
+            work->outa = (fftwf_complex*) workspace_alloc(N2 * n_rows * sizeof(fftwf_complex), &nbytes);
+            failed = (work->template_ext == NULL || work->outa == NULL);
+        }
+        work->image_ext = (float*) workspace_alloc((size_t) fft_len * sizeof(float), &nbytes);
+        work->outb = (fftwf_complex*) workspace_alloc(N2 * sizeof(fftwf_complex), &nbytes);
+        work->out = (fftwf_complex*) workspace_alloc(N2 * n_rows * sizeof(fftwf_complex), &nbytes);
+        work->ccc = (float*) workspace_alloc((size_t) fft_len * n_rows * sizeof(float), &nbytes);
+        work->norm_sums = (float*) workspace_alloc((size_t) n_rows * sizeof(float), &nbytes);
+        work->mean = (double*) workspace_alloc((size_t) n_stats * sizeof(double), &nbytes);
+        work->var = (double*) workspace_alloc((size_t) n_stats * sizeof(double), &nbytes);
+        work->stdev = (double*) workspace_alloc((size_t) n_stats * sizeof(double), &nbytes);
+        work->weight = (double*) workspace_alloc((size_t) n_stats * sizeof(double), &nbytes);
+        work->flatline_count = (int*) workspace_alloc((size_t) n_stats * sizeof(int), &nbytes);
+        failed = (failed || work->image_ext == NULL || work->outb == NULL || work->out == NULL ||
+                  work->ccc == NULL || work->norm_sums == NULL || work->mean == NULL ||
+                  work->var == NULL || work->stdev == NULL || work->weight == NULL ||
+                  work->flatline_count == NULL);
+    }
+    workspace->nbytes = nbytes;
+    if (failed) {
+        printf("Error allocating correlator workspace for worker %d\n", i - 1);
+        workspace->nbytes = 0;
+        free_correlator_workspace(workspace);
+        return NULL;
+    }
+    #pragma omp critical (workspace_memory)
+    {
+    workspace_bytes_live += nbytes;
+    if (workspace_bytes_live > workspace_bytes_peak) {
+        workspace_bytes_peak = workspace_bytes_live;
+    }
+    }
+    return workspace;
+}
+
+
+void free_correlator_workspace(CorrelatorWorkspace *workspace) {
+    int i;
+
+    if (workspace == NULL) {
+        return;
+    }
+    for (i = 0; i < workspace->n_workers; ++i) {
+        ChannelWorkspace *work = &workspace->workers[i];
+
+        fftwf_free(work->template_ext);
+        fftwf_free(work->outa);
+        fftwf_free(work->image_ext);
+        fftwf_free(work->outb);
+        fftwf_free(work->out);
+        fftwf_free(work->ccc);
+        fftwf_free(work->norm_sums);
+        fftwf_free(work->mean);
+        fftwf_free(work->var);
+        fftwf_free(work->stdev);
+        fftwf_free(work->weight);
+        fftwf_free(work->flatline_count);
+    }
+    #pragma omp critical (workspace_memory)
+    {
+    workspace_bytes_live -= workspace->nbytes;
+    }
+    free(workspace->workers);
+    free(workspace);
+}
+
+
+long long correlator_workspace_bytes(CorrelatorWorkspace *workspace) {
+    /* Memory held by a workspace in bytes */
+    return (long long) workspace->nbytes;
+}
+
+
+long long get_workspace_peak_memory(int reset) {
+    /* Most memory held by correlator workspaces at once, in bytes. If reset
+     * is set the peak is reset to the memory currently held. */
+    long long peak;
+
+    #pragma omp critical (workspace_memory)
+    {
+    peak = (long long) workspace_bytes_peak;
+    if (reset) {
+        workspace_bytes_peak = workspace_bytes_live;
+    }
+    }
+    return peak;
+}
+
+
+static int workspace_fits(CorrelatorWorkspace *workspace, long n_rows, long template_len,
+                          long fft_len, int n_workers, int with_templates) {
+    /* Check that a workspace can be used for a call */
+    if (workspace->n_templates < n_rows || workspace->template_len != template_len ||
+        workspace->fft_len != fft_len || workspace->n_workers < n_workers ||
+        (with_templates && !workspace->with_templates)) {
+        printf("Error: correlator workspace does not fit this correlation\n");
+        return 0;
+    }
+    return 1;
+}
+
+
 int normxcorr_fftw_threaded(float *templates, long template_len, long n_templates,
                             float *image, long image_len, float *ncc, long fft_len,
                             int *used_chans, int *pad_array, int *variance_warning) {
@@ -97,16 +749,18 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     fftwf_complex * outa = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * N2 * n_templates);
     fftwf_complex * outb = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * N2);
     fftwf_complex * out = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * N2 * n_templates);
-    // Initialize threads
+    int n_threads = 1;
+    fftwf_plan pa, pb, px;
+    // Plan
     #ifdef N_THREADS
-        fftwf_init_threads();
-        fftwf_plan_with_nthreads(N_THREADS);
+        n_threads = N_THREADS;
     #endif
-    // Plan
-
-    fftwf_plan pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext, outa, FFTW_ESTIMATE);
-    fftwf_plan pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext, outb, FFTW_ESTIMATE);
-    fftwf_plan px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out, ccc, FFTW_ESTIMATE);
+    pa = get_cached_plan(PLAN_TEMPLATE_R2C, fft_len, n_templates, n_threads, template_ext, outa);
+    pb = get_cached_plan(PLAN_IMAGE_R2C, fft_len, 1, n_threads, image_ext, outb);
+    px = get_cached_plan(PLAN_C2R, fft_len, n_templates, n_threads, out, ccc);
+    // Planning may have used the arrays, so zero them again
+    memset(template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
+    memset(image_ext, 0, (size_t) fft_len * sizeof(float));
 
     // zero padding - and flip template
     for (t = 0; t < n_templates; ++t){
@@ -123,9 +777,9 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     //  Compute ffts of template and image
     #pragma omp parallel sections
     {
-        {fftwf_execute(pa); }
+        {fftwf_execute_dft_r2c(pa, template_ext, outa); }
         #pragma omp section
-        {fftwf_execute(pb); }
+        {fftwf_execute_dft_r2c(pb, image_ext, outb); }
     }
     //  Compute dot product
     for (t = 0; t < n_templates; ++t){
@@ -136,7 +790,7 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
         }
     }
     //  Compute inverse fft
-    fftwf_execute(px);
+    fftwf_execute_dft_c2r(px, out, ccc);
     //  Procedures for normalisation
     // Compute starting mean, will update this
     for (i=0; i < template_len; ++i){
@@ -153,8 +807,8 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
     startind = template_len - 1;
     if (var >= ACCEPTED_DIFF) {
         for (t = 0; t < n_templates; ++t){
-            float c = ((ccc[(t * fft_len) + startind] / (fft_len * n_templates)) - norm_sums[t] * mean) / stdev;
-            status += set_ncc(t, 0, template_len, image_len, (float) c, used_chans, pad_array, ncc);
+            float c = ((ccc[(t * fft_len) + startind] / fft_len) - norm_sums[t] * mean) / stdev;
+            status += set_ncc(t, 0, template_len, image_len, (float) c, used_chans, pad_array, ncc, 0);
         }
         if (var <= WARN_DIFF){
             variance_warning[0] = 1;
@@ -178,27 +832,24 @@ int normxcorr_fftw_threaded(float *templates, long template_len, long n_template
         stdev = sqrt(var);
         if (var >= ACCEPTED_DIFF && flatline_count < template_len - 1 && stdev * mean >= ACCEPTED_DIFF) {
             for (t = 0; t < n_templates; ++t){
-                float c = ((ccc[(t * fft_len) + i + startind] / (fft_len * n_templates)) - norm_sums[t] * mean ) / stdev;
-                status += set_ncc(t, i, template_len, image_len, (float) c, used_chans, pad_array, ncc);
+                float c = ((ccc[(t * fft_len) + i + startind] / fft_len) - norm_sums[t] * mean ) / stdev;
+                status += set_ncc(t, i, template_len, image_len, (float) c, used_chans, pad_array, ncc, 0);
             }
             if (var <= WARN_DIFF){
                 variance_warning[0] += 1;
             }
         }
     }
-    //  Clean up
-    fftwf_destroy_plan(pa);
-    fftwf_destroy_plan(pb);
-    fftwf_destroy_plan(px);
-
+    //  Clean up - plans are kept in the cache
+    release_cached_plan(pa);
+    release_cached_plan(pb);
+    release_cached_plan(px);
     fftwf_free(out);
     fftwf_free(outa);
     fftwf_free(outb);
     fftwf_free(ccc);
 
-    fftwf_cleanup();
-    fftwf_cleanup_threads();
-
+    free(norm_sums);
     free(template_ext);
     free(image_ext);
 
@@ -221,50 +872,46 @@ int normxcorr_fftw(float *templates, long template_len, long n_templates,
     image_len:      Length of image
     ncc:            Output for cross-correlation - should be pointer to memory -
                     must be n_templates x image_len - template_len + 1
-    fft_len:        Size for fft (n1)
+    fft_len:        Size for fft (n1) - if shorter than image_len + template_len - 1
+                    the image is correlated in overlapping blocks of this size
   Notes:
     This is a wrapper around `normxcorr_fftw_main`, allocating required memory and plans
     for that function. We have taken this outside the main function because creating plans
     is not thread-safe and we want to call the main function from within an OpenMP loop.
   */
     int status = 0;
-    long N2 = fft_len / 2 + 1;
-    // All memory allocated with `fftw_malloc` to ensure 16-byte aligned
-    float * template_ext = (float*) fftwf_malloc(fft_len * n_templates * sizeof(float));
-    float * image_ext = (float*) fftwf_malloc(fft_len * sizeof(float));
-    float * ccc = (float*) fftwf_malloc(fft_len * n_templates * sizeof(float));
-    fftwf_complex * outa = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
-    fftwf_complex * outb = (fftwf_complex*) fftwf_malloc(N2 * sizeof(fftwf_complex));
-    fftwf_complex * out = (fftwf_complex*) fftwf_malloc(N2 * n_templates * sizeof(fftwf_complex));
+    ChannelWorkspace *work;
+    fftwf_plan pa, pb, px;
+    CorrelatorWorkspace *workspace = create_correlator_workspace(
+        n_templates, template_len, 1, fft_len, 1, 0, 1);
+
+    if (workspace == NULL) {
+        return 1;
+    }
+    work = &workspace->workers[0];
     // Plan
-    fftwf_plan pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext, outa, FFTW_ESTIMATE);
-    fftwf_plan pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext, outb, FFTW_ESTIMATE);
-    fftwf_plan px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out, ccc, FFTW_ESTIMATE);
+    pa = get_cached_plan(PLAN_TEMPLATE_R2C, fft_len, n_templates, 1, work->template_ext, work->outa);
+    pb = get_cached_plan(PLAN_IMAGE_R2C, fft_len, 1, 1, work->image_ext, work->outb);
+    px = get_cached_plan(PLAN_C2R, fft_len, n_templates, 1, work->out, work->ccc);
 
     // Initialise to zero
-    memset(template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
-    memset(image_ext, 0, (size_t) fft_len * sizeof(float));
+    memset(work->template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
+    memset(work->image_ext, 0, (size_t) fft_len * sizeof(float));
 
     // Call the function to do the work
     // Note: forcing inner threads to 1 for now (could be passed from Python)
-    status = normxcorr_fftw_main(templates, template_len, n_templates, image, image_len,
-            ncc, fft_len, template_ext, image_ext, ccc, outa, outb, out, pa, pb, px,
-            used_chans, pad_array, 1, variance_warning);
-
-    // free memory and plans
-    fftwf_destroy_plan(pa);
-    fftwf_destroy_plan(pb);
-    fftwf_destroy_plan(px);
-
-    fftwf_free(out);
-    fftwf_free(outa);
-    fftwf_free(outb);
-    fftwf_free(ccc);
-    fftwf_free(template_ext);
-    fftwf_free(image_ext);
+    if (pa == NULL || pb == NULL || px == NULL) {
+        status = -1;
+    } else {
+        status = normxcorr_fftw_main(templates, template_len, n_templates, image, image_len,
+                ncc, fft_len, work, pa, pb, px, used_chans, pad_array, 1, variance_warning, 0, NULL);
+    }
 
-    fftwf_cleanup();
-    fftwf_cleanup_threads();
+    // free memory - plans are kept in the cache
+    release_cached_plan(pa);
+    release_cached_plan(pb);
+    release_cached_plan(px);
+    free_correlator_workspace(workspace);
 
     return status;
 }
@@ -272,10 +919,10 @@ int normxcorr_fftw(float *templates, long template_len, long n_templates,
 
 int normxcorr_fftw_main(float *templates, long template_len, long n_templates,
                         float *image, long image_len, float *ncc, long fft_len,
-                        float *template_ext, float *image_ext, float *ccc,
-                        fftwf_complex *outa, fftwf_complex *outb, fftwf_complex *out,
-                        fftwf_plan pa, fftwf_plan pb, fftwf_plan px, int *used_chans,
-                        int *pad_array, int num_threads, int *variance_warning) {
+                        ChannelWorkspace *work, fftwf_plan pa, fftwf_plan pb,
+                        fftwf_plan px, int *used_chans,
+                        int *pad_array, int num_threads, int *variance_warning,
+                        int stack_atomic, CorrelationStats *stats) {
   /*
   Purpose: compute frequency domain normalised cross-correlation of real data using fftw
   Author: Calum J. Chamberlain
@@ -290,29 +937,49 @@ int normxcorr_fftw_main(float *templates, long template_len, long n_templates,
                     must be n_templates x image_len - template_len + 1
                     It is assumed that ncc will be initialised to zero before
                     passing into this function
-    fft_len:        Size for fft (n1)
-    template_ext:   Input FFTW array for template transform (must be allocated)
-    image_ext:      Input FFTW array for image transform (must be allocated)
-    ccc:            Output FFTW array for reverse transform (must be allocated)
-    outa:           Output FFTW array for template transform (must be allocatd)
-    outb:           Output FFTW array for image transform (must be allocated)
-    out:            Input array for reverse transform (must be allocated)
+    fft_len:        Size for fft (n1) - may be shorter than image_len + template_len - 1
+                    to correlate in overlapping blocks
+    work:           Buffers for at least n_templates templates, including
+                    template buffers - template_ext and image_ext must be
+                    zeroed
     pa:             Forward plan for templates
     pb:             Forward plan for image
     px:             Reverse plan
+    stack_atomic:   Whether other channels may be stacked into ncc at the
+                    same time, requiring atomic adds.
+    stats:          NULL, or counters to add the time in each stage and the
+                    number of skipped windows to.
   */
-    long N2 = fft_len / 2 + 1;
-    long i, t, startind;
-    int status = 0, unused_corr = 0;
-    int * flatline_count = (int *) calloc(image_len - template_len + 1, sizeof(int));
-    double *mean, *var;
-    double new_samp, old_samp, sum=0.0;
-    float * norm_sums = (float *) calloc(n_templates, sizeof(float));
+    double tic = (stats != NULL) ? stats_clock() : 0.0;
 
-    if (norm_sums == NULL) {
-        printf("Error allocating norm_sums in normxcorr_fftw_main\n");
-        return 1;
-    }
+    memset(work->norm_sums, 0, (size_t) n_templates * sizeof(float));
+    template_spectra_fftw(templates, template_len, n_templates, fft_len,
+                          work->template_ext, work->outa, work->norm_sums, pa);
+    stats_lap(stats, STAGE_TEMPLATE_FFT, tic);
+
+    return normxcorr_fftw_spectra(work->outa, work->norm_sums, template_len, n_templates, image,
+                                  image_len, ncc, fft_len, work, pb, px, used_chans, pad_array,
+                                  num_threads, variance_warning, image_len - template_len + 1,
+                                  NULL, stack_atomic, stats);
+}
+
+
+static int template_spectra_fftw(float *templates, long template_len, long n_templates,
+                                 long fft_len, float *template_ext, fftwf_complex *outa,
+                                 float *norm_sums, fftwf_plan pa) {
+  /*
+  Purpose: flip, zero-pad and forward transform a set of normalised templates
+  Args:
+    templates:      Template signals (n_templates x template_len)
+    template_len:   Length of template
+    n_templates:    Number of templates
+    fft_len:        Size for fft
+    template_ext:   Input FFTW array for template transform - must be zeroed
+    outa:           Output template spectra (n_templates x fft_len / 2 + 1)
+    norm_sums:      Output sums of templates - must be zeroed
+    pa:             Forward plan for templates
+  */
+    long i, t;
 
     // zero padding - and flip template
     for (t = 0; t < n_templates; ++t){
@@ -322,105 +989,446 @@ int normxcorr_fftw_main(float *templates, long template_len, long n_templates,
             norm_sums[t] += templates[(t * template_len) + i];
         }
     }
-    for (i = 0; i < image_len; ++i)
-    {
-        image_ext[i] = image[i];
-    }
 
     //  Compute fft of template
     fftwf_execute_dft_r2c(pa, template_ext, outa);
-    
-    // Compute fft of image
-    fftwf_execute_dft_r2c(pb, image_ext, outb);
+    return 0;
+}
 
-    //  Compute dot product
-    #pragma omp parallel for num_threads(num_threads) private(i)
-    for (t = 0; t < n_templates; ++t){
-        for (i = 0; i < N2; ++i)
-        {
-            out[(t * N2) + i][0] = outa[(t * N2) + i][0] * outb[i][0] - outa[(t * N2) + i][1] * outb[i][1];
-            out[(t * N2) + i][1] = outa[(t * N2) + i][0] * outb[i][1] + outa[(t * N2) + i][1] * outb[i][0];
-        }
-    }
 
-    //  Compute inverse fft
-    fftwf_execute_dft_c2r(px, out, ccc);
- 
-    // Allocate mean and var arrays
-    mean = (double*) malloc((image_len - template_len + 1) * sizeof(double));
-    if (mean == NULL) {
-        printf("Error allocating mean in normxcorr_fftw_main\n");
-        free(norm_sums);
-        return 1;
+/* Vector kernels for the spectral multiply and normalisation. All variants
+ * give the same results: no fused multiply-adds are used, so that results do
+ * not depend on the machine. */
+static int simd_level = -1;
+
+static int detect_simd_level(void) {
+    int level = SIMD_SCALAR;
+
+    #ifdef SIMD_SSE2_AVAILABLE
+    level = SIMD_SSE2;
+    #endif
+    #ifdef SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        level = SIMD_AVX2;
     }
-    var = (double*) malloc((image_len - template_len + 1) * sizeof(double));
-    if (var == NULL) {
-        printf("Error allocating var in normxcorr_fftw_main\n");
-        free(norm_sums);
-        free(mean);
-        return 1;
+    if (__builtin_cpu_supports("avx512f")) {
+        level = SIMD_AVX512;
+    }
+    #endif
+    return level;
+}
+
+
+int get_simd_level(void) {
+    /* Instruction set in use: the best available unless set_simd_level has
+     * been used to select a lower one. */
+    #pragma omp critical (simd_level)
+    {
+    if (simd_level < 0) {
+        simd_level = detect_simd_level();
     }
-    
-    //  Procedures for normalisation
-    // Compute starting mean, will update this
-    sum = 0.0;
-    for (i=0; i < template_len; ++i){
-        sum += (double) image[i];
     }
-    mean[0] = sum / template_len;
+    return simd_level;
+}
 
-    // Compute starting standard deviation
+
+int set_simd_level(int level) {
+    /* Select the instruction set to use (e.g. for testing), levels higher
+     * than available (or negative) select the best available. Returns the
+     * level in use. */
+    int available = detect_simd_level();
+
+    if (level < 0 || level > available) {
+        level = available;
+    }
+    #pragma omp critical (simd_level)
+    {
+    simd_level = level;
+    }
+    return level;
+}
+
+
+static void complex_multiply_scalar(fftwf_complex *out, fftwf_complex *a, fftwf_complex *b, long n) {
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        out[i][0] = a[i][0] * b[i][0] - a[i][1] * b[i][1];
+        out[i][1] = a[i][0] * b[i][1] + a[i][1] * b[i][0];
+    }
+}
+
+
+static int normalise_row_scalar(float *ccc, double scale, double norm_sum, double *mean,
+                                double *stdev, double *weight, float *ncc, long n) {
+    /* Normalise one template's correlations and stack them into ncc, as
+     * set_ncc. Correlations with zero weight add nothing. */
+    long i;
+    int status = 0;
+
+    for (i = 0; i < n; ++i) {
+        double c = ((ccc[i] / (float) scale) - norm_sum * mean[i]) * weight[i];
+        c /= stdev[i];
+        status |= stack_ncc(&ncc[i], (float) c, 0);
+    }
+    return status;
+}
+
+
+#ifdef SIMD_SSE2_AVAILABLE
+static void complex_multiply_sse2(fftwf_complex *out, fftwf_complex *a, fftwf_complex *b, long n) {
+    long i;
+    const __m128 sign = _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f);
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128 va = _mm_loadu_ps(&a[i][0]);
+        __m128 vb = _mm_loadu_ps(&b[i][0]);
+        __m128 b_re = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 b_im = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 a_swap = _mm_shuffle_ps(va, va, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 re = _mm_mul_ps(va, b_re);
+        __m128 im = _mm_xor_ps(_mm_mul_ps(a_swap, b_im), sign);
+        _mm_storeu_ps(&out[i][0], _mm_add_ps(re, im));
+    }
+    complex_multiply_scalar(&out[i], &a[i], &b[i], n - i);
+}
+
+
+static inline __m128 clamp_correlations_sse2(__m128 v, int *status) {
+    /* NaNs to zero, flag values beyond 1.01 and clip to +/- 1 */
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    v = _mm_and_ps(v, _mm_cmpord_ps(v, v));
+    if (_mm_movemask_ps(_mm_cmpgt_ps(_mm_and_ps(v, abs_mask), _mm_set1_ps(1.01f)))) {
+        *status = 1;
+    }
+    return _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+}
+
+
+static int normalise_row_sse2(float *ccc, double scale, double norm_sum, double *mean,
+                              double *stdev, double *weight, float *ncc, long n) {
+    long i;
+    int status = 0;
+    const __m128 vscale = _mm_set1_ps((float) scale);
+    const __m128d vnorm = _mm_set1_pd(norm_sum);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128 x = _mm_div_ps(_mm_loadu_ps(&ccc[i]), vscale);
+        __m128d lo = _mm_sub_pd(_mm_cvtps_pd(x), _mm_mul_pd(vnorm, _mm_loadu_pd(&mean[i])));
+        __m128d hi = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)),
+                                _mm_mul_pd(vnorm, _mm_loadu_pd(&mean[i + 2])));
+        __m128 v;
+        lo = _mm_div_pd(_mm_mul_pd(lo, _mm_loadu_pd(&weight[i])), _mm_loadu_pd(&stdev[i]));
+        hi = _mm_div_pd(_mm_mul_pd(hi, _mm_loadu_pd(&weight[i + 2])), _mm_loadu_pd(&stdev[i + 2]));
+        v = _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+        v = clamp_correlations_sse2(v, &status);
+        _mm_storeu_ps(&ncc[i], _mm_add_ps(_mm_loadu_ps(&ncc[i]), v));
+    }
+    status |= normalise_row_scalar(&ccc[i], scale, norm_sum, &mean[i], &stdev[i],
+                                   &weight[i], &ncc[i], n - i);
+    return status;
+}
+#endif
+
+
+#ifdef SIMD_DISPATCH
+SIMD_TARGET("avx2")
+static void complex_multiply_avx2(fftwf_complex *out, fftwf_complex *a, fftwf_complex *b, long n) {
+    long i;
+    const __m256 sign = _mm256_set_ps(0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f, 0.0f, -0.0f);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256 va = _mm256_loadu_ps(&a[i][0]);
+        __m256 vb = _mm256_loadu_ps(&b[i][0]);
+        __m256 re = _mm256_mul_ps(va, _mm256_moveldup_ps(vb));
+        __m256 im = _mm256_mul_ps(_mm256_permute_ps(va, 0xB1), _mm256_movehdup_ps(vb));
+        _mm256_storeu_ps(&out[i][0], _mm256_add_ps(re, _mm256_xor_ps(im, sign)));
+    }
+    complex_multiply_scalar(&out[i], &a[i], &b[i], n - i);
+}
+
+
+SIMD_TARGET("avx2")
+static int normalise_row_avx2(float *ccc, double scale, double norm_sum, double *mean,
+                              double *stdev, double *weight, float *ncc, long n) {
+    long i;
+    int status = 0;
+    const __m128 vscale = _mm_set1_ps((float) scale);
+    const __m256d vnorm = _mm256_set1_pd(norm_sum);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128 x = _mm_div_ps(_mm_loadu_ps(&ccc[i]), vscale);
+        __m256d c = _mm256_sub_pd(_mm256_cvtps_pd(x), _mm256_mul_pd(vnorm, _mm256_loadu_pd(&mean[i])));
+        __m128 v;
+        c = _mm256_div_pd(_mm256_mul_pd(c, _mm256_loadu_pd(&weight[i])), _mm256_loadu_pd(&stdev[i]));
+        v = _mm256_cvtpd_ps(c);
+        v = _mm_and_ps(v, _mm_cmpord_ps(v, v));
+        if (_mm_movemask_ps(_mm_cmpgt_ps(_mm_and_ps(v, abs_mask), _mm_set1_ps(1.01f)))) {
+            status = 1;
+        }
+        v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+        _mm_storeu_ps(&ncc[i], _mm_add_ps(_mm_loadu_ps(&ncc[i]), v));
+    }
+    status |= normalise_row_scalar(&ccc[i], scale, norm_sum, &mean[i], &stdev[i],
+                                   &weight[i], &ncc[i], n - i);
+    return status;
+}
+
+
+SIMD_TARGET("avx512f")
+static void complex_multiply_avx512(fftwf_complex *out, fftwf_complex *a, fftwf_complex *b, long n) {
+    long i;
+    const __m512i sign = _mm512_set1_epi64(0x80000000LL);
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512 va = _mm512_loadu_ps(&a[i][0]);
+        __m512 vb = _mm512_loadu_ps(&b[i][0]);
+        __m512 re = _mm512_mul_ps(va, _mm512_moveldup_ps(vb));
+        __m512 im = _mm512_mul_ps(_mm512_permute_ps(va, 0xB1), _mm512_movehdup_ps(vb));
+        im = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(im), sign));
+        _mm512_storeu_ps(&out[i][0], _mm512_add_ps(re, im));
+    }
+    complex_multiply_scalar(&out[i], &a[i], &b[i], n - i);
+}
+
+
+SIMD_TARGET("avx512f")
+static int normalise_row_avx512(float *ccc, double scale, double norm_sum, double *mean,
+                                double *stdev, double *weight, float *ncc, long n) {
+    long i;
+    int status = 0;
+    const __m256 vscale = _mm256_set1_ps((float) scale);
+    const __m512d vnorm = _mm512_set1_pd(norm_sum);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_div_ps(_mm256_loadu_ps(&ccc[i]), vscale);
+        __m512d c = _mm512_sub_pd(_mm512_cvtps_pd(x), _mm512_mul_pd(vnorm, _mm512_loadu_pd(&mean[i])));
+        __m256 v;
+        c = _mm512_div_pd(_mm512_mul_pd(c, _mm512_loadu_pd(&weight[i])), _mm512_loadu_pd(&stdev[i]));
+        v = _mm512_cvtpd_ps(c);
+        v = _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q));
+        if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_and_ps(v, abs_mask), _mm256_set1_ps(1.01f), _CMP_GT_OQ))) {
+            status = 1;
+        }
+        v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+        _mm256_storeu_ps(&ncc[i], _mm256_add_ps(_mm256_loadu_ps(&ncc[i]), v));
+    }
+    status |= normalise_row_scalar(&ccc[i], scale, norm_sum, &mean[i], &stdev[i],
+                                   &weight[i], &ncc[i], n - i);
+    return status;
+}
+#endif
+
+
+static complex_multiply_func select_complex_multiply(int level) {
+    #ifdef SIMD_DISPATCH
+    if (level >= SIMD_AVX512) {
+        return complex_multiply_avx512;
+    }
+    if (level >= SIMD_AVX2) {
+        return complex_multiply_avx2;
+    }
+    #endif
+    #ifdef SIMD_SSE2_AVAILABLE
+    if (level >= SIMD_SSE2) {
+        return complex_multiply_sse2;
+    }
+    #endif
+    return complex_multiply_scalar;
+}
+
+
+static normalise_row_func select_normalise_row(int level) {
+    #ifdef SIMD_DISPATCH
+    if (level >= SIMD_AVX512) {
+        return normalise_row_avx512;
+    }
+    if (level >= SIMD_AVX2) {
+        return normalise_row_avx2;
+    }
+    #endif
+    #ifdef SIMD_SSE2_AVAILABLE
+    if (level >= SIMD_SSE2) {
+        return normalise_row_sse2;
+    }
+    #endif
+    return normalise_row_scalar;
+}
+
+
+static void window_stats(float *window, long template_len, double *mean, double *var) {
+    /* Mean and (population) variance of one window, computed directly */
+    long i;
+    double sum = 0.0;
+
+    for (i = 0; i < template_len; ++i){
+        sum += (double) window[i];
+    }
+    *mean = sum / template_len;
     sum = 0.0;
-    for (i=0; i < template_len; ++i){
-        sum += pow((double) image[i] - mean[0], 2) / (template_len);
+    for (i = 0; i < template_len; ++i){
+        sum += pow((double) window[i] - *mean, 2) / (template_len);
     }
-    var[0] = sum;
+    *var = sum;
+}
 
-    // Used for centering - taking only the valid part of the cross-correlation
-    startind = template_len - 1;
-    if (var[0] >= ACCEPTED_DIFF) {
-        double stdev = sqrt(var[0]);
-        for (t = 0; t < n_templates; ++t){
-            double c = ((ccc[(t * fft_len) + startind] / (fft_len * n_templates)) - norm_sums[t] * mean[0]);
-            c /= stdev;
-            status += set_ncc(t, 0, template_len, image_len, (float) c, used_chans, pad_array, ncc);
 
+static int flatline_run(float *image, long j, long template_len, int first_flatline) {
+    /* Flatline count for window j of image as the running count would give,
+     * where first_flatline is the count for window 0. Counts of template_len
+     * or more are not computed exactly. */
+    int count = 0;
+    long k;
+
+    for (k = j; k >= 1; --k) {
+        if (image[k + template_len - 1] != image[k + template_len - 2]) {
+            return count;
         }
-        if (var[0] <= WARN_DIFF){
-            variance_warning[0] = 1;
+        if (++count >= template_len) {
+            return count;
         }
-    } else {
-        unused_corr = 1;
     }
- 
-    // pre-compute the mean and var so we can parallelise the calculation
-    for(i = 1; i < (image_len - template_len + 1); ++i){
-        // Need to cast to double otherwise we end up with annoying floating
-        // point errors when the variance is massive - collecting fp errors.
-        new_samp = (double) image[i + template_len - 1];
-        old_samp = (double) image[i - 1];
-        mean[i] = mean[i - 1] + (new_samp - old_samp) / template_len;
-        var[i] = var[i - 1] + (new_samp - old_samp) * (new_samp - mean[i] + old_samp - mean[i - 1]) / (template_len);
-        if (new_samp == (double) image[i + template_len - 2]) {
-            flatline_count[i] = flatline_count[i - 1] + 1;
+    return count + first_flatline;
+}
+
+
+static void sliding_stats(float *image, long start, long n, long template_len, double *mean,
+                          double *var, int *flatline_count, int num_threads) {
+  /*
+  Purpose: running mean, variance and flatline count for windows
+           start + 1 to start + n - 1 of image, given those for window start
+           (in mean[0], var[0] and flatline_count[0]).
+  Notes:
+    The windows are split into chunks of MIN_STATS_CHUNK, each of which starts
+    afresh from a direct calculation for its first window, so the chunks can
+    be run in parallel (and the running sums do not accumulate rounding errors
+    between chunks). Chunks are the same whatever the number of threads, so
+    the statistics are too.
+  */
+    int c, n_chunks;
+    long chunk_len = MIN_STATS_CHUNK;
+
+    if (n < 2) {
+        return;
+    }
+    n_chunks = (int) ((n - 1 + chunk_len - 1) / chunk_len);
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > n_chunks) {
+        num_threads = n_chunks;
+    }
+
+    #pragma omp parallel for num_threads(num_threads)
+    for (c = 0; c < n_chunks; ++c) {
+        long i;
+        long first = 1 + c * chunk_len;
+        long last = first + chunk_len;
+        double new_samp, old_samp;
+
+        if (last > n) {
+            last = n;
         }
-        else {
-            flatline_count[i] = 0;
+        if (c > 0 && first < last) {
+            window_stats(&image[start + first], template_len, &mean[first], &var[first]);
+            flatline_count[first] = flatline_run(&image[start], first, template_len, flatline_count[0]);
+            first++;
+        }
+        for (i = first; i < last; ++i){
+            // Need to cast to double otherwise we end up with annoying floating
+            // point errors when the variance is massive - collecting fp errors.
+            new_samp = (double) image[start + i + template_len - 1];
+            old_samp = (double) image[start + i - 1];
+            mean[i] = mean[i - 1] + (new_samp - old_samp) / template_len;
+            var[i] = var[i - 1] + (new_samp - old_samp) * (new_samp - mean[i] + old_samp - mean[i - 1]) / (template_len);
+            if (new_samp == (double) image[start + i + template_len - 2]) {
+                flatline_count[i] = flatline_count[i - 1] + 1;
+            }
+            else {
+                flatline_count[i] = 0;
+            }
         }
     }
+}
 
-    // Center and divide by length to generate scaled convolution
-    #pragma omp parallel for reduction(+:status,unused_corr) num_threads(num_threads) private(t)
-    for(i = 1; i < (image_len - template_len + 1); ++i){
-        if (var[i] >= ACCEPTED_DIFF && flatline_count[i] < template_len - 1) {
-            double stdev = sqrt(var[i]);
-            double meanstd = fabs(mean[i] * stdev);
-            if (meanstd >= ACCEPTED_DIFF){
-                for (t = 0; t < n_templates; ++t){
-                    double c = ((ccc[(t * fft_len) + i + startind] / (fft_len * n_templates)) - norm_sums[t] * mean[i]);
-                    c /= stdev;
-                    status += set_ncc(t, i, template_len, image_len, (float) c, used_chans, pad_array, ncc);
+
+static int block_statistics(float *image, long block_start, long block_corr, long template_len,
+                            double *state, double *mean, double *var, int *flatline_count,
+                            double *stdev, double *weight, int *variance_warning,
+                            int num_threads) {
+  /*
+  Purpose: normalisation for correlations block_start to block_start +
+           block_corr - 1 of image
+  Args:
+    state:          RUNNING_STATS_LEN doubles holding the running normalisation
+                    state (valid flag, mean, variance, flatline count and the
+                    sample leaving the window at the next correlation). If the
+                    flag is not set the statistics are started afresh at
+                    block_start. Updated to the state at the end of the block.
+    mean, var, flatline_count:
+                    Output window statistics (block_corr long)
+    stdev:          Output standard deviations, one for correlations that
+                    cannot be normalised
+    weight:         Output one for correlations that can be normalised, zero
+                    otherwise
+    variance_warning:
+                    Incremented for low variance windows
+  Returns:
+    1 if any correlations cannot be normalised, 0 otherwise
+  */
+    long i;
+    int unused_corr = 0;
+    int fresh = (state[0] == 0);
+    double new_samp, old_samp;
+
+    if (block_corr < 1) {
+        return 0;
+    }
+    if (fresh) {
+        // Compute starting mean and variance, will update these
+        window_stats(&image[block_start], template_len, &mean[0], &var[0]);
+        flatline_count[0] = 0;
+    } else {
+        // Carry on from the end of the previous block (or call)
+        new_samp = (double) image[block_start + template_len - 1];
+        old_samp = state[4];
+        mean[0] = state[1] + (new_samp - old_samp) / template_len;
+        var[0] = state[2] + (new_samp - old_samp) * (new_samp - mean[0] + old_samp - state[1]) / (template_len);
+        if (new_samp == (double) image[block_start + template_len - 2]) {
+            flatline_count[0] = (int) state[3] + 1;
+        }
+        else {
+            flatline_count[0] = 0;
+        }
+    }
+    // pre-compute the mean and var so we can parallelise the calculation
+    sliding_stats(image, block_start, block_corr, template_len, mean, var,
+                  flatline_count, num_threads);
+
+    // Work out which correlations can be normalised
+    for (i = 0; i < block_corr; ++i){
+        stdev[i] = 1.0;
+        weight[i] = 0.0;
+        if (i == 0 && fresh) {
+            // The first window is only checked for variance
+            if (var[0] >= ACCEPTED_DIFF) {
+                stdev[0] = sqrt(var[0]);
+                weight[0] = 1.0;
+                if (var[0] <= WARN_DIFF){
+                    variance_warning[0] = 1;
                 }
+            } else {
+                unused_corr = 1;
+            }
+        } else if (var[i] >= ACCEPTED_DIFF && flatline_count[i] < template_len - 1) {
+            double std = sqrt(var[i]);
+            if (fabs(mean[i] * std) >= ACCEPTED_DIFF){
+                stdev[i] = std;
+                weight[i] = 1.0;
             }
             else {
                 unused_corr = 1;
@@ -432,47 +1440,216 @@ int normxcorr_fftw_main(float *templates, long template_len, long n_templates,
             unused_corr = 1;
         }
     }
+    state[0] = 1;
+    state[1] = mean[block_corr - 1];
+    state[2] = var[block_corr - 1];
+    state[3] = flatline_count[block_corr - 1];
+    state[4] = (double) image[block_start + block_corr - 1];
+    return unused_corr;
+}
+
+
+static int normxcorr_fftw_spectra(fftwf_complex *outa, float *norm_sums, long template_len,
+                                  long n_templates, float *image, long image_len, float *ncc,
+                                  long fft_len, ChannelWorkspace *work, fftwf_plan pb,
+                                  fftwf_plan px, int *used_chans, int *pad_array,
+                                  int num_threads, int *variance_warning, long ncc_len,
+                                  double *running_stats, int stack_atomic,
+                                  CorrelationStats *stats) {
+  /*
+  Purpose: correlate an image with pre-computed template spectra and normalise
+  Args:
+    outa:           Template spectra from template_spectra_fftw
+    norm_sums:      Template sums from template_spectra_fftw
+    work:           Buffers for at least n_templates templates - image_ext
+                    must be zeroed
+    ncc_len:        Length of each row of ncc, normally image_len - template_len + 1
+    running_stats:  NULL, or RUNNING_STATS_LEN doubles holding the running
+                    normalisation state of the previous call for this channel
+                    (valid flag, mean, variance, flatline count and the sample
+                    leaving the window at the next correlation). If the flag is
+                    set the image is treated as the continuation of the
+                    previous image, otherwise the statistics are started
+                    afresh. The state at the end of the image is stored.
+    stack_atomic:   Whether other channels may be stacked into ncc at the
+                    same time, requiring atomic adds.
+    stats:          NULL, or counters as for normxcorr_fftw_main
+    Other arguments as for normxcorr_fftw_main
+  Notes:
+    If fft_len is shorter than image_len + template_len - 1 the image is
+    correlated in overlapping blocks (overlap-save): each block of fft_len
+    samples gives the fft_len - template_len + 1 valid correlations, and the
+    next block starts where those end. The running mean and variance are
+    carried between blocks so the normalisation is the same as for a single
+    transform.
+  */
+    long N2 = fft_len / 2 + 1;
+    long n_corr = image_len - template_len + 1;
+    long block_step = fft_len - template_len + 1;
+    long block_start, block_corr = 0, i, t, startind;
+    int status = 0, unused_corr = 0;
+    float *image_ext = work->image_ext, *ccc = work->ccc;
+    fftwf_complex *outb = work->outb, *out = work->out;
+    int *flatline_count = work->flatline_count;
+    double *mean = work->mean, *var = work->var, *stdev = work->stdev, *weight = work->weight;
+    double state[RUNNING_STATS_LEN] = {0};
+    float scale = (float) fft_len;
+    int simd = get_simd_level();
+    complex_multiply_func complex_multiply = select_complex_multiply(simd);
+    normalise_row_func normalise_row = select_normalise_row(simd);
+    double tic = (stats != NULL) ? stats_clock() : 0.0;
+
+    // Blocks must give at least one correlation each, or the loop cannot advance
+    if (fft_len < template_len) {
+        printf("Error: fft_len %ld is shorter than the templates (%ld)\n", fft_len, template_len);
+        return -1;
+    }
+    if (running_stats != NULL && running_stats[0] != 0) {
+        memcpy(state, running_stats, RUNNING_STATS_LEN * sizeof(double));
+    }
+    if (block_step > n_corr) {
+        block_step = n_corr;
+    }
+    // Used for centering - taking only the valid part of the cross-correlation
+    startind = template_len - 1;
+
+    for (block_start = 0; block_start < n_corr; block_start += block_step) {
+        block_corr = n_corr - block_start;
+        if (block_corr > block_step) {
+            block_corr = block_step;
+        }
+        for (i = 0; i < block_corr + template_len - 1; ++i)
+        {
+            image_ext[i] = image[block_start + i];
+        }
+        if (block_start > 0) {
+            // The last block may be short - clear the previous block
+            for (; i < fft_len; ++i) {
+                image_ext[i] = 0.0;
+            }
+        }
+
+        // Compute fft of image
+        fftwf_execute_dft_r2c(pb, image_ext, outb);
+        tic = stats_lap(stats, STAGE_IMAGE_FFT, tic);
+
+        //  Compute dot product
+        #pragma omp parallel for num_threads(num_threads)
+        for (t = 0; t < n_templates; ++t){
+            complex_multiply(&out[t * N2], &outa[t * N2], outb, N2);
+        }
+        tic = stats_lap(stats, STAGE_MULTIPLY, tic);
+
+        //  Compute inverse fft
+        fftwf_execute_dft_c2r(px, out, ccc);
+        tic = stats_lap(stats, STAGE_INVERSE_FFT, tic);
+
+        //  Procedures for normalisation
+        if (block_statistics(image, block_start, block_corr, template_len, state, mean, var,
+                             flatline_count, stdev, weight, variance_warning, num_threads)) {
+            unused_corr = 1;
+        }
+        if (stats != NULL) {
+            long long skipped = 0, flat = 0;
+
+            for (i = 0; i < block_corr; ++i) {
+                if (weight[i] == 0.0) {
+                    ++skipped;
+                    if (flatline_count[i] >= template_len - 1) {
+                        ++flat;
+                    }
+                }
+            }
+            stats_add(&stats->skipped_samples, skipped);
+            stats_add(&stats->flatline_samples, flat);
+            tic = stats_lap(stats, STAGE_STATISTICS, tic);
+        }
+
+        // Center and divide by length to generate scaled convolution
+        #pragma omp parallel for reduction(+:status) num_threads(num_threads) private(i)
+        for (t = 0; t < n_templates; ++t){
+            // Correlation block_start + i is stacked at block_start + i - pad
+            long first = pad_array[t] - block_start;
+            float *ccc_row;
+            float *ncc_row;
+
+            if (!used_chans[t]) {
+                continue;
+            }
+            if (first < 0) {
+                first = 0;
+            }
+            if (first >= block_corr) {
+                continue;
+            }
+            ccc_row = &ccc[(t * fft_len) + startind + first];
+            ncc_row = &ncc[(size_t) t * ncc_len + block_start + first - pad_array[t]];
+            if (stack_atomic) {
+                for (i = 0; i < block_corr - first; ++i){
+                    double c = ((ccc_row[i] / scale) - norm_sums[t] * mean[first + i]) * weight[first + i];
+                    c /= stdev[first + i];
+                    status += stack_ncc(&ncc_row[i], (float) c, 1);
+                }
+            } else {
+                status += normalise_row(
+                    ccc_row, scale, (double) norm_sums[t], &mean[first], &stdev[first],
+                    &weight[first], ncc_row, block_corr - first);
+            }
+        }
+        tic = stats_lap(stats, STAGE_NORMALISE, tic);
+    }
     if (unused_corr == 1){
         if (status == 0){
             status = 999;
         }
     }
+    if (running_stats != NULL && block_corr > 0) {
+        // Keep the state at the last correlation (end of the last block)
+        memcpy(running_stats, state, RUNNING_STATS_LEN * sizeof(double));
+    }
 
-    //  Clean up
-    free(norm_sums);
-    free(mean);
-    free(var);
-    free(flatline_count);
     return status;
 }
 
 
-static inline int set_ncc(long t, long i, long template_len, long image_len, float value, int *used_chans, int *pad_array, float *ncc) {
-
+static inline int set_ncc(long t, long i, long template_len, long image_len, float value, int *used_chans, int *pad_array, float *ncc, int stack_atomic) {
     int status = 0;
 
     if (used_chans[t] && (i >= pad_array[t])) {
         size_t ncc_index = t * ((size_t) image_len - template_len + 1) + i - pad_array[t];
+        status = stack_ncc(&ncc[ncc_index], value, stack_atomic);
+    }
 
-        if (isnanf(value)) {
-            // set NaNs to zero
-            value = 0.0;
-        }
-        else if (fabsf(value) > 1.01) {
-            // this will raise an exception when we return to Python
-            status = 1;
-        }
-        else if (value > 1.0) {
-            value = 1.0;
-        }
-        else if (value < -1.0) {
-            value = -1.0;
-        }
-        // prev_ncc = ncc[ncc_index];
+    return status;
+}
+
+
+static inline int stack_ncc(float *target, float value, int stack_atomic) {
+    /* Add a correlation to the stack. Within one channel every correlation
+     * is stacked into a different element of ncc, so the add only needs to
+     * be atomic when several channels are stacked into the same ncc at once. */
+    int status = 0;
+
+    if (isnanf(value)) {
+        // set NaNs to zero
+        value = 0.0;
+    }
+    else if (fabsf(value) > 1.01) {
+        // this will raise an exception when we return to Python
+        status = 1;
+    }
+    else if (value > 1.0) {
+        value = 1.0;
+    }
+    else if (value < -1.0) {
+        value = -1.0;
+    }
+    if (stack_atomic) {
         #pragma omp atomic
-        ncc[ncc_index] += value;
+        *target += value;
+    } else {
+        *target += value;
     }
-
     return status;
 }
 
@@ -520,204 +1697,602 @@ void free_fftw_arrays(int size, double **template_ext, double **image_ext, doubl
 
 
 int multi_normxcorr_fftw(float *templates, long n_templates, long template_len, long n_channels,
-        float *image, long image_len, float *ncc, long fft_len, int *used_chans, int *pad_array,
-        int num_threads_outer, int num_threads_inner, int *variance_warning) {
+        float *image, long image_len, long long *image_offsets, float *ncc, long fft_len,
+        int *used_chans, int *pad_array,
+        int num_threads_outer, int num_threads_inner, int *variance_warning, int split_templates,
+        CorrelatorWorkspace *workspace, CorrelationStats *stats) {
+  /*
+  Purpose: multi-channel frequency domain normalised cross-correlation, stacked
+           into ncc.
+  Args:
+    image_offsets:      NULL if the images are stacked [ch_1, ch_2, ..., ch_n],
+                        otherwise the index in image of the start of each
+                        channel, so that rows of a larger buffer can be
+                        correlated without copying.
+    split_templates:    If 0 the outer threads each correlate whole channels,
+                        stacking into ncc with atomic adds. Otherwise the
+                        templates are split into one slice per outer thread
+                        and each thread correlates every channel for its
+                        slice, so no two threads write to the same part of
+                        ncc. The image transform is repeated for each slice.
+    workspace:          Buffers from create_correlator_workspace for the same
+                        shape, threads and split, or NULL to allocate them for
+                        this call.
+    stats:              NULL, or counters to add the time in each stage, the
+                        busy time of each outer thread, memory allocated and
+                        windows skipped to.
+    Other arguments as for normxcorr_fftw_main, with templates, image,
+    used_chans and pad_array stacked by channel.
+  */
     int i;
     int r=0;
-    size_t N2 = (size_t) fft_len / 2 + 1;
-    float **template_ext = NULL;
-    float **image_ext = NULL;
-    float **ccc = NULL;
-    int * results = (int *) calloc(n_channels, sizeof(int));
-    fftwf_complex **outa = NULL;
-    fftwf_complex **outb = NULL;
-    fftwf_complex **out = NULL;
-    fftwf_plan pa, pb, px;
+    int s;
+    long n_slices = 1;
+    long slice_len = n_templates;
+    long last_len = n_templates;
+    long n_corr = image_len - template_len + 1;
+    int * results = NULL;
+    int * slice_warnings = NULL;
+    CorrelatorWorkspace *own_workspace = NULL;
+    ChannelWorkspace *work;
+    fftwf_plan pa, pb, px, pa_last, px_last;
+    double start = (stats != NULL) ? stats_clock() : 0.0;
+    double tic = start;
+
+    if (split_templates) {
+        set_thread_layout(n_templates, &num_threads_outer, &num_threads_inner);
+        slice_len = (n_templates + num_threads_outer - 1) / num_threads_outer;
+        n_slices = (n_templates + slice_len - 1) / slice_len;
+        last_len = n_templates - (n_slices - 1) * slice_len;
+        num_threads_outer = (int) n_slices;
+    } else {
+        set_thread_layout(n_channels, &num_threads_outer, &num_threads_inner);
+    }
 
-    #ifdef N_THREADS
-    /* num_threads_outer cannot be greater than the number of channels */
-    num_threads_outer = (num_threads_outer > n_channels) ? n_channels : num_threads_outer;
+    if (workspace == NULL) {
+        own_workspace = workspace = create_correlator_workspace(
+            n_templates, template_len, n_channels, fft_len, num_threads_outer,
+            split_templates, 1);
+        if (workspace == NULL) {
+            return -1;
+        }
+    } else if (!workspace_fits(workspace, slice_len, template_len, fft_len,
+                               num_threads_outer, 1)) {
+        return -1;
+    }
 
-    /* Outer loop parallelism seems to cause issues on OSX */
-    if (OUTER_SAFE != 1 && num_threads_outer > 1){
-        printf("WARNING\tMULTI_NORMXCORR_FFTW\tOuter loop threading disabled for this system\n");
-        num_threads_inner *= num_threads_outer;
-        printf("WARNING\tMULTI_NORMXCORR_FFTW\tSetting inner threading to %i and outer threading to 1\n", num_threads_inner);
-        num_threads_outer = 1;
+    results = (int *) calloc((size_t) n_slices * n_channels, sizeof(int));
+    if (results == NULL) {
+        printf("Error allocating results\n");
+        free_correlator_workspace(own_workspace);
+        return -1;
+    }
+    /* Variance warnings only depend on the image: keep those from the first slice */
+    if (n_slices > 1) {
+        slice_warnings = (int *) calloc((size_t) (n_slices - 1) * n_channels, sizeof(int));
+        if (slice_warnings == NULL) {
+            printf("Error allocating slice_warnings\n");
+            free(results);
+            free_correlator_workspace(own_workspace);
+            return -1;
+        }
     }
-    if (num_threads_inner > 1) {
-        /* initialise FFTW threads */
-        fftwf_init_threads();
-        fftwf_plan_with_nthreads(num_threads_inner);
+    if (stats != NULL) {
+        long long nbytes = (long long) ((size_t) n_slices * n_channels * sizeof(int) +
+                                        (size_t) (n_slices - 1) * n_channels * sizeof(int));
 
-        if (num_threads_outer > 1) {
-            /* explicitly enable nested OpenMP loops */
-            omp_set_nested(1);
+        if (own_workspace != NULL) {
+            nbytes += (long long) own_workspace->nbytes;
         }
+        stats_add(&stats->bytes_allocated, nbytes);
+        tic = stats_lap(stats, STAGE_SETUP, tic);
     }
 
-    /* warn if the total number of threads is higher than the number of cores */
-    if (num_threads_outer * num_threads_inner > N_THREADS) {
-        printf("Warning: requesting more threads than available - this could negatively impact performance\n");
+    // We get the plans here since they are not thread safe.
+    work = &workspace->workers[0];
+    pa = get_cached_plan(PLAN_TEMPLATE_R2C, fft_len, slice_len, num_threads_inner, work->template_ext, work->outa);
+    pb = get_cached_plan(PLAN_IMAGE_R2C, fft_len, 1, num_threads_inner, work->image_ext, work->outb);
+    px = get_cached_plan(PLAN_C2R, fft_len, slice_len, num_threads_inner, work->out, work->ccc);
+    pa_last = pa;
+    px_last = px;
+    if (last_len != slice_len) {
+        pa_last = get_cached_plan(PLAN_TEMPLATE_R2C, fft_len, last_len, num_threads_inner, work->template_ext, work->outa);
+        px_last = get_cached_plan(PLAN_C2R, fft_len, last_len, num_threads_inner, work->out, work->ccc);
+    }
+    stats_lap(stats, STAGE_PLAN, tic);
+
+    if (pa == NULL || pb == NULL || px == NULL || pa_last == NULL || px_last == NULL) {
+        r = -1;
+    } else if (n_slices > 1) {
+        /* loop over the template slices, each slice owns its rows of ncc */
+        #pragma omp parallel for num_threads(num_threads_outer)
+        for (s = 0; s < n_slices; ++s){
+            int tid = 0; /* each thread has its own workspace */
+            long c;
+            long t0 = s * slice_len;
+            long n_sub = (s == n_slices - 1) ? last_len : slice_len;
+            fftwf_plan pa_s = (s == n_slices - 1) ? pa_last : pa;
+            fftwf_plan px_s = (s == n_slices - 1) ? px_last : px;
+            int *warnings = (s == 0) ? variance_warning : &slice_warnings[(size_t) (s - 1) * n_channels];
+            ChannelWorkspace *thread_work;
+
+            #ifdef N_THREADS
+            /* get the id of this thread */
+            tid = omp_get_thread_num();
+            #endif
+            thread_work = &workspace->workers[tid];
+            for (c = 0; c < n_channels; ++c){
+                size_t offset = (size_t) c * n_templates + t0;
+                double busy = (stats != NULL) ? stats_clock() : 0.0;
+
+                memset(thread_work->template_ext, 0, (size_t) fft_len * n_sub * sizeof(float));
+                memset(thread_work->image_ext, 0, (size_t) fft_len * sizeof(float));
+
+                results[s * n_channels + c] = normxcorr_fftw_main(
+                    &templates[offset * template_len], template_len, n_sub,
+                    channel_image(image, image_offsets, c, image_len), image_len, &ncc[(size_t) t0 * n_corr],
+                    fft_len, thread_work, pa_s, pb, px_s, &used_chans[offset], &pad_array[offset],
+                    num_threads_inner, &warnings[c], 0, stats);
+                if (stats != NULL && tid < STATS_MAX_THREADS) {
+                    stats_add(&stats->thread_busy_ns[tid], (long long) ((stats_clock() - busy) * 1e9));
+                }
+            }
+        }
+    } else {
+        /* loop over the channels */
+        #pragma omp parallel for num_threads(num_threads_outer)
+        for (i = 0; i < n_channels; ++i){
+            int tid = 0; /* each thread has its own workspace */
+            ChannelWorkspace *thread_work;
+            double busy = (stats != NULL) ? stats_clock() : 0.0;
+
+            #ifdef N_THREADS
+            /* get the id of this thread */
+            tid = omp_get_thread_num();
+            #endif
+            thread_work = &workspace->workers[tid];
+            /* initialise memory to zero */
+            memset(thread_work->template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
+            memset(thread_work->image_ext, 0, (size_t) fft_len * sizeof(float));
+
+            /* call the routine */
+            results[i] = normxcorr_fftw_main(&templates[(size_t) n_templates * template_len * i], template_len,
+                                     n_templates, channel_image(image, image_offsets, i, image_len), image_len,
+                                     ncc, fft_len,
+                                     thread_work, pa, pb, px, &used_chans[(size_t) i * n_templates],
+                                     &pad_array[(size_t) i * n_templates], num_threads_inner, &variance_warning[i],
+                                     num_threads_outer > 1, stats);
+            if (stats != NULL && tid < STATS_MAX_THREADS) {
+                stats_add(&stats->thread_busy_ns[tid], (long long) ((stats_clock() - busy) * 1e9));
+            }
+        }
     }
-    #else
-    /* threading/OpenMP is disabled */
-    num_threads_outer = 1;
-    num_threads_inner = 1;
-    #endif
 
-    /* allocate memory for all threads here */
-    template_ext = (float**) malloc(num_threads_outer * sizeof(float*));
-    if (template_ext == NULL) {
-        printf("Error allocating template_ext\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+    // Conduct error handling
+    if (r == 0) {
+        r = combine_channel_results(results, n_slices * n_channels);
     }
-    image_ext = (float**) malloc(num_threads_outer * sizeof(float*));
-    if (image_ext == NULL) {
-        printf("Error allocating image_ext\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+    if (last_len != slice_len) {
+        release_cached_plan(pa_last);
+        release_cached_plan(px_last);
     }
-    ccc = (float**) malloc(num_threads_outer * sizeof(float*));
-    if (ccc == NULL) {
-        printf("Error allocating ccc\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+    release_cached_plan(pa);
+    release_cached_plan(pb);
+    release_cached_plan(px);
+    free(results);
+    free(slice_warnings);
+    free_correlator_workspace(own_workspace);
+    if (stats != NULL) {
+        stats_add(&stats->wall_ns, (long long) ((stats_clock() - start) * 1e9));
+        stats_add(&stats->n_calls, 1);
+        if (num_threads_outer > stats->n_threads) {
+            stats->n_threads = num_threads_outer;
+        }
     }
-    outa = (fftwf_complex**) malloc(num_threads_outer * sizeof(fftwf_complex*));
-    if (outa == NULL) {
-        printf("Error allocating outa\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+
+    return r;
+}
+
+
+static inline size_t batch_row(long t, long c, long n_templates, long n_channels, int layout) {
+    /* Row of template t, channel c in the batched transforms */
+    if (layout == LAYOUT_TEMPLATE_MAJOR) {
+        return (size_t) t * n_channels + c;
     }
-    outb = (fftwf_complex**) malloc(num_threads_outer * sizeof(fftwf_complex*));
-    if (outb == NULL) {
-        printf("Error allocating outb\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
+    return (size_t) c * n_templates + t;
+}
+
+
+int multi_normxcorr_fftw_batched(float *templates, long n_templates, long template_len,
+        long n_channels, float *image, long image_len, long long *image_offsets, float *ncc,
+        long fft_len, int *used_chans, int *pad_array, int num_threads, int *variance_warning,
+        int layout) {
+  /*
+  Purpose: multi-channel frequency domain normalised cross-correlation, stacked
+           into ncc, using batched transforms of all channels at once.
+  Args:
+    num_threads:    Number of threads to use for transforms and loops
+    layout:         Order of the rows of the batched transforms:
+                    LAYOUT_CHANNEL_MAJOR keeps the templates for each channel
+                    together, LAYOUT_TEMPLATE_MAJOR keeps the channels of each
+                    template together.
+    Other arguments as for multi_normxcorr_fftw.
+  Notes:
+    The templates of all channels are transformed in one batch, as are the
+    images of all channels for each block, and all the correlations are
+    inverse transformed in one batch. Memory therefore scales with
+    n_templates x n_channels x fft_len: use fft_len shorter than image_len to
+    correlate in blocks (overlap-save). Each thread stacks whole templates,
+    so no atomic adds are needed.
+  */
+    long n_rows = n_templates * n_channels;
+    long N2 = fft_len / 2 + 1;
+    long n_corr = image_len - template_len + 1;
+    long block_step = fft_len - template_len + 1;
+    long block_start, block_corr, startind = template_len - 1;
+    int r, c, t, row, status = 0, unused_corr = 0;
+    float scale = (float) fft_len;
+    float *template_ext, *image_ext, *ccc, *norm_sums;
+    fftwf_complex *spectra, *image_spectra, *product;
+    double *mean, *var, *stdev, *weight, *state;
+    int *flatline_count, *unused;
+    fftwf_plan pa = NULL, pb = NULL, px = NULL;
+    int simd = get_simd_level();
+    complex_multiply_func complex_multiply = select_complex_multiply(simd);
+    normalise_row_func normalise_row = select_normalise_row(simd);
+
+    // Blocks must give at least one correlation each, or the loop cannot advance
+    if (fft_len < template_len) {
+        printf("Error: fft_len %ld is shorter than the templates (%ld)\n", fft_len, template_len);
         return -1;
     }
-    out = (fftwf_complex**) malloc(num_threads_outer * sizeof(fftwf_complex*));
-    if (out == NULL) {
-        printf("Error allocating out\n");
-        free_fftwf_arrays(0, template_ext, image_ext, ccc, outa, outb, out);
-        return -1;
+    if (block_step > n_corr) {
+        block_step = n_corr;
     }
-
-    // All memory allocated with `fftw_malloc` to ensure 16-byte aligned.
-    for (i = 0; i < num_threads_outer; i++) {
-        /* initialise all to NULL so that freeing on error works */
-        template_ext[i] = NULL;
-        image_ext[i] = NULL;
-        ccc[i] = NULL;
-        outa[i] = NULL;
-        outb[i] = NULL;
-        out[i] = NULL;
-
-        /* allocate template_ext arrays */
-        template_ext[i] = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
-        if (template_ext[i] == NULL) {
-            printf("Error allocating template_ext[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+    #ifndef N_THREADS
+    num_threads = 1;
+    #endif
+    // The template input is not needed after the forward transform, so it
+    // holds the correlations.
+    template_ext = (float*) fftwf_malloc((size_t) n_rows * fft_len * sizeof(float));
+    spectra = (fftwf_complex*) fftwf_malloc((size_t) n_rows * N2 * sizeof(fftwf_complex));
+    product = (fftwf_complex*) fftwf_malloc((size_t) n_rows * N2 * sizeof(fftwf_complex));
+    image_ext = (float*) fftwf_malloc((size_t) n_channels * fft_len * sizeof(float));
+    image_spectra = (fftwf_complex*) fftwf_malloc((size_t) n_channels * N2 * sizeof(fftwf_complex));
+    norm_sums = (float*) calloc(n_rows, sizeof(float));
+    mean = (double*) malloc((size_t) n_channels * block_step * sizeof(double));
+    var = (double*) malloc((size_t) n_channels * block_step * sizeof(double));
+    stdev = (double*) malloc((size_t) n_channels * block_step * sizeof(double));
+    weight = (double*) malloc((size_t) n_channels * block_step * sizeof(double));
+    flatline_count = (int*) calloc((size_t) n_channels * block_step, sizeof(int));
+    state = (double*) calloc((size_t) n_channels * RUNNING_STATS_LEN, sizeof(double));
+    unused = (int*) calloc(n_channels, sizeof(int));
+    if (template_ext == NULL || spectra == NULL || product == NULL || image_ext == NULL ||
+        image_spectra == NULL || norm_sums == NULL || mean == NULL || var == NULL ||
+        stdev == NULL || weight == NULL || flatline_count == NULL || state == NULL ||
+        unused == NULL) {
+        printf("Error allocating memory in multi_normxcorr_fftw_batched\n");
+        status = -1;
+    }
+    if (status == 0) {
+        ccc = template_ext;
+        pa = get_cached_plan(PLAN_TEMPLATE_R2C, fft_len, n_rows, num_threads, template_ext, spectra);
+        pb = get_cached_plan(PLAN_IMAGE_R2C, fft_len, n_channels, num_threads, image_ext, image_spectra);
+        px = get_cached_plan(PLAN_C2R, fft_len, n_rows, num_threads, product, ccc);
+        if (pa == NULL || pb == NULL || px == NULL) {
+            status = -1;
         }
+    }
+    if (status == 0) {
+        // Planning may have used the arrays: zero padding - and flip templates
+        memset(template_ext, 0, (size_t) n_rows * fft_len * sizeof(float));
+        memset(image_ext, 0, (size_t) n_channels * fft_len * sizeof(float));
+        #pragma omp parallel for num_threads(num_threads) private(t)
+        for (c = 0; c < n_channels; ++c){
+            for (t = 0; t < n_templates; ++t){
+                long i;
+                size_t dest = batch_row(t, c, n_templates, n_channels, layout);
+                float *template_row = &templates[((size_t) c * n_templates + t) * template_len];
 
-        /* allocate image_ext arrays */
-        image_ext[i] = (float*) fftwf_malloc(fft_len * sizeof(float));
-        if (image_ext[i] == NULL) {
-            printf("Error allocating image_ext[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+                for (i = 0; i < template_len; ++i){
+                    template_ext[dest * fft_len + i] = template_row[template_len - (i + 1)];
+                    norm_sums[dest] += template_row[i];
+                }
+            }
         }
+        fftwf_execute_dft_r2c(pa, template_ext, spectra);
 
-        /* allocate ccc arrays */
-        ccc[i] = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
-        if (ccc[i] == NULL) {
-            printf("Error allocating ccc[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
-        }
+        for (block_start = 0; block_start < n_corr; block_start += block_step) {
+            block_corr = n_corr - block_start;
+            if (block_corr > block_step) {
+                block_corr = block_step;
+            }
+            #pragma omp parallel for num_threads(num_threads)
+            for (c = 0; c < n_channels; ++c){
+                memcpy(&image_ext[(size_t) c * fft_len],
+                       channel_image(image, image_offsets, c, image_len) + block_start,
+                       (block_corr + template_len - 1) * sizeof(float));
+            }
+            fftwf_execute_dft_r2c(pb, image_ext, image_spectra);
+
+            //  Compute dot products
+            #pragma omp parallel for num_threads(num_threads)
+            for (row = 0; row < n_rows; ++row){
+                long chan = (layout == LAYOUT_TEMPLATE_MAJOR) ? row % n_channels : row / n_templates;
+                complex_multiply(&product[(size_t) row * N2], &spectra[(size_t) row * N2],
+                                 &image_spectra[(size_t) chan * N2], N2);
+            }
+            fftwf_execute_dft_c2r(px, product, ccc);
 
-        /* allocate outa arrays */
-        outa[i] = (fftwf_complex*) fftwf_malloc((size_t) N2 * n_templates * sizeof(fftwf_complex));
-        if (outa[i] == NULL) {
-            printf("Error allocating outa[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
-        }
+            #pragma omp parallel for num_threads(num_threads)
+            for (c = 0; c < n_channels; ++c){
+                size_t offset = (size_t) c * block_step;
 
-        /* allocate outb arrays */
-        outb[i] = (fftwf_complex*) fftwf_malloc((size_t) N2 * sizeof(fftwf_complex));
-        if (outb[i] == NULL) {
-            printf("Error allocating outb[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
-            return -1;
+                if (block_statistics(channel_image(image, image_offsets, c, image_len), block_start, block_corr,
+                                     template_len, &state[c * RUNNING_STATS_LEN], &mean[offset],
+                                     &var[offset], &flatline_count[offset], &stdev[offset],
+                                     &weight[offset], &variance_warning[c], 1)) {
+                    unused[c] = 1;
+                }
+            }
+
+            // Normalise and stack: each thread owns whole rows of ncc
+            #pragma omp parallel for reduction(+:status) num_threads(num_threads) private(c)
+            for (t = 0; t < n_templates; ++t){
+                for (c = 0; c < n_channels; ++c){
+                    size_t in_index = (size_t) c * n_templates + t;
+                    size_t src = batch_row(t, c, n_templates, n_channels, layout);
+                    size_t offset = (size_t) c * block_step;
+                    long first = pad_array[in_index] - block_start;
+
+                    if (!used_chans[in_index]) {
+                        continue;
+                    }
+                    if (first < 0) {
+                        first = 0;
+                    }
+                    if (first >= block_corr) {
+                        continue;
+                    }
+                    status += normalise_row(
+                        &ccc[src * fft_len + startind + first], scale, (double) norm_sums[src],
+                        &mean[offset + first], &stdev[offset + first], &weight[offset + first],
+                        &ncc[(size_t) t * n_corr + block_start + first - pad_array[in_index]],
+                        block_corr - first);
+                }
+            }
         }
+        for (c = 0; c < n_channels; ++c){
+            unused_corr |= unused[c];
+        }
+        if (status == 0 && unused_corr) {
+            status = 999;
+        }
+    }
+    r = status;
+
+    release_cached_plan(pa);
+    release_cached_plan(pb);
+    release_cached_plan(px);
+    fftwf_free(template_ext);
+    fftwf_free(spectra);
+    fftwf_free(product);
+    fftwf_free(image_ext);
+    fftwf_free(image_spectra);
+    free(norm_sums);
+    free(mean);
+    free(var);
+    free(stdev);
+    free(weight);
+    free(flatline_count);
+    free(state);
+    free(unused);
+    return r;
+}
+
+
+static size_t spectra_stride(long n_templates, long fft_len) {
+    /* Per-channel stride of cached spectra, rounded up so that every channel
+     * keeps the alignment of the base allocation (required for new-array
+     * execution of the plans). */
+    size_t stride = (size_t) n_templates * (fft_len / 2 + 1);
+    return (stride + 3) & ~((size_t) 3);
+}
+
+
+TemplateSpectra* prepare_template_spectra(float *templates, long n_templates, long template_len,
+        long n_channels, long fft_len, int num_threads) {
+  /*
+  Purpose: compute and keep the spectra of normalised templates for re-use
+  Args:
+    templates:      Normalised templates stacked as for multi_normxcorr_fftw
+    n_templates:    Number of templates
+    template_len:   Length of templates
+    n_channels:     Number of channels
+    fft_len:        Size for fft - data longer than fft_len - template_len + 1
+                    samples are correlated in blocks of this size
+    num_threads:    Number of threads to use for the transforms
+  Returns:
+    Pointer to the prepared spectra, or NULL if memory allocation failed or
+    fft_len is shorter than template_len. Must be freed using
+    free_template_spectra.
+  */
+    long c;
+    size_t stride = spectra_stride(n_templates, fft_len);
+    float *template_ext;
+    fftwf_plan pa;
+    TemplateSpectra *prepared;
+
+    if (fft_len < template_len) {
+        printf("Error: fft_len %ld is shorter than the templates (%ld)\n", fft_len, template_len);
+        return NULL;
+    }
+    prepared = (TemplateSpectra*) malloc(sizeof(TemplateSpectra));
+    if (prepared == NULL) {
+        printf("Error allocating template spectra\n");
+        return NULL;
+    }
+    prepared->n_templates = n_templates;
+    prepared->template_len = template_len;
+    prepared->n_channels = n_channels;
+    prepared->fft_len = fft_len;
+    prepared->norm_sums = (float*) calloc((size_t) n_channels * n_templates, sizeof(float));
+    prepared->spectra = (fftwf_complex*) fftwf_malloc(stride * n_channels * sizeof(fftwf_complex));
+    template_ext = (float*) fftwf_malloc((size_t) fft_len * n_templates * sizeof(float));
+    if (prepared->norm_sums == NULL || prepared->spectra == NULL || template_ext == NULL) {
+        printf("Error allocating template spectra\n");
+        fftwf_free(template_ext);
+        free_template_spectra(prepared);
+        return NULL;
+    }
+
+    pa = get_cached_plan(PLAN_TEMPLATE_R2C, fft_len, n_templates, num_threads, template_ext, prepared->spectra);
+    if (pa == NULL) {
+        fftwf_free(template_ext);
+        free_template_spectra(prepared);
+        return NULL;
+    }
+
+    for (c = 0; c < n_channels; ++c) {
+        memset(template_ext, 0, (size_t) fft_len * n_templates * sizeof(float));
+        template_spectra_fftw(&templates[(size_t) n_templates * template_len * c], template_len,
+                              n_templates, fft_len, template_ext, &prepared->spectra[stride * c],
+                              &prepared->norm_sums[(size_t) n_templates * c], pa);
+    }
+
+    release_cached_plan(pa);
+    fftwf_free(template_ext);
+    return prepared;
+}
+
+
+void free_template_spectra(TemplateSpectra *prepared) {
+    if (prepared == NULL) {
+        return;
+    }
+    fftwf_free(prepared->spectra);
+    free(prepared->norm_sums);
+    free(prepared);
+}
+
 
-        /* allocate out arrays */
-        out[i] = (fftwf_complex*) fftwf_malloc((size_t) N2 * n_templates * sizeof(fftwf_complex));
-        if (out[i] == NULL) {
-            printf("Error allocating out[%d]\n", i);
-            free_fftwf_arrays(i + 1, template_ext, image_ext, ccc, outa, outb, out);
+int multi_normxcorr_fftw_prepared(TemplateSpectra *prepared, float *image, long image_len,
+        long long *image_offsets, float *ncc, int *used_chans, int *pad_array, int num_threads_outer,
+        int num_threads_inner, int *variance_warning, CorrelatorWorkspace *workspace) {
+  /*
+  Purpose: multi-channel correlation using template spectra from
+           prepare_template_spectra - only the image is transformed. Images
+           longer than the spectra allow are correlated in overlapping blocks.
+  Args:
+    prepared:       Template spectra
+    image:          Image signals (stacked [ch_1, ch_2, ..., ch_n], or at image_offsets)
+    image_len:      Length of each image
+    Other arguments as for multi_normxcorr_fftw
+  */
+    return multi_normxcorr_fftw_stream(
+        prepared, image, image_len, image_offsets, ncc, image_len - prepared->template_len + 1,
+        used_chans, pad_array, num_threads_outer, num_threads_inner,
+        variance_warning, NULL, workspace);
+}
+
+
+int multi_normxcorr_fftw_stream(TemplateSpectra *prepared, float *image, long image_len,
+        long long *image_offsets, float *ncc, long ncc_len, int *used_chans, int *pad_array, int num_threads_outer,
+        int num_threads_inner, int *variance_warning, double *running_stats,
+        CorrelatorWorkspace *workspace) {
+  /*
+  Purpose: multi-channel correlation of the next piece of a continuous image
+           using template spectra from prepare_template_spectra.
+  Args:
+    prepared:       Template spectra
+    image:          Image signals (stacked [ch_1, ch_2, ..., ch_n], or at image_offsets) - for
+                    continuation these must start with the last
+                    template_len - 1 samples of the previous image
+    image_len:      Length of each image
+    ncc:            Output for cross-correlation, n_templates x ncc_len
+    ncc_len:        Length of each row of ncc - correlation i of template t is
+                    added to ncc[t * ncc_len + i - pad_array[t]], so negative
+                    pads can be used to offset correlations within ncc
+    running_stats:  NULL, or RUNNING_STATS_LEN x n_channels normalisation
+                    state, zeroed before the first call and kept between calls
+    workspace:      Buffers from create_correlator_workspace (template buffers
+                    are not needed), or NULL to allocate them for this call
+    Other arguments as for multi_normxcorr_fftw
+  */
+    int i;
+    int r = 0;
+    long n_templates = prepared->n_templates;
+    long template_len = prepared->template_len;
+    long n_channels = prepared->n_channels;
+    long fft_len = prepared->fft_len;
+    size_t stride = spectra_stride(n_templates, fft_len);
+    int * results = NULL;
+    CorrelatorWorkspace *own_workspace = NULL;
+    fftwf_plan pb, px;
+
+    if (fft_len < template_len) {
+        printf("Error: fft_len %ld is shorter than the templates (%ld)\n", fft_len, template_len);
+        return -1;
+    }
+    set_thread_layout(n_channels, &num_threads_outer, &num_threads_inner);
+
+    if (workspace == NULL) {
+        own_workspace = workspace = create_correlator_workspace(
+            n_templates, template_len, n_channels, fft_len, num_threads_outer, 0, 0);
+        if (workspace == NULL) {
             return -1;
         }
+    } else if (!workspace_fits(workspace, n_templates, template_len, fft_len,
+                               num_threads_outer, 0)) {
+        return -1;
+    }
+    results = (int *) calloc(n_channels, sizeof(int));
+    if (results == NULL) {
+        printf("Error allocating results\n");
+        free_correlator_workspace(own_workspace);
+        return -1;
     }
 
     // We create the plans here since they are not thread safe.
-    pa = fftwf_plan_dft_r2c_2d(n_templates, fft_len, template_ext[0], outa[0], FFTW_ESTIMATE);
-    pb = fftwf_plan_dft_r2c_1d(fft_len, image_ext[0], outb[0], FFTW_ESTIMATE);
-    px = fftwf_plan_dft_c2r_2d(n_templates, fft_len, out[0], ccc[0], FFTW_ESTIMATE);
+    pb = get_cached_plan(PLAN_IMAGE_R2C, fft_len, 1, num_threads_inner, workspace->workers[0].image_ext,
+                         workspace->workers[0].outb);
+    px = get_cached_plan(PLAN_C2R, fft_len, n_templates, num_threads_inner, workspace->workers[0].out,
+                         workspace->workers[0].ccc);
+    if (pb == NULL || px == NULL) {
+        n_channels = 0;
+        r = -1;
+    }
 
     /* loop over the channels */
     #pragma omp parallel for num_threads(num_threads_outer)
     for (i = 0; i < n_channels; ++i){
         int tid = 0; /* each thread has its own workspace */
+        ChannelWorkspace *thread_work;
 
         #ifdef N_THREADS
         /* get the id of this thread */
         tid = omp_get_thread_num();
         #endif
-        /* initialise memory to zero */
-        memset(template_ext[tid], 0, (size_t) fft_len * n_templates * sizeof(float));
-        memset(image_ext[tid], 0, (size_t) fft_len * sizeof(float));
-
-        /* call the routine */
-        results[i] = normxcorr_fftw_main(&templates[(size_t) n_templates * template_len * i], template_len,
-                                 n_templates, &image[(size_t) image_len * i], image_len, ncc, fft_len,
-                                 template_ext[tid], image_ext[tid], ccc[tid], outa[tid], outb[tid], out[tid],
-                                 pa, pb, px, &used_chans[(size_t) i * n_templates],
-                                 &pad_array[(size_t) i * n_templates], num_threads_inner, &variance_warning[i]);
+        thread_work = &workspace->workers[tid];
+        memset(thread_work->image_ext, 0, (size_t) fft_len * sizeof(float));
+
+        results[i] = normxcorr_fftw_spectra(
+            &prepared->spectra[stride * i], &prepared->norm_sums[(size_t) n_templates * i],
+            template_len, n_templates, channel_image(image, image_offsets, i, image_len), image_len, ncc,
+            fft_len, thread_work, pb, px,
+            &used_chans[(size_t) i * n_templates], &pad_array[(size_t) i * n_templates],
+            num_threads_inner, &variance_warning[i], ncc_len,
+            (running_stats == NULL) ? NULL : &running_stats[(size_t) RUNNING_STATS_LEN * i],
+            num_threads_outer > 1, NULL);
     }
 
-    // Conduct error handling
-    for (i = 0; i < n_channels; ++i){
-        if (results[i] != 999 && results[i] != 0){
-            // Some error internally, must catch this
-            r += results[i];
-        } else if (results[i] == 999 && r == 0){
-            // First time unused correlation raised and no prior errors
-            r = results[i];
-        } else if (r == 999 && results[i] == 999){
-            // Unused correlations raised multiple times
-            r = 999;
-        } else if (r == 999 && results[i] != 999){
-            // Some error internally.
-            r += results[i];
-        } else if (r != 0){
-            // Any other error
-            r += results[i];
-        }
+    if (r == 0) {
+        r = combine_channel_results(results, n_channels);
     }
+    release_cached_plan(pb);
+    release_cached_plan(px);
     free(results);
-    /* free fftw memory */
-    free_fftwf_arrays(num_threads_outer, template_ext, image_ext, ccc, outa, outb, out);
-    fftwf_destroy_plan(pa);
-    fftwf_destroy_plan(pb);
-    fftwf_destroy_plan(px);
-    if (num_threads_inner > 1) {
-        fftwf_cleanup_threads();
-    }
-    fftwf_cleanup();
+    free_correlator_workspace(own_workspace);
 
     return r;
 }
@@ -0,0 +1,213 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  pre_processing.c
+ *
+ *        Purpose:  Threaded resampling, detrending and filtering of continuous data
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fftw3.h>
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+// Prototypes
+int process_channels(double*, long*, long, double*, long*, long, long, double*, double, double*,
+                     int, int);
+
+static int resample_channel(double*, long, double, double*, long, double);
+
+static void detrend_simple(double*, long);
+
+static void sos_filter(double*, long, double*, int, int);
+
+
+static int resample_channel(double *data, long npts, double in_rate, double *out, long num,
+                            double out_rate){
+    /*
+    Resample in the frequency domain as obspy.core.trace.Trace.resample with the
+    default Hanning window: window the spectrum, linearly interpolate it onto the
+    new frequencies and transform back.
+    */
+    long n_bins = npts / 2 + 1, m_bins = num / 2 + 1, k, j, idx, n_used;
+    double df = in_rate / npts, d_large_f = out_rate / num, w, p, frac;
+    double *out_buf = (double*) fftw_malloc(sizeof(double) * num);
+    fftw_complex *spec = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * n_bins);
+    fftw_complex *large_spec = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * m_bins);
+    fftw_plan pa = NULL, pb = NULL;
+
+    if (out_buf == NULL || spec == NULL || large_spec == NULL){
+        fftw_free(out_buf);
+        fftw_free(spec);
+        fftw_free(large_spec);
+        return -1;
+    }
+    // The planner is not thread-safe, share its lock with multi_corr.c. Estimated
+    // plans do not touch the arrays, and out-of-place r2c keeps the input intact.
+    #pragma omp critical (fftw_planner)
+    {
+        pa = fftw_plan_dft_r2c_1d((int) npts, data, spec, FFTW_ESTIMATE);
+        pb = fftw_plan_dft_c2r_1d((int) num, large_spec, out_buf, FFTW_ESTIMATE);
+    }
+    fftw_execute(pa);
+
+    // Periodic Hann window, ifftshifted so that it peaks at zero frequency. Only
+    // the bins read by the interpolation are needed.
+    n_used = (long) (((m_bins - 1) * d_large_f) / df) + 2;
+    if (n_used > n_bins){
+        n_used = n_bins;
+    }
+    for (k = 0; k < n_used; ++k){
+        idx = (k + npts / 2) % npts;
+        w = 0.5 - 0.5 * cos(2.0 * M_PI * idx / npts);
+        spec[k][0] *= w;
+        spec[k][1] *= w;
+    }
+    // Linear interpolation, holding the last value beyond the old Nyquist
+    for (j = 0; j < m_bins; ++j){
+        p = (j * d_large_f) / df;
+        k = (long) p;
+        if (k >= n_bins - 1){
+            large_spec[j][0] = spec[n_bins - 1][0];
+            large_spec[j][1] = spec[n_bins - 1][1];
+            continue;
+        }
+        frac = p - k;
+        large_spec[j][0] = spec[k][0] * (1.0 - frac) + spec[k + 1][0] * frac;
+        large_spec[j][1] = spec[k][1] * (1.0 - frac) + spec[k + 1][1] * frac;
+    }
+    large_spec[0][1] = 0.0;
+    if (num % 2 == 0){
+        large_spec[m_bins - 1][1] = 0.0;
+    }
+    fftw_execute(pb);
+    // Unnormalised inverse, scaled by num / npts as obspy
+    for (j = 0; j < num; ++j){
+        out[j] = out_buf[j] / npts;
+    }
+
+    #pragma omp critical (fftw_planner)
+    {
+        fftw_destroy_plan(pa);
+        fftw_destroy_plan(pb);
+    }
+    fftw_free(out_buf);
+    fftw_free(spec);
+    fftw_free(large_spec);
+    return 0;
+}
+
+
+static void detrend_simple(double *data, long npts){
+    /* Remove the line through the first and last samples, as obspy's simple detrend */
+    long i;
+    double first = data[0], slope;
+
+    if (npts < 2){
+        return;
+    }
+    slope = (data[npts - 1] - first) / (double) (npts - 1);
+    for (i = 0; i < npts; ++i){
+        data[i] -= first + i * slope;
+    }
+}
+
+
+static void sos_filter(double *data, long npts, double *sos, int n_sections, int reverse){
+    /*
+    Filter in place through cascaded second-order sections (b0, b1, b2, 1, a1, a2)
+    from zero initial conditions, as scipy.signal.sosfilt. Runs backwards in time
+    if reverse is set.
+    */
+    int s;
+    long i, sample;
+    double *section, x, y, z0, z1;
+
+    for (s = 0; s < n_sections; ++s){
+        section = &sos[6 * s];
+        z0 = 0.0;
+        z1 = 0.0;
+        for (i = 0; i < npts; ++i){
+            sample = (reverse) ? npts - 1 - i : i;
+            x = data[sample];
+            y = section[0] * x + z0;
+            z0 = section[1] * x - section[4] * y + z1;
+            z1 = section[2] * x - section[5] * y;
+            data[sample] = y;
+        }
+    }
+}
+
+
+int process_channels(double *data, long *data_lens, long data_stride, double *out, long *out_lens,
+                     long out_stride, long n_channels, double *sampling_rates, double samp_rate,
+                     double *sos, int n_sections, int num_threads){
+    /*
+    Resample, detrend and zero-phase filter each channel in one pass, as the
+    resample, detrend and filter steps of eqcorrscan.utils.pre_processing.process.
+
+    data:           Channels to process, one per row of data_stride samples
+    data_lens:      Number of samples in each data row
+    data_stride:    Samples per data row
+    out:            Output, one row of out_stride samples per channel
+    out_lens:       Number of samples to resample each channel to
+    out_stride:     Samples per output row
+    n_channels:     Number of channels
+    sampling_rates: Sampling rate of each channel in Hz
+    samp_rate:      Desired sampling rate in Hz, channels at this rate are not resampled
+    sos:            Second-order sections of the filter, n_sections rows of six
+    n_sections:     Number of filter sections, zero to not filter
+    num_threads:    Number of channels to process in parallel
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int c, ret = 0;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (c = 0; c < (int) n_channels; ++c){
+        double *channel = &data[(long) c * data_stride];
+        double *processed = &out[(long) c * out_stride];
+        int status = 0;
+
+        if (data_lens[c] == 0 || out_lens[c] == 0){
+            continue;
+        }
+        if (sampling_rates[c] != samp_rate){
+            status = resample_channel(channel, data_lens[c], sampling_rates[c], processed,
+                                      out_lens[c], samp_rate);
+        } else {
+            memcpy(processed, channel, sizeof(double) * out_lens[c]);
+        }
+        if (status != 0){
+            #pragma omp critical (process_memory)
+            ret = -1;
+            continue;
+        }
+        detrend_simple(processed, out_lens[c]);
+        if (n_sections > 0){
+            sos_filter(processed, out_lens[c], sos, n_sections, 0);
+            sos_filter(processed, out_lens[c], sos, n_sections, 1);
+        }
+    }
+    if (ret != 0){
+        printf("Error allocating memory for resampling\n");
+    }
+    return ret;
+}
@@ -0,0 +1,369 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stacking.c
+ *
+ *        Purpose:  Batched FFT alignment and phase-weighted stacking of traces
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <fftw3.h>
+
+// Prototypes
+int align_traces_fftw(double*, long, double*, long*, long, long, long, int, long*, double*, int);
+
+int phase_weighted_stack(double*, long, long, int, long, double*, double*, int);
+
+static void complex_sqrt(double, double, double*, double*);
+
+static double nan_to_num(double);
+
+// Define minimum variance to compute correlations, as in multi_corr.c
+#define ACCEPTED_DIFF 1e-10
+
+
+int align_traces_fftw(double *master, long master_len, double *templates, long *template_lens,
+                      long n_templates, long template_stride, long fft_len, int positive,
+                      long *shifts, double *ccs, int num_threads){
+    /*
+    Find the best alignment of many templates within a master trace, as the
+    normalised cross-correlation of eqcorrscan.core.match_filter.normxcorr2 in
+    eqcorrscan.utils.stacking.align_traces.
+
+    The master is transformed once, its windowed means and variances for any
+    template length come from running sums, and the templates are transformed
+    in parallel. Only the lags where the template lies within the master are
+    searched, so fft_len need only cover the master.
+
+    master:         Master trace
+    master_len:     Number of samples in the master
+    templates:      Templates, one per row of template_stride samples
+    template_lens:  Number of samples in each template, at most master_len
+    n_templates:    Number of templates
+    template_stride: Samples per template row
+    fft_len:        Transform length, at least master_len
+    positive:       Take the largest positive correlation rather than the largest
+                    absolute correlation
+    shifts:         Output, start of the best matching window in the master
+    ccs:            Output, correlation at the best matching window
+    num_threads:    Number of templates to correlate in parallel
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int tpl, ret = 0;
+    long k, n_complex = fft_len / 2 + 1;
+    double master_mean = 0.0;
+    double *sums = (double*) malloc((size_t) (master_len + 1) * sizeof(double));
+    double *squares = (double*) malloc((size_t) (master_len + 1) * sizeof(double));
+    double *real_buf = (double*) fftw_malloc((size_t) fft_len * sizeof(double));
+    fftw_complex *master_fd = (fftw_complex*) fftw_malloc(
+        (size_t) n_complex * sizeof(fftw_complex));
+    fftw_plan pa = NULL, pb = NULL;
+
+    if (sums == NULL || squares == NULL || real_buf == NULL || master_fd == NULL){
+        printf("Error allocating memory for alignment\n");
+        free(sums);
+        free(squares);
+        fftw_free(real_buf);
+        fftw_free(master_fd);
+        return -1;
+    }
+    // The planner is not thread-safe, share its lock with multi_corr.c
+    #pragma omp critical (fftw_planner)
+    {
+        pa = fftw_plan_dft_r2c_1d((int) fft_len, real_buf, master_fd, FFTW_ESTIMATE);
+        pb = fftw_plan_dft_c2r_1d((int) fft_len, master_fd, real_buf, FFTW_ESTIMATE);
+    }
+    // The templates are demeaned, so removing the mean of the master changes no
+    // correlation but keeps the running sums accurate
+    for (k = 0; k < master_len; ++k){
+        master_mean += master[k];
+    }
+    master_mean /= (master_len > 0) ? master_len : 1;
+    memset(real_buf, 0, (size_t) fft_len * sizeof(double));
+    sums[0] = 0.0;
+    squares[0] = 0.0;
+    for (k = 0; k < master_len; ++k){
+        real_buf[k] = master[k] - master_mean;
+        sums[k + 1] = sums[k] + real_buf[k];
+        squares[k + 1] = squares[k] + real_buf[k] * real_buf[k];
+    }
+    fftw_execute_dft_r2c(pa, real_buf, master_fd);
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        double *column = (double*) fftw_malloc((size_t) fft_len * sizeof(double));
+        fftw_complex *column_fd = (fftw_complex*) fftw_malloc(
+            (size_t) n_complex * sizeof(fftw_complex));
+
+        if (column == NULL || column_fd == NULL){
+            #pragma omp critical (stacking_memory)
+            ret = -1;
+        }
+        #pragma omp for schedule(dynamic)
+        for (tpl = 0; tpl < (int) n_templates; ++tpl){
+            double *tpl_data = &templates[(long) tpl * template_stride];
+            long len = template_lens[tpl], n_lags = master_len - len + 1, lag, f, i, best = 0;
+            double mean = 0.0, energy = 0.0, cc, window_mean, window_var, best_cc = 0.0;
+
+            shifts[tpl] = 0;
+            ccs[tpl] = 0.0;
+            if (column == NULL || column_fd == NULL || len < 1 || n_lags < 1){
+                continue;
+            }
+            for (i = 0; i < len; ++i){
+                mean += tpl_data[i];
+            }
+            mean /= len;
+            memset(column, 0, (size_t) fft_len * sizeof(double));
+            for (i = 0; i < len; ++i){
+                column[i] = tpl_data[i] - mean;
+                energy += column[i] * column[i];
+            }
+            if (energy / len >= ACCEPTED_DIFF){
+                fftw_execute_dft_r2c(pa, column, column_fd);
+                // Cross-spectrum, conj(template) * master, so that lag k is the
+                // template against the master from sample k
+                for (f = 0; f < n_complex; ++f){
+                    double re = column_fd[f][0] * master_fd[f][0] + column_fd[f][1] * master_fd[f][1];
+                    double im = column_fd[f][0] * master_fd[f][1] - column_fd[f][1] * master_fd[f][0];
+
+                    column_fd[f][0] = re;
+                    column_fd[f][1] = im;
+                }
+                fftw_execute_dft_c2r(pb, column_fd, column);
+            } else {
+                memset(column, 0, (size_t) n_lags * sizeof(double));
+            }
+            for (lag = 0; lag < n_lags; ++lag){
+                window_mean = (sums[lag + len] - sums[lag]) / len;
+                window_var = (squares[lag + len] - squares[lag]) / len - window_mean * window_mean;
+                cc = 0.0;
+                if (window_var >= ACCEPTED_DIFF && energy / len >= ACCEPTED_DIFF){
+                    cc = column[lag] / fft_len / sqrt(energy * window_var * len);
+                }
+                // Keep the first of equal peaks, as numpy's argmax
+                if ((positive && (lag == 0 || cc > best_cc)) ||
+                    (!positive && fabs(cc) > fabs(best_cc))){
+                    best_cc = cc;
+                    best = lag;
+                }
+            }
+            shifts[tpl] = best;
+            ccs[tpl] = best_cc;
+        }
+        fftw_free(column);
+        fftw_free(column_fd);
+    }
+    #pragma omp critical (fftw_planner)
+    {
+        fftw_destroy_plan(pa);
+        fftw_destroy_plan(pb);
+    }
+    free(sums);
+    free(squares);
+    fftw_free(real_buf);
+    fftw_free(master_fd);
+    if (ret != 0){
+        printf("Error allocating memory for alignment\n");
+    }
+    return ret;
+}
+
+
+static void complex_sqrt(double re, double im, double *out_re, double *out_im){
+    /* Principal square root, with the sign of a zero imaginary part, as numpy */
+    double modulus = hypot(re, im), t;
+
+    if (modulus == 0){
+        *out_re = 0.0;
+        *out_im = im;
+        return;
+    }
+    if (re >= 0){
+        t = sqrt((modulus + re) / 2);
+        *out_re = t;
+        *out_im = im / (2 * t);
+    } else {
+        t = sqrt((modulus - re) / 2);
+        *out_re = fabs(im) / (2 * t);
+        *out_im = copysign(t, im);
+    }
+}
+
+
+static double nan_to_num(double value){
+    /* Replace nan with zero and infinities with the largest finite value, as numpy */
+    if (value != value){
+        return 0.0;
+    }
+    if (value > DBL_MAX){
+        return DBL_MAX;
+    }
+    if (value < -DBL_MAX){
+        return -DBL_MAX;
+    }
+    return value;
+}
+
+
+int phase_weighted_stack(double *data, long npts, long n_traces, int normalize, long batch,
+                         double *lin_stack, double *phase_stack, int num_threads){
+    /*
+    Accumulate the linear stack and the instantaneous phase stack of traces of
+    one channel, as eqcorrscan.utils.stacking.PWS_stack, without keeping the
+    analytic signal of every trace.
+
+    Traces are taken batch at a time: the analytic signals of a batch are found
+    in parallel with one forward and one inverse transform per trace (zeroing the
+    negative frequencies, as scipy.signal.hilbert), then added to the stacks in
+    parallel over samples, so the sums are in the order of the traces whatever
+    the number of threads.
+
+    The linear stack is of traces normalised by their RMS amplitude. The phase of
+    each trace is its analytic signal a over sqrt(a * a + x * x) in complex
+    arithmetic, as PWS_stack, normalised by the square root of the mean of its
+    square if normalize is set, and the modulus of the phase stack is returned.
+
+    data:           Traces, one per row of npts samples
+    npts:           Number of samples in each trace
+    n_traces:       Number of traces
+    normalize:      Whether to normalise the phases before stacking
+    batch:          Number of traces to hold analytic signals for at once
+    lin_stack:      Output, linear stack of npts samples
+    phase_stack:    Output, modulus of the phase stack of npts samples
+    num_threads:    Number of threads to use
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int row, sample;
+    long first, t, n_complex = npts / 2 + 1;
+    double *real_buf = (double*) fftw_malloc((size_t) npts * sizeof(double));
+    double *phase_re = (double*) malloc((size_t) npts * sizeof(double));
+    double *phase_im = (double*) malloc((size_t) npts * sizeof(double));
+    double *scales = NULL;
+    fftw_complex *analytic = NULL;
+    fftw_plan pa = NULL, pb = NULL;
+
+    if (batch < 1){
+        batch = 1;
+    }
+    if (batch > n_traces){
+        batch = n_traces;
+    }
+    analytic = (fftw_complex*) fftw_malloc((size_t) batch * npts * sizeof(fftw_complex));
+    scales = (double*) malloc((size_t) batch * sizeof(double));
+    if (real_buf == NULL || phase_re == NULL || phase_im == NULL || analytic == NULL ||
+        scales == NULL){
+        printf("Error allocating memory for phase-weighted stack\n");
+        fftw_free(real_buf);
+        free(phase_re);
+        free(phase_im);
+        fftw_free(analytic);
+        free(scales);
+        return -1;
+    }
+    #pragma omp critical (fftw_planner)
+    {
+        // Each trace of the batch is transformed in place in its own row
+        pa = fftw_plan_dft_r2c_1d((int) npts, real_buf, analytic, FFTW_ESTIMATE | FFTW_UNALIGNED);
+        pb = fftw_plan_dft_1d((int) npts, analytic, analytic, FFTW_BACKWARD,
+                              FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    for (t = 0; t < npts; ++t){
+        lin_stack[t] = 0.0;
+        phase_re[t] = 0.0;
+        phase_im[t] = 0.0;
+    }
+
+    for (first = 0; first < n_traces; first += batch){
+        int n_batch = (int) ((first + batch <= n_traces) ? batch : n_traces - first);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+        for (row = 0; row < n_batch; ++row){
+            double *trace = &data[(first + row) * npts];
+            fftw_complex *signal = &analytic[(long) row * npts];
+            double energy = 0.0, square_re = 0.0, square_im = 0.0, re, im, env_re, env_im;
+            double norm_re, norm_im, denominator;
+            long i, k;
+
+            // Analytic signal: double the positive and zero the negative frequencies
+            fftw_execute_dft_r2c(pa, trace, signal);
+            for (k = 1; k < n_complex; ++k){
+                if (2 * k != npts){
+                    signal[k][0] *= 2;
+                    signal[k][1] *= 2;
+                }
+            }
+            for (k = n_complex; k < npts; ++k){
+                signal[k][0] = 0.0;
+                signal[k][1] = 0.0;
+            }
+            fftw_execute_dft(pb, signal, signal);
+            for (i = 0; i < npts; ++i){
+                re = signal[i][0] / npts;
+                im = signal[i][1] / npts;
+                // Phase as analytic / sqrt(analytic ** 2 + data ** 2)
+                complex_sqrt(re * re - im * im + trace[i] * trace[i], 2 * re * im,
+                             &env_re, &env_im);
+                denominator = env_re * env_re + env_im * env_im;
+                signal[i][0] = (re * env_re + im * env_im) / denominator;
+                signal[i][1] = (im * env_re - re * env_im) / denominator;
+                square_re += signal[i][0] * signal[i][0] - signal[i][1] * signal[i][1];
+                square_im += 2 * signal[i][0] * signal[i][1];
+                energy += trace[i] * trace[i];
+            }
+            scales[row] = sqrt(energy / npts);
+            if (normalize){
+                complex_sqrt(square_re / npts, square_im / npts, &norm_re, &norm_im);
+                denominator = norm_re * norm_re + norm_im * norm_im;
+                for (i = 0; i < npts; ++i){
+                    re = signal[i][0];
+                    im = signal[i][1];
+                    signal[i][0] = nan_to_num((re * norm_re + im * norm_im) / denominator);
+                    signal[i][1] = nan_to_num((im * norm_re - re * norm_im) / denominator);
+                }
+            }
+        }
+        #pragma omp parallel for num_threads(num_threads)
+        for (sample = 0; sample < (int) npts; ++sample){
+            long r;
+
+            for (r = 0; r < n_batch; ++r){
+                lin_stack[sample] += nan_to_num(data[(first + r) * npts + sample] / scales[r]);
+                phase_re[sample] += analytic[r * npts + sample][0];
+                phase_im[sample] += analytic[r * npts + sample][1];
+            }
+        }
+    }
+    for (t = 0; t < npts; ++t){
+        phase_stack[t] = hypot(phase_re[t], phase_im[t]);
+    }
+    #pragma omp critical (fftw_planner)
+    {
+        fftw_destroy_plan(pa);
+        fftw_destroy_plan(pb);
+    }
+    fftw_free(real_buf);
+    free(phase_re);
+    free(phase_im);
+    fftw_free(analytic);
+    free(scales);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  subspace.c
+ *
+ *        Purpose:  Batched subspace detection statistics using FFTW
+ *
+ *        Created:  17/10/26
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  EQcorrscan developers
+ *   Organization:  EQcorrscan
+ *      Copyright:  EQcorrscan developers.
+ *        License:  GNU Lesser General Public License, Version 3
+ *                  (https://www.gnu.org/copyleft/lesser.html)
+ *
+ * =====================================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fftw3.h>
+
+// Prototypes
+int subspace_statistic(double*, long, long, double*, long*, long*, long, long, long, long, long,
+                       double*, long, int);
+
+
+int subspace_statistic(double *data, long data_len, long n_chans, double *bases, long *basis_lens,
+                       long *dimensions, long n_detectors, long basis_stride, long max_dimension,
+                       long step, long fft_len, double *stats, long stats_stride, int num_threads){
+    /*
+    Compute the subspace detection statistic (the fraction of the energy in each
+    window of data captured by the detector's basis) for many detectors at once,
+    as eqcorrscan.core.subspace._det_stat_freq.
+
+    data:           Channels of data, one per row of data_len samples
+    data_len:       Number of samples in each channel
+    n_chans:        Number of channels
+    bases:          Basis vectors, column d of detector det for channel c is in row
+                    (det * n_chans + c) * max_dimension + d of basis_stride samples
+    basis_lens:     Number of samples in the basis vectors of each detector
+    dimensions:     Number of basis vectors for each (detector, channel), zero if the
+                    detector has no data for the channel
+    n_detectors:    Number of detectors
+    basis_stride:   Samples per basis row
+    max_dimension:  Basis rows per (detector, channel)
+    step:           Samples between statistics, the number of multiplexed channels
+    fft_len:        Length of transforms, at least data_len + max(basis_lens) - step
+    stats:          Output, row (det * n_chans + c) of stats_stride samples
+    stats_stride:   Samples per stats row
+    num_threads:    Number of threads to use
+
+    Returns 0 on success, -1 if memory could not be allocated.
+    */
+    int pair, n_pairs = (int) (n_detectors * n_chans), ret = 0;
+    long c, t, n_complex = fft_len / 2 + 1;
+    double *energy = (double*) malloc((size_t) n_chans * (data_len + 1) * sizeof(double));
+    double *real_buf = (double*) fftw_malloc((size_t) fft_len * sizeof(double));
+    fftw_complex *data_fd = (fftw_complex*) fftw_malloc(
+        (size_t) n_chans * n_complex * sizeof(fftw_complex));
+    fftw_complex *complex_buf = (fftw_complex*) fftw_malloc(
+        (size_t) n_complex * sizeof(fftw_complex));
+    fftw_plan pa = NULL, pb = NULL;
+
+    if (energy == NULL || real_buf == NULL || data_fd == NULL || complex_buf == NULL){
+        printf("Error allocating memory for subspace statistics\n");
+        free(energy);
+        fftw_free(real_buf);
+        fftw_free(data_fd);
+        fftw_free(complex_buf);
+        return -1;
+    }
+    // The planner is not thread-safe, share its lock with multi_corr.c
+    #pragma omp critical (fftw_planner)
+    {
+        pa = fftw_plan_dft_r2c_1d((int) fft_len, real_buf, complex_buf, FFTW_ESTIMATE);
+        pb = fftw_plan_dft_c2r_1d((int) fft_len, complex_buf, real_buf, FFTW_ESTIMATE);
+    }
+    // Transform the data once, and keep the running energy of each channel, which
+    // gives the boxcar denominator of every detector, whatever its length
+    for (c = 0; c < n_chans; ++c){
+        double *channel = &data[c * data_len], *channel_energy = &energy[c * (data_len + 1)];
+
+        memset(real_buf, 0, (size_t) fft_len * sizeof(double));
+        memcpy(real_buf, channel, (size_t) data_len * sizeof(double));
+        fftw_execute_dft_r2c(pa, real_buf, &data_fd[c * n_complex]);
+        channel_energy[0] = 0.0;
+        for (t = 0; t < data_len; ++t){
+            channel_energy[t + 1] = channel_energy[t] + channel[t] * channel[t];
+        }
+    }
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        double *column = (double*) fftw_malloc((size_t) fft_len * sizeof(double));
+        fftw_complex *column_fd = (fftw_complex*) fftw_malloc(
+            (size_t) n_complex * sizeof(fftw_complex));
+
+        if (column == NULL || column_fd == NULL){
+            #pragma omp critical (subspace_memory)
+            ret = -1;
+        }
+        #pragma omp for schedule(dynamic)
+        for (pair = 0; pair < n_pairs; ++pair){
+            long det = pair / n_chans, chan = pair % n_chans, ulen = basis_lens[det];
+            long n_out = (data_len - ulen) / step + 1, d, k, f, i;
+            double *stat = &stats[(long) pair * stats_stride];
+            double *channel_energy = &energy[chan * (data_len + 1)], denominator, value;
+            fftw_complex *spectrum = &data_fd[chan * n_complex];
+
+            if (column == NULL || column_fd == NULL || ulen > data_len){
+                continue;
+            }
+            for (k = 0; k < n_out; ++k){
+                stat[k] = 0.0;
+            }
+            for (d = 0; d < dimensions[pair]; ++d){
+                double *basis = &bases[((long) pair * max_dimension + d) * basis_stride];
+
+                // Time-reverse the basis vector to correlate by convolution
+                memset(column, 0, (size_t) fft_len * sizeof(double));
+                for (i = 0; i < ulen; ++i){
+                    column[i] = basis[ulen - 1 - i];
+                }
+                fftw_execute_dft_r2c(pa, column, column_fd);
+                for (f = 0; f < n_complex; ++f){
+                    double re = column_fd[f][0] * spectrum[f][0] - column_fd[f][1] * spectrum[f][1];
+                    double im = column_fd[f][0] * spectrum[f][1] + column_fd[f][1] * spectrum[f][0];
+
+                    column_fd[f][0] = re;
+                    column_fd[f][1] = im;
+                }
+                fftw_execute_dft_c2r(pb, column_fd, column);
+                // Projected energy, the first ulen - 1 samples are invalid
+                for (k = 0; k < n_out; ++k){
+                    value = column[ulen - 1 + k * step] / fft_len;
+                    stat[k] += value * value;
+                }
+            }
+            for (k = 0; k < n_out; ++k){
+                denominator = channel_energy[k * step + ulen] - channel_energy[k * step];
+                stat[k] = (denominator > 0) ? stat[k] / denominator : 0.0;
+            }
+        }
+        fftw_free(column);
+        fftw_free(column_fd);
+    }
+    #pragma omp critical (fftw_planner)
+    {
+        fftw_destroy_plan(pa);
+        fftw_destroy_plan(pb);
+    }
+    free(energy);
+    fftw_free(real_buf);
+    fftw_free(data_fd);
+    fftw_free(complex_buf);
+    if (ret != 0){
+        printf("Error allocating memory for subspace statistics\n");
+    }
+    return ret;
+}
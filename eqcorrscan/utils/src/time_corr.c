@@ -20,7 +20,30 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#if (defined(_MSC_VER))
+    #include <float.h>
+    #define isnanf(x) _isnan(x)
+    #define inline __inline
+#endif
+#if (defined(__APPLE__) && !isnanf)
+    #define isnanf isnan
+#endif
+// Vector kernels, selected at run-time as for the fftw routines
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+    #include <immintrin.h>
+    #define SIMD_DISPATCH 1
+    #define SIMD_SSE2_AVAILABLE 1
+    #if defined(__clang__)
+        #define SIMD_TARGET(isa) __attribute__((target(isa)))
+    #else
+        #define SIMD_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+    #endif
+#elif (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64)))
+    #include <emmintrin.h>
+    #define SIMD_SSE2_AVAILABLE 1
+#endif
 #if defined(__linux__) || defined(__linux) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
     #include <omp.h>
     #ifndef N_THREADS
@@ -36,6 +59,27 @@ int multi_normxcorr_time(float*, int, int, float*, int, float*);
 
 int multi_normxcorr_time_threaded(float*, int, int, float*, int, float*, int);
 
+int multi_normxcorr_time_tiled(float*, long, long, long, float*, long, long long*, float*, int*, int*, int, int*);
+
+// Defined in multi_corr.c
+int get_simd_level(void);
+
+// Same normalisation thresholds as the fftw routines
+#define ACCEPTED_DIFF 1e-10
+#define WARN_DIFF 1e-8
+
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+
+// Templates correlated per pass through the data
+#define TIME_TILE 4
+// Correlations per block of work
+#define TIME_BLOCK_LEN 4096
+
+typedef void (*tile_dots_func)(float*, long, float*, long, double*, long);
+
 int normxcorr_time_threaded(float *template, int template_len, float *image, int image_len, float *ccc, int num_threads){
     // Time domain cross-correlation - requires zero-mean template
 	int p, k;
@@ -120,3 +164,457 @@ int multi_normxcorr_time_threaded(float *templates, int template_len, int n_temp
 	}
 	return 0;
 }
+
+
+static void tile_dots_scalar(float *rows, long template_len, float *image, long n,
+                             double *dots, long stride) {
+    /* Dot products of TIME_TILE consecutive template rows with the n windows
+     * of image starting at image[0] to image[n - 1], accumulated in double as
+     * normxcorr_time. Every image sample is loaded once for all the templates
+     * of the tile. */
+    long i, p;
+
+    for (i = 0; i < n; ++i) {
+        double a0 = 0.0, a1 = 0.0, a2 = 0.0, a3 = 0.0;
+
+        for (p = 0; p < template_len; ++p) {
+            double x = (double) image[i + p];
+            a0 += (double) rows[p] * x;
+            a1 += (double) rows[template_len + p] * x;
+            a2 += (double) rows[2 * template_len + p] * x;
+            a3 += (double) rows[3 * template_len + p] * x;
+        }
+        dots[i] = a0;
+        dots[stride + i] = a1;
+        dots[2 * stride + i] = a2;
+        dots[3 * stride + i] = a3;
+    }
+}
+
+
+#ifdef SIMD_SSE2_AVAILABLE
+static void tile_dots_sse2(float *rows, long template_len, float *image, long n,
+                           double *dots, long stride) {
+    /* As tile_dots_scalar, for four windows at a time: the accumulators for
+     * the whole tile stay in registers. */
+    long i, p;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128d a00 = _mm_setzero_pd(), a01 = _mm_setzero_pd();
+        __m128d a10 = _mm_setzero_pd(), a11 = _mm_setzero_pd();
+        __m128d a20 = _mm_setzero_pd(), a21 = _mm_setzero_pd();
+        __m128d a30 = _mm_setzero_pd(), a31 = _mm_setzero_pd();
+
+        for (p = 0; p < template_len; ++p) {
+            __m128 x = _mm_loadu_ps(&image[i + p]);
+            __m128d x0 = _mm_cvtps_pd(x);
+            __m128d x1 = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+            __m128d w = _mm_set1_pd((double) rows[p]);
+            a00 = _mm_add_pd(a00, _mm_mul_pd(w, x0));
+            a01 = _mm_add_pd(a01, _mm_mul_pd(w, x1));
+            w = _mm_set1_pd((double) rows[template_len + p]);
+            a10 = _mm_add_pd(a10, _mm_mul_pd(w, x0));
+            a11 = _mm_add_pd(a11, _mm_mul_pd(w, x1));
+            w = _mm_set1_pd((double) rows[2 * template_len + p]);
+            a20 = _mm_add_pd(a20, _mm_mul_pd(w, x0));
+            a21 = _mm_add_pd(a21, _mm_mul_pd(w, x1));
+            w = _mm_set1_pd((double) rows[3 * template_len + p]);
+            a30 = _mm_add_pd(a30, _mm_mul_pd(w, x0));
+            a31 = _mm_add_pd(a31, _mm_mul_pd(w, x1));
+        }
+        _mm_storeu_pd(&dots[i], a00);
+        _mm_storeu_pd(&dots[i + 2], a01);
+        _mm_storeu_pd(&dots[stride + i], a10);
+        _mm_storeu_pd(&dots[stride + i + 2], a11);
+        _mm_storeu_pd(&dots[2 * stride + i], a20);
+        _mm_storeu_pd(&dots[2 * stride + i + 2], a21);
+        _mm_storeu_pd(&dots[3 * stride + i], a30);
+        _mm_storeu_pd(&dots[3 * stride + i + 2], a31);
+    }
+    tile_dots_scalar(rows, template_len, &image[i], n - i, &dots[i], stride);
+}
+#endif
+
+
+#ifdef SIMD_DISPATCH
+SIMD_TARGET("avx2")
+static void tile_dots_avx2(float *rows, long template_len, float *image, long n,
+                           double *dots, long stride) {
+    long i, p;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256d a00 = _mm256_setzero_pd(), a01 = _mm256_setzero_pd();
+        __m256d a10 = _mm256_setzero_pd(), a11 = _mm256_setzero_pd();
+        __m256d a20 = _mm256_setzero_pd(), a21 = _mm256_setzero_pd();
+        __m256d a30 = _mm256_setzero_pd(), a31 = _mm256_setzero_pd();
+
+        for (p = 0; p < template_len; ++p) {
+            __m256d x0 = _mm256_cvtps_pd(_mm_loadu_ps(&image[i + p]));
+            __m256d x1 = _mm256_cvtps_pd(_mm_loadu_ps(&image[i + p + 4]));
+            __m256d w = _mm256_set1_pd((double) rows[p]);
+            a00 = _mm256_add_pd(a00, _mm256_mul_pd(w, x0));
+            a01 = _mm256_add_pd(a01, _mm256_mul_pd(w, x1));
+            w = _mm256_set1_pd((double) rows[template_len + p]);
+            a10 = _mm256_add_pd(a10, _mm256_mul_pd(w, x0));
+            a11 = _mm256_add_pd(a11, _mm256_mul_pd(w, x1));
+            w = _mm256_set1_pd((double) rows[2 * template_len + p]);
+            a20 = _mm256_add_pd(a20, _mm256_mul_pd(w, x0));
+            a21 = _mm256_add_pd(a21, _mm256_mul_pd(w, x1));
+            w = _mm256_set1_pd((double) rows[3 * template_len + p]);
+            a30 = _mm256_add_pd(a30, _mm256_mul_pd(w, x0));
+            a31 = _mm256_add_pd(a31, _mm256_mul_pd(w, x1));
+        }
+        _mm256_storeu_pd(&dots[i], a00);
+        _mm256_storeu_pd(&dots[i + 4], a01);
+        _mm256_storeu_pd(&dots[stride + i], a10);
+        _mm256_storeu_pd(&dots[stride + i + 4], a11);
+        _mm256_storeu_pd(&dots[2 * stride + i], a20);
+        _mm256_storeu_pd(&dots[2 * stride + i + 4], a21);
+        _mm256_storeu_pd(&dots[3 * stride + i], a30);
+        _mm256_storeu_pd(&dots[3 * stride + i + 4], a31);
+    }
+    tile_dots_sse2(rows, template_len, &image[i], n - i, &dots[i], stride);
+}
+
+
+SIMD_TARGET("avx512f")
+static void tile_dots_avx512(float *rows, long template_len, float *image, long n,
+                             double *dots, long stride) {
+    long i, p;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m512d a00 = _mm512_setzero_pd(), a01 = _mm512_setzero_pd();
+        __m512d a10 = _mm512_setzero_pd(), a11 = _mm512_setzero_pd();
+        __m512d a20 = _mm512_setzero_pd(), a21 = _mm512_setzero_pd();
+        __m512d a30 = _mm512_setzero_pd(), a31 = _mm512_setzero_pd();
+
+        for (p = 0; p < template_len; ++p) {
+            __m512d x0 = _mm512_cvtps_pd(_mm256_loadu_ps(&image[i + p]));
+            __m512d x1 = _mm512_cvtps_pd(_mm256_loadu_ps(&image[i + p + 8]));
+            __m512d w = _mm512_set1_pd((double) rows[p]);
+            a00 = _mm512_add_pd(a00, _mm512_mul_pd(w, x0));
+            a01 = _mm512_add_pd(a01, _mm512_mul_pd(w, x1));
+            w = _mm512_set1_pd((double) rows[template_len + p]);
+            a10 = _mm512_add_pd(a10, _mm512_mul_pd(w, x0));
+            a11 = _mm512_add_pd(a11, _mm512_mul_pd(w, x1));
+            w = _mm512_set1_pd((double) rows[2 * template_len + p]);
+            a20 = _mm512_add_pd(a20, _mm512_mul_pd(w, x0));
+            a21 = _mm512_add_pd(a21, _mm512_mul_pd(w, x1));
+            w = _mm512_set1_pd((double) rows[3 * template_len + p]);
+            a30 = _mm512_add_pd(a30, _mm512_mul_pd(w, x0));
+            a31 = _mm512_add_pd(a31, _mm512_mul_pd(w, x1));
+        }
+        _mm512_storeu_pd(&dots[i], a00);
+        _mm512_storeu_pd(&dots[i + 8], a01);
+        _mm512_storeu_pd(&dots[stride + i], a10);
+        _mm512_storeu_pd(&dots[stride + i + 8], a11);
+        _mm512_storeu_pd(&dots[2 * stride + i], a20);
+        _mm512_storeu_pd(&dots[2 * stride + i + 8], a21);
+        _mm512_storeu_pd(&dots[3 * stride + i], a30);
+        _mm512_storeu_pd(&dots[3 * stride + i + 8], a31);
+    }
+    tile_dots_avx2(rows, template_len, &image[i], n - i, &dots[i], stride);
+}
+#endif
+
+
+static tile_dots_func select_tile_dots(int level) {
+    #ifdef SIMD_DISPATCH
+    if (level >= SIMD_AVX512) {
+        return tile_dots_avx512;
+    }
+    if (level >= SIMD_AVX2) {
+        return tile_dots_avx2;
+    }
+    #endif
+    #ifdef SIMD_SSE2_AVAILABLE
+    if (level >= SIMD_SSE2) {
+        return tile_dots_sse2;
+    }
+    #endif
+    return tile_dots_scalar;
+}
+
+
+static int time_block_stats(float *image, long block_start, long n, long template_len,
+                            double *mean, double *stdev, double *weight, int *variance_warning) {
+  /*
+  Purpose: normalisation for correlations block_start to block_start + n - 1
+           of image, with the same rules as the fftw routines.
+  Notes:
+    The statistics of the first window of the block are computed directly,
+    those of the rest from running sums, so blocks are independent of one
+    another.
+  Returns:
+    1 if any correlations cannot be normalised, 0 otherwise
+  */
+    long i, k;
+    int flatline_count = 0, unused_corr = 0;
+    double sum = 0.0, var, old_mean, new_samp, old_samp;
+
+    for (i = 0; i < template_len; ++i){
+        sum += (double) image[block_start + i];
+    }
+    mean[0] = sum / template_len;
+    var = 0.0;
+    for (i = 0; i < template_len; ++i){
+        var += pow((double) image[block_start + i] - mean[0], 2) / (template_len);
+    }
+    for (k = block_start; k >= 1; --k) {
+        if (image[k + template_len - 1] != image[k + template_len - 2]) {
+            break;
+        }
+        if (++flatline_count >= template_len) {
+            break;
+        }
+    }
+    for (i = 0; i < n; ++i){
+        if (i > 0) {
+            new_samp = (double) image[block_start + i + template_len - 1];
+            old_samp = (double) image[block_start + i - 1];
+            old_mean = mean[i - 1];
+            mean[i] = old_mean + (new_samp - old_samp) / template_len;
+            var += (new_samp - old_samp) * (new_samp - mean[i] + old_samp - old_mean) / (template_len);
+            if (new_samp == (double) image[block_start + i + template_len - 2]) {
+                flatline_count++;
+            }
+            else {
+                flatline_count = 0;
+            }
+        }
+        stdev[i] = 1.0;
+        weight[i] = 0.0;
+        if (block_start + i == 0) {
+            // The first window is only checked for variance
+            if (var >= ACCEPTED_DIFF) {
+                stdev[i] = sqrt(var);
+                weight[i] = 1.0;
+                if (var <= WARN_DIFF){
+                    variance_warning[0] = 1;
+                }
+            } else {
+                unused_corr = 1;
+            }
+        } else if (var >= ACCEPTED_DIFF && flatline_count < template_len - 1) {
+            double std = sqrt(var);
+            if (fabs(mean[i] * std) >= ACCEPTED_DIFF){
+                stdev[i] = std;
+                weight[i] = 1.0;
+            }
+            else {
+                unused_corr = 1;
+            }
+            if (var <= WARN_DIFF){
+                variance_warning[0] += 1;
+            }
+        } else {
+            unused_corr = 1;
+        }
+    }
+    return unused_corr;
+}
+
+
+static int stack_time_row(double *dots, double norm_sum, double *mean, double *stdev,
+                          double *weight, float *ncc, long n) {
+    /* Normalise one template's correlations and stack them into ncc: NaNs
+     * are set to zero, values beyond 1.01 flagged and the rest clipped. */
+    long i;
+    int status = 0;
+
+    for (i = 0; i < n; ++i) {
+        double c = (dots[i] - norm_sum * mean[i]) * weight[i];
+        float value = (float) (c / stdev[i]);
+
+        if (isnanf(value)) {
+            value = 0.0;
+        }
+        else if (fabsf(value) > 1.01) {
+            status = 1;
+        }
+        else if (value > 1.0) {
+            value = 1.0;
+        }
+        else if (value < -1.0) {
+            value = -1.0;
+        }
+        ncc[i] += value;
+    }
+    return status;
+}
+
+
+int multi_normxcorr_time_tiled(float *templates, long n_templates, long template_len,
+        long n_channels, float *image, long image_len, long long *image_offsets, float *ncc,
+        int *used_chans, int *pad_array, int num_threads, int *variance_warning) {
+  /*
+  Purpose: multi-channel time domain normalised cross-correlation, stacked
+           into ncc.
+  Args:
+    templates:      Normalised templates, stacked
+                    [ch_1-t_1, ch_1-t_2, ..., ch_2-t_1, ch_2-t_2, ...], as
+                    for multi_normxcorr_fftw
+    n_templates:    Number of templates
+    template_len:   Length of templates
+    n_channels:     Number of channels
+    image:          Continuous data, stacked [ch_1, ch_2, ...]
+    image_len:      Length of image for each channel
+    image_offsets:  NULL, or the index in image of the start of each channel
+    ncc:            Output for summed correlations (n_templates x
+                    (image_len - template_len + 1)), must be zeroed
+    used_chans:     Whether each template-channel is used (as templates)
+    pad_array:      Pad for each template-channel (as templates)
+    num_threads:    Number of threads to use
+    variance_warning:
+                    Output low variance counts, one per channel
+  Notes:
+    The correlations are computed in blocks of lags, with TIME_TILE templates
+    correlated on each pass through a block of data. Blocks are at least as
+    long as the largest pad, so even blocks never stack into the same part
+    of ncc as each other and nor do odd blocks: even blocks are run in
+    parallel, then odd blocks, without atomic adds.
+  Returns:
+    0 on success, 999 if some correlations could not be normalised, -1 if
+    memory could not be allocated, otherwise the number of blocks with
+    correlations out of range.
+  */
+    long n_corr = image_len - template_len + 1;
+    long n_tiles = (n_templates + TIME_TILE - 1) / TIME_TILE;
+    long block_len = TIME_BLOCK_LEN, i, c, t;
+    int n_blocks, phase, status = 0, unused_corr = 0, alloc_failed = 0;
+    float *rows;
+    double *norm_sums;
+    tile_dots_func tile_dots = select_tile_dots(get_simd_level());
+
+    if (n_corr < 1 || n_templates < 1) {
+        return 0;
+    }
+    #ifndef N_THREADS
+    num_threads = 1;
+    #endif
+    for (i = 0; i < n_templates * n_channels; ++i){
+        if (pad_array[i] > block_len) {
+            block_len = pad_array[i];
+        }
+    }
+    n_blocks = (int) ((n_corr + block_len - 1) / block_len);
+
+    // Copy the templates into whole tiles, padded with zero templates
+    rows = (float*) calloc((size_t) n_channels * n_tiles * TIME_TILE * template_len, sizeof(float));
+    norm_sums = (double*) calloc((size_t) n_channels * n_templates, sizeof(double));
+    if (rows == NULL || norm_sums == NULL) {
+        printf("Error allocating memory in multi_normxcorr_time_tiled\n");
+        free(rows);
+        free(norm_sums);
+        return -1;
+    }
+    for (c = 0; c < n_channels; ++c){
+        for (t = 0; t < n_templates; ++t){
+            float *template_row = &templates[((size_t) c * n_templates + t) * template_len];
+            double norm_sum = 0.0;
+
+            memcpy(&rows[((size_t) c * n_tiles * TIME_TILE + t) * template_len], template_row,
+                   template_len * sizeof(float));
+            for (i = 0; i < template_len; ++i){
+                norm_sum += (double) template_row[i];
+            }
+            norm_sums[c * n_templates + t] = norm_sum;
+        }
+    }
+
+    #pragma omp parallel num_threads(num_threads) private(phase)
+    {
+        double *dots = (double*) malloc((size_t) TIME_TILE * block_len * sizeof(double));
+        double *mean = (double*) malloc((size_t) block_len * sizeof(double));
+        double *stdev = (double*) malloc((size_t) block_len * sizeof(double));
+        double *weight = (double*) malloc((size_t) block_len * sizeof(double));
+        int b, have_memory = (dots != NULL && mean != NULL && stdev != NULL && weight != NULL);
+
+        if (!have_memory) {
+            #pragma omp critical (time_tiled_memory)
+            alloc_failed = 1;
+        }
+        for (phase = 0; phase < 2; ++phase){
+            #pragma omp for schedule(dynamic) reduction(+:status, unused_corr)
+            for (b = phase; b < n_blocks; b += 2){
+                long block_start = (long) b * block_len;
+                long block_corr = n_corr - block_start;
+                long ch, tile, j;
+
+                if (!have_memory) {
+                    continue;
+                }
+                if (block_corr > block_len) {
+                    block_corr = block_len;
+                }
+                for (ch = 0; ch < n_channels; ++ch){
+                    float *chan_image = (image_offsets != NULL) ?
+                        &image[image_offsets[ch]] : &image[(size_t) ch * image_len];
+                    int warnings = 0, chan_used = 0;
+
+                    for (j = 0; j < n_templates; ++j){
+                        chan_used |= used_chans[ch * n_templates + j];
+                    }
+                    if (!chan_used) {
+                        continue;
+                    }
+                    if (time_block_stats(chan_image, block_start, block_corr, template_len,
+                                         mean, stdev, weight, &warnings)) {
+                        unused_corr = 1;
+                    }
+                    if (warnings) {
+                        #pragma omp atomic
+                        variance_warning[ch] += warnings;
+                    }
+                    for (tile = 0; tile < n_tiles; ++tile){
+                        int tile_used = 0;
+
+                        for (j = tile * TIME_TILE; j < n_templates && j < (tile + 1) * TIME_TILE; ++j){
+                            tile_used |= used_chans[ch * n_templates + j];
+                        }
+                        if (!tile_used) {
+                            continue;
+                        }
+                        tile_dots(&rows[((size_t) ch * n_tiles + tile) * TIME_TILE * template_len],
+                                  template_len, &chan_image[block_start], block_corr, dots,
+                                  block_len);
+                        for (j = 0; j < TIME_TILE && tile * TIME_TILE + j < n_templates; ++j){
+                            long tmpl = tile * TIME_TILE + j;
+                            long in_index = ch * n_templates + tmpl;
+                            long first = pad_array[in_index] - block_start;
+
+                            if (!used_chans[in_index]) {
+                                continue;
+                            }
+                            if (first < 0) {
+                                first = 0;
+                            }
+                            if (first >= block_corr) {
+                                continue;
+                            }
+                            status += stack_time_row(
+                                &dots[j * block_len + first], norm_sums[in_index], &mean[first],
+                                &stdev[first], &weight[first],
+                                &ncc[(size_t) tmpl * n_corr + block_start + first - pad_array[in_index]],
+                                block_corr - first);
+                        }
+                    }
+                }
+            }
+        }
+        free(dots);
+        free(mean);
+        free(stdev);
+        free(weight);
+    }
+    free(rows);
+    free(norm_sums);
+    if (alloc_failed) {
+        printf("Error allocating memory in multi_normxcorr_time_tiled\n");
+        return -1;
+    }
+    if (status == 0 && unused_corr) {
+        status = 999;
+    }
+    return status;
+}
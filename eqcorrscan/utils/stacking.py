@@ -14,10 +14,13 @@ from __future__ import division
 from __future__ import print_function
 from __future__ import unicode_literals
 
+import ctypes
 import numpy as np
 
-from scipy.signal import hilbert
-from copy import deepcopy
+from future.utils import native_str
+from scipy.fftpack import next_fast_len
+
+from eqcorrscan.utils.libnames import _load_cdll
 
 
 def linstack(streams, normalize=True):
@@ -55,10 +58,54 @@ def linstack(streams, normalize=True):
     return stack
 
 
-def PWS_stack(streams, weight=2, normalize=True):
+def _phase_weighted_stack(data, normalize=True, cores=1):
+    """
+    Compute the linear and phase stacks of traces of one channel.
+
+    :type data: numpy.ndarray
+    :param data: Traces to stack, one per row.
+    :type normalize: bool
+    :param normalize: Normalize the instantaneous phases before stacking.
+    :type cores: int
+    :param cores: Number of threads to use.
+
+    :returns:
+        Linear stack of the traces normalised by their RMS amplitude, and
+        the modulus of the stack of their instantaneous phases.
+    :rtype: tuple
+    """
+    data = np.ascontiguousarray(data, dtype=np.float64)
+    n_traces, npts = data.shape
+    lin_stack = np.empty(npts)
+    phase_stack = np.empty(npts)
+
+    utilslib = _load_cdll('libutils')
+    utilslib.phase_weighted_stack.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long, ctypes.c_long, ctypes.c_int, ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int]
+    utilslib.phase_weighted_stack.restype = ctypes.c_int
+    ret = utilslib.phase_weighted_stack(
+        data, npts, n_traces, int(normalize), cores, lin_stack, phase_stack,
+        cores)
+    if ret != 0:
+        raise MemoryError('Could not allocate memory for phase stack')
+    return lin_stack, phase_stack
+
+
+def PWS_stack(streams, weight=2, normalize=True, cores=1):
     """
     Compute the phase weighted stack of a series of streams.
 
+    The analytic signals are computed by FFT and the linear and phase stacks
+    of each channel accumulated in one compiled call, taking `cores` traces
+    at a time, without keeping the instantaneous phase of every trace.
+
     .. note:: It is recommended to align the traces before stacking.
 
     :type streams: list
@@ -67,42 +114,105 @@ def PWS_stack(streams, weight=2, normalize=True):
     :param weight: Exponent to the phase stack used for weighting.
     :type normalize: bool
     :param normalize: Normalize traces before stacking.
+    :type cores: int
+    :param cores: Number of threads to use.
 
     :return: Stacked stream.
     :rtype: :class:`obspy.core.stream.Stream`
     """
-    # First get the linear stack which we will weight by the phase stack
-    Linstack = linstack(streams)
-    # Compute the instantaneous phase
-    instaphases = []
-    print("Computing instantaneous phase")
-    for stream in streams:
-        instaphase = stream.copy()
-        for tr in instaphase:
-            analytic = hilbert(tr.data)
-            envelope = np.sqrt(np.sum((np.square(analytic),
-                                       np.square(tr.data)), axis=0))
-            tr.data = analytic / envelope
-        instaphases.append(instaphase)
-    # Compute the phase stack
+    # Stack channels as linstack, against the stream with the most traces
+    stack = streams[np.argmax([len(stream) for stream in streams])].copy()
     print("Computing the phase stack")
-    Phasestack = linstack(instaphases, normalize=normalize)
-    # Compute the phase-weighted stack
-    for tr in Phasestack:
-        tr.data = Linstack.select(station=tr.stats.station)[0].data *\
-            np.abs(tr.data ** weight)
-    return Phasestack
+    lin_stacks = []
+    phase_stacks = []
+    for tr in stack:
+        rows = [tr.data]
+        for i in range(1, len(streams)):
+            matchtr = streams[i].select(station=tr.stats.station,
+                                        channel=tr.stats.channel)
+            if matchtr:
+                rows.append(matchtr[0].data)
+        if any(len(row) != len(tr.data) for row in rows):
+            raise ValueError('Traces for %s.%s are not the same length' %
+                             (tr.stats.station, tr.stats.channel))
+        lin_stack, phase_stack = _phase_weighted_stack(
+            np.array(rows, dtype=np.float64), normalize=normalize,
+            cores=cores)
+        lin_stacks.append(lin_stack)
+        phase_stacks.append(phase_stack)
+    # Weight by the linear stack of the first channel of the station
+    stations = [tr.stats.station for tr in stack]
+    for tr, phase_stack in zip(stack, phase_stacks):
+        tr.data = lin_stacks[stations.index(tr.stats.station)] *\
+            phase_stack ** weight
+    return stack
+
+
+def _align_templates(templates, image, positive=False, cores=1):
+    """
+    Find the best alignment of templates within an image.
+
+    :type templates: list
+    :param templates:
+        List of numpy.ndarray templates, each no longer than the image.
+    :type image: numpy.ndarray
+    :param image: Image to scan the templates through.
+    :type positive: bool
+    :param positive: Return the maximum positive cross-correlation, or the \
+        absolute maximum.
+    :type cores: int
+    :param cores: Number of threads to use.
+
+    :returns:
+        Index of the start of the best matching window of the image and the
+        normalised cross-correlation there, for each template.
+    :rtype: tuple
+    """
+    c_long = np.dtype(ctypes.c_long)
+    image = np.ascontiguousarray(image, dtype=np.float64)
+    template_lens = np.array([len(tpl) for tpl in templates], dtype=c_long)
+    template_array = np.zeros((len(templates), max(template_lens.max(), 1)))
+    for i, tpl in enumerate(templates):
+        template_array[i, 0:len(tpl)] = tpl
+    shifts = np.empty(len(templates), dtype=c_long)
+    ccs = np.empty(len(templates))
+
+    utilslib = _load_cdll('libutils')
+    utilslib.align_traces_fftw.argtypes = [
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long,
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=c_long,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_long, ctypes.c_long, ctypes.c_long, ctypes.c_int,
+        np.ctypeslib.ndpointer(dtype=c_long,
+                               flags=native_str('C_CONTIGUOUS')),
+        np.ctypeslib.ndpointer(dtype=np.float64,
+                               flags=native_str('C_CONTIGUOUS')),
+        ctypes.c_int]
+    utilslib.align_traces_fftw.restype = ctypes.c_int
+    ret = utilslib.align_traces_fftw(
+        image, len(image), template_array, template_lens, len(templates),
+        template_array.shape[1], next_fast_len(len(image)), int(positive),
+        shifts, ccs, cores)
+    if ret != 0:
+        raise MemoryError('Could not allocate memory for alignment')
+    return shifts, ccs
 
 
 def align_traces(trace_list, shift_len, master=False, positive=False,
-                 plot=False):
+                 plot=False, cores=1):
     """
     Align traces relative to each other based on their cross-correlation value.
 
-    Uses the :func:`eqcorrscan.core.match_filter.normxcorr2` function to find
-    the optimum shift to align traces relative to a master event.  Either uses
-    a given master to align traces, or uses the trace with the highest MAD
-    amplitude.
+    Finds the optimum shift to align traces relative to a master event from
+    the normalised cross-correlation of
+    :func:`eqcorrscan.core.match_filter.normxcorr2`. The master is
+    transformed once and all traces correlated against it in one compiled
+    call. Either uses a given master to align traces, or uses the trace with
+    the highest MAD amplitude.
 
     :type trace_list: list
     :param trace_list: List of traces to align
@@ -116,46 +226,52 @@ def align_traces(trace_list, shift_len, master=False, positive=False,
         absolute maximum, defaults to False (absolute maximum).
     :type plot: bool
     :param plot: If true, will plot each trace aligned with the master.
+    :type cores: int
+    :param cores: Number of threads to use.
 
     :returns: list of shifts and correlations for best alignment in seconds.
     :rtype: list
     """
     from eqcorrscan.core.match_filter import normxcorr2
     from eqcorrscan.utils.plotting import xcorr_plot
-    traces = deepcopy(trace_list)
     if not master:
         # Use trace with largest MAD amplitude as master
-        master = traces[0]
+        master = trace_list[0]
         MAD_master = np.median(np.abs(master.data))
-        for i in range(1, len(traces)):
-            if np.median(np.abs(traces[i].data)) > MAD_master:
-                master = traces[i]
+        for i in range(1, len(trace_list)):
+            if np.median(np.abs(trace_list[i].data)) > MAD_master:
+                master = trace_list[i]
                 MAD_master = np.median(np.abs(master.data))
     else:
         print('Using master given by user')
-    shifts = []
-    ccs = []
-    for i in range(len(traces)):
-        if not master.stats.sampling_rate == traces[i].stats.sampling_rate:
+    for tr in trace_list:
+        if not master.stats.sampling_rate == tr.stats.sampling_rate:
             raise ValueError('Sampling rates not the same')
-        cc_vec = normxcorr2(template=traces[i].data.
-                            astype(np.float32)[shift_len:-shift_len],
-                            image=master.data.astype(np.float32))
-        cc_vec = cc_vec[0]
-        shift = np.abs(cc_vec).argmax()
-        cc = cc_vec[shift]
-        if plot:
-            xcorr_plot(template=traces[i].data.
-                       astype(np.float32)[shift_len:-shift_len],
-                       image=master.data.astype(np.float32), shift=shift,
-                       cc=cc)
-        shift -= shift_len
-        if cc < 0 and positive:
-            cc = cc_vec.max()
-            shift = cc_vec.argmax() - shift_len
-        shifts.append(shift / master.stats.sampling_rate)
-        ccs.append(cc)
-    return shifts, ccs
+    image = master.data.astype(np.float32)
+    templates = [tr.data.astype(np.float32)[shift_len:-shift_len]
+                 for tr in trace_list]
+    index = np.zeros(len(templates), dtype=int)
+    ccs = np.zeros(len(templates), dtype=np.float32)
+    native = [i for i, tpl in enumerate(templates)
+              if 0 < len(tpl) <= len(image)]
+    if len(native) > 0:
+        index[native], ccs[native] = _align_templates(
+            [templates[i] for i in native], image, positive=positive,
+            cores=cores)
+    for i in range(len(templates)):
+        if i in native:
+            continue
+        # Templates longer than the master are correlated the other way round
+        cc_vec = normxcorr2(template=templates[i], image=image)[0]
+        index[i] = cc_vec.argmax() if positive else np.abs(cc_vec).argmax()
+        ccs[i] = cc_vec[index[i]]
+    if plot:
+        for i in range(len(templates)):
+            xcorr_plot(template=templates[i], image=image, shift=index[i],
+                       cc=ccs[i])
+    shifts = [(shift - shift_len) / master.stats.sampling_rate
+              for shift in index]
+    return shifts, list(ccs)
 
 
 if __name__ == "__main__":
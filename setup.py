@@ -201,7 +201,13 @@ def get_extensions():
 
     sources = [os.path.join('eqcorrscan', 'utils', 'src', 'multi_corr.c'),
                os.path.join('eqcorrscan', 'utils', 'src', 'time_corr.c'),
-               os.path.join('eqcorrscan', 'utils', 'src', 'find_peaks.c')]
+               os.path.join('eqcorrscan', 'utils', 'src', 'find_peaks.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'lag_calc.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'pre_processing.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'subspace.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'brightness.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'clustering.c'),
+               os.path.join('eqcorrscan', 'utils', 'src', 'stacking.c')]
     exp_symbols = export_symbols("eqcorrscan/utils/src/libutils.def")
 
     if get_build_platform() not in ('win32', 'win-amd64'):